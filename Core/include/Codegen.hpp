@@ -0,0 +1,212 @@
+//
+// Created by Aman LaChapelle on 3/24/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef HOBBIT_CODEGEN_HPP
+#define HOBBIT_CODEGEN_HPP
+
+#include <functional>
+#include <string>
+
+#include <llvm/IR/IRBuilder.h>
+
+namespace Hobbit {
+  namespace core {
+    struct Symbol;
+
+    // Helpers shared by the OpNode emitters. Everything here assumes the
+    // builder is positioned in the last block of the function, which is the
+    // invariant Module::FinalizeFunction relies on to chain ops together.
+
+    // The element type of a symbol, with any pointer stripped off.
+    llvm::Type *ElementType(Symbol *sym);
+
+    // Width of a SIMD register in elements of type t (256-bit registers).
+    unsigned VectorWidth(llvm::Type *t);
+
+    // Module::HasCPUFeature for the module sym's function belongs to, so
+    // false unless that module targets the host.
+    bool HasCPUFeature(Symbol *sym, const std::string &feature);
+
+    // The same for helpers that only have the function being emitted,
+    // read from the target-features attribute Module::GetFunction gives
+    // it in host mode.
+    bool HasCPUFeature(llvm::Function *func, const std::string &feature);
+
+    // Puts the FPPolicy of the function sym belongs to on the builder, so
+    // every FP instruction it creates carries the matching fast-math flags.
+    void ApplyFPPolicy(llvm::IRBuilder<> &builder, Symbol *sym);
+
+    // Elements of ElementType(sym) in the symbol's buffer: its size, except
+    // for bit-packed tensors, which take one word per 64 elements of a row.
+    uint64_t BufferSize(Symbol *sym);
+
+    // Bytes one element of type takes up in memory, rounded up to whole
+    // bytes. Bit words and bfloat16 count as the integer they wrap.
+    uint64_t ElementBytes(llvm::Type *type);
+
+    // Bytes the symbol's buffer takes up: BufferSize elements of
+    // ElementBytes each.
+    uint64_t BufferBytes(Symbol *sym);
+
+    // Returns a pointer to the first element of the symbol's buffer.
+    // Constants materialized by Module::GetFunction are wrapped in a private
+    // global the first time they are addressed, and symbols with no buffer
+    // yet (intermediates) get a stack buffer in the entry block.
+    llvm::Value *BufferPointer(llvm::IRBuilder<> &builder, Symbol *sym);
+
+    // The array a constant symbol was materialized into, or null if the
+    // symbol's contents aren't known until run time.
+    llvm::Constant *ConstantInitializer(Symbol *sym);
+
+    // Puts a constant array in a private global and returns a pointer to its
+    // first element.
+    llvm::Constant *GlobalConstant(llvm::Module *module, llvm::Constant *array);
+
+    // The size elements of type at data (host memory, in the layout the
+    // emitted code uses) as a constant array, which is how constant symbols
+    // hold their contents. Null if type isn't one it knows how to read.
+    llvm::Constant *HostConstant(llvm::Type *type, uint64_t size,
+                                 const void *data);
+
+    // Allocates `size` elements of `type` at the top of the entry block so
+    // that mem2reg/SROA can see it, and returns a pointer to the first one.
+    // While a ScratchScope for func is alive, arrays of kScratchMinBytes or
+    // more come out of the caller's workspace instead.
+    llvm::Value *EntryAlloca(llvm::Function *func, llvm::Type *type,
+                             uint64_t size, const std::string &name);
+
+    // The name of the i8* argument Module::GetFunction appends when asked
+    // for a caller-provided workspace.
+    const char *const kWorkspaceArgName = "hobbit.workspace";
+
+    // func's workspace argument, or null if it keeps everything on the
+    // stack.
+    llvm::Argument *WorkspaceArg(llvm::Function *func);
+
+    // Arrays smaller than this stay on the stack even with a workspace, so
+    // that accumulators and the like can still be promoted to registers.
+    const uint64_t kScratchMinBytes = 4096;
+
+    // The part of a caller-provided workspace (base, an i8*) that
+    // EntryAlloca hands out for func, starting at offset. peak is the end of
+    // the furthest array handed out so far.
+    struct ScratchSpace {
+      llvm::Function *func = nullptr;
+      llvm::Value *base = nullptr;
+      uint64_t offset = 0;
+      uint64_t peak = 0;
+    };
+
+    // Points EntryAlloca at scratch (on this thread) for as long as it's
+    // alive.
+    class ScratchScope {
+    public:
+      explicit ScratchScope(ScratchSpace *scratch);
+      ~ScratchScope();
+
+    private:
+      ScratchSpace *previous_;
+    };
+
+    // Loop metadata asking the vectorizer for a particular width.
+    llvm::MDNode *LoopVectorizeMD(llvm::LLVMContext &ctx, unsigned width);
+
+    // Emits for (idx = begin; idx < end; idx += step) body(idx). The body
+    // is free to create more blocks; on return the builder is positioned in
+    // the (empty) exit block, which is the last block in the function.
+    void EmitLoop(llvm::IRBuilder<> &builder, const std::string &name,
+                  llvm::Value *begin, llvm::Value *end, uint64_t step,
+                  const std::function<void(llvm::Value *)> &body,
+                  llvm::MDNode *loop_md = nullptr);
+
+    // Runs body over [0, end): first `width` elements at a time with
+    // vector == true, then one at a time for the remainder.
+    void EmitVectorLoop(llvm::IRBuilder<> &builder, const std::string &name,
+                        uint64_t end, uint64_t width,
+                        const std::function<void(llvm::Value *, bool)> &body);
+
+    // Loads (stores) `lanes` consecutive elements starting at ptr[idx], as
+    // a vector, or as a plain scalar when lanes is 1. Only element
+    // alignment is assumed.
+    llvm::Value *EmitLoadLanes(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                               llvm::Value *idx, unsigned lanes);
+    void EmitStoreLanes(llvm::IRBuilder<> &builder, llvm::Value *val,
+                        llvm::Value *ptr, llvm::Value *idx);
+
+    // Emits if (cond) then_body() else else_body(), same block invariants
+    // as EmitLoop. else_body may be empty.
+    void EmitIf(llvm::IRBuilder<> &builder, const std::string &name,
+                llvm::Value *cond, const std::function<void()> &then_body,
+                const std::function<void()> &else_body = nullptr);
+
+    // A constant of type t with value v, splatted if t is a vector. Integer
+    // values saturate to the range of the type.
+    llvm::Constant *ConstantValue(llvm::Type *t, double v);
+
+    // Arithmetic that works on scalars and vectors of either float or int
+    // (signed).
+    llvm::Value *EmitAdd(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs);
+    llvm::Value *EmitSub(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs);
+    llvm::Value *EmitMul(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs);
+    llvm::Value *EmitDiv(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs);
+    llvm::Value *EmitMin(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs);
+    llvm::Value *EmitMax(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs);
+
+    // acc + lhs * rhs, as a single llvm.fmuladd if fuse is set and the
+    // operands are floating point.
+    llvm::Value *EmitMulAdd(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                            llvm::Value *rhs, llvm::Value *acc, bool fuse);
+
+    // Sums the lanes of a vector by repeatedly adding its upper half to its
+    // lower half. The width must be a power of two.
+    llvm::Value *EmitHorizontalAdd(llvm::IRBuilder<> &builder,
+                                   llvm::Value *vec);
+
+    // Half precision and bfloat16 are only storage formats: kernels widen
+    // them to float when they load, compute in float and narrow when they
+    // store. This is the type arithmetic on t happens in.
+    llvm::Type *ComputeType(llvm::Type *t);
+
+    // EmitLoadLanes and EmitStoreLanes with the conversion between ptr's
+    // element type and its compute type. Half goes through integer
+    // sequences that vectorize on plain SSE2, where fpext/fptrunc of half
+    // would be a libcall per element. bfloat16 is the upper half of a
+    // float, so it's a shift. Narrowing rounds to nearest even.
+    llvm::Value *EmitLoadCompute(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                                 llvm::Value *idx, unsigned lanes);
+    void EmitStoreCompute(llvm::IRBuilder<> &builder, llvm::Value *val,
+                          llvm::Value *ptr, llvm::Value *idx);
+
+    // val, in the compute type of storage_type, rounded to what
+    // storage_type can hold
+    llvm::Value *EmitRoundTo(llvm::IRBuilder<> &builder, llvm::Value *val,
+                             llvm::Type *storage_type);
+  }
+}
+
+#endif // HOBBIT_CODEGEN_HPP
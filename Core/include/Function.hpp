@@ -23,11 +23,15 @@
 #ifndef HOBBIT_FUNCTION_HPP
 #define HOBBIT_FUNCTION_HPP
 
+#include <cstdint>
+#include <limits>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "Shape.hpp"
+
 namespace llvm {
   class LLVMContext;
   class Type;
@@ -48,6 +52,141 @@ namespace Hobbit {
   enum OpCode {
     ALLOCA = 0,
     SDOT = 1,
+    GEMM = 2,
+    CONV2D = 3,
+    ADD = 4,
+    SUB = 5,
+    MUL = 6,
+    DIV = 7,
+    MAX = 8,
+    MIN = 9,
+    RELU = 10,
+    CLAMP = 11,
+    SELECT = 12,
+    REDUCE_SUM = 13,
+    REDUCE_MEAN = 14,
+    REDUCE_MAX = 15,
+    REDUCE_MIN = 16,
+    REDUCE_ARGMAX = 17,
+    SOFTMAX = 18,
+    LOG_SOFTMAX = 19,
+    EXP = 20,
+    LOG = 21,
+    TANH = 22,
+    SIGMOID = 23,
+    ERF = 24,
+    GELU = 25,
+    POOL_MAX = 26,
+    POOL_AVG = 27,
+    TRANSPOSE = 28,
+    QDOT = 29,
+    QGEMM = 30,
+    CAST_HALF = 31,
+    CAST_FLOAT = 32,
+    CAST_BFLOAT16 = 33,
+    SPMV = 34,
+    SPMM = 35,
+    BINARIZE = 36,
+    BDOT = 37,
+    BGEMM = 38,
+    GATHER = 39,
+    SCATTER_ADD = 40,
+    ATTENTION = 41,
+    LSTM_CELL = 42,
+    GRU_CELL = 43,
+    TOPK = 44,
+    RANDOM_UNIFORM = 45,
+    RANDOM_BERNOULLI = 46,
+  };
+
+  enum ConvAlgorithm {
+    CONV_AUTO = 0,
+    CONV_DIRECT = 1,
+    CONV_IM2COL = 2,
+    CONV_WINOGRAD_2X2 = 3,
+    CONV_WINOGRAD_4X4 = 4,
+  };
+
+  // Affine quantization, real = scale * (q - zero_point)
+  struct QuantParams {
+    std::vector<float> scale = {1.0f};
+    std::vector<int32_t> zero_point = {0};
+  };
+
+  // Settings for ops that need more than their input tensors. Each op reads
+  // the fields it cares about and ignores the rest.
+  struct OpParams {
+    // SDOT and GEMM on half or bfloat16 tensors compute in float. The
+    // result is rounded back unless float_output is set.
+    bool float_output = false;
+
+    // Conv2D, and pooling for stride and padding
+    uint64_t stride_h = 1, stride_w = 1;
+    uint64_t pad_h = 0, pad_w = 0;
+    uint64_t dilation_h = 1, dilation_w = 1;
+    ConvAlgorithm conv_algorithm = CONV_AUTO;
+    // Relative error (against the sum of |input * weight| over the receptive
+    // field) the convolution may give up for speed. At 0 CONV_AUTO only
+    // picks the exact lowerings; looser values let it pick Winograd.
+    float conv_tolerance = 0;
+
+    // Pooling window. Padding has to be smaller than the window, and
+    // POOL_AVG only counts the elements that aren't padding.
+    uint64_t pool_h = 1, pool_w = 1;
+
+    // Clamp
+    double clamp_min = -std::numeric_limits<double>::infinity();
+    double clamp_max = std::numeric_limits<double>::infinity();
+
+    // Reductions. Reduced axes are kept with size 1, and an empty list
+    // reduces over everything.
+    std::vector<Axis> reduce_axes;
+
+    // QDOT and QGEMM. The rhs may have a scale and zero point per output
+    // column (per channel), the rest are per tensor. Without requantize the
+    // output is the int32 accumulator with the zero points taken out.
+    QuantParams lhs_quant, rhs_quant, out_quant;
+    bool requantize = true;
+
+    // Transpose: axis i of the output is axis permutation[i] of the input.
+    // Empty swaps H and W.
+    std::vector<Axis> permutation;
+
+    // TOPK: how many of the largest elements of each row (along W) to keep
+    uint64_t top_k = 1;
+
+    // RANDOM_UNIFORM and RANDOM_BERNOULLI. The same seed and offset always
+    // give the same numbers; successive draws should move the offset past
+    // the elements already used. p is the Bernoulli probability of a 1.
+    uint64_t random_seed = 0;
+    uint64_t random_offset = 0;
+    double random_p = 0.5;
+  };
+
+  // How closely the transcendental functions (exp, log, tanh, ...) track
+  // the correctly rounded result
+  enum MathAccuracy {
+    // Within a few ulp
+    MATH_ACCURATE = 0,
+    // Shorter polynomials, a few 1e-6 relative error for float. Good
+    // enough for activations.
+    MATH_FAST = 1,
+  };
+
+  // What the emitted floating point code is allowed to assume. The default
+  // is strict IEEE semantics, i.e. results match a naive sequential loop.
+  struct FPPolicy {
+    // Sums may be reordered, which is what lets reductions keep several
+    // independent (vector) accumulators
+    bool reassociate = false;
+    // a * b + c may be fused into one rounding
+    bool contract = false;
+    // Kernels emit llvm.fmuladd for their multiply-adds (implies contract)
+    bool fma = false;
+    // Inputs and results are never NaN
+    bool no_nans = false;
+    // Used by the activations and softmax
+    MathAccuracy math = MATH_ACCURATE;
   };
 
   class Function {
@@ -59,30 +198,75 @@ namespace Hobbit {
     void MarkSymbolAsArg(void *sym_addr);
 
     Tensor *AddOpNode(std::initializer_list<void *> sym_addrs,
-                      const OpCode &opcode);
+                      const OpCode &opcode,
+                      const OpParams &params = OpParams());
+
+    // Every output of the op AddOpNode returned output_addr for, starting
+    // with it. Only TOPK has more than one: its values, then their indices.
+    std::vector<Tensor *> GetOpOutputs(void *output_addr);
 
     llvm::LLVMContext *GetContext();
+    Module *GetModule();
 
     const std::string &GetName();
 
+    void SetFPPolicy(const FPPolicy &policy);
+    const FPPolicy &GetFPPolicy() const;
+
     std::vector<Tensor *>
     GetSignatureArgs(std::initializer_list<void *> output_addrs);
 
+    // Edges of the op graph: the op that writes sym (null for inputs and
+    // constants, including the ones Emit folded), and the ops that read any
+    // of op's outputs, in the order they were added.
+    core::OpNode *GetProducer(core::Symbol *sym);
+    const std::vector<core::OpNode *> &GetConsumers(core::OpNode *op);
+
+    // The ops Emit runs: only those with a path to a symbol marked as an arg
+    // (the outputs given to GetSignatureArgs, usually), each after the
+    // producers of its inputs and otherwise in the order they were added.
+    std::vector<core::OpNode *> Schedule();
+
+    // Emits the schedule, fusing as it goes: elementwise ops over the same
+    // shape share one loop nest, and elementwise ops that only continue a
+    // GEMM or a reduction run in its loops. Intermediates that nothing else
+    // reads stay in registers, and the ones that do reach memory share a
+    // single workspace laid out by core::PlanMemory. Ops that only read
+    // constants are run once beforehand (see FoldConstants).
     void Emit(llvm::Function *func);
 
+    // Bytes of workspace the last Emit needed, at peak: the intermediates,
+    // plus the ops' large scratch arrays if the function was made to take
+    // a workspace (see Module::GetFunction). That's how big the buffer the
+    // caller passes in has to be.
+    uint64_t GetWorkspaceSize() const;
+
     void AddBlock(const std::string &name);
     void AddToBlock(const std::string &name, llvm::Value *v);
 
   private:
+    // Runs every scheduled op whose inputs are all constants (or the results
+    // of such ops) now, at build time, and makes its outputs constants
+    // holding the results, so the function never computes them. Things
+    // like weight transposes, scalings and batchnorm folded into weights.
+    // The ops drop out of the graph. Outputs that are args aren't folded.
+    void FoldConstants();
+
     //    std::unique_ptr<Tensor> CreateVariable(void *addr);
     //    std::unique_ptr<Tensor> CreateConstant(void *addr);
 
     std::string name_;
     Module *module_;
+    FPPolicy fp_policy_;
 
     // everything in this function comes from these
     std::map<void *, core::Symbol *> symbol_table_;
+    // insertion order of symbol_table_, so that signatures are deterministic
+    std::vector<void *> symbol_order_;
     std::vector<core::OpNode *> op_table_;
+    std::map<core::Symbol *, core::OpNode *> producers_;
+    std::map<core::OpNode *, std::vector<core::OpNode *>> consumers_;
+    uint64_t workspace_size_ = 0;
 
     std::map<std::string, std::vector<llvm::Value *>> function_blocks_;
   };
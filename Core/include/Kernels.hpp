@@ -0,0 +1,76 @@
+//
+// Created by Aman LaChapelle on 3/24/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef HOBBIT_KERNELS_HPP
+#define HOBBIT_KERNELS_HPP
+
+#include <functional>
+
+#include <llvm/IR/IRBuilder.h>
+
+namespace Hobbit {
+  namespace core {
+
+    // Compute kernels that more than one OpNode is built out of. They take
+    // raw element pointers so they can be pointed at sub-buffers.
+
+    // Applied to finished elements of C on their way to memory: val holds
+    // row `row` of C starting at column `col` (one or more lanes along the
+    // row), in the compute type.
+    using GemmEpilogue = std::function<llvm::Value *(
+        llvm::IRBuilder<> &builder, llvm::Value *val, llvm::Value *row,
+        llvm::Value *col)>;
+
+    // C[m x n] = A[m x k] * B[k x n], all row-major with leading dimensions
+    // lda, ldb, ldc. Half A and B are computed in float, and C may be
+    // either. If there's an epilogue, C ends up holding epilogue(A * B).
+    struct GemmOperands {
+      llvm::Value *a, *b, *c;
+      uint64_t m, n, k;
+      uint64_t lda, ldb, ldc;
+      GemmEpilogue epilogue;
+    };
+
+    // Cache blocking parameters, in elements. The register block is
+    // kGemmMR rows by two SIMD vectors.
+    const uint64_t kGemmMR = 6;
+    const uint64_t kGemmMC = 72;
+    const uint64_t kGemmKC = 256;
+    const uint64_t kGemmNC = 512;
+
+    // Emits a GotoBLAS-style GEMM: B is packed into kGemmKC x kGemmNC panels
+    // and A into kGemmMC x kGemmKC blocks, both laid out in the order the
+    // register-blocked micro-kernel reads them. A single row of A is
+    // done as a GEMV instead, which streams B once without packing it.
+    void EmitGemm(llvm::IRBuilder<> &builder, const GemmOperands &ops);
+
+    // sum over i < size of a[i] * b[i], returned in the compute type of a's
+    // elements. With reassociate the products are spread over several
+    // independent vector accumulators, otherwise they're added in order.
+    // fuse makes the multiply-adds llvm.fmuladd.
+    llvm::Value *EmitDot(llvm::IRBuilder<> &builder, llvm::Value *a,
+                         llvm::Value *b, uint64_t size, bool reassociate,
+                         bool fuse);
+  }
+}
+
+#endif // HOBBIT_KERNELS_HPP
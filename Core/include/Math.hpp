@@ -0,0 +1,65 @@
+//
+// Created by Aman LaChapelle on 3/29/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef HOBBIT_MATH_HPP
+#define HOBBIT_MATH_HPP
+
+#include <llvm/IR/IRBuilder.h>
+
+#include "Function.hpp"
+
+namespace Hobbit {
+  namespace core {
+
+    // Transcendental functions emitted as straight-line IR instead of libm
+    // calls, so loops using them still vectorize. They take float or double
+    // scalars or vectors.
+
+    // e^x. Underflows to 0, and saturates at the largest finite power of two
+    // on the way up.
+    llvm::Value *EmitExp(llvm::IRBuilder<> &builder, llvm::Value *x,
+                         MathAccuracy accuracy = MATH_ACCURATE);
+
+    // Natural log. NaN below 0, -inf at 0. Not accurate for denormals.
+    llvm::Value *EmitLog(llvm::IRBuilder<> &builder, llvm::Value *x,
+                         MathAccuracy accuracy = MATH_ACCURATE);
+
+    llvm::Value *EmitTanh(llvm::IRBuilder<> &builder, llvm::Value *x,
+                          MathAccuracy accuracy = MATH_ACCURATE);
+
+    // 1 / (1 + e^-x)
+    llvm::Value *EmitSigmoid(llvm::IRBuilder<> &builder, llvm::Value *x,
+                             MathAccuracy accuracy = MATH_ACCURATE);
+
+    // Error function. Away from 0 this is a Chebyshev fit of erfc that is
+    // good to about 1e-7 relative, in double as well.
+    llvm::Value *EmitErf(llvm::IRBuilder<> &builder, llvm::Value *x,
+                         MathAccuracy accuracy = MATH_ACCURATE);
+
+    // x * (1 + erf(x / sqrt(2))) / 2, the exact form rather than the tanh
+    // approximation
+    llvm::Value *EmitGelu(llvm::IRBuilder<> &builder, llvm::Value *x,
+                          MathAccuracy accuracy = MATH_ACCURATE);
+  }
+}
+
+#endif // HOBBIT_MATH_HPP
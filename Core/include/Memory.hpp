@@ -0,0 +1,67 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef HOBBIT_MEMORY_HPP
+#define HOBBIT_MEMORY_HPP
+
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace Hobbit {
+  namespace core {
+    struct Symbol;
+
+    // Offsets into the workspace are multiples of this many bytes, which is
+    // what the stack arrays they replace were aligned to.
+    const uint64_t kWorkspaceAlignment = 32;
+
+    // What one loop nest of Function::Emit (an op, or a fused chain of
+    // elementwise ops) does to memory.
+    struct MemoryStep {
+      std::vector<Symbol *> reads, writes;
+      // (output, input) pairs where the output may be written over the
+      // input, because every element is read before the same element of
+      // the output is written. Only used if this is the input's last step.
+      std::vector<std::pair<Symbol *, Symbol *>> in_place;
+    };
+
+    struct MemoryPlan {
+      // Byte offset of each symbol the plan placed in the workspace
+      std::map<Symbol *, uint64_t> offsets;
+      // Peak workspace size, in bytes
+      uint64_t size = 0;
+    };
+
+    // Places every symbol the steps touch that has no memory of its own yet
+    // (i.e. the intermediates) in one workspace. A symbol lives from the
+    // first step that touches it to the last, and symbols whose lifetimes
+    // don't overlap can share bytes. In-place outputs take over their
+    // input's memory outright. Placement is greedy, biggest first, at the
+    // lowest offset that doesn't collide with anything live at the same
+    // time.
+    MemoryPlan PlanMemory(const std::vector<MemoryStep> &steps);
+  }
+}
+
+#endif // HOBBIT_MEMORY_HPP
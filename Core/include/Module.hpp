@@ -23,6 +23,9 @@
 #ifndef HOBBIT_MODULE_HPP
 #define HOBBIT_MODULE_HPP
 
+#include <map>
+#include <string>
+
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Support/raw_ostream.h>
@@ -35,9 +38,15 @@ namespace Hobbit {
     Module(const std::string &name, llvm::LLVMContext &ctx);
 
     llvm::LLVMContext *GetContext();
+    // With workspace, the function takes one more argument after args: an
+    // i8* to Function::GetWorkspaceSize bytes (aligned to 32) that the
+    // caller owns, which intermediates and large scratch arrays live in
+    // instead of the stack.
     llvm::Function *GetFunction(const std::string &name,
-                                const std::vector<Tensor *> &args);
+                                const std::vector<Tensor *> &args,
+                                bool workspace = false);
     void FinalizeFunction(llvm::Function *f);
+    // In host mode the cpu and features are the host's, whatever is passed
     void FinalizeModule(unsigned int opt_level,
                         const std::string &target_triple,
                         const std::string &cpu = "corei7-avx",
@@ -46,10 +55,27 @@ namespace Hobbit {
 
     void *GetFunctionPtr(const std::string &name);
 
+    // Host mode: compile for the CPU this is running on, with all of its
+    // features, instead of baseline x86-64. Ops can then use instructions
+    // only some CPUs have (see HasCPUFeature), so the code won't run
+    // anywhere else. Has to be set before anything is emitted.
+    void TargetHost();
+    bool TargetsHost() const;
+
+    // Whether the code is compiled for a CPU with feature (an LLVM feature
+    // name, like "avx2"). Always false outside host mode.
+    bool HasCPUFeature(const std::string &feature) const;
+
   private:
+    // cpu_features_ as an LLVM feature string, "+avx2,-avx512f,..."
+    std::string FeatureString() const;
+
     llvm::LLVMContext *ctx_;
     std::string name_;
     std::unique_ptr<llvm::Module> module_;
+    // Set by TargetHost
+    std::string cpu_;
+    std::map<std::string, bool> cpu_features_;
   };
 }
 
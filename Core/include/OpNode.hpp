@@ -32,6 +32,7 @@
 
 namespace Hobbit {
   namespace core {
+    class Elementwise;
 
     class IncorrectNumArgs : public std::runtime_error {
     public:
@@ -41,6 +42,20 @@ namespace Hobbit {
                 " is initialized with an incorrect number of args!"){};
     };
 
+    class IncompatibleShapes : public std::runtime_error {
+    public:
+      explicit IncompatibleShapes(const std::string &node_name)
+          : std::runtime_error("Node " + node_name +
+                               " is initialized with incompatible shapes!"){};
+    };
+
+    class IncompatibleTypes : public std::runtime_error {
+    public:
+      explicit IncompatibleTypes(const std::string &node_name)
+          : std::runtime_error("Node " + node_name +
+                               " is initialized with incompatible types!"){};
+    };
+
     class OpNode {
     public:
       OpNode(const std::initializer_list<Symbol *> &args,
@@ -50,9 +65,37 @@ namespace Hobbit {
       virtual Tensor *GetOutput() = 0;
       virtual llvm::Value *Emit(llvm::Function *func) = 0;
 
+      // The inputs, followed by the output once GetOutput has been called.
+      const std::vector<Symbol *> &GetArgs() const { return args_; }
+
+      // GetArgs split into what the op reads and what it writes. The outputs
+      // are only there once GetOutput has been called.
+      std::vector<Symbol *> GetInputs() const {
+        return std::vector<Symbol *>(args_.begin(),
+                                     args_.begin() + num_inputs_);
+      }
+      std::vector<Symbol *> GetOutputs() const {
+        return std::vector<Symbol *>(args_.begin() + num_inputs_,
+                                     args_.end());
+      }
+
+      // Outputs besides the one GetOutput returns, for ops that have more
+      // than one. They come after it in GetArgs.
+      virtual std::vector<Tensor *> GetExtraOutputs() { return {}; }
+
+      // Gives the op a chain of elementwise ops to apply to its output on
+      // the way to memory (see Elementwise::EmitEpilogue), so the chain's
+      // last output is written instead of the op's own. Ops that can't run
+      // them inside their loops return false and are emitted as usual.
+      virtual bool SetEpilogue(const std::vector<Elementwise *> & /*ops*/) {
+        return false;
+      }
+
     protected:
       const std::string name_;
       std::vector<Symbol *> args_;
+      // How many of args_ are inputs, the rest are outputs
+      uint64_t num_inputs_;
     };
 
     class Alloca : public OpNode {
@@ -61,11 +104,14 @@ namespace Hobbit {
           : OpNode(args, "Alloca") {
         if (args.size() != 1)
           throw IncorrectNumArgs("Alloca");
+        // The symbol it's given is what it produces
+        num_inputs_ = 0;
       };
 
       explicit Alloca(std::vector<Symbol *> args) : OpNode(args, "Alloca") {
         if (args.size() != 1)
           throw IncorrectNumArgs("Alloca");
+        num_inputs_ = 0;
       };
 
       Tensor *GetOutput() override;
@@ -74,18 +120,740 @@ namespace Hobbit {
 
     class Sdot : public OpNode {
     public:
-      Sdot(const std::initializer_list<Symbol *> &args) : OpNode(args, "Sdot") {
+      Sdot(const std::initializer_list<Symbol *> &args,
+           const OpParams &params = OpParams())
+          : OpNode(args, "Sdot"), params_(params) {
         if (args.size() != 2)
           throw IncorrectNumArgs("Sdot");
       };
 
-      explicit Sdot(std::vector<Symbol *> args) : OpNode(args, "Sdot") {
+      explicit Sdot(std::vector<Symbol *> args,
+                    const OpParams &params = OpParams())
+          : OpNode(args, "Sdot"), params_(params) {
         if (args.size() != 2)
           throw IncorrectNumArgs("Sdot");
       };
 
       Tensor *GetOutput() override;
       llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      OpParams params_;
+    };
+
+    // Batched matrix multiply. The K axis is the batch, H and W are rows and
+    // columns: {K, M, N} x {K or 1, N, P} -> {K, M, P}. A rhs with K == 1 is
+    // shared across the batch (the usual weights case).
+    class Gemm : public OpNode {
+    public:
+      Gemm(const std::initializer_list<Symbol *> &args,
+           const OpParams &params = OpParams())
+          : OpNode(args, "Gemm"), params_(params) {
+        CheckArgs();
+      };
+
+      explicit Gemm(std::vector<Symbol *> args,
+                    const OpParams &params = OpParams())
+          : OpNode(args, "Gemm"), params_(params) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+      bool SetEpilogue(const std::vector<Elementwise *> &ops) override;
+
+    private:
+      void CheckArgs();
+
+      OpParams params_;
+      std::vector<Elementwise *> epilogue_;
+    };
+
+    // {table, indices} -> {1, N, D}: row indices[i] of the table (its W
+    // axis is D, its K * H rows are the entries) for each of the N integer
+    // indices, in order. Indices outside the table give a row of zeros.
+    class Gather : public OpNode {
+    public:
+      Gather(const std::initializer_list<Symbol *> &args)
+          : OpNode(args, "Gather") {
+        CheckArgs();
+      };
+
+      explicit Gather(std::vector<Symbol *> args) : OpNode(args, "Gather") {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+      void EmitRows(llvm::IRBuilder<> &builder, llvm::Value *table,
+                    llvm::Value *indices, llvm::Value *output);
+      void EmitShortRows(llvm::IRBuilder<> &builder, llvm::Value *table,
+                         llvm::Value *indices, llvm::Value *output);
+    };
+
+    // {table, indices, updates} -> a copy of the table with row i of
+    // updates (N rows of D) added into row indices[i], in index order, so
+    // repeated indices accumulate. Indices outside the table are skipped.
+    class ScatterAdd : public OpNode {
+    public:
+      ScatterAdd(const std::initializer_list<Symbol *> &args)
+          : OpNode(args, "ScatterAdd") {
+        CheckArgs();
+      };
+
+      explicit ScatterAdd(std::vector<Symbol *> args)
+          : OpNode(args, "ScatterAdd") {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+    };
+
+    // Sparse (CSR) lhs {1, M, N} times a dense rhs. SPMV takes N elements
+    // and gives {1, 1, M}; SPMM takes {1, N, P} and gives {1, M, P}. Only
+    // the stored nonzeros are visited, and a SparseConstant's pattern and
+    // values are compiled into the code when it's small enough.
+    class SparseMatMul : public OpNode {
+    public:
+      SparseMatMul(const std::initializer_list<Symbol *> &args, OpCode op)
+          : OpNode(args, "SparseMatMul"), op_(op) {
+        CheckArgs();
+      };
+
+      SparseMatMul(std::vector<Symbol *> args, OpCode op)
+          : OpNode(args, "SparseMatMul"), op_(op) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+      void EmitUnrolled(llvm::IRBuilder<> &builder, llvm::Value *dense,
+                        llvm::Value *output);
+      void EmitRows(llvm::IRBuilder<> &builder, llvm::Value *dense,
+                    llvm::Value *output);
+
+      OpCode op_;
+      // Columns of the dense operand and the output
+      uint64_t n_;
+    };
+
+    // Dot product of two int8 tensors of the same shape, accumulated in
+    // int32. Quantization comes from OpParams; the output is one int8, or
+    // int32 without requantize.
+    class QDot : public OpNode {
+    public:
+      QDot(const std::initializer_list<Symbol *> &args, const OpParams &params)
+          : OpNode(args, "QDot"), params_(params) {
+        CheckArgs();
+      };
+
+      QDot(std::vector<Symbol *> args, const OpParams &params)
+          : OpNode(args, "QDot"), params_(params) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+
+      OpParams params_;
+    };
+
+    // Batched int8 matrix multiply with int32 accumulators, shaped like Gemm.
+    // The rhs may be quantized per output column.
+    class QGemm : public OpNode {
+    public:
+      QGemm(const std::initializer_list<Symbol *> &args,
+            const OpParams &params)
+          : OpNode(args, "QGemm"), params_(params) {
+        CheckArgs();
+      };
+
+      QGemm(std::vector<Symbol *> args, const OpParams &params)
+          : OpNode(args, "QGemm"), params_(params) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+
+      OpParams params_;
+    };
+
+    // Packs any real or integer tensor into a bit tensor (Type<bit *, 1>)
+    // of the same shape: 1 where the element is >= 0, 0 where it's negative
+    // or NaN.
+    class Binarize : public OpNode {
+    public:
+      Binarize(const std::initializer_list<Symbol *> &args)
+          : OpNode(args, "Binarize") {
+        CheckArgs();
+      };
+
+      explicit Binarize(std::vector<Symbol *> args)
+          : OpNode(args, "Binarize") {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+    };
+
+    // Dot products of bit tensors whose bits stand for -1 (0) and +1 (1),
+    // as N - 2 * popcount(a XOR b) over the N bits of a row, into int32.
+    // BDOT takes two tensors of the same shape and gives {1, 1, 1}. BGEMM
+    // takes {K, M, N} and a transposed rhs {K or 1, P, N}, one row per
+    // output column, and gives {K, M, P}. Row padding is ignored.
+    class BinaryGemm : public OpNode {
+    public:
+      BinaryGemm(const std::initializer_list<Symbol *> &args, OpCode op)
+          : OpNode(args, "BinaryGemm"), op_(op) {
+        CheckArgs();
+      };
+
+      BinaryGemm(std::vector<Symbol *> args, OpCode op)
+          : OpNode(args, "BinaryGemm"), op_(op) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+      void EmitDot(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                   llvm::Value *rhs, llvm::Value *output);
+      void EmitGemm(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                    llvm::Value *rhs, llvm::Value *output);
+
+      OpCode op_;
+    };
+
+    // 2D convolution over the H and W axes. The input is {C_in, H, W} and the
+    // filter is {C_out * C_in, R, S}, i.e. C_out filters of C_in x R x S. The
+    // output is {C_out, H_out, W_out}. Stride, padding, dilation and the
+    // lowering come from OpParams. The Winograd lowerings only handle 3x3
+    // filters with unit stride and dilation.
+    class Conv2D : public OpNode {
+    public:
+      Conv2D(const std::initializer_list<Symbol *> &args,
+             const OpParams &params)
+          : OpNode(args, "Conv2D"), params_(params) {
+        CheckArgs();
+      };
+
+      Conv2D(std::vector<Symbol *> args, const OpParams &params)
+          : OpNode(args, "Conv2D"), params_(params) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+      // The lowering that will be used, with CONV_AUTO resolved. workspace
+      // says whether its buffers would come out of a caller-provided
+      // workspace, which allows much bigger ones than the stack.
+      ConvAlgorithm GetAlgorithm(bool workspace = false) const;
+
+    private:
+      void CheckArgs();
+      void EmitDirect(llvm::IRBuilder<> &builder, llvm::Value *input,
+                      llvm::Value *filter, llvm::Value *output);
+      void EmitIm2Col(llvm::IRBuilder<> &builder, llvm::Value *input,
+                      llvm::Value *filter, llvm::Value *output);
+      // Winograd F(tile x tile, 3x3), tile is 2 or 4
+      void EmitWinograd(llvm::IRBuilder<> &builder, llvm::Value *input,
+                        llvm::Value *filter, llvm::Value *output,
+                        uint64_t tile);
+      bool WinogradApplies() const;
+      uint64_t WinogradElements(uint64_t tile) const;
+
+      OpParams params_;
+      uint64_t c_out_, h_out_, w_out_;
+    };
+
+    // Base for ops that map each output element to a function of the same
+    // element of every input. Inputs broadcast NumPy-style against each
+    // other. Function::Emit fuses chains of these into a single loop nest,
+    // or into the loops of the op they follow (see OpNode::SetEpilogue).
+    class Elementwise : public OpNode {
+    public:
+      // The args from first_value on are values, which all have to be of
+      // the same type; the output and the arithmetic are in that type. The
+      // ones before it (Select's condition) can be of any type.
+      Elementwise(std::vector<Symbol *> args, const std::string &node_name,
+                  uint64_t num_args, uint64_t first_value = 0);
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+      // Computes the op on operand values, which are either all scalars or
+      // all vectors of the same width.
+      virtual llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) = 0;
+
+      // EmitElement for ops that also depend on where the element is: index
+      // is the flat (row-major) position in the output of the element, or
+      // of the first lane. Everything but Random ignores it.
+      virtual llvm::Value *
+      EmitElementAt(llvm::IRBuilder<> &builder,
+                    const std::vector<llvm::Value *> &operands,
+                    llvm::Value *index);
+
+      // Emits ops (all with the same output shape, each only reading the
+      // outputs of the ones before it) as one loop nest. Intermediates stay
+      // in registers and only the outputs flagged in store are written out.
+      static void EmitFused(llvm::Function *func,
+                            const std::vector<Elementwise *> &ops,
+                            const std::vector<bool> &store);
+
+      // Runs ops inside another op's loops: val holds source (the input of
+      // ops[0] the other op produces) at row `row` of the K * H rows of its
+      // shape, starting at column `col`, in the compute type. Each op reads
+      // the one before it and anything else is loaded and broadcast as in
+      // EmitFused. Returns the last result without storing anything.
+      static llvm::Value *EmitEpilogue(llvm::IRBuilder<> &builder,
+                                       const std::vector<Elementwise *> &ops,
+                                       Symbol *source, llvm::Value *val,
+                                       llvm::Value *row, llvm::Value *col);
+
+    protected:
+      Symbol *ValueArg() const { return args_[first_value_]; }
+
+      Shape shape_;
+      uint64_t first_value_;
+    };
+
+    class Add : public Elementwise {
+    public:
+      Add(const std::initializer_list<Symbol *> &args)
+          : Elementwise(args, "Add", 2){};
+      explicit Add(std::vector<Symbol *> args)
+          : Elementwise(std::move(args), "Add", 2){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+    };
+
+    class Sub : public Elementwise {
+    public:
+      Sub(const std::initializer_list<Symbol *> &args)
+          : Elementwise(args, "Sub", 2){};
+      explicit Sub(std::vector<Symbol *> args)
+          : Elementwise(std::move(args), "Sub", 2){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+    };
+
+    class Mul : public Elementwise {
+    public:
+      Mul(const std::initializer_list<Symbol *> &args)
+          : Elementwise(args, "Mul", 2){};
+      explicit Mul(std::vector<Symbol *> args)
+          : Elementwise(std::move(args), "Mul", 2){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+    };
+
+    class Div : public Elementwise {
+    public:
+      Div(const std::initializer_list<Symbol *> &args)
+          : Elementwise(args, "Div", 2){};
+      explicit Div(std::vector<Symbol *> args)
+          : Elementwise(std::move(args), "Div", 2){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+    };
+
+    class Max : public Elementwise {
+    public:
+      Max(const std::initializer_list<Symbol *> &args)
+          : Elementwise(args, "Max", 2){};
+      explicit Max(std::vector<Symbol *> args)
+          : Elementwise(std::move(args), "Max", 2){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+    };
+
+    class Min : public Elementwise {
+    public:
+      Min(const std::initializer_list<Symbol *> &args)
+          : Elementwise(args, "Min", 2){};
+      explicit Min(std::vector<Symbol *> args)
+          : Elementwise(std::move(args), "Min", 2){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+    };
+
+    class Relu : public Elementwise {
+    public:
+      Relu(const std::initializer_list<Symbol *> &args)
+          : Elementwise(args, "Relu", 1){};
+      explicit Relu(std::vector<Symbol *> args)
+          : Elementwise(std::move(args), "Relu", 1){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+    };
+
+    // Clamps to [clamp_min, clamp_max] from OpParams.
+    class Clamp : public Elementwise {
+    public:
+      Clamp(const std::initializer_list<Symbol *> &args,
+            const OpParams &params)
+          : Elementwise(args, "Clamp", 1), params_(params){};
+      Clamp(std::vector<Symbol *> args, const OpParams &params)
+          : Elementwise(std::move(args), "Clamp", 1), params_(params){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+
+    private:
+      OpParams params_;
+    };
+
+    // {cond, a, b} -> cond != 0 ? a : b. cond may be of a different type
+    // than a and b, which give the output its type.
+    class Select : public Elementwise {
+    public:
+      Select(const std::initializer_list<Symbol *> &args)
+          : Elementwise(args, "Select", 3, 1){};
+      explicit Select(std::vector<Symbol *> args)
+          : Elementwise(std::move(args), "Select", 3, 1){};
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+    };
+
+    // EXP, LOG, TANH, SIGMOID, ERF or GELU, from Math.hpp at the accuracy
+    // in the Function's FPPolicy. Only for floating point types.
+    class Activation : public Elementwise {
+    public:
+      Activation(const std::initializer_list<Symbol *> &args, OpCode op)
+          : Elementwise(args, "Activation", 1), op_(op) {
+        CheckArgs();
+      };
+      Activation(std::vector<Symbol *> args, OpCode op)
+          : Elementwise(std::move(args), "Activation", 1), op_(op) {
+        CheckArgs();
+      };
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+
+    private:
+      void CheckArgs();
+
+      OpCode op_;
+    };
+
+    // CAST_HALF, CAST_BFLOAT16 or CAST_FLOAT from any floating point type.
+    // The result is rounded to the new type even when it only lives in
+    // registers inside a fused chain.
+    class Cast : public Elementwise {
+    public:
+      Cast(const std::initializer_list<Symbol *> &args, OpCode op)
+          : Elementwise(args, "Cast", 1) {
+        CheckArgs(op);
+      };
+      Cast(std::vector<Symbol *> args, OpCode op)
+          : Elementwise(std::move(args), "Cast", 1) {
+        CheckArgs(op);
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+
+    private:
+      void CheckArgs(OpCode op);
+
+      llvm::Type *type_;
+    };
+
+    // RANDOM_UNIFORM or RANDOM_BERNOULLI, a tensor of random numbers with
+    // the shape and type of its input (whose values don't matter). With
+    // j = random_offset + i (OpParams), element i is word j % 4 of the
+    // Philox4x32-10 block for key random_seed and counter j / 4; a double
+    // takes the pair of words j % 2 of block j / 2. Results depend only on
+    // those and not on the vector width or on what the op is fused with.
+    // Uniform gives [0, 1) (24 bits for float, 53 for double); half and
+    // bfloat16 round that and can reach 1. Bernoulli gives 1 with
+    // probability random_p and 0 otherwise, in any real or integer type.
+    class Random : public Elementwise {
+    public:
+      Random(const std::initializer_list<Symbol *> &args,
+             const OpParams &params, OpCode op)
+          : Elementwise(args, "Random", 1), params_(params), op_(op) {
+        CheckArgs();
+      };
+      Random(std::vector<Symbol *> args, const OpParams &params, OpCode op)
+          : Elementwise(std::move(args), "Random", 1), params_(params),
+            op_(op) {
+        CheckArgs();
+      };
+
+      llvm::Value *
+      EmitElement(llvm::IRBuilder<> &builder,
+                  const std::vector<llvm::Value *> &operands) override;
+      llvm::Value *EmitElementAt(llvm::IRBuilder<> &builder,
+                                 const std::vector<llvm::Value *> &operands,
+                                 llvm::Value *index) override;
+
+    private:
+      void CheckArgs();
+
+      OpParams params_;
+      OpCode op_;
+    };
+
+    // REDUCE_SUM, REDUCE_MEAN, REDUCE_MAX, REDUCE_MIN or REDUCE_ARGMAX over
+    // the axes in OpParams::reduce_axes. Argmax produces i64 indices into
+    // the reduced sub-tensor (row-major over the reduced axes), and the
+    // first maximum wins ties.
+    class Reduce : public OpNode {
+    public:
+      Reduce(const std::initializer_list<Symbol *> &args,
+             const OpParams &params, OpCode op)
+          : OpNode(args, "Reduce"), params_(params), op_(op) {
+        CheckArgs();
+      };
+
+      Reduce(std::vector<Symbol *> args, const OpParams &params, OpCode op)
+          : OpNode(args, "Reduce"), params_(params), op_(op) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+      bool SetEpilogue(const std::vector<Elementwise *> &ops) override;
+
+    private:
+      void CheckArgs();
+      void EmitInner(llvm::IRBuilder<> &builder, llvm::Value *input,
+                     llvm::Value *output);
+      void EmitOuter(llvm::IRBuilder<> &builder, llvm::Value *input,
+                     llvm::Value *output);
+      llvm::Value *Combine(llvm::IRBuilder<> &builder, llvm::Value *acc,
+                           llvm::Value *val);
+      llvm::Value *Identity(llvm::Type *type);
+
+      llvm::Value *Finish(llvm::IRBuilder<> &builder, llvm::Value *val,
+                          llvm::Value *index);
+
+      OpParams params_;
+      OpCode op_;
+      Shape out_shape_;
+      std::vector<Elementwise *> epilogue_;
+      // The input viewed as {outer, reduced, kept, inner} where the op
+      // reduces over the second and fourth axes
+      uint64_t outer_, reduced_, kept_, inner_;
+    };
+
+    // POOL_MAX or POOL_AVG over windows in the H and W axes, for every K.
+    // The input is {K, H, W} and the output {K, H_out, W_out}, with window,
+    // stride and padding from OpParams.
+    class Pool : public OpNode {
+    public:
+      Pool(const std::initializer_list<Symbol *> &args, const OpParams &params,
+           OpCode op)
+          : OpNode(args, "Pool"), params_(params), op_(op) {
+        CheckArgs();
+      };
+
+      Pool(std::vector<Symbol *> args, const OpParams &params, OpCode op)
+          : OpNode(args, "Pool"), params_(params), op_(op) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+      llvm::Value *Combine(llvm::IRBuilder<> &builder, llvm::Value *acc,
+                           llvm::Value *val);
+      // Per output row (or column), how many window elements aren't padding
+      llvm::Constant *Counts(llvm::Type *type, uint64_t size,
+                             uint64_t out_size, uint64_t window,
+                             uint64_t stride, uint64_t pad);
+
+      OpParams params_;
+      OpCode op_;
+      uint64_t h_out_, w_out_;
+    };
+
+    // Reorders the K, H and W axes as given by OpParams::permutation.
+    class Transpose : public OpNode {
+    public:
+      Transpose(const std::initializer_list<Symbol *> &args,
+                const OpParams &params)
+          : OpNode(args, "Transpose"), params_(params) {
+        CheckArgs();
+      };
+
+      Transpose(std::vector<Symbol *> args, const OpParams &params)
+          : OpNode(args, "Transpose"), params_(params) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+      void EmitRowCopy(llvm::IRBuilder<> &builder, llvm::Value *input,
+                       llvm::Value *output);
+      void EmitBlocked(llvm::IRBuilder<> &builder, llvm::Value *input,
+                       llvm::Value *output);
+
+      OpParams params_;
+      Axis perm_[3];
+      Shape out_shape_;
+    };
+
+    // {Q, K, V} -> softmax(Q K^T / sqrt(d)) V for each batch (the K axis):
+    // Q is {B, Lq, d}, K is {B or 1, Lk, d} and V is {B or 1, Lk, dv},
+    // giving {B, Lq, dv}. A K and V batch of 1 is shared by every query
+    // batch. The scores are made a tile of keys at a time and folded into
+    // running softmax statistics, so the Lq x Lk matrix never exists.
+    class Attention : public OpNode {
+    public:
+      Attention(const std::initializer_list<Symbol *> &args)
+          : OpNode(args, "Attention") {
+        CheckArgs();
+      };
+
+      explicit Attention(std::vector<Symbol *> args)
+          : OpNode(args, "Attention") {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+    };
+
+    // One step of an LSTM_CELL or GRU_CELL for a batch of B inputs:
+    // {x, state, weights, bias} -> the new state. x is {1, B, I}. The state
+    // is {2, B, H} for an LSTM (h, then c) and {1, B, H} for a GRU. The
+    // weights are one packed {1, I + H, G * H} matrix, the input rows over
+    // the hidden rows, with the G gates (i, f, g, o or r, z, n) side by side
+    // in the columns. The LSTM bias is {1, 1, 4H}; the GRU has the input
+    // bias over the hidden one, {1, 2, 3H}, since the reset gate only
+    // scales the hidden half of n.
+    class RecurrentCell : public OpNode {
+    public:
+      RecurrentCell(const std::initializer_list<Symbol *> &args, OpCode op)
+          : OpNode(args, "RecurrentCell"), op_(op) {
+        CheckArgs();
+      };
+
+      RecurrentCell(std::vector<Symbol *> args, OpCode op)
+          : OpNode(args, "RecurrentCell"), op_(op) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+
+      OpCode op_;
+      uint64_t gates_, batch_, input_, hidden_;
+    };
+
+    // TOPK: the top_k (from OpParams) largest elements of every (k, h) row,
+    // along W, as {K, H, top_k} values sorted best first, and as a second
+    // output of their i64 indices in the row. Ties go to the earlier
+    // element and NaN ranks below everything else.
+    class TopK : public OpNode {
+    public:
+      TopK(const std::initializer_list<Symbol *> &args, const OpParams &params)
+          : OpNode(args, "TopK"), params_(params) {
+        CheckArgs();
+      };
+
+      TopK(std::vector<Symbol *> args, const OpParams &params)
+          : OpNode(args, "TopK"), params_(params) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      std::vector<Tensor *> GetExtraOutputs() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+      void EmitArgmax(llvm::IRBuilder<> &builder, llvm::Value *in_row,
+                      llvm::Value *val_row, llvm::Value *idx_row);
+      void EmitSelect(llvm::IRBuilder<> &builder, llvm::Value *in_row,
+                      llvm::Value *val_row, llvm::Value *idx_row);
+
+      OpParams params_;
+      Tensor *indices_ = nullptr;
+    };
+
+    // SOFTMAX or LOG_SOFTMAX along the W axis, for every (k, h) row. One
+    // pass finds the row's max and sum of exponentials together (the sum
+    // gets rescaled whenever the max moves), a second writes the output.
+    class Softmax : public OpNode {
+    public:
+      Softmax(const std::initializer_list<Symbol *> &args, OpCode op)
+          : OpNode(args, "Softmax"), op_(op) {
+        CheckArgs();
+      };
+
+      Softmax(std::vector<Symbol *> args, OpCode op)
+          : OpNode(args, "Softmax"), op_(op) {
+        CheckArgs();
+      };
+
+      Tensor *GetOutput() override;
+      llvm::Value *Emit(llvm::Function *func) override;
+
+    private:
+      void CheckArgs();
+
+      OpCode op_;
     };
   }
 }
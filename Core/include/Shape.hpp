@@ -53,7 +53,11 @@ namespace Hobbit {
 
     uint64_t GetSize() const;
 
-    uint64_t GetAxisSize(Axis &axis) const;
+    uint64_t GetAxisSize(const Axis &axis) const;
+
+    // NumPy-style broadcasting: on each axis the sizes have to match or one
+    // of them has to be 1. Returns false (leaving result alone) otherwise.
+    bool Broadcast(const Shape &other, Shape &result) const;
 
     friend inline bool operator==(const Shape &lhs, const Shape &rhs) {
       return (lhs.k_ == rhs.k_ && lhs.h_ == rhs.h_ && lhs.w_ == rhs.w_);
@@ -33,17 +33,32 @@ namespace llvm {
 namespace Hobbit {
   namespace core {
 
+    struct Symbol;
+
+    // Compressed sparse row storage of an H x W matrix. The nonzeros of row
+    // r are values[row_ptr[r] .. row_ptr[r + 1]), at columns col_idx[...].
+    // The indices are int32.
+    struct CSR {
+      Symbol *row_ptr = nullptr;
+      Symbol *col_idx = nullptr;
+      Symbol *values = nullptr;
+    };
+
     struct Symbol {
       std::unique_ptr<Function> &parent_func;
       Shape shape;
       llvm::Type *type;
       bool is_arg;
       void *buffer = nullptr;
+      // Only set for sparse tensors, which have no buffer of their own
+      CSR csr;
 
       Symbol(std::unique_ptr<Function> &parent_func, const Shape &s,
              llvm::Type *t, bool is_arg = false, void *buffer = nullptr)
           : parent_func(parent_func), shape(s), type(t), is_arg(is_arg),
             buffer(buffer){};
+
+      bool IsSparse() const { return csr.values != nullptr; }
     };
   }
 }
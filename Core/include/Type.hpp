@@ -32,6 +32,31 @@ namespace Hobbit {
 
     template <typename T, unsigned int BITWIDTH> class Type { ; };
 
+    // Tag for bfloat16 tensors, Type<bfloat16 *, 16>. LLVM has no bfloat
+    // type, so it's the literal struct { i16 }: the right size, and nothing
+    // else maps to it. Only kernels that widen it to float (ComputeType in
+    // Codegen.hpp) can read or write it.
+    struct bfloat16 {};
+
+    inline llvm::Type *BFloat16Ty(llvm::LLVMContext &ctx) {
+      return llvm::StructType::get(llvm::Type::getInt16Ty(ctx));
+    }
+
+    // Tag for bit-packed tensors, Type<bit *, 1>. Each row (the W axis) is
+    // packed into 64-bit words, element w in bit w % 64 of word w / 64, and
+    // padded out to a whole word. The element type is the literal struct
+    // { i64 }, one word, so the buffer holds PackedWords(W) of them per
+    // row. Only the binary ops read or write it.
+    struct bit {};
+
+    inline llvm::Type *BitTy(llvm::LLVMContext &ctx) {
+      return llvm::StructType::get(llvm::Type::getInt64Ty(ctx));
+    }
+
+    inline bool IsBit(llvm::Type *t) { return t == BitTy(t->getContext()); }
+
+    inline uint64_t PackedWords(uint64_t bits) { return (bits + 63) / 64; }
+
     template <> class Type<float, 16> {
     public:
       static llvm::Type *get(llvm::LLVMContext *ctx) {
@@ -74,6 +99,32 @@ namespace Hobbit {
       }
     };
 
+    template <> class Type<bfloat16, 16> {
+    public:
+      static llvm::Type *get(llvm::LLVMContext *ctx) {
+        return BFloat16Ty(*ctx);
+      }
+    };
+
+    template <> class Type<bfloat16 *, 16> {
+    public:
+      static llvm::Type *get(llvm::LLVMContext *ctx) {
+        return BFloat16Ty(*ctx)->getPointerTo();
+      }
+    };
+
+    template <> class Type<bit, 1> {
+    public:
+      static llvm::Type *get(llvm::LLVMContext *ctx) { return BitTy(*ctx); }
+    };
+
+    template <> class Type<bit *, 1> {
+    public:
+      static llvm::Type *get(llvm::LLVMContext *ctx) {
+        return BitTy(*ctx)->getPointerTo();
+      }
+    };
+
     template <unsigned int BITWIDTH> class Type<int, BITWIDTH> {
     public:
       static llvm::Type *get(llvm::LLVMContext *ctx) {
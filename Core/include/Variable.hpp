@@ -93,6 +93,66 @@ namespace Hobbit {
       return c;
     }
   };
+
+  // A {1, H, W} matrix stored in compressed sparse row form (core::CSR).
+  // The nonzeros live in three tensors of their own, and that's how the
+  // matrix is passed to the function: marking it as an arg puts the row
+  // pointers (H + 1 of them), the column indices and the values in the
+  // signature, in that order. Only SPMV and SPMM take sparse tensors.
+  class SparseTensor : public Tensor {
+  public:
+    Tensor *GetRowPointers() { return row_ptr_; }
+    Tensor *GetColumnIndices() { return col_idx_; }
+    Tensor *GetValues() { return values_; }
+
+  protected:
+    SparseTensor(std::unique_ptr<Function> &f, const Shape &s,
+                 Tensor *row_ptr, Tensor *col_idx, Tensor *values);
+
+    Tensor *row_ptr_, *col_idx_, *values_;
+  };
+
+  // A sparse matrix with nnz nonzeros whose pattern and values are only
+  // known at run time
+  class SparseVariable : public SparseTensor {
+  private:
+    using SparseTensor::SparseTensor;
+
+  public:
+    template <typename T, unsigned int BITWIDTH>
+    static SparseVariable *Create(std::unique_ptr<Function> &f,
+                                  Hobbit::core::Type<T, BITWIDTH> *type,
+                                  const Shape &s, uint64_t nnz) {
+      return Create(f, type->get(f->GetContext()), s, nnz);
+    }
+
+    static SparseVariable *Create(std::unique_ptr<Function> &f,
+                                  llvm::Type *type, const Shape &s,
+                                  uint64_t nnz);
+  };
+
+  // A sparse matrix known when the function is compiled, so SPMV and SPMM
+  // can be specialized to its pattern. The buffers have to stay alive until
+  // Module::GetFunction, like a Constant's.
+  class SparseConstant : public SparseTensor {
+  private:
+    using SparseTensor::SparseTensor;
+
+  public:
+    template <typename T, unsigned int BITWIDTH>
+    static SparseConstant *Create(std::unique_ptr<Function> &f,
+                                  Hobbit::core::Type<T, BITWIDTH> *type,
+                                  const Shape &s, int32_t *row_ptr,
+                                  int32_t *col_idx, T values) {
+      return Create(f, type->get(f->GetContext()), s, row_ptr, col_idx,
+                    (void *)values);
+    }
+
+    static SparseConstant *Create(std::unique_ptr<Function> &f,
+                                  llvm::Type *type, const Shape &s,
+                                  int32_t *row_ptr, int32_t *col_idx,
+                                  void *values);
+  };
 }
 
 #endif // HOBBIT_VARIABLE_HPP
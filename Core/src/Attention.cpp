@@ -0,0 +1,311 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "Codegen.hpp"
+#include "Kernels.hpp"
+#include "Math.hpp"
+
+namespace {
+  // Keys whose scores are made and folded in together. The K and V rows of
+  // a tile are what the query rows of a block share from cache.
+  const uint64_t kAttentionKeyTile = 64;
+  // Query rows per block, each K and V tile is read once per block
+  const uint64_t kAttentionQueryBlock = 16;
+  // Bound on the block's output accumulators, wide V gets fewer rows
+  const uint64_t kAttentionAccBytes = 64 * 1024;
+  // Rows of V folded into an accumulator row per pass
+  const uint64_t kAttentionValueRows = 4;
+}
+
+void Hobbit::core::Attention::CheckArgs() {
+  if (args_.size() != 3)
+    throw IncorrectNumArgs("Attention");
+
+  const Shape &q = args_[0]->shape;
+  const Shape &k = args_[1]->shape;
+  const Shape &v = args_[2]->shape;
+  if (q.GetAxisSize(W) != k.GetAxisSize(W) ||
+      k.GetAxisSize(H) != v.GetAxisSize(H) ||
+      k.GetAxisSize(K) != v.GetAxisSize(K))
+    throw IncompatibleShapes("Attention");
+  if (k.GetAxisSize(K) != 1 && k.GetAxisSize(K) != q.GetAxisSize(K))
+    throw IncompatibleShapes("Attention");
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  if (ElementType(args_[1]) != elt_type || ElementType(args_[2]) != elt_type ||
+      !ComputeType(elt_type)->isFloatingPointTy())
+    throw IncompatibleTypes("Attention");
+}
+
+Hobbit::Tensor *Hobbit::core::Attention::GetOutput() {
+  const Shape &q = args_[0]->shape;
+  const uint64_t dv = args_[2]->shape.GetAxisSize(W);
+
+  Tensor *output_tensor =
+      Variable::Create(args_[0]->parent_func, args_[0]->type,
+                       Shape(q.GetAxisSize(K), q.GetAxisSize(H), dv));
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+// Flash attention. For a block of query rows, every tile of keys is
+// visited once, and for each row of the block:
+//  1. the tile's scores q . k / sqrt(d) go into a buffer of one tile,
+//  2. the row's running max m moves to include the tile's max, and the
+//     scores become p = e^(s - m), added into the running sum l,
+//  3. the row's accumulator is scaled by e^(m_old - m) and the tile's rows
+//     of V are added in with weights p.
+// After the last tile the accumulator divided by l is the output row. The
+// only buffers are a tile of scores and the block's accumulators.
+llvm::Value *Hobbit::core::Attention::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.attention.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+  const FPPolicy &policy = args_[0]->parent_func->GetFPPolicy();
+
+  llvm::Value *q = BufferPointer(builder, args_[0]);
+  llvm::Value *k = BufferPointer(builder, args_[1]);
+  llvm::Value *v = BufferPointer(builder, args_[2]);
+  llvm::Value *output = BufferPointer(builder, args_[3]);
+
+  const Shape &q_shape = args_[0]->shape;
+  const Shape &k_shape = args_[1]->shape;
+  const uint64_t batch = q_shape.GetAxisSize(K);
+  const uint64_t lq = q_shape.GetAxisSize(H);
+  const uint64_t lk = k_shape.GetAxisSize(H);
+  const uint64_t d = q_shape.GetAxisSize(W);
+  const uint64_t dv = args_[2]->shape.GetAxisSize(W);
+  const bool kv_batched = k_shape.GetAxisSize(K) != 1;
+
+  llvm::Type *elt_type = ComputeType(ElementType(args_[0]));
+  const uint64_t vw = VectorWidth(elt_type);
+  llvm::VectorType *vec_type = llvm::VectorType::get(elt_type, vw);
+  const uint64_t tile = std::min(kAttentionKeyTile, lk);
+  const uint64_t elt_bytes = elt_type->getPrimitiveSizeInBits() / 8;
+  const uint64_t block = std::max<uint64_t>(
+      1, std::min(kAttentionQueryBlock,
+                  kAttentionAccBytes / (dv * elt_bytes)));
+
+  llvm::Value *acc =
+      EntryAlloca(func, elt_type, block * dv, "hobbit.attention.acc");
+  llvm::Value *row_max =
+      EntryAlloca(func, elt_type, block, "hobbit.attention.max");
+  llvm::Value *row_sum =
+      EntryAlloca(func, elt_type, block, "hobbit.attention.sum");
+  llvm::Value *scores =
+      EntryAlloca(func, elt_type, tile, "hobbit.attention.scores");
+  llvm::Value *tile_max =
+      EntryAlloca(func, elt_type, 1, "hobbit.attention.tmax");
+  llvm::Value *tile_sum =
+      EntryAlloca(func, elt_type, 1, "hobbit.attention.tsum");
+
+  const double inf = std::numeric_limits<double>::infinity();
+  llvm::Value *scale = ConstantValue(elt_type, 1.0 / std::sqrt((double)d));
+
+  auto lanes = [&](llvm::Value *val, bool vector) {
+    return vector ? builder.CreateVectorSplat(vw, val) : val;
+  };
+
+  EmitLoop(builder, "hobbit.attention.batch", builder.getInt64(0),
+           builder.getInt64(batch), 1, [&](llvm::Value *b) {
+    llvm::Value *q_b =
+        builder.CreateGEP(q, builder.CreateMul(b, builder.getInt64(lq * d)));
+    llvm::Value *kv_b = kv_batched ? b : builder.getInt64(0);
+    llvm::Value *k_b =
+        builder.CreateGEP(k, builder.CreateMul(kv_b, builder.getInt64(lk * d)));
+    llvm::Value *v_b = builder.CreateGEP(
+        v, builder.CreateMul(kv_b, builder.getInt64(lk * dv)));
+    llvm::Value *out_b = builder.CreateGEP(
+        output, builder.CreateMul(b, builder.getInt64(lq * dv)));
+
+    EmitLoop(builder, "hobbit.attention.block", builder.getInt64(0),
+             builder.getInt64(lq), block, [&](llvm::Value *first) {
+      llvm::Value *last = EmitMin(
+          builder, builder.CreateAdd(first, builder.getInt64(block)),
+          builder.getInt64(lq));
+
+      // Runs body(row, row - first) for the rows of the block
+      auto rows = [&](const std::string &name,
+                      const std::function<void(llvm::Value *, llvm::Value *)>
+                          &body) {
+        EmitLoop(builder, name, first, last, 1, [&](llvm::Value *row) {
+          body(row, builder.CreateSub(row, first));
+        });
+      };
+
+      rows("hobbit.attention.init", [&](llvm::Value *, llvm::Value *i) {
+        builder.CreateStore(ConstantValue(elt_type, -inf),
+                            builder.CreateGEP(row_max, i));
+        builder.CreateStore(llvm::Constant::getNullValue(elt_type),
+                            builder.CreateGEP(row_sum, i));
+        llvm::Value *acc_row =
+            builder.CreateGEP(acc, builder.CreateMul(i, builder.getInt64(dv)));
+        EmitVectorLoop(builder, "hobbit.attention.zero", dv, vw,
+                       [&](llvm::Value *c, bool vector) {
+          EmitStoreLanes(builder,
+                         llvm::Constant::getNullValue(
+                             vector ? (llvm::Type *)vec_type : elt_type),
+                         acc_row, c);
+        });
+      });
+
+      // The keys [key, key + size)
+      auto key_tile = [&](llvm::Value *key, uint64_t size) {
+        llvm::Value *k_tile = builder.CreateGEP(
+            k_b, builder.CreateMul(key, builder.getInt64(d)));
+        llvm::Value *v_tile = builder.CreateGEP(
+            v_b, builder.CreateMul(key, builder.getInt64(dv)));
+
+        rows("hobbit.attention.row", [&](llvm::Value *row, llvm::Value *i) {
+          llvm::Value *q_row = builder.CreateGEP(
+              q_b, builder.CreateMul(row, builder.getInt64(d)));
+
+          // 1.
+          builder.CreateStore(ConstantValue(elt_type, -inf), tile_max);
+          EmitLoop(builder, "hobbit.attention.scores", builder.getInt64(0),
+                   builder.getInt64(size), 1, [&](llvm::Value *j) {
+            llvm::Value *k_row = builder.CreateGEP(
+                k_tile, builder.CreateMul(j, builder.getInt64(d)));
+            llvm::Value *s = builder.CreateFMul(
+                EmitDot(builder, q_row, k_row, d, policy.reassociate,
+                        policy.fma),
+                scale);
+            builder.CreateStore(s, builder.CreateGEP(scores, j));
+            builder.CreateStore(
+                EmitMax(builder, builder.CreateLoad(tile_max), s), tile_max);
+          });
+
+          // 2.
+          llvm::Value *max_ptr = builder.CreateGEP(row_max, i);
+          llvm::Value *old_max = builder.CreateLoad(max_ptr);
+          llvm::Value *new_max =
+              EmitMax(builder, old_max, builder.CreateLoad(tile_max));
+          llvm::Value *correction = EmitExp(
+              builder, builder.CreateFSub(old_max, new_max), policy.math);
+          builder.CreateStore(new_max, max_ptr);
+
+          builder.CreateStore(llvm::Constant::getNullValue(elt_type),
+                              tile_sum);
+          EmitVectorLoop(builder, "hobbit.attention.exp", size, vw,
+                         [&](llvm::Value *j, bool vector) {
+            llvm::Value *p = EmitExp(
+                builder,
+                builder.CreateFSub(
+                    EmitLoadLanes(builder, scores, j, vector ? vw : 1),
+                    lanes(new_max, vector)),
+                policy.math);
+            EmitStoreLanes(builder, p, scores, j);
+            if (vector)
+              p = EmitHorizontalAdd(builder, p);
+            builder.CreateStore(
+                builder.CreateFAdd(builder.CreateLoad(tile_sum), p), tile_sum);
+          });
+          llvm::Value *sum_ptr = builder.CreateGEP(row_sum, i);
+          builder.CreateStore(
+              builder.CreateFAdd(
+                  builder.CreateFMul(builder.CreateLoad(sum_ptr), correction),
+                  builder.CreateLoad(tile_sum)),
+              sum_ptr);
+
+          // 3.
+          llvm::Value *acc_row = builder.CreateGEP(
+              acc, builder.CreateMul(i, builder.getInt64(dv)));
+          EmitVectorLoop(builder, "hobbit.attention.rescale", dv, vw,
+                         [&](llvm::Value *c, bool vector) {
+            EmitStoreLanes(
+                builder,
+                builder.CreateFMul(
+                    EmitLoadLanes(builder, acc_row, c, vector ? vw : 1),
+                    lanes(correction, vector)),
+                acc_row, c);
+          });
+
+          auto fold = [&](llvm::Value *j, uint64_t n_rows) {
+            std::vector<llvm::Value *> p, v_rows;
+            for (uint64_t r = 0; r < n_rows; r++) {
+              llvm::Value *key_j = builder.CreateAdd(j, builder.getInt64(r));
+              p.push_back(builder.CreateLoad(builder.CreateGEP(scores, key_j)));
+              v_rows.push_back(builder.CreateGEP(
+                  v_tile, builder.CreateMul(key_j, builder.getInt64(dv))));
+            }
+            EmitVectorLoop(builder, "hobbit.attention.fold", dv, vw,
+                           [&](llvm::Value *c, bool vector) {
+              const unsigned n_lanes = vector ? vw : 1;
+              llvm::Value *sum = EmitLoadLanes(builder, acc_row, c, n_lanes);
+              for (uint64_t r = 0; r < n_rows; r++)
+                sum = EmitMulAdd(
+                    builder, lanes(p[r], vector),
+                    EmitLoadCompute(builder, v_rows[r], c, n_lanes), sum,
+                    policy.fma);
+              EmitStoreLanes(builder, sum, acc_row, c);
+            });
+          };
+
+          const uint64_t grouped = size - size % kAttentionValueRows;
+          EmitLoop(builder, "hobbit.attention.values", builder.getInt64(0),
+                   builder.getInt64(grouped), kAttentionValueRows,
+                   [&](llvm::Value *j) { fold(j, kAttentionValueRows); });
+          for (uint64_t r = grouped; r < size; r++)
+            fold(builder.getInt64(r), 1);
+        });
+      };
+
+      const uint64_t full = lk - lk % tile;
+      EmitLoop(builder, "hobbit.attention.tile", builder.getInt64(0),
+               builder.getInt64(full), tile,
+               [&](llvm::Value *key) { key_tile(key, tile); });
+      if (full < lk)
+        key_tile(builder.getInt64(full), lk - full);
+
+      rows("hobbit.attention.out", [&](llvm::Value *row, llvm::Value *i) {
+        llvm::Value *inv = builder.CreateFDiv(
+            ConstantValue(elt_type, 1.0),
+            builder.CreateLoad(builder.CreateGEP(row_sum, i)));
+        llvm::Value *acc_row =
+            builder.CreateGEP(acc, builder.CreateMul(i, builder.getInt64(dv)));
+        llvm::Value *out_row = builder.CreateGEP(
+            out_b, builder.CreateMul(row, builder.getInt64(dv)));
+        EmitVectorLoop(builder, "hobbit.attention.store", dv, vw,
+                       [&](llvm::Value *c, bool vector) {
+          EmitStoreCompute(
+              builder,
+              builder.CreateFMul(
+                  EmitLoadLanes(builder, acc_row, c, vector ? vw : 1),
+                  lanes(inv, vector)),
+              out_row, c);
+        });
+      });
+    });
+  });
+
+  return output;
+}
@@ -0,0 +1,354 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+
+#include "Codegen.hpp"
+
+namespace {
+  // Rows of the rhs compared against each lhs row per pass, so that every
+  // lhs word loaded is used this many times
+  const uint64_t kBgemmColumns = 4;
+  // Bytes of rhs rows BGEMM runs all of the lhs rows against before moving
+  // on, about half of L1
+  const uint64_t kBgemmChunkBytes = 16 * 1024;
+
+  llvm::Value *Words(llvm::IRBuilder<> &builder, llvm::Value *ptr) {
+    return builder.CreateBitCast(ptr, builder.getInt64Ty()->getPointerTo());
+  }
+
+  // popcount(a[i] ^ b[i]) summed over `words` words, for each of the rows
+  // in b. Only the bits in last_mask of the last word count. There's no
+  // POPCNT on the baseline target, but vector ctpop becomes SSE2 bit
+  // arithmetic that does two words at a time.
+  std::vector<llvm::Value *>
+  EmitXorPopcounts(llvm::IRBuilder<> &builder, llvm::Value *a,
+                   const std::vector<llvm::Value *> &b, uint64_t words,
+                   uint64_t last_mask) {
+    llvm::Function *func = builder.GetInsertBlock()->getParent();
+    llvm::Type *i64 = builder.getInt64Ty();
+    const uint64_t vw = Hobbit::core::VectorWidth(i64);
+    llvm::VectorType *vec_type = llvm::VectorType::get(i64, vw);
+    llvm::Function *ctpop = llvm::Intrinsic::getDeclaration(
+        func->getParent(), llvm::Intrinsic::ctpop, {i64});
+    llvm::Function *vec_ctpop = llvm::Intrinsic::getDeclaration(
+        func->getParent(), llvm::Intrinsic::ctpop, {vec_type});
+
+    const bool masked = last_mask != ~(uint64_t)0;
+    const uint64_t unmasked = masked ? words - 1 : words;
+    const uint64_t vec_end = unmasked - unmasked % vw;
+
+    std::vector<llvm::Value *> counts(b.size(), builder.getInt64(0));
+    if (vec_end > 0) {
+      llvm::Value *acc =
+          Hobbit::core::EntryAlloca(func, vec_type, b.size(), "hobbit.bin.acc");
+      auto acc_ptr = [&](uint64_t j) {
+        return builder.CreateGEP(acc, builder.getInt64(j));
+      };
+      for (uint64_t j = 0; j < b.size(); j++)
+        builder.CreateStore(llvm::Constant::getNullValue(vec_type), acc_ptr(j));
+
+      Hobbit::core::EmitLoop(builder, "hobbit.bin.words", builder.getInt64(0),
+                             builder.getInt64(vec_end), vw,
+                             [&](llvm::Value *w) {
+        llvm::Value *a_vec = Hobbit::core::EmitLoadLanes(builder, a, w, vw);
+        for (uint64_t j = 0; j < b.size(); j++) {
+          llvm::Value *diff = builder.CreateXor(
+              a_vec, Hobbit::core::EmitLoadLanes(builder, b[j], w, vw));
+          builder.CreateStore(
+              builder.CreateAdd(builder.CreateLoad(acc_ptr(j)),
+                                builder.CreateCall(vec_ctpop, {diff})),
+              acc_ptr(j));
+        }
+      });
+
+      for (uint64_t j = 0; j < b.size(); j++)
+        counts[j] = Hobbit::core::EmitHorizontalAdd(
+            builder, builder.CreateLoad(acc_ptr(j)));
+    }
+
+    for (uint64_t w = vec_end; w < words; w++) {
+      llvm::Value *a_word = builder.CreateLoad(
+          builder.CreateGEP(a, builder.getInt64(w)));
+      for (uint64_t j = 0; j < b.size(); j++) {
+        llvm::Value *diff = builder.CreateXor(
+            a_word,
+            builder.CreateLoad(builder.CreateGEP(b[j], builder.getInt64(w))));
+        if (masked && w == words - 1)
+          diff = builder.CreateAnd(diff, builder.getInt64(last_mask));
+        counts[j] =
+            builder.CreateAdd(counts[j], builder.CreateCall(ctpop, {diff}));
+      }
+    }
+    return counts;
+  }
+
+  // The bits of the last word of a row of n bits that are elements
+  uint64_t LastWordMask(uint64_t n) {
+    return n % 64 == 0 ? ~(uint64_t)0 : ((uint64_t)1 << (n % 64)) - 1;
+  }
+}
+
+void Hobbit::core::Binarize::CheckArgs() {
+  if (args_.size() != 1)
+    throw IncorrectNumArgs("Binarize");
+
+  llvm::Type *elt_type = ComputeType(ElementType(args_[0]));
+  if (!elt_type->isFloatingPointTy() && !elt_type->isIntegerTy())
+    throw IncompatibleTypes("Binarize");
+}
+
+Hobbit::Tensor *Hobbit::core::Binarize::GetOutput() {
+  llvm::LLVMContext &ctx = args_[0]->type->getContext();
+  Tensor *output_tensor = Variable::Create(
+      args_[0]->parent_func, BitTy(ctx)->getPointerTo(), args_[0]->shape);
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+// A word at a time: 64 elements are compared at once, and the vector of
+// results bitcast to i64 is the packed word (a movmsk per register on
+// x86). The last word of a row takes the leftover elements the same way.
+llvm::Value *Hobbit::core::Binarize::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.binarize.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+
+  llvm::Value *input = BufferPointer(builder, args_[0]);
+  llvm::Value *output = Words(builder, BufferPointer(builder, args_[1]));
+
+  const Shape &shape = args_[0]->shape;
+  const uint64_t n = shape.GetAxisSize(W);
+  const uint64_t words = PackedWords(n);
+  const uint64_t full = n / 64;
+  llvm::Type *elt_type = ComputeType(ElementType(args_[0]));
+
+  auto pack = [&](llvm::Value *in_row, llvm::Value *word, unsigned lanes) {
+    llvm::Value *x = EmitLoadCompute(
+        builder, in_row, builder.CreateMul(word, builder.getInt64(64)), lanes);
+    llvm::Value *zero = llvm::Constant::getNullValue(x->getType());
+    llvm::Value *set = elt_type->isFloatingPointTy()
+                           ? builder.CreateFCmpOGE(x, zero)
+                           : builder.CreateICmpSGE(x, zero);
+    return builder.CreateZExt(
+        builder.CreateBitCast(set, builder.getIntNTy(lanes)),
+        builder.getInt64Ty());
+  };
+
+  EmitLoop(builder, "hobbit.binarize.row", builder.getInt64(0),
+           builder.getInt64(shape.GetAxisSize(K) * shape.GetAxisSize(H)), 1,
+           [&](llvm::Value *r) {
+    llvm::Value *in_row =
+        builder.CreateGEP(input, builder.CreateMul(r, builder.getInt64(n)));
+    llvm::Value *out_row = builder.CreateGEP(
+        output, builder.CreateMul(r, builder.getInt64(words)));
+
+    if (full > 0) {
+      EmitLoop(builder, "hobbit.binarize.word", builder.getInt64(0),
+               builder.getInt64(full), 1, [&](llvm::Value *w) {
+        builder.CreateStore(pack(in_row, w, 64),
+                            builder.CreateGEP(out_row, w));
+      });
+    }
+    if (full < words) {
+      llvm::Value *w = builder.getInt64(full);
+      builder.CreateStore(pack(in_row, w, n % 64),
+                          builder.CreateGEP(out_row, w));
+    }
+  });
+
+  return output;
+}
+
+void Hobbit::core::BinaryGemm::CheckArgs() {
+  if (args_.size() != 2)
+    throw IncorrectNumArgs("BinaryGemm");
+
+  llvm::Type *bit_type = BitTy(args_[0]->type->getContext());
+  if (ElementType(args_[0]) != bit_type || ElementType(args_[1]) != bit_type)
+    throw IncompatibleTypes("BinaryGemm");
+
+  const Shape &lhs = args_[0]->shape;
+  const Shape &rhs = args_[1]->shape;
+  if (op_ == BDOT) {
+    if (lhs != rhs)
+      throw IncompatibleShapes("BinaryGemm");
+    return;
+  }
+  if (lhs.GetAxisSize(W) != rhs.GetAxisSize(W))
+    throw IncompatibleShapes("BinaryGemm");
+  if (rhs.GetAxisSize(K) != 1 && rhs.GetAxisSize(K) != lhs.GetAxisSize(K))
+    throw IncompatibleShapes("BinaryGemm");
+}
+
+Hobbit::Tensor *Hobbit::core::BinaryGemm::GetOutput() {
+  const Shape &lhs = args_[0]->shape;
+  const Shape &rhs = args_[1]->shape;
+
+  Tensor *output_tensor = Variable::Create(
+      args_[0]->parent_func,
+      llvm::Type::getInt32PtrTy(args_[0]->type->getContext()),
+      op_ == BDOT ? Shape(1, 1, 1)
+                  : Shape(lhs.GetAxisSize(K), lhs.GetAxisSize(H),
+                          rhs.GetAxisSize(H)));
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+llvm::Value *Hobbit::core::BinaryGemm::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.bgemm.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+
+  llvm::Value *lhs = Words(builder, BufferPointer(builder, args_[0]));
+  llvm::Value *rhs = Words(builder, BufferPointer(builder, args_[1]));
+  llvm::Value *output = BufferPointer(builder, args_[2]);
+
+  if (op_ == BDOT)
+    EmitDot(builder, lhs, rhs, output);
+  else
+    EmitGemm(builder, lhs, rhs, output);
+
+  return output;
+}
+
+// Rows only matter for their padding, so rows that fill their last word
+// are treated as one long row
+void Hobbit::core::BinaryGemm::EmitDot(llvm::IRBuilder<> &builder,
+                                       llvm::Value *lhs, llvm::Value *rhs,
+                                       llvm::Value *output) {
+  const Shape &shape = args_[0]->shape;
+  const uint64_t n = shape.GetAxisSize(W);
+  uint64_t rows = shape.GetAxisSize(K) * shape.GetAxisSize(H);
+  uint64_t words = PackedWords(n);
+  if (n % 64 == 0) {
+    words *= rows;
+    rows = 1;
+  }
+
+  llvm::Value *count =
+      EntryAlloca(builder.GetInsertBlock()->getParent(), builder.getInt64Ty(),
+                  1, "hobbit.bdot.count");
+  builder.CreateStore(builder.getInt64(0), count);
+  EmitLoop(builder, "hobbit.bdot.row", builder.getInt64(0),
+           builder.getInt64(rows), 1, [&](llvm::Value *r) {
+    llvm::Value *offset = builder.CreateMul(r, builder.getInt64(words));
+    llvm::Value *popcount =
+        EmitXorPopcounts(builder, builder.CreateGEP(lhs, offset),
+                         {builder.CreateGEP(rhs, offset)}, words,
+                         LastWordMask(n))[0];
+    builder.CreateStore(builder.CreateAdd(builder.CreateLoad(count), popcount),
+                        count);
+  });
+
+  llvm::Value *dot =
+      builder.CreateSub(builder.getInt64(shape.GetSize()),
+                        builder.CreateShl(builder.CreateLoad(count), 1));
+  builder.CreateStore(builder.CreateTrunc(dot, builder.getInt32Ty()), output);
+}
+
+// The rhs goes a chunk of rows (output columns) at a time, small enough to
+// stay in L1 while every lhs row is run against it kBgemmColumns rows at a
+// time. Columns past the last full group are done one by one at the end.
+void Hobbit::core::BinaryGemm::EmitGemm(llvm::IRBuilder<> &builder,
+                                        llvm::Value *lhs, llvm::Value *rhs,
+                                        llvm::Value *output) {
+  const Shape &lhs_shape = args_[0]->shape;
+  const Shape &rhs_shape = args_[1]->shape;
+  const uint64_t batch = lhs_shape.GetAxisSize(K);
+  const uint64_t m = lhs_shape.GetAxisSize(H);
+  const uint64_t n = lhs_shape.GetAxisSize(W);
+  const uint64_t p = rhs_shape.GetAxisSize(H);
+  const uint64_t words = PackedWords(n);
+  const uint64_t last_mask = LastWordMask(n);
+  const bool rhs_batched = rhs_shape.GetAxisSize(K) != 1;
+
+  const uint64_t p_grouped = p - p % kBgemmColumns;
+  const uint64_t chunk =
+      std::max(kBgemmChunkBytes / (words * 8) / kBgemmColumns, (uint64_t)1) *
+      kBgemmColumns;
+
+  EmitLoop(builder, "hobbit.bgemm.batch", builder.getInt64(0),
+           builder.getInt64(batch), 1, [&](llvm::Value *b) {
+    llvm::Value *a = builder.CreateGEP(
+        lhs, builder.CreateMul(b, builder.getInt64(m * words)));
+    llvm::Value *bt = rhs;
+    if (rhs_batched)
+      bt = builder.CreateGEP(rhs,
+                             builder.CreateMul(b, builder.getInt64(p * words)));
+    llvm::Value *c = builder.CreateGEP(
+        output, builder.CreateMul(b, builder.getInt64(m * p)));
+
+    auto columns = [&](llvm::Value *i, llvm::Value *j, uint64_t count) {
+      llvm::Value *a_row =
+          builder.CreateGEP(a, builder.CreateMul(i, builder.getInt64(words)));
+      std::vector<llvm::Value *> b_rows;
+      for (uint64_t col = 0; col < count; col++)
+        b_rows.push_back(builder.CreateGEP(
+            bt, builder.CreateMul(builder.CreateAdd(j, builder.getInt64(col)),
+                                  builder.getInt64(words))));
+      std::vector<llvm::Value *> popcounts =
+          EmitXorPopcounts(builder, a_row, b_rows, words, last_mask);
+      llvm::Value *c_row =
+          builder.CreateGEP(c, builder.CreateMul(i, builder.getInt64(p)));
+      for (uint64_t col = 0; col < count; col++) {
+        llvm::Value *dot = builder.CreateSub(
+            builder.getInt64(n), builder.CreateShl(popcounts[col], 1));
+        builder.CreateStore(
+            builder.CreateTrunc(dot, builder.getInt32Ty()),
+            builder.CreateGEP(c_row,
+                              builder.CreateAdd(j, builder.getInt64(col))));
+      }
+    };
+
+    if (p_grouped > 0) {
+      EmitLoop(builder, "hobbit.bgemm.chunk", builder.getInt64(0),
+               builder.getInt64(p_grouped), chunk, [&](llvm::Value *jc) {
+        llvm::Value *j_end = EmitMin(
+            builder, builder.CreateAdd(jc, builder.getInt64(chunk)),
+            builder.getInt64(p_grouped));
+        EmitLoop(builder, "hobbit.bgemm.row", builder.getInt64(0),
+                 builder.getInt64(m), 1, [&](llvm::Value *i) {
+          EmitLoop(builder, "hobbit.bgemm.cols", jc, j_end, kBgemmColumns,
+                   [&](llvm::Value *j) { columns(i, j, kBgemmColumns); });
+        });
+      });
+    }
+    if (p_grouped < p) {
+      EmitLoop(builder, "hobbit.bgemm.tail_row", builder.getInt64(0),
+               builder.getInt64(m), 1, [&](llvm::Value *i) {
+        EmitLoop(builder, "hobbit.bgemm.tail", builder.getInt64(p_grouped),
+                 builder.getInt64(p), 1,
+                 [&](llvm::Value *j) { columns(i, j, 1); });
+      });
+    }
+  });
+}
@@ -0,0 +1,656 @@
+//
+// Created by Aman LaChapelle on 3/24/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "Codegen.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <llvm/ADT/APSInt.h>
+
+#include "Module.hpp"
+#include "Symbol.hpp"
+#include "Type.hpp"
+
+namespace Hobbit {
+  namespace core {
+    llvm::Type *ElementType(Symbol *sym) {
+      llvm::Type *t = sym->type;
+      if (t->isPointerTy()) {
+        t = t->getPointerElementType();
+      }
+      return t;
+    }
+
+    unsigned VectorWidth(llvm::Type *t) {
+      unsigned bits = t->getScalarSizeInBits();
+      if (bits == 0 || bits >= 256)
+        return 1;
+      return 256 / bits;
+    }
+
+    bool HasCPUFeature(Symbol *sym, const std::string &feature) {
+      return sym->parent_func->GetModule()->HasCPUFeature(feature);
+    }
+
+    bool HasCPUFeature(llvm::Function *func, const std::string &feature) {
+      llvm::SmallVector<llvm::StringRef, 64> features;
+      func->getFnAttribute("target-features")
+          .getValueAsString()
+          .split(features, ',');
+      for (auto &f : features) {
+        if (f.startswith("+") && f.substr(1) == feature)
+          return true;
+      }
+      return false;
+    }
+
+    void ApplyFPPolicy(llvm::IRBuilder<> &builder, Symbol *sym) {
+      const FPPolicy &policy = sym->parent_func->GetFPPolicy();
+
+      llvm::FastMathFlags flags;
+      if (policy.reassociate)
+        flags.setAllowReassoc();
+      if (policy.contract || policy.fma)
+        flags.setAllowContract(true);
+      if (policy.no_nans)
+        flags.setNoNaNs();
+      builder.setFastMathFlags(flags);
+    }
+
+    uint64_t BufferSize(Symbol *sym) {
+      const Shape &shape = sym->shape;
+      if (ElementType(sym) != BitTy(sym->type->getContext()))
+        return shape.GetSize();
+      return shape.GetAxisSize(K) * shape.GetAxisSize(H) *
+             PackedWords(shape.GetAxisSize(W));
+    }
+
+    uint64_t ElementBytes(llvm::Type *type) {
+      // The packed words and bfloat16 are structs, so they have no
+      // primitive size of their own
+      llvm::LLVMContext &ctx = type->getContext();
+      if (type == BitTy(ctx) || type == BFloat16Ty(ctx))
+        type = llvm::cast<llvm::StructType>(type)->getElementType(0);
+      return (type->getPrimitiveSizeInBits() + 7) / 8;
+    }
+
+    uint64_t BufferBytes(Symbol *sym) {
+      return BufferSize(sym) * ElementBytes(ElementType(sym));
+    }
+
+    llvm::Value *BufferPointer(llvm::IRBuilder<> &builder, Symbol *sym) {
+      llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+      if (sym->buffer == nullptr) {
+        sym->buffer = EntryAlloca(func, ElementType(sym), BufferSize(sym),
+                                  "hobbit.buffer");
+      }
+
+      llvm::Value *buffer = (llvm::Value *)sym->buffer;
+      if (buffer->getType()->isArrayTy()) {
+        buffer = GlobalConstant(func->getParent(), (llvm::Constant *)buffer);
+        sym->buffer = buffer;
+      }
+
+      return buffer;
+    }
+
+    llvm::Constant *ConstantInitializer(Symbol *sym) {
+      llvm::Value *buffer = (llvm::Value *)sym->buffer;
+      if (buffer == nullptr)
+        return nullptr;
+      if (buffer->getType()->isArrayTy())
+        return (llvm::Constant *)buffer;
+
+      // Already wrapped up by BufferPointer
+      llvm::ConstantExpr *gep = llvm::dyn_cast<llvm::ConstantExpr>(buffer);
+      if (gep == nullptr)
+        return nullptr;
+      llvm::GlobalVariable *global =
+          llvm::dyn_cast<llvm::GlobalVariable>(gep->getOperand(0));
+      if (global == nullptr || !global->isConstant() ||
+          !global->hasInitializer())
+        return nullptr;
+      return global->getInitializer();
+    }
+
+    llvm::Constant *GlobalConstant(llvm::Module *module,
+                                   llvm::Constant *array) {
+      llvm::GlobalVariable *global = new llvm::GlobalVariable(
+          *module, array->getType(), true, llvm::GlobalValue::PrivateLinkage,
+          array, "hobbit.constant");
+      global->setAlignment(32);
+
+      llvm::Type *i64 = llvm::Type::getInt64Ty(module->getContext());
+      llvm::Constant *idx[] = {llvm::ConstantInt::get(i64, 0),
+                               llvm::ConstantInt::get(i64, 0)};
+      return llvm::ConstantExpr::getInBoundsGetElementPtr(array->getType(),
+                                                          global, idx);
+    }
+
+    namespace {
+      template <typename T>
+      void ReadInts(llvm::Type *type, uint64_t size, const void *data,
+                    std::vector<llvm::Constant *> &elements) {
+        const T *buf = (const T *)data;
+        for (uint64_t i = 0; i < size; i++)
+          elements.push_back(llvm::ConstantInt::get(type, (uint64_t)buf[i]));
+      }
+    }
+
+    llvm::Constant *HostConstant(llvm::Type *type, uint64_t size,
+                                 const void *data) {
+      llvm::LLVMContext &ctx = type->getContext();
+      std::vector<llvm::Constant *> elements;
+
+      if (type->isFloatTy()) {
+        const float *buf = (const float *)data;
+        for (uint64_t i = 0; i < size; i++)
+          elements.push_back(llvm::ConstantFP::get(type, (double)buf[i]));
+      } else if (type->isDoubleTy()) {
+        const double *buf = (const double *)data;
+        for (uint64_t i = 0; i < size; i++)
+          elements.push_back(llvm::ConstantFP::get(type, buf[i]));
+      } else if (type->isHalfTy()) {
+        const uint16_t *buf = (const uint16_t *)data;
+        for (uint64_t i = 0; i < size; i++) {
+          elements.push_back(llvm::ConstantFP::get(
+              ctx, llvm::APFloat(llvm::APFloat::IEEEhalf(),
+                                 llvm::APInt(16, buf[i]))));
+        }
+      } else if (type == BitTy(ctx) || type == BFloat16Ty(ctx)) {
+        // One integer word wrapped in a struct
+        llvm::StructType *word_type = llvm::cast<llvm::StructType>(type);
+        llvm::Type *int_type = word_type->getElementType(0);
+        std::vector<llvm::Constant *> words;
+        if (int_type->isIntegerTy(64))
+          ReadInts<uint64_t>(int_type, size, data, words);
+        else
+          ReadInts<uint16_t>(int_type, size, data, words);
+        for (auto &word : words)
+          elements.push_back(llvm::ConstantStruct::get(word_type, word));
+      } else if (type->isIntegerTy(64)) {
+        ReadInts<uint64_t>(type, size, data, elements);
+      } else if (type->isIntegerTy(32)) {
+        ReadInts<uint32_t>(type, size, data, elements);
+      } else if (type->isIntegerTy(16)) {
+        ReadInts<uint16_t>(type, size, data, elements);
+      } else if (type->isIntegerTy(8)) {
+        ReadInts<uint8_t>(type, size, data, elements);
+      } else if (type->isIntegerTy(1)) {
+        ReadInts<bool>(type, size, data, elements);
+      } else {
+        return nullptr;
+      }
+
+      return llvm::ConstantArray::get(llvm::ArrayType::get(type, size),
+                                      elements);
+    }
+
+    namespace {
+      thread_local ScratchSpace *current_scratch = nullptr;
+    }
+
+    ScratchScope::ScratchScope(ScratchSpace *scratch)
+        : previous_(current_scratch) {
+      current_scratch = scratch;
+    }
+
+    ScratchScope::~ScratchScope() { current_scratch = previous_; }
+
+    llvm::Argument *WorkspaceArg(llvm::Function *func) {
+      for (auto &arg : func->args()) {
+        if (arg.getName() == kWorkspaceArgName)
+          return &arg;
+      }
+      return nullptr;
+    }
+
+    llvm::Value *EntryAlloca(llvm::Function *func, llvm::Type *type,
+                             uint64_t size, const std::string &name) {
+      llvm::BasicBlock *entryBB = &func->getEntryBlock();
+      llvm::IRBuilder<> builder(entryBB, entryBB->begin());
+
+      ScratchSpace *scratch = current_scratch;
+      const uint64_t bytes = size * ElementBytes(type);
+      if (scratch != nullptr && scratch->func == func &&
+          bytes >= kScratchMinBytes) {
+        const uint64_t offset = (scratch->offset + 31) / 32 * 32;
+        scratch->offset = offset + bytes;
+        scratch->peak = std::max(scratch->peak, scratch->offset);
+        return builder.CreateBitCast(
+            builder.CreateConstInBoundsGEP1_64(scratch->base, offset),
+            type->getPointerTo(), name);
+      }
+
+      llvm::AllocaInst *alloca = builder.CreateAlloca(
+          llvm::ArrayType::get(type, size), builder.getInt64(1), name);
+      alloca->setAlignment(32);
+
+      return builder.CreateConstInBoundsGEP2_64(alloca, 0, 0);
+    }
+
+    llvm::MDNode *LoopVectorizeMD(llvm::LLVMContext &ctx, unsigned width) {
+      llvm::SmallVector<llvm::Metadata *, 4> Args;
+      // Reserve operand 0 for loop id self reference.
+      auto TempNode = llvm::MDNode::getTemporary(ctx, llvm::None);
+      Args.push_back(TempNode.get());
+
+      llvm::Metadata *vecMD[] = {
+          llvm::MDString::get(ctx, "llvm.loop.vectorize.width"),
+          llvm::ConstantAsMetadata::get(
+              llvm::ConstantInt::get(llvm::Type::getInt32Ty(ctx), width))};
+      Args.push_back(llvm::MDNode::get(ctx, vecMD));
+
+      llvm::MDNode *LoopID = llvm::MDNode::get(ctx, Args);
+      LoopID->replaceOperandWith(0, LoopID);
+
+      return LoopID;
+    }
+
+    void EmitLoop(llvm::IRBuilder<> &builder, const std::string &name,
+                  llvm::Value *begin, llvm::Value *end, uint64_t step,
+                  const std::function<void(llvm::Value *)> &body,
+                  llvm::MDNode *loop_md) {
+      llvm::BasicBlock *preheaderBB = builder.GetInsertBlock();
+      llvm::Function *func = preheaderBB->getParent();
+      llvm::LLVMContext &ctx = func->getContext();
+
+      llvm::BasicBlock *headerBB =
+          llvm::BasicBlock::Create(ctx, name + ".header", func);
+      llvm::BasicBlock *bodyBB =
+          llvm::BasicBlock::Create(ctx, name + ".body", func);
+      // Not inserted until the body is done so it stays the last block
+      llvm::BasicBlock *exitBB = llvm::BasicBlock::Create(ctx, name + ".exit");
+
+      builder.CreateBr(headerBB);
+
+      builder.SetInsertPoint(headerBB);
+      llvm::PHINode *idx =
+          builder.CreatePHI(begin->getType(), 2, name + ".idx");
+      idx->addIncoming(begin, preheaderBB);
+      builder.CreateCondBr(builder.CreateICmpULT(idx, end), bodyBB, exitBB);
+
+      builder.SetInsertPoint(bodyBB);
+      body(idx);
+
+      llvm::Value *next = builder.CreateAdd(
+          idx, llvm::ConstantInt::get(idx->getType(), step), name + ".next");
+      idx->addIncoming(next, builder.GetInsertBlock());
+      llvm::BranchInst *br = builder.CreateBr(headerBB);
+      if (loop_md != nullptr)
+        br->setMetadata("llvm.loop", loop_md);
+
+      exitBB->insertInto(func);
+      builder.SetInsertPoint(exitBB);
+    }
+
+    void EmitVectorLoop(llvm::IRBuilder<> &builder, const std::string &name,
+                        uint64_t end, uint64_t width,
+                        const std::function<void(llvm::Value *, bool)> &body) {
+      const uint64_t vec_end = end - end % width;
+      if (vec_end > 0) {
+        EmitLoop(builder, name + ".vec", builder.getInt64(0),
+                 builder.getInt64(vec_end), width,
+                 [&](llvm::Value *idx) { body(idx, true); });
+      }
+      if (vec_end < end) {
+        EmitLoop(builder, name + ".tail", builder.getInt64(vec_end),
+                 builder.getInt64(end), 1,
+                 [&](llvm::Value *idx) { body(idx, false); });
+      }
+    }
+
+    llvm::Value *EmitLoadLanes(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                               llvm::Value *idx, unsigned lanes) {
+      llvm::Type *elt_type = ptr->getType()->getPointerElementType();
+      llvm::Value *elt_ptr = builder.CreateGEP(ptr, idx);
+      if (lanes == 1)
+        return builder.CreateLoad(elt_ptr);
+
+      llvm::Type *vec_ptr_type =
+          llvm::VectorType::get(elt_type, lanes)->getPointerTo();
+      return builder.CreateAlignedLoad(
+          builder.CreateBitCast(elt_ptr, vec_ptr_type),
+          elt_type->getPrimitiveSizeInBits() / 8);
+    }
+
+    void EmitStoreLanes(llvm::IRBuilder<> &builder, llvm::Value *val,
+                        llvm::Value *ptr, llvm::Value *idx) {
+      llvm::Value *elt_ptr = builder.CreateGEP(ptr, idx);
+      if (!val->getType()->isVectorTy()) {
+        builder.CreateStore(val, elt_ptr);
+        return;
+      }
+
+      llvm::Type *elt_type = ptr->getType()->getPointerElementType();
+      builder.CreateAlignedStore(
+          val, builder.CreateBitCast(elt_ptr, val->getType()->getPointerTo()),
+          elt_type->getPrimitiveSizeInBits() / 8);
+    }
+
+    void EmitIf(llvm::IRBuilder<> &builder, const std::string &name,
+                llvm::Value *cond, const std::function<void()> &then_body,
+                const std::function<void()> &else_body) {
+      llvm::Function *func = builder.GetInsertBlock()->getParent();
+      llvm::LLVMContext &ctx = func->getContext();
+
+      llvm::BasicBlock *thenBB =
+          llvm::BasicBlock::Create(ctx, name + ".then", func);
+      llvm::BasicBlock *elseBB = nullptr;
+      llvm::BasicBlock *mergeBB =
+          llvm::BasicBlock::Create(ctx, name + ".merge");
+
+      if (else_body) {
+        elseBB = llvm::BasicBlock::Create(ctx, name + ".else");
+        builder.CreateCondBr(cond, thenBB, elseBB);
+      } else {
+        builder.CreateCondBr(cond, thenBB, mergeBB);
+      }
+
+      builder.SetInsertPoint(thenBB);
+      then_body();
+      builder.CreateBr(mergeBB);
+
+      if (else_body) {
+        elseBB->insertInto(func);
+        builder.SetInsertPoint(elseBB);
+        else_body();
+        builder.CreateBr(mergeBB);
+      }
+
+      mergeBB->insertInto(func);
+      builder.SetInsertPoint(mergeBB);
+    }
+
+    llvm::Constant *ConstantValue(llvm::Type *t, double v) {
+      if (t->isFPOrFPVectorTy())
+        return llvm::ConstantFP::get(t, v);
+
+      llvm::APSInt val(t->getScalarSizeInBits(), false);
+      bool exact;
+      llvm::APFloat(v).convertToInteger(val, llvm::APFloat::rmTowardZero,
+                                        &exact);
+      return llvm::ConstantInt::get(t, val.getSExtValue(), true);
+    }
+
+    llvm::Value *EmitAdd(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs) {
+      if (lhs->getType()->isFPOrFPVectorTy())
+        return builder.CreateFAdd(lhs, rhs);
+      return builder.CreateAdd(lhs, rhs);
+    }
+
+    llvm::Value *EmitSub(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs) {
+      if (lhs->getType()->isFPOrFPVectorTy())
+        return builder.CreateFSub(lhs, rhs);
+      return builder.CreateSub(lhs, rhs);
+    }
+
+    llvm::Value *EmitMul(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs) {
+      if (lhs->getType()->isFPOrFPVectorTy())
+        return builder.CreateFMul(lhs, rhs);
+      return builder.CreateMul(lhs, rhs);
+    }
+
+    llvm::Value *EmitDiv(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs) {
+      if (lhs->getType()->isFPOrFPVectorTy())
+        return builder.CreateFDiv(lhs, rhs);
+      return builder.CreateSDiv(lhs, rhs);
+    }
+
+    llvm::Value *EmitMin(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs) {
+      if (lhs->getType()->isFPOrFPVectorTy())
+        return builder.CreateSelect(builder.CreateFCmpOLT(lhs, rhs), lhs, rhs);
+      return builder.CreateSelect(builder.CreateICmpSLT(lhs, rhs), lhs, rhs);
+    }
+
+    llvm::Value *EmitMax(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                         llvm::Value *rhs) {
+      if (lhs->getType()->isFPOrFPVectorTy())
+        return builder.CreateSelect(builder.CreateFCmpOGT(lhs, rhs), lhs, rhs);
+      return builder.CreateSelect(builder.CreateICmpSGT(lhs, rhs), lhs, rhs);
+    }
+
+    llvm::Value *EmitMulAdd(llvm::IRBuilder<> &builder, llvm::Value *lhs,
+                            llvm::Value *rhs, llvm::Value *acc, bool fuse) {
+      if (fuse && lhs->getType()->isFPOrFPVectorTy()) {
+        llvm::Function *fmuladd = llvm::Intrinsic::getDeclaration(
+            builder.GetInsertBlock()->getModule(), llvm::Intrinsic::fmuladd,
+            {lhs->getType()});
+        return builder.CreateCall(fmuladd, {lhs, rhs, acc});
+      }
+      return EmitAdd(builder, acc, EmitMul(builder, lhs, rhs));
+    }
+
+    llvm::Value *EmitHorizontalAdd(llvm::IRBuilder<> &builder,
+                                   llvm::Value *vec) {
+      unsigned width = vec->getType()->getVectorNumElements();
+      while (width > 1) {
+        width /= 2;
+        llvm::SmallVector<uint32_t, 16> lo, hi;
+        for (unsigned i = 0; i < width; i++) {
+          lo.push_back(i);
+          hi.push_back(i + width);
+        }
+        llvm::Value *undef = llvm::UndefValue::get(vec->getType());
+        vec = EmitAdd(builder, builder.CreateShuffleVector(vec, undef, lo),
+                      builder.CreateShuffleVector(vec, undef, hi));
+      }
+      return builder.CreateExtractElement(vec, builder.getInt64(0));
+    }
+
+    namespace {
+      // t with its scalar type replaced by elt, keeping any vector width
+      llvm::Type *WithElement(llvm::Type *t, llvm::Type *elt) {
+        if (t->isVectorTy())
+          return llvm::VectorType::get(elt, t->getVectorNumElements());
+        return elt;
+      }
+
+      bool IsBFloat16(llvm::Type *t) {
+        return t == BFloat16Ty(t->getContext());
+      }
+
+      // vcvtph2ps and vcvtps2ph convert a vector of halfs in one instruction
+      // and round the same way as the integer code below (only NaN payloads
+      // differ), so where the CPU has them plain fpext and fptrunc are used
+      bool HasF16C(llvm::IRBuilder<> &builder) {
+        return HasCPUFeature(builder.GetInsertBlock()->getParent(), "f16c");
+      }
+
+      // The half's exponent and mantissa shifted into place are a float
+      // 2^-112 times too small, which one multiply fixes for normal and
+      // subnormal halfs alike. Inf and NaN just get the exponent filled in.
+      llvm::Value *WidenHalf(llvm::IRBuilder<> &builder, llvm::Value *val) {
+        llvm::Type *type = val->getType();
+        if (HasF16C(builder))
+          return builder.CreateFPExt(
+              val, WithElement(type, builder.getFloatTy()));
+
+        // As much as possible is done on the 16-bit lanes, which are twice
+        // as many per register
+        llvm::Type *i16 = WithElement(type, builder.getInt16Ty());
+        llvm::Type *i32 = WithElement(type, builder.getInt32Ty());
+        llvm::Type *f32 = WithElement(type, builder.getFloatTy());
+        auto c16 = [&](uint64_t v) { return llvm::ConstantInt::get(i16, v); };
+        auto c32 = [&](uint64_t v) { return llvm::ConstantInt::get(i32, v); };
+
+        llvm::Value *h = builder.CreateBitCast(val, i16);
+        llvm::Value *magnitude = builder.CreateAnd(h, c16(0x7fff));
+        // Upper half of the float: the sign, and the exponent for inf/NaN
+        llvm::Value *upper = builder.CreateOr(
+            builder.CreateXor(h, magnitude),
+            builder.CreateSelect(builder.CreateICmpSGT(magnitude, c16(0x7bff)),
+                                 c16(0x7f80), c16(0)));
+
+        llvm::Value *scaled = builder.CreateFMul(
+            builder.CreateBitCast(
+                builder.CreateShl(builder.CreateZExt(magnitude, i32), c32(13)),
+                f32),
+            llvm::ConstantFP::get(f32, std::ldexp(1.0, 112)));
+        return builder.CreateBitCast(
+            builder.CreateOr(
+                builder.CreateBitCast(scaled, i32),
+                builder.CreateShl(builder.CreateZExt(upper, i32), c32(16))),
+            f32);
+      }
+
+      // Three cases on the magnitude: too big for a half (inf, or a quiet NaN
+      // for NaN), subnormal in half, where adding 0.5 lets the FPU do the
+      // rounding at the right bit, and normal, where the rounding bias is
+      // added to the bits before the mantissa is cut down to 10 bits.
+      llvm::Value *NarrowHalf(llvm::IRBuilder<> &builder, llvm::Value *val) {
+        llvm::Type *type = val->getType();
+        if (HasF16C(builder))
+          return builder.CreateFPTrunc(
+              val, WithElement(type, builder.getHalfTy()));
+
+        llvm::Type *i32 = WithElement(type, builder.getInt32Ty());
+        auto c = [&](uint64_t v) { return llvm::ConstantInt::get(i32, v); };
+        // 0.5, whose exponent lines the half subnormals up with bit 0
+        const uint64_t magic = 126u << 23;
+
+        llvm::Value *u = builder.CreateBitCast(val, i32);
+        llvm::Value *sign = builder.CreateAnd(u, c(0x80000000));
+        u = builder.CreateXor(u, sign);
+
+        llvm::Value *overflow = builder.CreateSelect(
+            builder.CreateICmpUGT(u, c(0x7f800000)), c(0x7e00), c(0x7c00));
+
+        llvm::Value *subnormal = builder.CreateSub(
+            builder.CreateBitCast(
+                builder.CreateFAdd(builder.CreateBitCast(u, type),
+                                   builder.CreateBitCast(c(magic), type)),
+                i32),
+            c(magic));
+
+        llvm::Value *odd =
+            builder.CreateAnd(builder.CreateLShr(u, c(13)), c(1));
+        // Rebias the exponent from 127 to 15 and add just under half an ulp
+        llvm::Value *normal = builder.CreateLShr(
+            builder.CreateAdd(builder.CreateAdd(u, c(0xc8000fff)), odd), c(13));
+
+        llvm::Value *bits = builder.CreateSelect(
+            builder.CreateICmpUGE(u, c(143u << 23)), overflow,
+            builder.CreateSelect(builder.CreateICmpULT(u, c(113u << 23)),
+                                 subnormal, normal));
+        bits = builder.CreateOr(bits, builder.CreateLShr(sign, c(16)));
+        return builder.CreateBitCast(
+            builder.CreateTrunc(bits, WithElement(type, builder.getInt16Ty())),
+            WithElement(type, builder.getHalfTy()));
+      }
+
+      // bfloat16 is the upper half of a float
+      llvm::Value *WidenBFloat16(llvm::IRBuilder<> &builder,
+                                 llvm::Value *bits) {
+        llvm::Type *i32 = WithElement(bits->getType(), builder.getInt32Ty());
+        return builder.CreateBitCast(
+            builder.CreateShl(builder.CreateZExt(bits, i32),
+                              llvm::ConstantInt::get(i32, 16)),
+            WithElement(bits->getType(), builder.getFloatTy()));
+      }
+
+      // Round to nearest even by adding just under half an ulp, plus one
+      // for odd results, before dropping the low 16 bits. NaNs are made
+      // quiet so that rounding can't turn them into infinities.
+      llvm::Value *NarrowBFloat16(llvm::IRBuilder<> &builder,
+                                  llvm::Value *val) {
+        llvm::Type *i32 = WithElement(val->getType(), builder.getInt32Ty());
+        auto c = [&](uint64_t v) { return llvm::ConstantInt::get(i32, v); };
+
+        llvm::Value *u = builder.CreateBitCast(val, i32);
+        llvm::Value *upper = builder.CreateLShr(u, c(16));
+        llvm::Value *rounded = builder.CreateLShr(
+            builder.CreateAdd(builder.CreateAdd(u, c(0x7fff)),
+                              builder.CreateAnd(upper, c(1))),
+            c(16));
+        llvm::Value *bits =
+            builder.CreateSelect(builder.CreateFCmpUNO(val, val),
+                                 builder.CreateOr(upper, c(0x40)), rounded);
+        return builder.CreateTrunc(
+            bits, WithElement(val->getType(), builder.getInt16Ty()));
+      }
+    }
+
+    llvm::Type *ComputeType(llvm::Type *t) {
+      if (t->getScalarType()->isHalfTy() || IsBFloat16(t))
+        return WithElement(t, llvm::Type::getFloatTy(t->getContext()));
+      return t;
+    }
+
+    llvm::Value *EmitLoadCompute(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                                 llvm::Value *idx, unsigned lanes) {
+      llvm::Type *elt_type = ptr->getType()->getPointerElementType();
+      if (!elt_type->isHalfTy() && !IsBFloat16(elt_type))
+        return EmitLoadLanes(builder, ptr, idx, lanes);
+
+      llvm::IRBuilder<>::FastMathFlagGuard guard(builder);
+      builder.clearFastMathFlags();
+
+      if (elt_type->isHalfTy())
+        return WidenHalf(builder, EmitLoadLanes(builder, ptr, idx, lanes));
+      llvm::Value *bits = builder.CreateBitCast(
+          ptr, builder.getInt16Ty()->getPointerTo(
+                   ptr->getType()->getPointerAddressSpace()));
+      return WidenBFloat16(builder, EmitLoadLanes(builder, bits, idx, lanes));
+    }
+
+    void EmitStoreCompute(llvm::IRBuilder<> &builder, llvm::Value *val,
+                          llvm::Value *ptr, llvm::Value *idx) {
+      llvm::Type *elt_type = ptr->getType()->getPointerElementType();
+      if (!elt_type->isHalfTy() && !IsBFloat16(elt_type)) {
+        EmitStoreLanes(builder, val, ptr, idx);
+        return;
+      }
+
+      llvm::IRBuilder<>::FastMathFlagGuard guard(builder);
+      builder.clearFastMathFlags();
+
+      if (elt_type->isHalfTy()) {
+        EmitStoreLanes(builder, NarrowHalf(builder, val), ptr, idx);
+        return;
+      }
+      llvm::Value *bits = builder.CreateBitCast(
+          ptr, builder.getInt16Ty()->getPointerTo(
+                   ptr->getType()->getPointerAddressSpace()));
+      EmitStoreLanes(builder, NarrowBFloat16(builder, val), bits, idx);
+    }
+
+    llvm::Value *EmitRoundTo(llvm::IRBuilder<> &builder, llvm::Value *val,
+                             llvm::Type *storage_type) {
+      llvm::IRBuilder<>::FastMathFlagGuard guard(builder);
+      builder.clearFastMathFlags();
+
+      if (storage_type->isHalfTy())
+        return WidenHalf(builder, NarrowHalf(builder, val));
+      if (IsBFloat16(storage_type))
+        return WidenBFloat16(builder, NarrowBFloat16(builder, val));
+      return val;
+    }
+  }
+}
@@ -0,0 +1,405 @@
+//
+// Created by Aman LaChapelle on 3/25/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+
+#include "Codegen.hpp"
+#include "Kernels.hpp"
+
+namespace {
+  // Past this many elements the im2col (or Winograd) buffers cost more than
+  // the GEMM saves.
+  const uint64_t kIm2ColMaxElements = 1 << 20;
+  // Without a workspace the buffers are on the stack, which can't take
+  // anything near kIm2ColMaxElements (4MB of float) safely
+  const uint64_t kIm2ColMaxStackElements = 1 << 16;
+
+  // Worst case error of each Winograd variant in fp32, relative to the sum
+  // of |input * weight|. F(4x4, 3x3) has much larger transform constants.
+  const float kWinograd2x2Error = 1e-5f;
+  const float kWinograd4x4Error = 1e-4f;
+
+  // The range of output positions [start, end) whose input position
+  // out * stride + offset - pad falls inside [0, size).
+  Hobbit::Range ValidRange(uint64_t size, uint64_t out_size, uint64_t stride,
+                           uint64_t offset, uint64_t pad) {
+    uint64_t start = 0, end = 0;
+    if (offset < pad)
+      start = (pad - offset + stride - 1) / stride;
+    if (size + pad > offset)
+      end = std::min((size - 1 + pad - offset) / stride + 1, out_size);
+    return Hobbit::Range(std::min(start, end), end);
+  }
+}
+
+void Hobbit::core::Conv2D::CheckArgs() {
+  if (args_.size() != 2)
+    throw IncorrectNumArgs("Conv2D");
+
+  const Shape &input = args_[0]->shape;
+  const Shape &filter = args_[1]->shape;
+
+  const uint64_t c_in = input.GetAxisSize(K);
+  if (filter.GetAxisSize(K) % c_in != 0)
+    throw IncompatibleShapes("Conv2D");
+  if (params_.stride_h == 0 || params_.stride_w == 0 ||
+      params_.dilation_h == 0 || params_.dilation_w == 0)
+    throw IncompatibleShapes("Conv2D");
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  llvm::Type *compute_type = ComputeType(elt_type);
+  if (IsBit(elt_type) || ElementType(args_[1]) != elt_type ||
+      !(compute_type->isFloatingPointTy() || compute_type->isIntegerTy()))
+    throw IncompatibleTypes("Conv2D");
+
+  // Extent of the (dilated) filter
+  const uint64_t r = params_.dilation_h * (filter.GetAxisSize(H) - 1) + 1;
+  const uint64_t s = params_.dilation_w * (filter.GetAxisSize(W) - 1) + 1;
+  const uint64_t h = input.GetAxisSize(H) + 2 * params_.pad_h;
+  const uint64_t w = input.GetAxisSize(W) + 2 * params_.pad_w;
+  if (h < r || w < s)
+    throw IncompatibleShapes("Conv2D");
+
+  c_out_ = filter.GetAxisSize(K) / c_in;
+  h_out_ = (h - r) / params_.stride_h + 1;
+  w_out_ = (w - s) / params_.stride_w + 1;
+
+  if ((params_.conv_algorithm == CONV_WINOGRAD_2X2 ||
+       params_.conv_algorithm == CONV_WINOGRAD_4X4) &&
+      !WinogradApplies())
+    throw IncompatibleShapes("Conv2D");
+}
+
+Hobbit::ConvAlgorithm
+Hobbit::core::Conv2D::GetAlgorithm(bool workspace) const {
+  if (params_.conv_algorithm != CONV_AUTO)
+    return params_.conv_algorithm;
+
+  const uint64_t max_elements =
+      workspace ? kIm2ColMaxElements : kIm2ColMaxStackElements;
+
+  const Shape &filter = args_[1]->shape;
+  const uint64_t c_in = args_[0]->shape.GetAxisSize(K);
+  const uint64_t kernel_size = filter.GetAxisSize(H) * filter.GetAxisSize(W);
+
+  // Winograd only if the caller said the accuracy loss is acceptable, with
+  // the bigger tile (fewer multiplies, more error) preferred
+  if (WinogradApplies()) {
+    if (params_.conv_tolerance >= kWinograd4x4Error &&
+        WinogradElements(4) <= max_elements)
+      return CONV_WINOGRAD_4X4;
+    if (params_.conv_tolerance >= kWinograd2x2Error &&
+        WinogradElements(2) <= max_elements)
+      return CONV_WINOGRAD_2X2;
+  }
+
+  // 1x1 filters are a GEMM with no unrolling at all. Otherwise im2col wins
+  // as long as there are enough filters to fill the GEMM register block and
+  // the column buffer (kernel_size copies of the input) stays small.
+  if (kernel_size == 1)
+    return CONV_IM2COL;
+  if (c_out_ >= kGemmMR &&
+      c_in * kernel_size * h_out_ * w_out_ <= max_elements)
+    return CONV_IM2COL;
+  return CONV_DIRECT;
+}
+
+Hobbit::Tensor *Hobbit::core::Conv2D::GetOutput() {
+  Tensor *output_tensor = Variable::Create(args_[0]->parent_func,
+                                           args_[0]->type,
+                                           Shape(c_out_, h_out_, w_out_));
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+llvm::Value *Hobbit::core::Conv2D::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB =
+      llvm::BasicBlock::Create(func->getContext(), "hobbit.conv2d.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+
+  llvm::Value *input = BufferPointer(builder, args_[0]);
+  llvm::Value *filter = BufferPointer(builder, args_[1]);
+  llvm::Value *output = BufferPointer(builder, args_[2]);
+
+  switch (GetAlgorithm(WorkspaceArg(func) != nullptr)) {
+  case CONV_DIRECT: {
+    EmitDirect(builder, input, filter, output);
+    break;
+  }
+  case CONV_WINOGRAD_2X2: {
+    EmitWinograd(builder, input, filter, output, 2);
+    break;
+  }
+  case CONV_WINOGRAD_4X4: {
+    EmitWinograd(builder, input, filter, output, 4);
+    break;
+  }
+  default: {
+    EmitIm2Col(builder, input, filter, output);
+    break;
+  }
+  }
+
+  return output;
+}
+
+// Accumulates one output row at a time. For each filter tap the range of
+// output columns that read inside the input is computed up front, so the
+// innermost loop is a branch-free (and for unit stride, contiguous) axpy.
+void Hobbit::core::Conv2D::EmitDirect(llvm::IRBuilder<> &builder,
+                                      llvm::Value *input, llvm::Value *filter,
+                                      llvm::Value *output) {
+  llvm::LLVMContext &ctx = builder.getContext();
+
+  const Shape &in_shape = args_[0]->shape;
+  const Shape &filter_shape = args_[1]->shape;
+  const uint64_t c_in = in_shape.GetAxisSize(K);
+  const uint64_t h = in_shape.GetAxisSize(H);
+  const uint64_t w = in_shape.GetAxisSize(W);
+  const uint64_t r_size = filter_shape.GetAxisSize(H);
+  const uint64_t s_size = filter_shape.GetAxisSize(W);
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  const unsigned vw = VectorWidth(elt_type);
+  llvm::Value *zero = llvm::Constant::getNullValue(elt_type);
+  llvm::Value *i64_0 = builder.getInt64(0);
+
+  EmitLoop(builder, "hobbit.conv2d.co", i64_0, builder.getInt64(c_out_), 1,
+           [&](llvm::Value *co) {
+    EmitLoop(builder, "hobbit.conv2d.oh", i64_0, builder.getInt64(h_out_), 1,
+             [&](llvm::Value *oh) {
+      llvm::Value *out_row = builder.CreateGEP(
+          output, builder.CreateMul(
+                      builder.CreateAdd(
+                          builder.CreateMul(co, builder.getInt64(h_out_)), oh),
+                      builder.getInt64(w_out_)));
+
+      EmitLoop(builder, "hobbit.conv2d.zero", i64_0, builder.getInt64(w_out_),
+               1,
+               [&](llvm::Value *ow) {
+                 builder.CreateStore(zero, builder.CreateGEP(out_row, ow));
+               },
+               LoopVectorizeMD(ctx, vw));
+
+      EmitLoop(builder, "hobbit.conv2d.ci", i64_0, builder.getInt64(c_in), 1,
+               [&](llvm::Value *ci) {
+        EmitLoop(builder, "hobbit.conv2d.r", i64_0, builder.getInt64(r_size),
+                 1, [&](llvm::Value *r) {
+          // ih = oh * stride + r * dilation - pad, which wraps around (and
+          // fails the unsigned compare) when it lands in the top padding
+          llvm::Value *ih = builder.CreateSub(
+              builder.CreateAdd(
+                  builder.CreateMul(oh, builder.getInt64(params_.stride_h)),
+                  builder.CreateMul(r, builder.getInt64(params_.dilation_h))),
+              builder.getInt64(params_.pad_h));
+
+          EmitIf(builder, "hobbit.conv2d.rowvalid",
+                 builder.CreateICmpULT(ih, builder.getInt64(h)), [&]() {
+            llvm::Value *in_row = builder.CreateGEP(
+                input,
+                builder.CreateMul(
+                    builder.CreateAdd(
+                        builder.CreateMul(ci, builder.getInt64(h)), ih),
+                    builder.getInt64(w)));
+            llvm::Value *filter_row = builder.CreateGEP(
+                filter,
+                builder.CreateMul(
+                    builder.CreateAdd(
+                        builder.CreateMul(
+                            builder.CreateAdd(
+                                builder.CreateMul(co, builder.getInt64(c_in)),
+                                ci),
+                            builder.getInt64(r_size)),
+                        r),
+                    builder.getInt64(s_size)));
+
+            for (uint64_t s = 0; s < s_size; s++) {
+              const uint64_t offset = s * params_.dilation_w;
+              Range valid = ValidRange(w, w_out_, params_.stride_w, offset,
+                                       params_.pad_w);
+              if (valid.start == valid.end)
+                continue;
+
+              llvm::Value *weight = builder.CreateLoad(
+                  builder.CreateGEP(filter_row, builder.getInt64(s)));
+
+              EmitLoop(builder, "hobbit.conv2d.ow",
+                       builder.getInt64(valid.start),
+                       builder.getInt64(valid.end), 1,
+                       [&](llvm::Value *ow) {
+                         llvm::Value *iw = builder.CreateSub(
+                             builder.CreateAdd(
+                                 builder.CreateMul(
+                                     ow, builder.getInt64(params_.stride_w)),
+                                 builder.getInt64(offset)),
+                             builder.getInt64(params_.pad_w));
+                         llvm::Value *in_elt = builder.CreateLoad(
+                             builder.CreateGEP(in_row, iw));
+                         llvm::Value *out_ptr = builder.CreateGEP(out_row, ow);
+                         builder.CreateStore(
+                             EmitAdd(builder, builder.CreateLoad(out_ptr),
+                                     EmitMul(builder, weight, in_elt)),
+                             out_ptr);
+                       },
+                       LoopVectorizeMD(ctx, vw));
+            }
+          });
+        });
+      });
+    });
+  });
+}
+
+// Unrolls the receptive fields into a (C_in * R * S) x (H_out * W_out)
+// column matrix, so that the convolution becomes
+// filter{C_out x C_in * R * S} * columns.
+void Hobbit::core::Conv2D::EmitIm2Col(llvm::IRBuilder<> &builder,
+                                      llvm::Value *input, llvm::Value *filter,
+                                      llvm::Value *output) {
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+  llvm::LLVMContext &ctx = builder.getContext();
+
+  const Shape &in_shape = args_[0]->shape;
+  const Shape &filter_shape = args_[1]->shape;
+  const uint64_t c_in = in_shape.GetAxisSize(K);
+  const uint64_t h = in_shape.GetAxisSize(H);
+  const uint64_t w = in_shape.GetAxisSize(W);
+  const uint64_t r_size = filter_shape.GetAxisSize(H);
+  const uint64_t s_size = filter_shape.GetAxisSize(W);
+  const uint64_t col_rows = c_in * r_size * s_size;
+  const uint64_t col_cols = h_out_ * w_out_;
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  const unsigned vw = VectorWidth(elt_type);
+  llvm::Value *zero = llvm::Constant::getNullValue(elt_type);
+  llvm::Value *i64_0 = builder.getInt64(0);
+
+  GemmOperands ops;
+  ops.a = filter;
+  ops.b = input;
+  ops.c = output;
+  ops.m = c_out_;
+  ops.n = col_cols;
+  ops.k = col_rows;
+  ops.lda = col_rows;
+  ops.ldb = col_cols;
+  ops.ldc = col_cols;
+
+  // A 1x1 filter with unit stride and no padding reads the input as-is
+  const bool identity = r_size == 1 && s_size == 1 && params_.stride_h == 1 &&
+                        params_.stride_w == 1 && params_.pad_h == 0 &&
+                        params_.pad_w == 0;
+  if (identity) {
+    EmitGemm(builder, ops);
+    return;
+  }
+
+  llvm::Value *columns =
+      EntryAlloca(func, elt_type, col_rows * col_cols, "hobbit.conv2d.col");
+
+  auto fill = [&](llvm::Value *dst, uint64_t start, uint64_t end) {
+    if (start == end)
+      return;
+    EmitLoop(builder, "hobbit.conv2d.pad", builder.getInt64(start),
+             builder.getInt64(end), 1,
+             [&](llvm::Value *ow) {
+               builder.CreateStore(zero, builder.CreateGEP(dst, ow));
+             },
+             LoopVectorizeMD(ctx, vw));
+  };
+
+  EmitLoop(builder, "hobbit.conv2d.ci", i64_0, builder.getInt64(c_in), 1,
+           [&](llvm::Value *ci) {
+    EmitLoop(builder, "hobbit.conv2d.r", i64_0, builder.getInt64(r_size), 1,
+             [&](llvm::Value *r) {
+      for (uint64_t s = 0; s < s_size; s++) {
+        const uint64_t offset = s * params_.dilation_w;
+        Range valid =
+            ValidRange(w, w_out_, params_.stride_w, offset, params_.pad_w);
+
+        llvm::Value *row = builder.CreateAdd(
+            builder.CreateMul(
+                builder.CreateAdd(
+                    builder.CreateMul(ci, builder.getInt64(r_size)), r),
+                builder.getInt64(s_size)),
+            builder.getInt64(s));
+        llvm::Value *col_row =
+            builder.CreateGEP(columns, builder.CreateMul(
+                                           row, builder.getInt64(col_cols)));
+
+        EmitLoop(builder, "hobbit.conv2d.oh", i64_0, builder.getInt64(h_out_),
+                 1, [&](llvm::Value *oh) {
+          llvm::Value *dst = builder.CreateGEP(
+              col_row, builder.CreateMul(oh, builder.getInt64(w_out_)));
+          llvm::Value *ih = builder.CreateSub(
+              builder.CreateAdd(
+                  builder.CreateMul(oh, builder.getInt64(params_.stride_h)),
+                  builder.CreateMul(r, builder.getInt64(params_.dilation_h))),
+              builder.getInt64(params_.pad_h));
+
+          EmitIf(builder, "hobbit.conv2d.rowvalid",
+                 builder.CreateICmpULT(ih, builder.getInt64(h)),
+                 [&]() {
+                   llvm::Value *in_row = builder.CreateGEP(
+                       input,
+                       builder.CreateMul(
+                           builder.CreateAdd(
+                               builder.CreateMul(ci, builder.getInt64(h)), ih),
+                           builder.getInt64(w)));
+
+                   fill(dst, 0, valid.start);
+                   if (valid.start != valid.end) {
+                     EmitLoop(builder, "hobbit.conv2d.copy",
+                              builder.getInt64(valid.start),
+                              builder.getInt64(valid.end), 1,
+                              [&](llvm::Value *ow) {
+                                llvm::Value *iw = builder.CreateSub(
+                                    builder.CreateAdd(
+                                        builder.CreateMul(
+                                            ow, builder.getInt64(
+                                                    params_.stride_w)),
+                                        builder.getInt64(offset)),
+                                    builder.getInt64(params_.pad_w));
+                                builder.CreateStore(
+                                    builder.CreateLoad(
+                                        builder.CreateGEP(in_row, iw)),
+                                    builder.CreateGEP(dst, ow));
+                              },
+                              LoopVectorizeMD(ctx, vw));
+                   }
+                   fill(dst, valid.end, w_out_);
+                 },
+                 [&]() { fill(dst, 0, w_out_); });
+        });
+      }
+    });
+  });
+
+  ops.b = columns;
+  EmitGemm(builder, ops);
+}
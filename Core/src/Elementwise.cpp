@@ -0,0 +1,347 @@
+//
+// Created by Aman LaChapelle on 3/27/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <map>
+
+#include "Codegen.hpp"
+#include "Math.hpp"
+
+Hobbit::core::Elementwise::Elementwise(std::vector<Symbol *> args,
+                                       const std::string &node_name,
+                                       uint64_t num_args,
+                                       uint64_t first_value)
+    : OpNode(std::move(args), node_name), first_value_(first_value) {
+  if (args_.size() != num_args)
+    throw IncorrectNumArgs(node_name);
+
+  shape_ = args_[0]->shape;
+  for (auto &arg : args_) {
+    if (!shape_.Broadcast(arg->shape, shape_))
+      throw IncompatibleShapes(node_name);
+  }
+
+  llvm::Type *type = ElementType(ValueArg());
+  for (uint64_t a = first_value_; a < args_.size(); a++) {
+    if (ElementType(args_[a]) != type)
+      throw IncompatibleTypes(node_name);
+  }
+}
+
+Hobbit::Tensor *Hobbit::core::Elementwise::GetOutput() {
+  Tensor *output_tensor =
+      Variable::Create(args_[0]->parent_func, ValueArg()->type, shape_);
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+llvm::Value *Hobbit::core::Elementwise::Emit(llvm::Function *func) {
+  EmitFused(func, {this}, {true});
+  return (llvm::Value *)args_.back()->buffer;
+}
+
+// Walks the output shape row by row (a row being the W axis) with a vector
+// loop and a scalar tail. Inputs that are broadcast along W are loaded once
+// per row and splatted. Without any broadcasting the whole thing is one
+// flat row. Half and bfloat16 buffers are widened on load and narrowed on
+// store, the chain itself runs in float.
+void Hobbit::core::Elementwise::EmitFused(
+    llvm::Function *func, const std::vector<Elementwise *> &ops,
+    const std::vector<bool> &store) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.elementwise.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, ops[0]->args_[0]);
+
+  const Shape &shape = ops[0]->shape_;
+  llvm::Type *elt_type = ComputeType(ElementType(ops[0]->ValueArg()));
+  const uint64_t vw = VectorWidth(elt_type);
+
+  // Everything that lives in memory, i.e. inputs coming from outside the
+  // chain and the outputs that get stored
+  std::map<Symbol *, llvm::Value *> buffers;
+  std::map<Symbol *, bool> in_chain;
+  bool broadcast = false;
+  for (uint64_t i = 0; i < ops.size(); i++) {
+    const std::vector<Symbol *> &args = ops[i]->args_;
+    for (uint64_t a = 0; a + 1 < args.size(); a++) {
+      if (in_chain.count(args[a]) || buffers.count(args[a]))
+        continue;
+      buffers[args[a]] = BufferPointer(builder, args[a]);
+      broadcast |= args[a]->shape != shape;
+    }
+    in_chain[args.back()] = true;
+    if (store[i])
+      buffers[args.back()] = BufferPointer(builder, args.back());
+  }
+
+  const uint64_t rows =
+      broadcast ? shape.GetAxisSize(K) * shape.GetAxisSize(H) : 1;
+  const uint64_t width = broadcast ? shape.GetAxisSize(W) : shape.GetSize();
+
+  EmitLoop(builder, "hobbit.elementwise.row", builder.getInt64(0),
+           builder.getInt64(rows), 1, [&](llvm::Value *row) {
+    // Start of this row in every buffer. Axes of size 1 stay at 0.
+    std::map<Symbol *, llvm::Value *> row_ptrs;
+    for (auto &buffer : buffers) {
+      if (!broadcast) {
+        row_ptrs[buffer.first] = buffer.second;
+        continue;
+      }
+
+      const Shape &s = buffer.first->shape;
+      llvm::Value *k = builder.getInt64(0), *h = builder.getInt64(0);
+      if (s.GetAxisSize(K) != 1)
+        k = builder.CreateUDiv(row, builder.getInt64(shape.GetAxisSize(H)));
+      if (s.GetAxisSize(H) != 1)
+        h = builder.CreateURem(row, builder.getInt64(shape.GetAxisSize(H)));
+      llvm::Value *offset = builder.CreateMul(
+          builder.CreateAdd(
+              builder.CreateMul(k, builder.getInt64(s.GetAxisSize(H))), h),
+          builder.getInt64(s.GetAxisSize(W)));
+      row_ptrs[buffer.first] = builder.CreateGEP(buffer.second, offset);
+    }
+
+    EmitVectorLoop(builder, "hobbit.elementwise", width, vw,
+                   [&](llvm::Value *w, bool vector) {
+      std::map<Symbol *, llvm::Value *> values;
+
+      auto operand = [&](Symbol *sym) {
+        if (values.count(sym))
+          return values[sym];
+
+        llvm::Value *val;
+        if (broadcast && sym->shape.GetAxisSize(W) == 1) {
+          val = EmitLoadCompute(builder, row_ptrs[sym], builder.getInt64(0),
+                                1);
+          if (vector)
+            val = builder.CreateVectorSplat(vw, val);
+        } else {
+          val = EmitLoadCompute(builder, row_ptrs[sym], w, vector ? vw : 1);
+        }
+        values[sym] = val;
+        return val;
+      };
+
+      for (uint64_t i = 0; i < ops.size(); i++) {
+        const std::vector<Symbol *> &args = ops[i]->args_;
+        std::vector<llvm::Value *> operands;
+        for (uint64_t a = 0; a + 1 < args.size(); a++)
+          operands.push_back(operand(args[a]));
+
+        llvm::Value *result = ops[i]->EmitElementAt(
+            builder, operands,
+            broadcast ? builder.CreateAdd(
+                            builder.CreateMul(row, builder.getInt64(width)), w)
+                      : w);
+        values[args.back()] = result;
+        if (!store[i])
+          continue;
+
+        EmitStoreCompute(builder, result, row_ptrs[args.back()], w);
+      }
+    });
+  });
+}
+
+llvm::Value *Hobbit::core::Elementwise::EmitEpilogue(
+    llvm::IRBuilder<> &builder, const std::vector<Elementwise *> &ops,
+    Symbol *source, llvm::Value *val, llvm::Value *row, llvm::Value *col) {
+  const Shape &shape = source->shape;
+  const uint64_t width = shape.GetAxisSize(W);
+  const unsigned lanes =
+      val->getType()->isVectorTy() ? val->getType()->getVectorNumElements() : 1;
+
+  std::map<Symbol *, llvm::Value *> values;
+  values[source] = val;
+
+  auto operand = [&](Symbol *sym) {
+    if (values.count(sym))
+      return values[sym];
+
+    // Where this row starts in sym. Axes of size 1 stay at 0.
+    const Shape &s = sym->shape;
+    llvm::Value *k = builder.getInt64(0), *h = builder.getInt64(0);
+    if (s.GetAxisSize(K) != 1)
+      k = builder.CreateUDiv(row, builder.getInt64(shape.GetAxisSize(H)));
+    if (s.GetAxisSize(H) != 1)
+      h = builder.CreateURem(row, builder.getInt64(shape.GetAxisSize(H)));
+    llvm::Value *sym_row = builder.CreateGEP(
+        BufferPointer(builder, sym),
+        builder.CreateMul(
+            builder.CreateAdd(
+                builder.CreateMul(k, builder.getInt64(s.GetAxisSize(H))), h),
+            builder.getInt64(s.GetAxisSize(W))));
+
+    llvm::Value *loaded;
+    if (s.GetAxisSize(W) == 1) {
+      loaded = EmitLoadCompute(builder, sym_row, builder.getInt64(0), 1);
+      if (lanes > 1)
+        loaded = builder.CreateVectorSplat(lanes, loaded);
+    } else {
+      loaded = EmitLoadCompute(builder, sym_row, col, lanes);
+    }
+    values[sym] = loaded;
+    return loaded;
+  };
+
+  llvm::Value *index =
+      builder.CreateAdd(builder.CreateMul(row, builder.getInt64(width)), col);
+  for (auto &op : ops) {
+    const std::vector<Symbol *> &args = op->args_;
+    std::vector<llvm::Value *> operands;
+    for (uint64_t a = 0; a + 1 < args.size(); a++)
+      operands.push_back(operand(args[a]));
+    val = op->EmitElementAt(builder, operands, index);
+    values[args.back()] = val;
+  }
+
+  return val;
+}
+
+llvm::Value *Hobbit::core::Elementwise::EmitElementAt(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands,
+    llvm::Value *) {
+  return EmitElement(builder, operands);
+}
+
+llvm::Value *Hobbit::core::Add::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  return EmitAdd(builder, operands[0], operands[1]);
+}
+
+llvm::Value *Hobbit::core::Sub::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  return EmitSub(builder, operands[0], operands[1]);
+}
+
+llvm::Value *Hobbit::core::Mul::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  return EmitMul(builder, operands[0], operands[1]);
+}
+
+llvm::Value *Hobbit::core::Div::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  return EmitDiv(builder, operands[0], operands[1]);
+}
+
+llvm::Value *Hobbit::core::Max::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  return EmitMax(builder, operands[0], operands[1]);
+}
+
+llvm::Value *Hobbit::core::Min::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  return EmitMin(builder, operands[0], operands[1]);
+}
+
+llvm::Value *Hobbit::core::Relu::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  return EmitMax(builder, operands[0],
+                 llvm::Constant::getNullValue(operands[0]->getType()));
+}
+
+llvm::Value *Hobbit::core::Clamp::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  llvm::Type *type = operands[0]->getType();
+  return EmitMin(
+      builder,
+      EmitMax(builder, operands[0], ConstantValue(type, params_.clamp_min)),
+      ConstantValue(type, params_.clamp_max));
+}
+
+llvm::Value *Hobbit::core::Select::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  llvm::Value *zero = llvm::Constant::getNullValue(operands[0]->getType());
+  llvm::Value *cond;
+  if (operands[0]->getType()->isFPOrFPVectorTy())
+    cond = builder.CreateFCmpUNE(operands[0], zero);
+  else
+    cond = builder.CreateICmpNE(operands[0], zero);
+  return builder.CreateSelect(cond, operands[1], operands[2]);
+}
+
+void Hobbit::core::Activation::CheckArgs() {
+  if (!ComputeType(ElementType(args_[0]))->isFloatingPointTy())
+    throw IncompatibleTypes("Activation");
+}
+
+llvm::Value *Hobbit::core::Activation::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  const MathAccuracy accuracy = args_[0]->parent_func->GetFPPolicy().math;
+  switch (op_) {
+  case EXP:
+    return EmitExp(builder, operands[0], accuracy);
+  case LOG:
+    return EmitLog(builder, operands[0], accuracy);
+  case TANH:
+    return EmitTanh(builder, operands[0], accuracy);
+  case SIGMOID:
+    return EmitSigmoid(builder, operands[0], accuracy);
+  case ERF:
+    return EmitErf(builder, operands[0], accuracy);
+  default:
+    return EmitGelu(builder, operands[0], accuracy);
+  }
+}
+
+void Hobbit::core::Cast::CheckArgs(OpCode op) {
+  if (!ComputeType(ElementType(args_[0]))->isFloatingPointTy())
+    throw IncompatibleTypes("Cast");
+
+  llvm::LLVMContext &ctx = args_[0]->type->getContext();
+  if (op == CAST_HALF)
+    type_ = llvm::Type::getHalfTy(ctx);
+  else if (op == CAST_BFLOAT16)
+    type_ = BFloat16Ty(ctx);
+  else
+    type_ = llvm::Type::getFloatTy(ctx);
+}
+
+Hobbit::Tensor *Hobbit::core::Cast::GetOutput() {
+  llvm::Type *type = type_;
+  if (args_[0]->type->isPointerTy())
+    type = type->getPointerTo();
+  Tensor *output_tensor =
+      Variable::Create(args_[0]->parent_func, type, shape_);
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+// Operands arrive in their compute type, so a cast to half or bfloat16 only
+// has to do the rounding
+llvm::Value *Hobbit::core::Cast::EmitElement(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands) {
+  llvm::Type *type = operands[0]->getType();
+  llvm::Type *target = ComputeType(type_);
+  if (type->isVectorTy())
+    target = llvm::VectorType::get(target, type->getVectorNumElements());
+
+  return EmitRoundTo(builder, builder.CreateFPCast(operands[0], target),
+                     type_);
+}
@@ -22,12 +22,28 @@
 
 #include "Function.hpp"
 
+#include <algorithm>
 #include <set>
 
+#include <llvm/Support/Host.h>
+
+#include "Codegen.hpp"
+#include "Memory.hpp"
 #include "Module.hpp"
 #include "OpNode.hpp"
 
 namespace Hobbit {
+  namespace {
+    // One loop nest Function::Emit produces: an op, with any epilogue it
+    // took on, or a fused chain of elementwise ops
+    struct EmitStep {
+      core::OpNode *op = nullptr;
+      std::vector<core::Elementwise *> chain;
+      std::vector<bool> store;
+      core::MemoryStep memory;
+    };
+  }
+
   std::unique_ptr<Function> Function::Create(Module *m,
                                              const std::string &name) {
     std::unique_ptr<Function> f = llvm::make_unique<Function>();
@@ -39,6 +55,8 @@ namespace Hobbit {
 
   llvm::LLVMContext *Function::GetContext() { return module_->GetContext(); }
 
+  Module *Function::GetModule() { return module_; }
+
   void Function::AddBlock(const std::string &name) {
     if (function_blocks_.find(name) != function_blocks_.end())
       throw std::runtime_error(
@@ -56,18 +74,29 @@ namespace Hobbit {
       throw std::runtime_error("Attempting to overwrite an existing argument!");
 
     symbol_table_[sym_addr] = arg;
+    symbol_order_.push_back(sym_addr);
   }
 
   void Function::MarkSymbolAsArg(void *sym_addr) {
-    symbol_table_.at(sym_addr)->is_arg = true;
+    core::Symbol *sym = symbol_table_.at(sym_addr);
+    // Sparse tensors are passed as their CSR arrays
+    if (sym->IsSparse()) {
+      sym->csr.row_ptr->is_arg = true;
+      sym->csr.col_idx->is_arg = true;
+      sym->csr.values->is_arg = true;
+      return;
+    }
+    sym->is_arg = true;
   }
 
   Tensor *Function::AddOpNode(std::initializer_list<void *> sym_addrs,
-                              const OpCode &opcode) {
+                              const OpCode &opcode, const OpParams &params) {
 
     std::vector<core::Symbol *> symbols;
     for (auto &addr : sym_addrs) {
       symbols.push_back(symbol_table_.at(addr));
+      if (symbols.back()->IsSparse() && opcode != SPMV && opcode != SPMM)
+        throw std::runtime_error("Only SPMV and SPMM take sparse tensors!");
     }
 
     core::OpNode *op;
@@ -78,28 +107,499 @@ namespace Hobbit {
       break;
     }
     case SDOT: {
-      op = new core::Sdot(symbols);
+      op = new core::Sdot(symbols, params);
+      break;
+    }
+    case GEMM: {
+      op = new core::Gemm(symbols, params);
+      break;
+    }
+    case CONV2D: {
+      op = new core::Conv2D(symbols, params);
+      break;
+    }
+    case ADD: {
+      op = new core::Add(symbols);
+      break;
+    }
+    case SUB: {
+      op = new core::Sub(symbols);
+      break;
+    }
+    case MUL: {
+      op = new core::Mul(symbols);
+      break;
+    }
+    case DIV: {
+      op = new core::Div(symbols);
+      break;
+    }
+    case MAX: {
+      op = new core::Max(symbols);
+      break;
+    }
+    case MIN: {
+      op = new core::Min(symbols);
+      break;
+    }
+    case RELU: {
+      op = new core::Relu(symbols);
+      break;
+    }
+    case CLAMP: {
+      op = new core::Clamp(symbols, params);
+      break;
+    }
+    case SELECT: {
+      op = new core::Select(symbols);
+      break;
+    }
+    case REDUCE_SUM:
+    case REDUCE_MEAN:
+    case REDUCE_MAX:
+    case REDUCE_MIN:
+    case REDUCE_ARGMAX: {
+      op = new core::Reduce(symbols, params, opcode);
+      break;
+    }
+    case SOFTMAX:
+    case LOG_SOFTMAX: {
+      op = new core::Softmax(symbols, opcode);
+      break;
+    }
+    case EXP:
+    case LOG:
+    case TANH:
+    case SIGMOID:
+    case ERF:
+    case GELU: {
+      op = new core::Activation(symbols, opcode);
+      break;
+    }
+    case POOL_MAX:
+    case POOL_AVG: {
+      op = new core::Pool(symbols, params, opcode);
+      break;
+    }
+    case TRANSPOSE: {
+      op = new core::Transpose(symbols, params);
+      break;
+    }
+    case QDOT: {
+      op = new core::QDot(symbols, params);
+      break;
+    }
+    case QGEMM: {
+      op = new core::QGemm(symbols, params);
+      break;
+    }
+    case CAST_HALF:
+    case CAST_FLOAT:
+    case CAST_BFLOAT16: {
+      op = new core::Cast(symbols, opcode);
+      break;
+    }
+    case SPMV:
+    case SPMM: {
+      op = new core::SparseMatMul(symbols, opcode);
+      break;
+    }
+    case BINARIZE: {
+      op = new core::Binarize(symbols);
+      break;
+    }
+    case BDOT:
+    case BGEMM: {
+      op = new core::BinaryGemm(symbols, opcode);
+      break;
+    }
+    case GATHER: {
+      op = new core::Gather(symbols);
+      break;
+    }
+    case SCATTER_ADD: {
+      op = new core::ScatterAdd(symbols);
+      break;
+    }
+    case ATTENTION: {
+      op = new core::Attention(symbols);
+      break;
+    }
+    case LSTM_CELL:
+    case GRU_CELL: {
+      op = new core::RecurrentCell(symbols, opcode);
+      break;
+    }
+    case TOPK: {
+      op = new core::TopK(symbols, params);
+      break;
+    }
+    case RANDOM_UNIFORM:
+    case RANDOM_BERNOULLI: {
+      op = new core::Random(symbols, params, opcode);
       break;
     }
     }
 
     output = op->GetOutput();
     op_table_.emplace_back(op);
-    symbol_table_[output] = output->GetSymbol();
+    if (symbol_table_.find(output) == symbol_table_.end())
+      AddSymbol(output, output->GetSymbol());
+
+    consumers_[op];
+    for (auto &input : op->GetInputs()) {
+      auto producer = producers_.find(input);
+      if (producer == producers_.end())
+        continue;
+      std::vector<core::OpNode *> &consumers = consumers_[producer->second];
+      if (consumers.empty() || consumers.back() != op)
+        consumers.push_back(op);
+    }
+    for (auto &sym : op->GetOutputs())
+      producers_[sym] = op;
 
     return output;
   }
 
+  std::vector<Tensor *> Function::GetOpOutputs(void *output_addr) {
+    std::vector<Tensor *> outputs = {(Tensor *)output_addr};
+    core::OpNode *op = GetProducer(((Tensor *)output_addr)->GetSymbol());
+    for (auto &extra : op->GetExtraOutputs())
+      outputs.push_back(extra);
+    return outputs;
+  }
+
+  core::OpNode *Function::GetProducer(core::Symbol *sym) {
+    auto producer = producers_.find(sym);
+    return producer == producers_.end() ? nullptr : producer->second;
+  }
+
+  const std::vector<core::OpNode *> &
+  Function::GetConsumers(core::OpNode *op) {
+    return consumers_.at(op);
+  }
+
+  std::vector<core::OpNode *> Function::Schedule() {
+    std::map<core::OpNode *, uint64_t> position;
+    for (uint64_t i = 0; i < op_table_.size(); i++)
+      position[op_table_[i]] = i;
+
+    // Walk back from the outputs along producer edges
+    std::set<core::OpNode *> live;
+    std::vector<core::OpNode *> stack;
+    for (auto &producer : producers_) {
+      if (producer.first->is_arg && live.insert(producer.second).second)
+        stack.push_back(producer.second);
+    }
+    while (!stack.empty()) {
+      core::OpNode *op = stack.back();
+      stack.pop_back();
+      for (auto &input : op->GetInputs()) {
+        core::OpNode *producer = GetProducer(input);
+        if (producer != nullptr && live.insert(producer).second)
+          stack.push_back(producer);
+      }
+    }
+
+    // Kahn's algorithm, taking the earliest added of the ready ops
+    std::map<core::OpNode *, uint64_t> waiting;
+    std::set<uint64_t> ready;
+    for (auto &op : live) {
+      std::set<core::OpNode *> producers;
+      for (auto &input : op->GetInputs()) {
+        core::OpNode *producer = GetProducer(input);
+        if (producer != nullptr && producer != op)
+          producers.insert(producer);
+      }
+      waiting[op] = producers.size();
+      if (producers.empty())
+        ready.insert(position[op]);
+    }
+
+    std::vector<core::OpNode *> schedule;
+    while (!ready.empty()) {
+      core::OpNode *op = op_table_[*ready.begin()];
+      ready.erase(ready.begin());
+      schedule.push_back(op);
+      for (auto &consumer : consumers_[op]) {
+        if (live.count(consumer) && --waiting[consumer] == 0)
+          ready.insert(position[consumer]);
+      }
+    }
+
+    return schedule;
+  }
+
   core::Symbol *Function::GetSymbol(void *sym_addr) {
     return symbol_table_.at(sym_addr);
   }
 
-  void Function::Emit(llvm::Function *func) {
-    for (auto &op : op_table_) {
+  void Function::FoldConstants() {
+    // Symbols whose contents are known now, or will be once the ops picked
+    // so far have run
+    std::set<core::Symbol *> folded;
+    auto known = [&](core::Symbol *sym) {
+      return folded.count(sym) != 0 ||
+             core::ConstantInitializer(sym) != nullptr;
+    };
+
+    std::vector<core::OpNode *> ops;
+    for (auto &op : Schedule()) {
+      std::vector<core::Symbol *> inputs = op->GetInputs();
+      if (inputs.empty() || !std::all_of(inputs.begin(), inputs.end(), known))
+        continue;
+
+      bool foldable = true;
+      for (auto &output : op->GetOutputs()) {
+        // Anything HostConstant can't turn back into a constant stays put
+        foldable &= !output->is_arg &&
+                    core::HostConstant(core::ElementType(output), 0,
+                                       nullptr) != nullptr;
+      }
+      if (!foldable)
+        continue;
+
+      ops.push_back(op);
+      for (auto &output : op->GetOutputs())
+        folded.insert(output);
+    }
+    if (ops.empty())
+      return;
+
+    // Run them all in one throwaway function that writes straight into
+    // host memory. The constants it reads are wrapped in globals of its
+    // own module, so they get their arrays back afterwards.
+    // The ops pick their instructions from module_'s target, so this one
+    // has to compile for the same CPU
+    Module module("hobbit.fold", *GetContext());
+    if (module_->TargetsHost())
+      module.TargetHost();
+    const std::string fold_name = name_ + ".fold";
+    llvm::Function *func = module.GetFunction(fold_name, {});
+
+    std::map<core::Symbol *, void *> inputs;
+    for (auto &op : ops) {
+      for (auto &input : op->GetInputs()) {
+        if (folded.count(input) == 0 && inputs.count(input) == 0) {
+          inputs[input] = input->buffer;
+          input->buffer = core::ConstantInitializer(input);
+        }
+      }
+    }
+
+    // The results, aligned like the rest of the buffers the kernels see
+    llvm::Type *i64 = llvm::Type::getInt64Ty(*GetContext());
+    std::map<core::Symbol *, std::vector<uint64_t>> storage;
+    std::map<core::Symbol *, uint64_t> results;
+    for (auto &sym : folded) {
+      const uint64_t a = core::kWorkspaceAlignment;
+      storage[sym].resize((core::BufferBytes(sym) + a) / sizeof(uint64_t) + 1);
+      results[sym] = ((uint64_t)storage[sym].data() + a - 1) / a * a;
+      sym->buffer = llvm::ConstantExpr::getIntToPtr(
+          llvm::ConstantInt::get(i64, results[sym]),
+          core::ElementType(sym)->getPointerTo());
+    }
+
+    for (auto &op : ops)
       op->Emit(func);
+    module.FinalizeFunction(func);
+    module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple());
+    ((void (*)())module.GetFunctionPtr(fold_name))();
+
+    for (auto &input : inputs)
+      input.first->buffer = input.second;
+    for (auto &result : results) {
+      core::Symbol *sym = result.first;
+      sym->buffer = core::HostConstant(core::ElementType(sym),
+                                       core::BufferSize(sym),
+                                       (const void *)result.second);
+      producers_.erase(sym);
     }
   }
 
+  void Function::Emit(llvm::Function *func) {
+    FoldConstants();
+
+    std::vector<core::OpNode *> schedule = Schedule();
+    std::set<core::OpNode *> live(schedule.begin(), schedule.end());
+    // Ops that are part of a step already
+    std::set<core::OpNode *> emitted;
+
+    // Whether sym has been computed by the time the next step runs
+    auto ready = [&](core::Symbol *sym) {
+      core::OpNode *producer = GetProducer(sym);
+      return producer == nullptr || emitted.count(producer) != 0;
+    };
+    // The scheduled ops that read sym
+    auto readers = [&](core::Symbol *sym) {
+      std::vector<core::OpNode *> ops;
+      for (auto &op : GetConsumers(GetProducer(sym))) {
+        std::vector<core::Symbol *> inputs = op->GetInputs();
+        if (live.count(op) &&
+            std::find(inputs.begin(), inputs.end(), sym) != inputs.end())
+          ops.push_back(op);
+      }
+      return ops;
+    };
+    // sym, if it isn't in syms already
+    auto add = [](std::vector<core::Symbol *> &syms, core::Symbol *sym) {
+      if (std::find(syms.begin(), syms.end(), sym) == syms.end())
+        syms.push_back(sym);
+    };
+
+    // Decide what goes in each loop nest first, so the memory plan knows
+    // which intermediates actually reach memory
+    std::vector<EmitStep> steps;
+    for (uint64_t i = 0; i < schedule.size(); i++) {
+      core::OpNode *op = schedule[i];
+      if (emitted.count(op))
+        continue;
+      emitted.insert(op);
+
+      core::Elementwise *first = dynamic_cast<core::Elementwise *>(op);
+      if (first == nullptr) {
+        // Follow the output through elementwise ops that are its only
+        // reader (and produce the same shape and type), so the op can
+        // apply them before anything is stored
+        std::vector<core::Elementwise *> epilogue;
+        std::vector<core::Symbol *> outputs = op->GetOutputs();
+        core::Symbol *value = outputs.size() == 1 ? outputs[0] : nullptr;
+        while (value != nullptr && !value->is_arg) {
+          std::vector<core::OpNode *> next_ops = readers(value);
+          core::Elementwise *next =
+              next_ops.size() == 1
+                  ? dynamic_cast<core::Elementwise *>(next_ops[0])
+                  : nullptr;
+          if (next == nullptr)
+            break;
+
+          core::Symbol *output = next->GetArgs().back();
+          bool fusable = output->shape == value->shape &&
+                         core::ElementType(output) == core::ElementType(value);
+          for (auto &input : next->GetInputs())
+            fusable &= input == value || ready(input);
+          if (!fusable)
+            break;
+
+          epilogue.push_back(next);
+          value = output;
+        }
+
+        EmitStep step;
+        step.op = op;
+        step.memory.reads = op->GetInputs();
+        step.memory.writes = outputs;
+        if (!epilogue.empty() && op->SetEpilogue(epilogue)) {
+          emitted.insert(epilogue.begin(), epilogue.end());
+          for (auto &member : epilogue) {
+            for (auto &input : member->GetInputs()) {
+              core::OpNode *producer = GetProducer(input);
+              if (producer != op && std::find(epilogue.begin(), epilogue.end(),
+                                              producer) == epilogue.end())
+                add(step.memory.reads, input);
+            }
+          }
+          step.memory.writes[0] = epilogue.back()->GetArgs().back();
+        }
+        steps.push_back(step);
+        continue;
+      }
+
+      // Gather every later elementwise op over the same shape that only
+      // needs what's been computed so far (this chain included), wherever
+      // the schedule put it
+      const Shape &shape = first->GetArgs().back()->shape;
+      EmitStep step;
+      step.chain = {first};
+      for (uint64_t j = i + 1; j < schedule.size(); j++) {
+        core::Elementwise *next =
+            dynamic_cast<core::Elementwise *>(schedule[j]);
+        if (next == nullptr || emitted.count(next) ||
+            next->GetArgs().back()->shape != shape)
+          continue;
+
+        std::vector<core::Symbol *> inputs = next->GetInputs();
+        if (std::all_of(inputs.begin(), inputs.end(), ready)) {
+          step.chain.push_back(next);
+          emitted.insert(next);
+        }
+      }
+
+      // Intermediates only go to memory if they're part of the signature or
+      // something outside the chain reads them. Inputs are loaded the first
+      // time a member uses them, so an output can overwrite any same-shaped
+      // input a member up to and including its own has loaded.
+      std::set<core::OpNode *> in_chain(step.chain.begin(), step.chain.end());
+      for (auto &member : step.chain) {
+        for (auto &input : member->GetInputs()) {
+          if (in_chain.count(GetProducer(input)) == 0)
+            add(step.memory.reads, input);
+        }
+
+        core::Symbol *output = member->GetArgs().back();
+        bool needed = output->is_arg;
+        for (auto &reader : readers(output))
+          needed |= in_chain.count(reader) == 0;
+        step.store.push_back(needed);
+        if (!needed)
+          continue;
+
+        step.memory.writes.push_back(output);
+        for (auto &input : step.memory.reads) {
+          if (input->shape == output->shape &&
+              core::ElementType(input) == core::ElementType(output))
+            step.memory.in_place.push_back({output, input});
+        }
+      }
+      steps.push_back(step);
+    }
+
+    std::vector<core::MemoryStep> memory;
+    for (auto &step : steps)
+      memory.push_back(step.memory);
+    core::MemoryPlan plan = core::PlanMemory(memory);
+
+    // The intermediates go at the start of the workspace, on the stack
+    // unless the caller provides one
+    llvm::Value *workspace = core::WorkspaceArg(func);
+    if (workspace == nullptr && plan.size > 0) {
+      workspace = core::EntryAlloca(func, llvm::Type::getInt8Ty(*GetContext()),
+                                    plan.size, "hobbit.workspace");
+    }
+    if (workspace != nullptr) {
+      llvm::IRBuilder<> builder(&func->getEntryBlock());
+      for (auto &entry : plan.offsets) {
+        llvm::Type *elt_type = core::ElementType(entry.first);
+        entry.first->buffer = builder.CreateBitCast(
+            builder.CreateConstInBoundsGEP1_64(workspace, entry.second),
+            elt_type->getPointerTo());
+      }
+    }
+
+    // With a caller's workspace, the ops' large scratch arrays go after
+    // the intermediates. They only live for one step, so every step starts
+    // over at the same offset.
+    core::ScratchSpace scratch;
+    if (core::WorkspaceArg(func) != nullptr) {
+      scratch.func = func;
+      scratch.base = workspace;
+    }
+    scratch.peak = plan.size;
+    {
+      core::ScratchScope scope(&scratch);
+      for (auto &step : steps) {
+        scratch.offset = plan.size;
+        if (step.op != nullptr)
+          step.op->Emit(func);
+        else
+          core::Elementwise::EmitFused(func, step.chain, step.store);
+      }
+    }
+    workspace_size_ = scratch.peak;
+  }
+
+  uint64_t Function::GetWorkspaceSize() const { return workspace_size_; }
+
   std::vector<Tensor *>
   Function::GetSignatureArgs(std::initializer_list<void *> output_addrs) {
     std::vector<Tensor *> output_types;
@@ -110,10 +610,10 @@ namespace Hobbit {
       visited_addrs.insert(addr);
       output_types.push_back((Tensor *)addr);
     }
-    for (auto &sym : symbol_table_) {
-      if (visited_addrs.find(sym.first) == visited_addrs.end() &&
-          sym.second->is_arg)
-        arg_types.push_back((Tensor *)sym.first);
+    for (auto &addr : symbol_order_) {
+      if (visited_addrs.find(addr) == visited_addrs.end() &&
+          symbol_table_.at(addr)->is_arg)
+        arg_types.push_back((Tensor *)addr);
     }
 
     std::vector<Tensor *> out(arg_types.begin(), arg_types.end());
@@ -129,6 +629,10 @@ namespace Hobbit {
 
   const std::string &Function::GetName() { return name_; }
 
+  void Function::SetFPPolicy(const FPPolicy &policy) { fp_policy_ = policy; }
+
+  const FPPolicy &Function::GetFPPolicy() const { return fp_policy_; }
+
   // Private functions
   //  std::unique_ptr<Tensor> Function::CreateVariable(void *addr) {
   //    return Variable::Create(this, symbol_table_.at(addr)->type,
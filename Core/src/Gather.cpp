@@ -0,0 +1,372 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+
+#include "Codegen.hpp"
+
+namespace {
+  // How many indices ahead the table rows are prefetched
+  const uint64_t kGatherPrefetchDistance = 8;
+  // Cache lines prefetched per row. The hardware prefetcher picks up the
+  // rest of a longer row once it's being read.
+  const uint64_t kGatherPrefetchLines = 4;
+  const uint64_t kCacheLineBytes = 64;
+
+  // Copies don't look at the elements, so bfloat16 rows move as i16
+  llvm::Type *CopyType(llvm::Type *t) {
+    return t->isStructTy() ? t->getStructElementType(0) : t;
+  }
+
+  llvm::Value *AsCopyType(llvm::IRBuilder<> &builder, llvm::Value *ptr) {
+    llvm::Type *elt_type = ptr->getType()->getPointerElementType();
+    return builder.CreateBitCast(ptr, CopyType(elt_type)->getPointerTo());
+  }
+
+  // indices[i] as an i64 row, and whether that row is in [0, rows)
+  std::pair<llvm::Value *, llvm::Value *>
+  LoadRow(llvm::IRBuilder<> &builder, llvm::Value *indices, llvm::Value *i,
+          uint64_t rows) {
+    llvm::Value *row = builder.CreateSExtOrTrunc(
+        builder.CreateLoad(builder.CreateGEP(indices, i)),
+        builder.getInt64Ty());
+    return {row, builder.CreateICmpULT(row, builder.getInt64(rows))};
+  }
+
+  // Prefetches the start of the table row that index i + distance points
+  // at, for reading or (write) for writing. Near the end that's the last
+  // index, and indices outside the table prefetch row 0.
+  void EmitPrefetchRow(llvm::IRBuilder<> &builder, llvm::Value *table,
+                       llvm::Value *indices, llvm::Value *i, uint64_t n,
+                       uint64_t rows, uint64_t row_size, bool write) {
+    llvm::Module *module = builder.GetInsertBlock()->getModule();
+    llvm::Function *prefetch =
+        llvm::Intrinsic::getDeclaration(module, llvm::Intrinsic::prefetch);
+
+    llvm::Value *ahead = Hobbit::core::EmitMin(
+        builder,
+        builder.CreateAdd(i, builder.getInt64(kGatherPrefetchDistance)),
+        builder.getInt64(n - 1));
+    auto row = LoadRow(builder, indices, ahead, rows);
+    llvm::Value *start = builder.CreateGEP(
+        table,
+        builder.CreateMul(
+            builder.CreateSelect(row.second, row.first, builder.getInt64(0)),
+            builder.getInt64(row_size)));
+
+    const uint64_t elt_bytes =
+        table->getType()->getPointerElementType()->getPrimitiveSizeInBits() /
+        8;
+    const uint64_t lines =
+        std::min((row_size * elt_bytes + kCacheLineBytes - 1) /
+                     kCacheLineBytes,
+                 kGatherPrefetchLines);
+    for (uint64_t l = 0; l < lines; l++) {
+      llvm::Value *addr = builder.CreateGEP(
+          start, builder.getInt64(l * kCacheLineBytes / elt_bytes));
+      builder.CreateCall(
+          prefetch, {builder.CreateBitCast(addr, builder.getInt8PtrTy()),
+                     builder.getInt32(write), builder.getInt32(3),
+                     builder.getInt32(1)});
+    }
+  }
+
+  uint64_t Gcd(uint64_t a, uint64_t b) { return b == 0 ? a : Gcd(b, a % b); }
+}
+
+void Hobbit::core::Gather::CheckArgs() {
+  if (args_.size() != 2)
+    throw IncorrectNumArgs("Gather");
+  if (IsBit(ElementType(args_[0])) || !ElementType(args_[1])->isIntegerTy())
+    throw IncompatibleTypes("Gather");
+}
+
+Hobbit::Tensor *Hobbit::core::Gather::GetOutput() {
+  Tensor *output_tensor = Variable::Create(
+      args_[0]->parent_func, args_[0]->type,
+      Shape(1, args_[1]->shape.GetSize(), args_[0]->shape.GetAxisSize(W)));
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+// Rows shorter than a vector are packed together into whole vectors before
+// they're stored. Those vectors come from llvm.masked.gather when the
+// target has a gather instruction (AVX2 in host mode) and from ordinary
+// loads otherwise.
+llvm::Value *Hobbit::core::Gather::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.gather.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+
+  llvm::Value *table = AsCopyType(builder, BufferPointer(builder, args_[0]));
+  llvm::Value *indices = BufferPointer(builder, args_[1]);
+  llvm::Value *output = BufferPointer(builder, args_[2]);
+
+  const uint64_t d = args_[0]->shape.GetAxisSize(W);
+  if (d < VectorWidth(CopyType(ElementType(args_[0]))))
+    EmitShortRows(builder, table, indices, AsCopyType(builder, output));
+  else
+    EmitRows(builder, table, indices, AsCopyType(builder, output));
+
+  return output;
+}
+
+// One row at a time, copied in vectors. Indices outside the table copy
+// from a row of zeros instead, so there's no branch.
+void Hobbit::core::Gather::EmitRows(llvm::IRBuilder<> &builder,
+                                    llvm::Value *table, llvm::Value *indices,
+                                    llvm::Value *output) {
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+  llvm::Type *elt_type = table->getType()->getPointerElementType();
+  const uint64_t vw = VectorWidth(elt_type);
+  const uint64_t d = args_[0]->shape.GetAxisSize(W);
+  const uint64_t rows = args_[0]->shape.GetSize() / d;
+  const uint64_t n = args_[1]->shape.GetSize();
+
+  llvm::Value *zero_row = GlobalConstant(
+      func->getParent(),
+      llvm::ConstantAggregateZero::get(llvm::ArrayType::get(elt_type, d)));
+
+  EmitLoop(builder, "hobbit.gather.row", builder.getInt64(0),
+           builder.getInt64(n), 1, [&](llvm::Value *i) {
+    EmitPrefetchRow(builder, table, indices, i, n, rows, d, false);
+
+    auto row = LoadRow(builder, indices, i, rows);
+    llvm::Value *src = builder.CreateSelect(
+        row.second,
+        builder.CreateGEP(table,
+                          builder.CreateMul(row.first, builder.getInt64(d))),
+        zero_row);
+    llvm::Value *dst =
+        builder.CreateGEP(output, builder.CreateMul(i, builder.getInt64(d)));
+    EmitVectorLoop(builder, "hobbit.gather.copy", d, vw,
+                   [&](llvm::Value *j, bool vector) {
+      EmitStoreLanes(builder, EmitLoadLanes(builder, src, j, vector ? vw : 1),
+                     dst, j);
+    });
+  });
+}
+
+// Groups of rows that fill a whole number of vectors (lcm(D, vw) elements)
+// are loaded into vectors and stored as those vectors, each vector with one
+// masked gather (lanes of rows outside the table are masked off to zero) if
+// the CPU has one for 32 or 64 bit elements, else element by element. Rows
+// past the last full group are copied one element at a time.
+void Hobbit::core::Gather::EmitShortRows(llvm::IRBuilder<> &builder,
+                                         llvm::Value *table,
+                                         llvm::Value *indices,
+                                         llvm::Value *output) {
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+  llvm::Type *elt_type = table->getType()->getPointerElementType();
+  const uint64_t vw = VectorWidth(elt_type);
+  const uint64_t d = args_[0]->shape.GetAxisSize(W);
+  const uint64_t rows = args_[0]->shape.GetSize() / d;
+  const uint64_t n = args_[1]->shape.GetSize();
+  const uint64_t group = vw / Gcd(vw, d);
+  const uint64_t n_grouped = n - n % group;
+  llvm::VectorType *vec_type = llvm::VectorType::get(elt_type, vw);
+
+  const uint64_t elt_bits = elt_type->getPrimitiveSizeInBits();
+  const bool gather = HasCPUFeature(args_[0], "avx2") &&
+                      (elt_bits == 32 || elt_bits == 64);
+  // Narrower offsets are what lets a gather fill a whole vector at once
+  llvm::Type *offset_type = rows * d < (1ull << 31) ? builder.getInt32Ty()
+                                                    : builder.getInt64Ty();
+
+  llvm::Value *zero_row = GlobalConstant(
+      func->getParent(),
+      llvm::ConstantAggregateZero::get(llvm::ArrayType::get(elt_type, d)));
+
+  auto source = [&](llvm::Value *i) {
+    auto row = LoadRow(builder, indices, i, rows);
+    return builder.CreateSelect(
+        row.second,
+        builder.CreateGEP(table,
+                          builder.CreateMul(row.first, builder.getInt64(d))),
+        zero_row);
+  };
+
+  if (n_grouped > 0) {
+    EmitLoop(builder, "hobbit.gather.group", builder.getInt64(0),
+             builder.getInt64(n_grouped), group, [&](llvm::Value *g) {
+      std::vector<llvm::Value *> srcs;
+      for (uint64_t r = 0; r < group; r++) {
+        llvm::Value *i = builder.CreateAdd(g, builder.getInt64(r));
+        EmitPrefetchRow(builder, table, indices, i, n, rows, d, false);
+        if (!gather)
+          srcs.push_back(source(i));
+      }
+      llvm::Value *dst =
+          builder.CreateGEP(output, builder.CreateMul(g, builder.getInt64(d)));
+
+      if (gather) {
+        // Offset of the first element of each row in the table, 0 for rows
+        // outside it, and whether it's in the table
+        std::vector<llvm::Value *> starts, valid;
+        for (uint64_t r = 0; r < group; r++) {
+          auto row = LoadRow(builder, indices,
+                             builder.CreateAdd(g, builder.getInt64(r)), rows);
+          llvm::Value *start = builder.CreateMul(
+              builder.CreateSelect(row.second, row.first, builder.getInt64(0)),
+              builder.getInt64(d));
+          starts.push_back(builder.CreateTrunc(start, offset_type));
+          valid.push_back(row.second);
+        }
+
+        llvm::Type *mask_type = llvm::VectorType::get(builder.getInt1Ty(), vw);
+        for (uint64_t v = 0; v < group * d / vw; v++) {
+          llvm::Value *offsets =
+              llvm::UndefValue::get(llvm::VectorType::get(offset_type, vw));
+          llvm::Value *mask = llvm::UndefValue::get(mask_type);
+          for (uint64_t l = 0; l < vw; l++) {
+            const uint64_t e = v * vw + l;
+            offsets = builder.CreateInsertElement(
+                offsets,
+                builder.CreateAdd(starts[e / d],
+                                  llvm::ConstantInt::get(offset_type, e % d)),
+                builder.getInt64(l));
+            mask = builder.CreateInsertElement(mask, valid[e / d],
+                                               builder.getInt64(l));
+          }
+          llvm::Value *vec = builder.CreateMaskedGather(
+              builder.CreateGEP(table, offsets), elt_bits / 8, mask,
+              llvm::Constant::getNullValue(vec_type));
+          EmitStoreLanes(builder, vec, dst, builder.getInt64(v * vw));
+        }
+        return;
+      }
+
+      for (uint64_t v = 0; v < group * d / vw; v++) {
+        llvm::Value *vec = llvm::UndefValue::get(vec_type);
+        for (uint64_t l = 0; l < vw; l++) {
+          const uint64_t e = v * vw + l;
+          vec = builder.CreateInsertElement(
+              vec,
+              builder.CreateLoad(
+                  builder.CreateGEP(srcs[e / d], builder.getInt64(e % d))),
+              builder.getInt64(l));
+        }
+        EmitStoreLanes(builder, vec, dst, builder.getInt64(v * vw));
+      }
+    });
+  }
+
+  if (n_grouped < n) {
+    EmitLoop(builder, "hobbit.gather.tail", builder.getInt64(n_grouped),
+             builder.getInt64(n), 1, [&](llvm::Value *i) {
+      llvm::Value *src = source(i);
+      llvm::Value *dst =
+          builder.CreateGEP(output, builder.CreateMul(i, builder.getInt64(d)));
+      for (uint64_t j = 0; j < d; j++)
+        builder.CreateStore(
+            builder.CreateLoad(builder.CreateGEP(src, builder.getInt64(j))),
+            builder.CreateGEP(dst, builder.getInt64(j)));
+    });
+  }
+}
+
+void Hobbit::core::ScatterAdd::CheckArgs() {
+  if (args_.size() != 3)
+    throw IncorrectNumArgs("ScatterAdd");
+
+  llvm::Type *elt_type = ComputeType(ElementType(args_[0]));
+  if (!elt_type->isFloatingPointTy() && !elt_type->isIntegerTy())
+    throw IncompatibleTypes("ScatterAdd");
+  if (!ElementType(args_[1])->isIntegerTy() ||
+      ElementType(args_[2]) != ElementType(args_[0]))
+    throw IncompatibleTypes("ScatterAdd");
+
+  const uint64_t d = args_[0]->shape.GetAxisSize(W);
+  const Shape &updates = args_[2]->shape;
+  if (updates.GetAxisSize(W) != d ||
+      updates.GetSize() != args_[1]->shape.GetSize() * d)
+    throw IncompatibleShapes("ScatterAdd");
+}
+
+Hobbit::Tensor *Hobbit::core::ScatterAdd::GetOutput() {
+  Tensor *output_tensor = Variable::Create(args_[0]->parent_func,
+                                           args_[0]->type, args_[0]->shape);
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+// The table is copied to the output, then every update row is added into
+// its output row in vectors, with the rows a few indices ahead prefetched
+// for writing
+llvm::Value *Hobbit::core::ScatterAdd::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.scatter.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+
+  llvm::Value *table = BufferPointer(builder, args_[0]);
+  llvm::Value *indices = BufferPointer(builder, args_[1]);
+  llvm::Value *updates = BufferPointer(builder, args_[2]);
+  llvm::Value *output = BufferPointer(builder, args_[3]);
+
+  const uint64_t d = args_[0]->shape.GetAxisSize(W);
+  const uint64_t rows = args_[0]->shape.GetSize() / d;
+  const uint64_t n = args_[1]->shape.GetSize();
+
+  llvm::Value *table_copy = AsCopyType(builder, table);
+  llvm::Value *output_copy = AsCopyType(builder, output);
+  const uint64_t copy_vw = VectorWidth(CopyType(ElementType(args_[0])));
+  EmitVectorLoop(builder, "hobbit.scatter.copy", args_[0]->shape.GetSize(),
+                 copy_vw, [&](llvm::Value *i, bool vector) {
+    EmitStoreLanes(
+        builder, EmitLoadLanes(builder, table_copy, i, vector ? copy_vw : 1),
+        output_copy, i);
+  });
+
+  const uint64_t vw = VectorWidth(ComputeType(ElementType(args_[0])));
+  EmitLoop(builder, "hobbit.scatter.row", builder.getInt64(0),
+           builder.getInt64(n), 1, [&](llvm::Value *i) {
+    EmitPrefetchRow(builder, output_copy, indices, i, n, rows, d, true);
+
+    auto row = LoadRow(builder, indices, i, rows);
+    EmitIf(builder, "hobbit.scatter.valid", row.second, [&]() {
+      llvm::Value *dst = builder.CreateGEP(
+          output, builder.CreateMul(row.first, builder.getInt64(d)));
+      llvm::Value *src =
+          builder.CreateGEP(updates, builder.CreateMul(i, builder.getInt64(d)));
+      EmitVectorLoop(builder, "hobbit.scatter.add", d, vw,
+                     [&](llvm::Value *j, bool vector) {
+        const unsigned lanes = vector ? vw : 1;
+        EmitStoreCompute(builder,
+                         EmitAdd(builder,
+                                 EmitLoadCompute(builder, dst, j, lanes),
+                                 EmitLoadCompute(builder, src, j, lanes)),
+                         dst, j);
+      });
+    });
+  });
+
+  return output;
+}
@@ -0,0 +1,521 @@
+//
+// Created by Aman LaChapelle on 3/24/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "Kernels.hpp"
+
+#include <algorithm>
+
+#include <llvm/Config/llvm-config.h>
+#if LLVM_VERSION_MAJOR >= 10
+#include <llvm/IR/IntrinsicsX86.h>
+#endif
+
+#include "Codegen.hpp"
+#include "Type.hpp"
+
+namespace Hobbit {
+  namespace core {
+    namespace {
+      // Rows of B folded into the accumulators per pass of the GEMV
+      const uint64_t kGemvRows = 4;
+      // Independent vector accumulators in EmitDot, enough to cover the
+      // latency of a vector add.
+      const uint64_t kDotAccumulators = 4;
+
+      uint64_t RoundUp(uint64_t x, uint64_t multiple) {
+        return (x + multiple - 1) / multiple * multiple;
+      }
+
+      // vdpbf16ps (AVX512-BF16 with VL) reads bfloat16 pairs as they are
+      // in memory and adds both products of a pair into one float lane.
+      // LLVM only knows the instruction from version 9 on.
+      bool HasDpbf16(llvm::Function *func) {
+#if LLVM_VERSION_MAJOR >= 9
+        return HasCPUFeature(func, "avx512bf16") &&
+               HasCPUFeature(func, "avx512vl");
+#else
+        return false;
+#endif
+      }
+
+      // acc (floats) plus the products of the 2 * |acc| bfloat16s of a and
+      // b from offset on, each pair of neighbours summed into one lane
+      llvm::Value *EmitDpbf16(llvm::IRBuilder<> &builder, llvm::Value *a,
+                              llvm::Value *b, llvm::Value *offset,
+                              llvm::Value *acc) {
+#if LLVM_VERSION_MAJOR >= 9
+        llvm::Function *vdpbf16ps = llvm::Intrinsic::getDeclaration(
+            builder.GetInsertBlock()->getModule(),
+            llvm::Intrinsic::x86_avx512bf16_dpbf16ps_256);
+        llvm::Type *pairs_type = vdpbf16ps->getFunctionType()->getParamType(1);
+        const unsigned lanes = 2 * acc->getType()->getVectorNumElements();
+        auto load = [&](llvm::Value *ptr) {
+          llvm::Value *bits = builder.CreateBitCast(
+              ptr, builder.getInt16Ty()->getPointerTo());
+          return builder.CreateBitCast(
+              EmitLoadLanes(builder, bits, offset, lanes), pairs_type);
+        };
+        return builder.CreateCall(vdpbf16ps, {acc, load(a), load(b)});
+#else
+        llvm_unreachable("vdpbf16ps needs LLVM 9");
+#endif
+      }
+
+      // C[1 x n] = A[1 x k] * B[k x n] for at most kGemmNC columns at a
+      // time. Rows of B are streamed in order and added into a row of
+      // accumulators that stays in L1, so B is read exactly once instead of
+      // being packed and run through the mostly empty register block.
+      void EmitGemv(llvm::IRBuilder<> &builder, const GemmOperands &ops) {
+        llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+        llvm::Type *elt_type =
+            ComputeType(ops.a->getType()->getPointerElementType());
+        const uint64_t vw = VectorWidth(elt_type);
+        const uint64_t nc = std::min(kGemmNC, ops.n);
+        const uint64_t k_grouped = ops.k - ops.k % kGemvRows;
+
+        llvm::Value *acc = EntryAlloca(func, elt_type, nc, "hobbit.gemv.acc");
+
+        auto chunk = [&](llvm::Value *jc, uint64_t width) {
+          EmitVectorLoop(builder, "hobbit.gemv.zero", width, vw,
+                         [&](llvm::Value *j, bool vector) {
+            EmitStoreLanes(
+                builder,
+                llvm::Constant::getNullValue(
+                    vector ? llvm::VectorType::get(elt_type, vw) : elt_type),
+                acc, j);
+          });
+
+          // acc += sum over r of A[p + r] * B[p + r, jc:jc + width]
+          auto fold = [&](llvm::Value *p, uint64_t rows) {
+            std::vector<llvm::Value *> a_vals, b_rows;
+            for (uint64_t r = 0; r < rows; r++) {
+              llvm::Value *row = builder.CreateAdd(p, builder.getInt64(r));
+              a_vals.push_back(EmitLoadCompute(builder, ops.a, row, 1));
+              b_rows.push_back(builder.CreateGEP(
+                  ops.b,
+                  builder.CreateAdd(
+                      builder.CreateMul(row, builder.getInt64(ops.ldb)), jc)));
+            }
+            EmitVectorLoop(builder, "hobbit.gemv.fold", width, vw,
+                           [&](llvm::Value *j, bool vector) {
+              const unsigned lanes = vector ? vw : 1;
+              llvm::Value *sum = nullptr;
+              for (uint64_t r = 0; r < rows; r++) {
+                llvm::Value *a_val =
+                    vector ? builder.CreateVectorSplat(vw, a_vals[r])
+                           : a_vals[r];
+                llvm::Value *prod =
+                    EmitMul(builder, a_val,
+                            EmitLoadCompute(builder, b_rows[r], j, lanes));
+                sum = sum == nullptr ? prod : EmitAdd(builder, sum, prod);
+              }
+              EmitStoreLanes(
+                  builder,
+                  EmitAdd(builder, EmitLoadLanes(builder, acc, j, lanes), sum),
+                  acc, j);
+            });
+          };
+          EmitLoop(builder, "hobbit.gemv.p", builder.getInt64(0),
+                   builder.getInt64(k_grouped), kGemvRows,
+                   [&](llvm::Value *p) { fold(p, kGemvRows); });
+          EmitLoop(builder, "hobbit.gemv.ptail", builder.getInt64(k_grouped),
+                   builder.getInt64(ops.k), 1,
+                   [&](llvm::Value *p) { fold(p, 1); });
+
+          llvm::Value *c_chunk = builder.CreateGEP(ops.c, jc);
+          EmitVectorLoop(builder, "hobbit.gemv.store", width, vw,
+                         [&](llvm::Value *j, bool vector) {
+            llvm::Value *val = EmitLoadLanes(builder, acc, j, vector ? vw : 1);
+            if (ops.epilogue)
+              val = ops.epilogue(builder, val, builder.getInt64(0),
+                                 builder.CreateAdd(jc, j));
+            EmitStoreCompute(builder, val, c_chunk, j);
+          });
+        };
+
+        const uint64_t n_full = ops.n - ops.n % nc;
+        EmitLoop(builder, "hobbit.gemv.jc", builder.getInt64(0),
+                 builder.getInt64(n_full), nc,
+                 [&](llvm::Value *jc) { chunk(jc, nc); });
+        if (n_full < ops.n)
+          chunk(builder.getInt64(n_full), ops.n - n_full);
+      }
+    }
+
+    void EmitGemm(llvm::IRBuilder<> &builder, const GemmOperands &ops) {
+      if (ops.m == 1) {
+        EmitGemv(builder, ops);
+        return;
+      }
+
+      llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+      // A and B are widened as they're packed, so everything past the
+      // packing (and the accumulation into C) is in the compute type
+      llvm::Type *c_type = ops.c->getType()->getPointerElementType();
+      llvm::Type *elt_type =
+          ComputeType(ops.a->getType()->getPointerElementType());
+      const uint64_t vw = VectorWidth(elt_type);
+      const uint64_t mr = kGemmMR;
+      const uint64_t nr = 2 * vw;
+      // A C narrower than the compute type can't hold partial sums, so it
+      // gets all of k in one panel. mc and nc shrink to keep the packed
+      // blocks the same size.
+      const bool one_panel = c_type != elt_type && ops.k > kGemmKC;
+      const uint64_t kc = one_panel ? ops.k : std::min(kGemmKC, ops.k);
+      const uint64_t max_mc = std::max(kGemmMC * kGemmKC / kc, mr);
+      const uint64_t max_nc = std::max(kGemmNC * kGemmKC / kc, nr);
+      const uint64_t mc = RoundUp(std::min(max_mc, ops.m), mr);
+      const uint64_t nc = RoundUp(std::min(max_nc, ops.n), nr);
+
+      llvm::VectorType *vec_type = llvm::VectorType::get(elt_type, vw);
+      llvm::Type *vec_ptr_type = vec_type->getPointerTo();
+      llvm::Value *zero = llvm::Constant::getNullValue(elt_type);
+      llvm::Value *vec_zero = llvm::Constant::getNullValue(vec_type);
+
+      llvm::Value *a_pack =
+          EntryAlloca(func, elt_type, mc * kc, "hobbit.gemm.apack");
+      llvm::Value *b_pack =
+          EntryAlloca(func, elt_type, kc * nc, "hobbit.gemm.bpack");
+      // Register block, SROA turns these into plain vector registers
+      llvm::Value *acc =
+          EntryAlloca(func, vec_type, mr * 2, "hobbit.gemm.acc");
+      // Staging area for tiles that hang off the edge of C
+      llvm::Value *tile =
+          EntryAlloca(func, elt_type, mr * nr, "hobbit.gemm.tile");
+
+      llvm::Value *m = builder.getInt64(ops.m);
+      llvm::Value *n = builder.getInt64(ops.n);
+      llvm::Value *k = builder.getInt64(ops.k);
+      llvm::Value *lda = builder.getInt64(ops.lda);
+      llvm::Value *ldb = builder.getInt64(ops.ldb);
+      llvm::Value *ldc = builder.getInt64(ops.ldc);
+      llvm::Value *mr_v = builder.getInt64(mr);
+      llvm::Value *nr_v = builder.getInt64(nr);
+      llvm::Value *i64_0 = builder.getInt64(0);
+
+      EmitLoop(builder, "hobbit.gemm.jc", i64_0, n, nc, [&](llvm::Value *jc) {
+        llvm::Value *ncur =
+            EmitMin(builder, builder.getInt64(nc), builder.CreateSub(n, jc));
+
+        EmitLoop(builder, "hobbit.gemm.pc", i64_0, k, kc, [&](llvm::Value *pc) {
+          llvm::Value *kcur =
+              EmitMin(builder, builder.getInt64(kc), builder.CreateSub(k, pc));
+          // The first panel overwrites C, the rest accumulate into it
+          llvm::Value *first = builder.CreateICmpEQ(pc, i64_0);
+          llvm::Value *last =
+              builder.CreateICmpEQ(builder.CreateAdd(pc, kcur), k);
+
+          // Pack B[pc:pc+kcur, jc:jc+ncur] into nr wide slivers, each one
+          // kcur x nr and contiguous. The last sliver is zero padded.
+          EmitLoop(builder, "hobbit.gemm.bpack.jr", i64_0, ncur, nr,
+                   [&](llvm::Value *jr) {
+            llvm::Value *col0 = builder.CreateAdd(jc, jr);
+            llvm::Value *full =
+                builder.CreateICmpULE(builder.CreateAdd(col0, nr_v), n);
+
+            EmitLoop(builder, "hobbit.gemm.bpack.p", i64_0, kcur, 1,
+                     [&](llvm::Value *p) {
+              llvm::Value *src = builder.CreateGEP(
+                  ops.b,
+                  builder.CreateAdd(
+                      builder.CreateMul(builder.CreateAdd(pc, p), ldb), col0));
+              llvm::Value *dst = builder.CreateGEP(
+                  b_pack, builder.CreateAdd(builder.CreateMul(jr, kcur),
+                                            builder.CreateMul(p, nr_v)));
+
+              EmitIf(builder, "hobbit.gemm.bpack.full", full,
+                     [&]() {
+                       for (uint64_t v = 0; v < nr; v += vw) {
+                         llvm::Value *val = EmitLoadCompute(
+                             builder, src, builder.getInt64(v), vw);
+                         builder.CreateAlignedStore(
+                             val,
+                             builder.CreateBitCast(
+                                 builder.CreateGEP(dst, builder.getInt64(v)),
+                                 vec_ptr_type),
+                             32);
+                       }
+                     },
+                     [&]() {
+                       llvm::Value *valid = builder.CreateSub(n, col0);
+                       EmitLoop(builder, "hobbit.gemm.bpack.v", i64_0, nr_v, 1,
+                                [&](llvm::Value *v) {
+                         llvm::Value *in_bounds =
+                             builder.CreateICmpULT(v, valid);
+                         llvm::Value *offset =
+                             builder.CreateSelect(in_bounds, v, i64_0);
+                         llvm::Value *val = builder.CreateSelect(
+                             in_bounds,
+                             EmitLoadCompute(builder, src, offset, 1), zero);
+                         builder.CreateStore(val, builder.CreateGEP(dst, v));
+                       });
+                     });
+            });
+          });
+
+          EmitLoop(builder, "hobbit.gemm.ic", i64_0, m, mc,
+                   [&](llvm::Value *ic) {
+            llvm::Value *mcur = EmitMin(builder, builder.getInt64(mc),
+                                        builder.CreateSub(m, ic));
+
+            // Pack A[ic:ic+mcur, pc:pc+kcur] into mr tall slivers, each one
+            // kcur x mr and stored column by column. Rows past the end of A
+            // are zero.
+            EmitLoop(builder, "hobbit.gemm.apack.ir", i64_0, mcur, mr,
+                     [&](llvm::Value *ir) {
+              llvm::Value *dst = builder.CreateGEP(a_pack,
+                                                   builder.CreateMul(ir, kcur));
+              for (uint64_t r = 0; r < mr; r++) {
+                llvm::Value *row = builder.CreateAdd(
+                    builder.CreateAdd(ic, ir), builder.getInt64(r));
+                llvm::Value *in_bounds = builder.CreateICmpULT(row, m);
+                row = builder.CreateSelect(in_bounds, row, i64_0);
+                llvm::Value *src = builder.CreateGEP(
+                    ops.a,
+                    builder.CreateAdd(builder.CreateMul(row, lda), pc));
+
+                EmitLoop(builder, "hobbit.gemm.apack.p", i64_0, kcur, 1,
+                         [&](llvm::Value *p) {
+                  llvm::Value *val = builder.CreateSelect(
+                      in_bounds, EmitLoadCompute(builder, src, p, 1), zero);
+                  llvm::Value *offset = builder.CreateAdd(
+                      builder.CreateMul(p, mr_v), builder.getInt64(r));
+                  builder.CreateStore(val, builder.CreateGEP(dst, offset));
+                });
+              }
+            });
+
+            EmitLoop(builder, "hobbit.gemm.jr", i64_0, ncur, nr,
+                     [&](llvm::Value *jr) {
+              EmitLoop(builder, "hobbit.gemm.ir", i64_0, mcur, mr,
+                       [&](llvm::Value *ir) {
+                llvm::Value *a_sliver =
+                    builder.CreateGEP(a_pack, builder.CreateMul(ir, kcur));
+                llvm::Value *b_sliver =
+                    builder.CreateGEP(b_pack, builder.CreateMul(jr, kcur));
+
+                for (uint64_t i = 0; i < mr * 2; i++) {
+                  builder.CreateStore(
+                      vec_zero, builder.CreateConstInBoundsGEP1_64(acc, i));
+                }
+
+                // Micro-kernel: rank-1 update of the mr x nr register block
+                EmitLoop(builder, "hobbit.gemm.micro", i64_0, kcur, 1,
+                         [&](llvm::Value *p) {
+                  llvm::Value *b_vec[2];
+                  for (uint64_t v = 0; v < 2; v++) {
+                    b_vec[v] = builder.CreateAlignedLoad(
+                        builder.CreateBitCast(
+                            builder.CreateGEP(
+                                b_sliver,
+                                builder.CreateAdd(builder.CreateMul(p, nr_v),
+                                                  builder.getInt64(v * vw))),
+                            vec_ptr_type),
+                        32);
+                  }
+
+                  for (uint64_t r = 0; r < mr; r++) {
+                    llvm::Value *a_elt = builder.CreateLoad(builder.CreateGEP(
+                        a_sliver, builder.CreateAdd(builder.CreateMul(p, mr_v),
+                                                    builder.getInt64(r))));
+                    llvm::Value *a_vec = builder.CreateVectorSplat(vw, a_elt);
+                    for (uint64_t v = 0; v < 2; v++) {
+                      llvm::Value *slot =
+                          builder.CreateConstInBoundsGEP1_64(acc, r * 2 + v);
+                      builder.CreateStore(
+                          EmitAdd(builder, builder.CreateLoad(slot),
+                                  EmitMul(builder, a_vec, b_vec[v])),
+                          slot);
+                    }
+                  }
+                });
+
+                llvm::Value *row0 = builder.CreateAdd(ic, ir);
+                llvm::Value *col0 = builder.CreateAdd(jc, jr);
+                llvm::Value *rows =
+                    EmitMin(builder, mr_v, builder.CreateSub(m, row0));
+                llvm::Value *cols =
+                    EmitMin(builder, nr_v, builder.CreateSub(n, col0));
+                llvm::Value *c_tile = builder.CreateGEP(
+                    ops.c,
+                    builder.CreateAdd(builder.CreateMul(row0, ldc), col0));
+                llvm::Value *full =
+                    builder.CreateAnd(builder.CreateICmpEQ(rows, mr_v),
+                                      builder.CreateICmpEQ(cols, nr_v));
+
+                // Runs the epilogue on what the last panel leaves in C. It's
+                // cheap next to a panel's worth of multiply-adds, so the
+                // earlier panels compute it too and throw it away rather
+                // than branch.
+                auto finish = [&](llvm::Value *val, llvm::Value *row,
+                                  llvm::Value *col) {
+                  if (!ops.epilogue)
+                    return val;
+                  llvm::Value *done = ops.epilogue(
+                      builder, val, builder.CreateAdd(row0, row),
+                      builder.CreateAdd(col0, col));
+                  if (kc >= ops.k)
+                    return done;
+                  return builder.CreateSelect(last, done, val);
+                };
+
+                EmitIf(builder, "hobbit.gemm.store", full,
+                       [&]() {
+                         for (uint64_t r = 0; r < mr; r++) {
+                           for (uint64_t v = 0; v < 2; v++) {
+                             llvm::Value *offset =
+                                 builder.getInt64(r * ops.ldc + v * vw);
+                             llvm::Value *old =
+                                 EmitLoadCompute(builder, c_tile, offset, vw);
+                             llvm::Value *val = EmitAdd(
+                                 builder,
+                                 builder.CreateLoad(
+                                     builder.CreateConstInBoundsGEP1_64(
+                                         acc, r * 2 + v)),
+                                 builder.CreateSelect(first, vec_zero, old));
+                             val = finish(val, builder.getInt64(r),
+                                          builder.getInt64(v * vw));
+                             EmitStoreCompute(builder, val, c_tile, offset);
+                           }
+                         }
+                       },
+                       [&]() {
+                         for (uint64_t r = 0; r < mr; r++) {
+                           for (uint64_t v = 0; v < 2; v++) {
+                             builder.CreateAlignedStore(
+                                 builder.CreateLoad(
+                                     builder.CreateConstInBoundsGEP1_64(
+                                         acc, r * 2 + v)),
+                                 builder.CreateBitCast(
+                                     builder.CreateGEP(
+                                         tile,
+                                         builder.getInt64(r * nr + v * vw)),
+                                     vec_ptr_type),
+                                 32);
+                           }
+                         }
+
+                         EmitLoop(builder, "hobbit.gemm.edge.r", i64_0, rows, 1,
+                                  [&](llvm::Value *r) {
+                           EmitLoop(builder, "hobbit.gemm.edge.c", i64_0, cols,
+                                    1, [&](llvm::Value *c) {
+                             llvm::Value *val = builder.CreateLoad(
+                                 builder.CreateGEP(
+                                     tile, builder.CreateAdd(
+                                               builder.CreateMul(r, nr_v), c)));
+                             llvm::Value *offset = builder.CreateAdd(
+                                 builder.CreateMul(r, ldc), c);
+                             llvm::Value *old =
+                                 EmitLoadCompute(builder, c_tile, offset, 1);
+                             old = builder.CreateSelect(first, zero, old);
+                             val = finish(EmitAdd(builder, val, old), r, c);
+                             EmitStoreCompute(builder, val, c_tile, offset);
+                           });
+                         });
+                       });
+              });
+            });
+          });
+        });
+      });
+    }
+
+    llvm::Value *EmitDot(llvm::IRBuilder<> &builder, llvm::Value *a,
+                         llvm::Value *b, uint64_t size, bool reassociate,
+                         bool fuse) {
+      llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+      llvm::Type *a_type = a->getType()->getPointerElementType();
+      llvm::Type *elt_type = ComputeType(a_type);
+      const uint64_t vw = VectorWidth(elt_type);
+      reassociate = reassociate || elt_type->isIntegerTy();
+      // Pairs of bfloat16s go into each float lane without widening, which
+      // sums them in a different order
+      const bool dpbf16 = reassociate &&
+                          a_type == BFloat16Ty(func->getContext()) &&
+                          HasDpbf16(func);
+      const uint64_t lanes = dpbf16 ? 2 * vw : vw;
+      const uint64_t step = kDotAccumulators * lanes;
+      const uint64_t vec_end = reassociate ? size - size % step : 0;
+
+      llvm::VectorType *vec_type = llvm::VectorType::get(elt_type, vw);
+
+      llvm::Value *sum = EntryAlloca(func, elt_type, 1, "hobbit.dot.sum");
+      builder.CreateStore(llvm::Constant::getNullValue(elt_type), sum);
+
+      if (vec_end > 0) {
+        llvm::Value *acc =
+            EntryAlloca(func, vec_type, kDotAccumulators, "hobbit.dot.acc");
+        for (uint64_t i = 0; i < kDotAccumulators; i++) {
+          builder.CreateStore(llvm::Constant::getNullValue(vec_type),
+                              builder.CreateGEP(acc, builder.getInt64(i)));
+        }
+
+        EmitLoop(builder, "hobbit.dot.vec", builder.getInt64(0),
+                 builder.getInt64(vec_end), step, [&](llvm::Value *idx) {
+          for (uint64_t i = 0; i < kDotAccumulators; i++) {
+            llvm::Value *offset =
+                builder.CreateAdd(idx, builder.getInt64(i * lanes));
+            llvm::Value *acc_ptr = builder.CreateGEP(acc, builder.getInt64(i));
+            llvm::Value *acc_val = builder.CreateLoad(acc_ptr);
+            if (dpbf16) {
+              acc_val = EmitDpbf16(builder, a, b, offset, acc_val);
+            } else {
+              acc_val = EmitMulAdd(builder,
+                                   EmitLoadCompute(builder, a, offset, vw),
+                                   EmitLoadCompute(builder, b, offset, vw),
+                                   acc_val, fuse);
+            }
+            builder.CreateStore(acc_val, acc_ptr);
+          }
+        });
+
+        // Pairwise combine, then reduce across lanes
+        std::vector<llvm::Value *> partial;
+        for (uint64_t i = 0; i < kDotAccumulators; i++) {
+          partial.push_back(
+              builder.CreateLoad(builder.CreateGEP(acc, builder.getInt64(i))));
+        }
+        while (partial.size() > 1) {
+          for (uint64_t i = 0; i < partial.size() / 2; i++)
+            partial[i] = EmitAdd(builder, partial[2 * i], partial[2 * i + 1]);
+          partial.resize(partial.size() / 2);
+        }
+        builder.CreateStore(EmitHorizontalAdd(builder, partial[0]), sum);
+      }
+
+      // Remainder, or everything in the strict case
+      EmitLoop(builder, "hobbit.dot.tail", builder.getInt64(vec_end),
+               builder.getInt64(size), 1, [&](llvm::Value *idx) {
+        builder.CreateStore(EmitMulAdd(builder,
+                                       EmitLoadCompute(builder, a, idx, 1),
+                                       EmitLoadCompute(builder, b, idx, 1),
+                                       builder.CreateLoad(sum), fuse),
+                            sum);
+      });
+
+      return builder.CreateLoad(sum);
+    }
+  }
+}
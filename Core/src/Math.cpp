@@ -0,0 +1,346 @@
+//
+// Created by Aman LaChapelle on 3/29/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "Math.hpp"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "Codegen.hpp"
+
+namespace Hobbit {
+  namespace core {
+    namespace {
+      // Horner's rule, coeffs from the highest power down
+      llvm::Value *EmitPolynomial(llvm::IRBuilder<> &builder, llvm::Value *x,
+                                  const std::vector<double> &coeffs) {
+        llvm::Type *type = x->getType();
+        llvm::Value *p = ConstantValue(type, coeffs[0]);
+        for (uint64_t i = 1; i < coeffs.size(); i++)
+          p = EmitAdd(builder, EmitMul(builder, p, x),
+                      ConstantValue(type, coeffs[i]));
+        return p;
+      }
+
+      // round(x) to the same shaped integer type, without needing SSE4.1
+      llvm::Value *EmitRoundToInt(llvm::IRBuilder<> &builder, llvm::Value *x,
+                                  llvm::Type *int_type) {
+        llvm::Type *type = x->getType();
+        llvm::Value *half = builder.CreateSelect(
+            builder.CreateFCmpOLT(x, llvm::Constant::getNullValue(type)),
+            ConstantValue(type, -0.5), ConstantValue(type, 0.5));
+        return builder.CreateFPToSI(builder.CreateFAdd(x, half), int_type);
+      }
+
+      llvm::Type *IntTypeLike(llvm::Type *type, unsigned bits) {
+        llvm::Type *int_type = llvm::Type::getIntNTy(type->getContext(), bits);
+        if (type->isVectorTy())
+          return llvm::VectorType::get(int_type, type->getVectorNumElements());
+        return int_type;
+      }
+
+      bool IsDouble(llvm::Value *x) {
+        return x->getType()->getScalarType()->isDoubleTy();
+      }
+
+      llvm::Value *EmitAbs(llvm::IRBuilder<> &builder, llvm::Value *x) {
+        llvm::Value *zero = llvm::Constant::getNullValue(x->getType());
+        return builder.CreateSelect(builder.CreateFCmpOLT(x, zero),
+                                    builder.CreateFNeg(x), x);
+      }
+
+      // Gives |y| the sign of x
+      llvm::Value *EmitCopySign(llvm::IRBuilder<> &builder, llvm::Value *y,
+                                llvm::Value *x) {
+        llvm::Value *zero = llvm::Constant::getNullValue(x->getType());
+        return builder.CreateSelect(builder.CreateFCmpOLT(x, zero),
+                                    builder.CreateFNeg(y), y);
+      }
+
+      // Taylor coefficients of e^x up to x^degree, highest first
+      std::vector<double> ExpCoefficients(int degree) {
+        std::vector<double> coeffs(degree + 1);
+        double term = 1;
+        for (int i = 0; i <= degree; i++) {
+          coeffs[degree - i] = term;
+          term /= i + 1;
+        }
+        return coeffs;
+      }
+
+      // tanh(x) = x * P(x^2), coefficients of P highest first. They follow
+      // from tanh' = 1 - tanh^2.
+      std::vector<double> TanhCoefficients(int terms) {
+        std::vector<double> odd(terms); // odd[i] multiplies x^(2i + 1)
+        odd[0] = 1;
+        for (int i = 1; i < terms; i++) {
+          double sum = 0;
+          for (int j = 0; j < i; j++)
+            sum += odd[j] * odd[i - 1 - j];
+          odd[i] = -sum / (2 * i + 1);
+        }
+        return std::vector<double>(odd.rbegin(), odd.rend());
+      }
+
+      // erf(x) = x * P(x^2) from the Maclaurin series, highest first
+      std::vector<double> ErfCoefficients(int terms) {
+        std::vector<double> coeffs(terms);
+        double factorial = 1;
+        for (int n = 0; n < terms; n++) {
+          if (n > 0)
+            factorial *= n;
+          coeffs[terms - 1 - n] = (n % 2 ? -2 : 2) / std::sqrt(M_PI) /
+                                  (factorial * (2 * n + 1));
+        }
+        return coeffs;
+      }
+    }
+
+    // Cody-Waite: e^x = 2^n * e^r with n = round(x / ln 2) and |r| <= ln2/2,
+    // e^r from a polynomial and 2^n put straight into the exponent bits.
+    llvm::Value *EmitExp(llvm::IRBuilder<> &builder, llvm::Value *x,
+                         MathAccuracy accuracy) {
+      llvm::Type *type = x->getType();
+      const bool is_double = IsDouble(x);
+
+      const double lo = is_double ? -708.0 : -87.0;
+      const double hi = is_double ? 709.0 : 88.5;
+      const int bias = is_double ? 1023 : 127;
+      const unsigned mantissa = is_double ? 52 : 23;
+      const unsigned bits = is_double ? 64 : 32;
+
+      llvm::Value *clamped = EmitMin(
+          builder, EmitMax(builder, x, ConstantValue(type, lo)),
+          ConstantValue(type, hi));
+
+      llvm::Type *n_type = IntTypeLike(type, 32);
+      llvm::Value *n = EmitRoundToInt(
+          builder,
+          builder.CreateFMul(clamped, ConstantValue(type, 1.4426950408889634)),
+          n_type);
+      // Keep 2^n a normal number, r picks up the difference
+      n = EmitMin(builder, EmitMax(builder, n, ConstantValue(n_type, 1 - bias)),
+                  ConstantValue(n_type, bias));
+      llvm::Value *n_fp = builder.CreateSIToFP(n, type);
+
+      // ln 2 split in two so that n * ln2_hi is exact
+      const double ln2_hi = is_double ? 6.93145751953125e-1 : 0.693359375;
+      const double ln2_lo =
+          is_double ? 1.42860682030941723212e-6 : -2.12194440e-4;
+      llvm::Value *r = builder.CreateFSub(
+          builder.CreateFSub(clamped, builder.CreateFMul(
+                                          n_fp, ConstantValue(type, ln2_hi))),
+          builder.CreateFMul(n_fp, ConstantValue(type, ln2_lo)));
+
+      llvm::Value *p;
+      if (is_double || accuracy == MATH_FAST) {
+        // Taylor is good to a few ulp at degree 13 for |r| <= ln2/2
+        int degree = is_double ? 13 : 5;
+        if (accuracy == MATH_FAST)
+          degree = is_double ? 7 : 5;
+        p = EmitPolynomial(builder, r, ExpCoefficients(degree));
+      } else {
+        // Cephes expf: e^r = 1 + r + r^2 * P(r)
+        llvm::Value *poly = EmitPolynomial(
+            builder, r,
+            {1.9875691500e-4, 1.3981999507e-3, 8.3334519073e-3,
+             4.1665795894e-2, 1.6666665459e-1, 5.0000001201e-1});
+        p = builder.CreateFAdd(
+            builder.CreateFAdd(
+                builder.CreateFMul(builder.CreateFMul(r, r), poly), r),
+            ConstantValue(type, 1.0));
+      }
+
+      llvm::Type *bits_type = IntTypeLike(type, bits);
+      llvm::Value *exponent = builder.CreateShl(
+          builder.CreateAdd(builder.CreateSExt(n, bits_type),
+                            ConstantValue(bits_type, bias)),
+          ConstantValue(bits_type, mantissa));
+      llvm::Value *result =
+          builder.CreateFMul(p, builder.CreateBitCast(exponent, type));
+
+      return builder.CreateSelect(
+          builder.CreateFCmpOLT(x, ConstantValue(type, lo)),
+          llvm::Constant::getNullValue(type), result);
+    }
+
+    // x = m * 2^e with m in [sqrt(1/2), sqrt(2)), then
+    // log m = 2 atanh(s) = 2 (s + s^3/3 + s^5/5 + ...) with s = (m-1)/(m+1),
+    // and |s| < 0.172 so the series is short.
+    llvm::Value *EmitLog(llvm::IRBuilder<> &builder, llvm::Value *x,
+                         MathAccuracy accuracy) {
+      llvm::Type *type = x->getType();
+      const bool is_double = IsDouble(x);
+
+      const unsigned mantissa = is_double ? 52 : 23;
+      const uint64_t bias = is_double ? 1023 : 127;
+      llvm::Type *bits_type = IntTypeLike(type, is_double ? 64 : 32);
+
+      // Exponent and mantissa for m in [1/2, 1)
+      llvm::Value *bits = builder.CreateBitCast(x, bits_type);
+      llvm::Value *e = builder.CreateSub(
+          builder.CreateAnd(
+              builder.CreateLShr(bits, ConstantValue(bits_type, mantissa)),
+              ConstantValue(bits_type, 2 * bias + 1)),
+          ConstantValue(bits_type, bias - 1));
+      llvm::Value *m = builder.CreateBitCast(
+          builder.CreateOr(
+              builder.CreateAnd(bits,
+                                ConstantValue(bits_type,
+                                              (1ull << mantissa) - 1)),
+              ConstantValue(bits_type, (bias - 1) << mantissa)),
+          type);
+
+      llvm::Value *small =
+          builder.CreateFCmpOLT(m, ConstantValue(type, M_SQRT1_2));
+      m = builder.CreateSelect(small, builder.CreateFAdd(m, m), m);
+      e = builder.CreateSelect(
+          small, builder.CreateSub(e, ConstantValue(bits_type, 1)), e);
+      llvm::Value *e_fp = builder.CreateSIToFP(e, type);
+
+      llvm::Value *one = ConstantValue(type, 1.0);
+      llvm::Value *s = builder.CreateFDiv(builder.CreateFSub(m, one),
+                                          builder.CreateFAdd(m, one));
+      int terms = is_double ? 12 : 5;
+      if (accuracy == MATH_FAST)
+        terms = is_double ? 6 : 3;
+      std::vector<double> coeffs;
+      for (int i = terms - 1; i >= 0; i--)
+        coeffs.push_back(2.0 / (2 * i + 1));
+      llvm::Value *log_m = builder.CreateFMul(
+          s, EmitPolynomial(builder, builder.CreateFMul(s, s), coeffs));
+
+      const double ln2_hi = is_double ? 6.93147180369123816490e-1 : 0.693359375;
+      const double ln2_lo =
+          is_double ? 1.90821492927058770002e-10 : -2.12194440e-4;
+      llvm::Value *result = builder.CreateFAdd(
+          builder.CreateFMul(e_fp, ConstantValue(type, ln2_hi)),
+          builder.CreateFAdd(
+              log_m, builder.CreateFMul(e_fp, ConstantValue(type, ln2_lo))));
+
+      const double inf = std::numeric_limits<double>::infinity();
+      llvm::Value *zero = llvm::Constant::getNullValue(type);
+      result = builder.CreateSelect(builder.CreateFCmpOEQ(x, zero),
+                                    ConstantValue(type, -inf), result);
+      result = builder.CreateSelect(
+          builder.CreateFCmpOEQ(x, ConstantValue(type, inf)), x, result);
+      // Also catches NaN inputs
+      return builder.CreateSelect(
+          builder.CreateFCmpUGE(x, zero), result,
+          ConstantValue(type, std::numeric_limits<double>::quiet_NaN()));
+    }
+
+    // tanh|x| = 1 - 2 / (e^2|x| + 1). Close to 0 that cancels, so it
+    // switches to the Taylor series there.
+    llvm::Value *EmitTanh(llvm::IRBuilder<> &builder, llvm::Value *x,
+                          MathAccuracy accuracy) {
+      llvm::Type *type = x->getType();
+      llvm::Value *one = ConstantValue(type, 1.0);
+      llvm::Value *ax = EmitAbs(builder, x);
+
+      llvm::Value *e =
+          EmitExp(builder, builder.CreateFAdd(ax, ax), accuracy);
+      llvm::Value *result = EmitCopySign(
+          builder,
+          builder.CreateFSub(
+              one, builder.CreateFDiv(ConstantValue(type, 2.0),
+                                      builder.CreateFAdd(e, one))),
+          x);
+      int terms = IsDouble(x) ? 12 : 6;
+      if (accuracy == MATH_FAST)
+        terms = IsDouble(x) ? 7 : 4;
+      llvm::Value *series = builder.CreateFMul(
+          x, EmitPolynomial(builder, builder.CreateFMul(x, x),
+                            TanhCoefficients(terms)));
+      return builder.CreateSelect(
+          builder.CreateFCmpOLT(ax, ConstantValue(type, 0.3)), series,
+          result);
+    }
+
+    llvm::Value *EmitSigmoid(llvm::IRBuilder<> &builder, llvm::Value *x,
+                             MathAccuracy accuracy) {
+      llvm::Value *one = ConstantValue(x->getType(), 1.0);
+      return builder.CreateFDiv(
+          one, builder.CreateFAdd(
+                   one, EmitExp(builder, builder.CreateFNeg(x), accuracy)));
+    }
+
+    llvm::Value *EmitErf(llvm::IRBuilder<> &builder, llvm::Value *x,
+                         MathAccuracy accuracy) {
+      llvm::Type *type = x->getType();
+      llvm::Value *one = ConstantValue(type, 1.0);
+      llvm::Value *ax = EmitAbs(builder, x);
+      llvm::Value *neg_x2 = builder.CreateFNeg(builder.CreateFMul(ax, ax));
+
+      llvm::Value *erfc;
+      if (accuracy == MATH_FAST) {
+        // Abramowitz and Stegun 7.1.26, 1.5e-7 absolute error
+        llvm::Value *t = builder.CreateFDiv(
+            one, builder.CreateFAdd(
+                     one, builder.CreateFMul(ConstantValue(type, 0.3275911),
+                                             ax)));
+        llvm::Value *p = builder.CreateFMul(
+            t, EmitPolynomial(builder, t,
+                              {1.061405429, -1.453152027, 1.421413741,
+                               -0.284496736, 0.254829592}));
+        erfc = builder.CreateFMul(p, EmitExp(builder, neg_x2, accuracy));
+      } else {
+        // erfc|x| = t e^(-x^2 + P(t)) with t = 1 / (1 + |x|/2), from
+        // Numerical Recipes
+        llvm::Value *t = builder.CreateFDiv(
+            one, builder.CreateFAdd(
+                     one, builder.CreateFMul(ConstantValue(type, 0.5), ax)));
+        llvm::Value *p = EmitPolynomial(
+            builder, t,
+            {0.17087277, -0.82215223, 1.48851587, -1.13520398, 0.27886807,
+             -0.18628806, 0.09678418, 0.37409196, 1.00002368, -1.26551223});
+        erfc = builder.CreateFMul(
+            t, EmitExp(builder, builder.CreateFAdd(neg_x2, p), accuracy));
+      }
+      llvm::Value *result =
+          EmitCopySign(builder, builder.CreateFSub(one, erfc), x);
+
+      // 1 - erfc loses the relative accuracy near 0
+      int terms = IsDouble(x) ? 12 : 7;
+      if (accuracy == MATH_FAST)
+        terms = IsDouble(x) ? 8 : 5;
+      llvm::Value *series = builder.CreateFMul(
+          x, EmitPolynomial(builder, builder.CreateFMul(x, x),
+                            ErfCoefficients(terms)));
+      return builder.CreateSelect(
+          builder.CreateFCmpOLT(ax, ConstantValue(type, 0.5)), series,
+          result);
+    }
+
+    llvm::Value *EmitGelu(llvm::IRBuilder<> &builder, llvm::Value *x,
+                          MathAccuracy accuracy) {
+      llvm::Type *type = x->getType();
+      llvm::Value *erf = EmitErf(
+          builder, builder.CreateFMul(x, ConstantValue(type, M_SQRT1_2)),
+          accuracy);
+      return builder.CreateFMul(
+          builder.CreateFMul(x, ConstantValue(type, 0.5)),
+          builder.CreateFAdd(ConstantValue(type, 1.0), erf));
+    }
+  }
+}
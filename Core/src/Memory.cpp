@@ -0,0 +1,136 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "Memory.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+#include "Codegen.hpp"
+#include "Symbol.hpp"
+
+namespace {
+  // A run of bytes in the workspace and the steps it's in use for. It
+  // holds one symbol, or a series of them each written in place over the
+  // one before.
+  struct Block {
+    uint64_t size;
+    uint64_t first, last;
+    // The symbol in it now, which is the only one an in-place write can
+    // take it over from
+    Hobbit::core::Symbol *owner;
+    uint64_t offset;
+  };
+
+  bool Planned(Hobbit::core::Symbol *sym) {
+    return sym->buffer == nullptr && !sym->is_arg && !sym->IsSparse();
+  }
+
+  uint64_t Align(uint64_t bytes) {
+    const uint64_t a = Hobbit::core::kWorkspaceAlignment;
+    return (bytes + a - 1) / a * a;
+  }
+}
+
+Hobbit::core::MemoryPlan
+Hobbit::core::PlanMemory(const std::vector<MemoryStep> &steps) {
+  // Lifetimes, in steps
+  std::map<Symbol *, std::pair<uint64_t, uint64_t>> life;
+  for (uint64_t s = 0; s < steps.size(); s++) {
+    for (auto *syms : {&steps[s].reads, &steps[s].writes}) {
+      for (auto &sym : *syms) {
+        if (!Planned(sym))
+          continue;
+        if (life.count(sym) == 0)
+          life[sym].first = s;
+        life[sym].second = s;
+      }
+    }
+  }
+
+  // Blocks are created in the order symbols first show up, so the plan
+  // doesn't depend on where the symbols happen to be allocated
+  std::vector<Block> blocks;
+  std::map<Symbol *, uint64_t> block_of;
+  for (uint64_t s = 0; s < steps.size(); s++) {
+    for (auto &pair : steps[s].in_place) {
+      Symbol *output = pair.first, *input = pair.second;
+      if (!Planned(output) || !Planned(input) || block_of.count(output) ||
+          block_of.count(input) == 0 || life[input].second != s)
+        continue;
+      Block &block = blocks[block_of[input]];
+      if (block.owner != input || block.size != Align(BufferBytes(output)))
+        continue;
+      block.owner = output;
+      block.last = life[output].second;
+      block_of[output] = block_of[input];
+    }
+
+    for (auto *syms : {&steps[s].reads, &steps[s].writes}) {
+      for (auto &sym : *syms) {
+        if (!Planned(sym) || block_of.count(sym))
+          continue;
+        block_of[sym] = blocks.size();
+        blocks.push_back({Align(BufferBytes(sym)), life[sym].first,
+                          life[sym].second, sym, 0});
+      }
+    }
+  }
+
+  std::vector<uint64_t> order(blocks.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) {
+    return blocks[a].size > blocks[b].size;
+  });
+
+  MemoryPlan plan;
+  std::vector<uint64_t> placed;
+  for (auto &b : order) {
+    Block &block = blocks[b];
+
+    // Byte ranges of everything placed so far that's live at the same time
+    std::vector<std::pair<uint64_t, uint64_t>> taken;
+    for (auto &p : placed) {
+      const Block &other = blocks[p];
+      if (other.first <= block.last && block.first <= other.last)
+        taken.push_back({other.offset, other.offset + other.size});
+    }
+    std::sort(taken.begin(), taken.end());
+
+    // The first gap it fits in
+    uint64_t offset = 0;
+    for (auto &range : taken) {
+      if (offset + block.size <= range.first)
+        break;
+      offset = std::max(offset, range.second);
+    }
+
+    block.offset = offset;
+    plan.size = std::max(plan.size, offset + block.size);
+    placed.push_back(b);
+  }
+
+  for (auto &entry : block_of)
+    plan.offsets[entry.first] = blocks[entry.second].offset;
+
+  return plan;
+}
@@ -34,9 +34,11 @@
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
 
+#include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 
+#include "Codegen.hpp"
 #include "Module.hpp"
 #include "Symbol.hpp"
 #include "Tensor.hpp"
@@ -49,18 +51,26 @@ Hobbit::Module::Module(const std::string &name, llvm::LLVMContext &ctx)
       module_(llvm::make_unique<llvm::Module>(name, ctx)) {}
 
 llvm::Function *Hobbit::Module::GetFunction(const std::string &name,
-                                            const std::vector<Tensor *> &args) {
+                                            const std::vector<Tensor *> &args,
+                                            bool workspace) {
   std::vector<llvm::Type *> arg_types;
   for (auto &arg : args) {
     if (arg->GetBuffer() != nullptr)
       continue;
     arg_types.push_back(arg->GetType());
   }
+  if (workspace)
+    arg_types.push_back(llvm::Type::getInt8PtrTy(*ctx_));
 
   llvm::FunctionType *ft =
       llvm::FunctionType::get(llvm::Type::getVoidTy(*ctx_), arg_types, false);
   llvm::Function *out =
       llvm::cast<llvm::Function>(module_->getOrInsertFunction(name, ft));
+  // What the emitters check with core::HasCPUFeature(llvm::Function *)
+  if (TargetsHost()) {
+    out->addFnAttr("target-cpu", cpu_);
+    out->addFnAttr("target-features", FeatureString());
+  }
   llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
       *ctx_, "hobbit." + name_ + "." + name + ".entry", out);
 
@@ -79,75 +89,22 @@ llvm::Function *Hobbit::Module::GetFunction(const std::string &name,
     args[idx]->GetBuffer() = &(*iter++);
     idx++;
   }
+  if (workspace)
+    std::prev(out->arg_end())->setName(core::kWorkspaceArgName);
 
-  std::vector<llvm::Constant *> buffer_constants;
   for (auto &c : constants) {
-
     llvm::Type *c_type = c->GetType();
     if (c_type->isPointerTy()) {
       c_type = c_type->getPointerElementType();
       c->GetSymbol()->type = c_type;
     }
 
-    if (c_type->isFloatingPointTy()) {
-      if (c_type->isFloatTy()) {
-        float *buf = (float *)c->GetBuffer();
-        for (uint64_t i = 0; i < c->GetShape().GetSize(); i++) {
-          buffer_constants.push_back(
-              llvm::ConstantFP::get(c_type, (double)buf[i]));
-        }
-      }
-      if (c_type->isDoubleTy()) {
-        double *buf = (double *)c->GetBuffer();
-        for (uint64_t i = 0; i < c->GetShape().GetSize(); i++) {
-          buffer_constants.push_back(llvm::ConstantFP::get(c_type, buf[i]));
-        }
-      }
-    } else if (c_type->isIntegerTy(64)) {
-      uint64_t *buf = (uint64_t *)c->GetBuffer();
-      for (uint64_t i = 0; i < c->GetShape().GetSize(); i++) {
-        buffer_constants.push_back(
-            llvm::ConstantInt::get(c_type, buf[i], true));
-      }
-    } else if (c_type->isIntegerTy(32)) {
-      uint32_t *buf = (uint32_t *)c->GetBuffer();
-      for (uint64_t i = 0; i < c->GetShape().GetSize(); i++) {
-        buffer_constants.push_back(
-            llvm::ConstantInt::get(c_type, (uint64_t)buf[i], true));
-      }
-    } else if (c_type->isIntegerTy(16)) {
-      uint16_t *buf = (uint16_t *)c->GetBuffer();
-      for (uint64_t i = 0; i < c->GetShape().GetSize(); i++) {
-        buffer_constants.push_back(
-            llvm::ConstantInt::get(c_type, (uint64_t)buf[i], true));
-      }
-    } else if (c_type->isIntegerTy(8)) {
-      uint8_t *buf = (uint8_t *)c->GetBuffer();
-      for (uint64_t i = 0; i < c->GetShape().GetSize(); i++) {
-        buffer_constants.push_back(
-            llvm::ConstantInt::get(c_type, (uint64_t)buf[i], true));
-      }
-    } else if (c_type->isIntegerTy(1)) {
-      bool *buf = (bool *)c->GetBuffer();
-      for (uint64_t i = 0; i < c->GetShape().GetSize(); i++) {
-        buffer_constants.push_back(
-            llvm::ConstantInt::get(c_type, (uint64_t)buf[i], true));
-      }
-    }
-
-    llvm::ArrayType *arr_type =
-        llvm::ArrayType::get(c_type, buffer_constants.size());
-
-    c->GetBuffer() = llvm::ConstantArray::get(arr_type, buffer_constants);
-    buffer_constants.clear();
-
-    //    llvm::IRBuilder<> builder(entryBB);
-    //    llvm::Value *arr_alloca = builder.CreateAlloca(arr_type,
-    //    builder.getInt64(1));
-    //    builder.CreateAlignedStore(const_array, arr_alloca, 32);
-    //    c->GetBuffer() =
-    //    builder.CreateAlignedLoad(builder.CreateGEP(arr_alloca,
-    //    builder.getInt64(0)), 32);
+    // Bit-packed constants are already packed, one word per element
+    llvm::Constant *array = core::HostConstant(
+        c_type, core::BufferSize(c->GetSymbol()), c->GetBuffer());
+    if (array == nullptr)
+      throw std::runtime_error("Unsupported constant type!");
+    c->GetBuffer() = array;
   }
 
   return out;
@@ -165,7 +122,7 @@ void Hobbit::Module::FinalizeFunction(llvm::Function *f) {
 
   for (llvm::Function::iterator bb = f->begin(); bb != f->end(); ++bb) {
     llvm::BasicBlock *BB = &(*bb);
-    if (llvm::dyn_cast<llvm::BranchInst>(--(BB->end())))
+    if (BB->getTerminator() != nullptr)
       continue;
     builder.SetInsertPoint(BB);
     builder.CreateBr(&(*(++bb)));
@@ -191,13 +148,23 @@ void Hobbit::Module::FinalizeModule(unsigned int opt_level,
   llvm::TargetOptions options;
   auto RM = llvm::Optional<llvm::Reloc::Model>();
 
-  llvm::TargetMachine *target_machine =
-      target->createTargetMachine(target_triple, cpu, features, options, RM);
+  std::string target_cpu = cpu, target_features = features;
+  if (TargetsHost()) {
+    target_cpu = cpu_;
+    target_features = FeatureString();
+  }
+
+  llvm::TargetMachine *target_machine = target->createTargetMachine(
+      target_triple, target_cpu, target_features, options, RM);
 
   module_->setDataLayout(target_machine->createDataLayout());
   module_->setTargetTriple(target_triple);
 
   llvm::legacy::PassManager PM;
+  // Without the target's cost model the vectorizers assume there are no
+  // vector registers at all
+  PM.add(llvm::createTargetTransformInfoWrapperPass(
+      target_machine->getTargetIRAnalysis()));
   llvm::PassManagerBuilder PMBuilder;
 
   PMBuilder.OptLevel = opt_level;
@@ -220,8 +187,43 @@ void *Hobbit::Module::GetFunctionPtr(const std::string &name) {
   llvm::EngineBuilder engineBuilder(std::move(module_));
   engineBuilder.setErrorStr(&error_str);
   engineBuilder.setEngineKind(llvm::EngineKind::JIT);
-  engineBuilder.setMCPU("x86-64");
+  if (TargetsHost()) {
+    std::vector<std::string> attrs;
+    for (auto &feature : cpu_features_)
+      attrs.push_back((feature.second ? "+" : "-") + feature.first);
+    engineBuilder.setMCPU(cpu_);
+    engineBuilder.setMAttrs(attrs);
+  } else {
+    engineBuilder.setMCPU("x86-64");
+  }
   llvm::ExecutionEngine *engine = engineBuilder.create();
 
   return (void *)engine->getFunctionAddress(name);
 }
+
+void Hobbit::Module::TargetHost() {
+  cpu_ = llvm::sys::getHostCPUName().str();
+  cpu_features_.clear();
+  llvm::StringMap<bool> features;
+  if (llvm::sys::getHostCPUFeatures(features)) {
+    for (auto &feature : features)
+      cpu_features_[feature.getKey().str()] = feature.getValue();
+  }
+}
+
+bool Hobbit::Module::TargetsHost() const { return !cpu_.empty(); }
+
+bool Hobbit::Module::HasCPUFeature(const std::string &feature) const {
+  auto found = cpu_features_.find(feature);
+  return found != cpu_features_.end() && found->second;
+}
+
+std::string Hobbit::Module::FeatureString() const {
+  std::string features;
+  for (auto &feature : cpu_features_) {
+    if (!features.empty())
+      features += ",";
+    features += (feature.second ? "+" : "-") + feature.first;
+  }
+  return features;
+}
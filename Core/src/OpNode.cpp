@@ -22,130 +22,159 @@
 
 #include "OpNode.hpp"
 
+#include "Codegen.hpp"
+#include "Kernels.hpp"
+
+namespace {
+  // The output type of Sdot and Gemm, the input's unless half or bfloat16
+  // inputs are asked to keep their float result
+  llvm::Type *OutputType(Hobbit::core::Symbol *sym,
+                         const Hobbit::OpParams &params) {
+    llvm::Type *type = sym->type;
+    llvm::Type *elt_type = Hobbit::core::ElementType(sym);
+    if (!params.float_output ||
+        Hobbit::core::ComputeType(elt_type) == elt_type)
+      return type;
+    llvm::Type *f32 = llvm::Type::getFloatTy(type->getContext());
+    return type->isPointerTy() ? f32->getPointerTo() : f32;
+  }
+}
+
 Hobbit::core::OpNode::OpNode(const std::initializer_list<Symbol *> &args,
                              const std::string &node_name)
-    : args_(args), name_(node_name) {}
+    : args_(args), name_(node_name), num_inputs_(args_.size()) {}
 
 Hobbit::core::OpNode::OpNode(std::vector<Symbol *> args,
                              const std::string &node_name)
-    : args_(std::move(args)), name_(node_name) {}
+    : args_(std::move(args)), name_(node_name), num_inputs_(args_.size()) {}
 
 Hobbit::Tensor *Hobbit::core::Alloca::GetOutput() {
   return new Tensor(args_[0]);
 }
 
+// Function::Emit has normally placed the symbol in the workspace by now, in
+// which case there's nothing left to allocate
 llvm::Value *Hobbit::core::Alloca::Emit(llvm::Function *func) {
-  llvm::BasicBlock *BB = &func->getEntryBlock();
-
-  llvm::IRBuilder<> builder(BB);
-
-  llvm::Type *arg_type = args_[0]->type;
-  if (arg_type->isPointerTy()) {
-    arg_type = arg_type->getPointerElementType();
-  }
-
-  llvm::Type *arr_type =
-      llvm::ArrayType::get(arg_type, args_[0]->shape.GetSize());
-
-  llvm::AllocaInst *output_alloca =
-      builder.CreateAlloca(arr_type, builder.getInt64(1), "hobbit.alloca");
-  output_alloca->setAlignment(32);
-
-  return output_alloca;
+  llvm::IRBuilder<> builder(&func->getEntryBlock());
+  return BufferPointer(builder, args_[0]);
 }
 
 Hobbit::Tensor *Hobbit::core::Sdot::GetOutput() {
-  Tensor *output_tensor =
-      Variable::Create(args_[0]->parent_func, args_[0]->type, Shape(1, 1, 1));
+  Tensor *output_tensor = Variable::Create(
+      args_[0]->parent_func, OutputType(args_[0], params_), Shape(1, 1, 1));
 
   args_.push_back(output_tensor->GetSymbol());
 
   return output_tensor;
 }
 
-// TODO: emit only kernel, write pass that sets up looping
+// Integer sums, and FP sums the function's FPPolicy lets us reassociate,
+// are spread over independent vector accumulators (see EmitDot) so the
+// loop runs at load throughput instead of at the latency of one add chain.
+// Strict FP keeps the sequential order. Half inputs are widened as they're
+// loaded and everything accumulates in float. The same goes for bfloat16.
 llvm::Value *Hobbit::core::Sdot::Emit(llvm::Function *func) {
   llvm::BasicBlock *entryBB =
       llvm::BasicBlock::Create(func->getContext(), "hobbit.sdot.entry", func);
-  llvm::BasicBlock *loopBB =
-      llvm::BasicBlock::Create(func->getContext(), "hobbit.sdot.loop", func);
-  llvm::BasicBlock *exitBB =
-      llvm::BasicBlock::Create(func->getContext(), "hobbit.sdot.exit", func);
 
   llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+  const FPPolicy &policy = args_[0]->parent_func->GetFPPolicy();
 
-  llvm::Type *arg_type = args_[0]->type;
-  uint64_t vector_size = args_[0]->shape.GetSize();
-  if (arg_type->isPointerTy()) {
-    arg_type = arg_type->getPointerElementType();
-  }
-
-  llvm::Value *zero = builder.CreateBitCast(builder.getInt64(0), arg_type);
-  llvm::Value *end_size = builder.getInt64(vector_size);
-
-  llvm::Value *lhs = (llvm::Value *)args_[0]->buffer;
-  llvm::Value *rhs = (llvm::Value *)args_[1]->buffer;
-  llvm::Value *output = (llvm::Value *)args_[2]->buffer;
-
-  builder.CreateBr(loopBB);
-
-  builder.SetInsertPoint(loopBB);
-
-  llvm::PHINode *idx_var =
-      builder.CreatePHI(builder.getInt64Ty(), 2, "hobbit.sdot.idx");
-  llvm::PHINode *accumulator =
-      builder.CreatePHI(arg_type, 2, "hobbit.sdot.accumulator");
-  idx_var->addIncoming(builder.getInt64(0), entryBB);
-  accumulator->addIncoming(zero, entryBB);
+  llvm::Value *lhs = BufferPointer(builder, args_[0]);
+  llvm::Value *rhs = BufferPointer(builder, args_[1]);
+  llvm::Value *output = BufferPointer(builder, args_[2]);
 
-  llvm::Value *lhs_elt, *rhs_elt;
-  if (lhs->getType()->isArrayTy()) {
-    lhs_elt = builder.CreateExtractElement(lhs, idx_var);
-  } else {
-    lhs_elt = builder.CreateAlignedLoad(builder.CreateGEP(lhs, idx_var), 32);
-  }
-
-  if (rhs->getType()->isArrayTy()) {
-    rhs_elt = builder.CreateExtractElement(rhs, idx_var);
-  } else {
-    rhs_elt = builder.CreateAlignedLoad(builder.CreateGEP(rhs, idx_var), 32);
-  }
+  EmitStoreCompute(builder,
+                   EmitDot(builder, lhs, rhs, args_[0]->shape.GetSize(),
+                           policy.reassociate, policy.fma),
+                   output, builder.getInt64(0));
 
-  llvm::Value *accumulator_next;
-  if (arg_type->isIntegerTy()) {
-    accumulator_next =
-        builder.CreateAdd(accumulator, builder.CreateMul(lhs_elt, rhs_elt));
-  }
-  if (arg_type->isFloatingPointTy()) {
-    accumulator_next =
-        builder.CreateFAdd(accumulator, builder.CreateFMul(lhs_elt, rhs_elt));
-  }
+  return output;
+}
 
-  llvm::Value *next_idx_var = builder.CreateAdd(idx_var, builder.getInt64(1));
+void Hobbit::core::Gemm::CheckArgs() {
+  if (args_.size() != 2)
+    throw IncorrectNumArgs("Gemm");
+
+  const Shape &lhs = args_[0]->shape;
+  const Shape &rhs = args_[1]->shape;
+  if (lhs.GetAxisSize(W) != rhs.GetAxisSize(H))
+    throw IncompatibleShapes("Gemm");
+  if (rhs.GetAxisSize(K) != 1 && rhs.GetAxisSize(K) != lhs.GetAxisSize(K))
+    throw IncompatibleShapes("Gemm");
+  if (ElementType(args_[0]) != ElementType(args_[1]))
+    throw IncompatibleTypes("Gemm");
+}
 
-  idx_var->addIncoming(next_idx_var, loopBB);
-  accumulator->addIncoming(accumulator_next, loopBB);
+Hobbit::Tensor *Hobbit::core::Gemm::GetOutput() {
+  const Shape &lhs = args_[0]->shape;
+  const Shape &rhs = args_[1]->shape;
 
-  llvm::SmallVector<llvm::Metadata *, 4> Args;
-  // Reserve operand 0 for loop id self reference.
-  auto TempNode = llvm::MDNode::getTemporary(builder.getContext(), llvm::None);
-  Args.push_back(TempNode.get());
+  Tensor *output_tensor = Variable::Create(
+      args_[0]->parent_func, OutputType(args_[0], params_),
+      Shape(lhs.GetAxisSize(K), lhs.GetAxisSize(H), rhs.GetAxisSize(W)));
 
-  llvm::Metadata *vecMD[] = {llvm::MDString::get(builder.getContext(), "llvm.loop.vectorize.width"),
-                      llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(
-                              llvm::Type::getInt32Ty(builder.getContext()), 8))};
-  Args.push_back(llvm::MDNode::get(builder.getContext(), vecMD));
+  args_.push_back(output_tensor->GetSymbol());
 
-  llvm::MDNode *LoopID = llvm::MDNode::get(builder.getContext(), Args);
-  LoopID->replaceOperandWith(0, LoopID);
+  return output_tensor;
+}
 
-  llvm::Value *end_cond = builder.CreateICmpEQ(next_idx_var, end_size);
-  // TODO: add metadata here (loop unroll/vectorize)
-  llvm::BranchInst *br = builder.CreateCondBr(end_cond, exitBB, loopBB);
-  br->setMetadata("llvm.loop", LoopID);
+llvm::Value *Hobbit::core::Gemm::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB =
+      llvm::BasicBlock::Create(func->getContext(), "hobbit.gemm.entry", func);
 
-  builder.SetInsertPoint(exitBB);
-  builder.CreateAlignedStore(accumulator_next, output, 32);
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+
+  const Shape &lhs_shape = args_[0]->shape;
+  const Shape &rhs_shape = args_[1]->shape;
+  const uint64_t batch = lhs_shape.GetAxisSize(K);
+  const uint64_t m = lhs_shape.GetAxisSize(H);
+  const uint64_t k = lhs_shape.GetAxisSize(W);
+  const uint64_t n = rhs_shape.GetAxisSize(W);
+  const bool rhs_batched = rhs_shape.GetAxisSize(K) != 1;
+
+  llvm::Value *lhs = BufferPointer(builder, args_[0]);
+  llvm::Value *rhs = BufferPointer(builder, args_[1]);
+  // With an epilogue, the product itself never reaches memory
+  llvm::Value *output = BufferPointer(
+      builder,
+      epilogue_.empty() ? args_[2] : epilogue_.back()->GetArgs().back());
+
+  EmitLoop(builder, "hobbit.gemm.batch", builder.getInt64(0),
+           builder.getInt64(batch), 1, [&](llvm::Value *b) {
+    GemmOperands ops;
+    ops.a =
+        builder.CreateGEP(lhs, builder.CreateMul(b, builder.getInt64(m * k)));
+    ops.b = rhs;
+    if (rhs_batched)
+      ops.b =
+          builder.CreateGEP(rhs, builder.CreateMul(b, builder.getInt64(k * n)));
+    ops.c = builder.CreateGEP(output,
+                              builder.CreateMul(b, builder.getInt64(m * n)));
+    ops.m = m;
+    ops.n = n;
+    ops.k = k;
+    ops.lda = k;
+    ops.ldb = n;
+    ops.ldc = n;
+    if (!epilogue_.empty()) {
+      ops.epilogue = [&, b](llvm::IRBuilder<> &builder, llvm::Value *val,
+                            llvm::Value *row, llvm::Value *col) {
+        row = builder.CreateAdd(builder.CreateMul(b, builder.getInt64(m)), row);
+        return Elementwise::EmitEpilogue(builder, epilogue_, args_[2], val, row,
+                                         col);
+      };
+    }
+
+    EmitGemm(builder, ops);
+  });
 
   return output;
 }
+
+bool Hobbit::core::Gemm::SetEpilogue(const std::vector<Elementwise *> &ops) {
+  epilogue_ = ops;
+  return true;
+}
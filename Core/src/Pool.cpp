@@ -0,0 +1,231 @@
+//
+// Created by Aman LaChapelle on 3/30/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "Codegen.hpp"
+
+void Hobbit::core::Pool::CheckArgs() {
+  if (args_.size() != 1)
+    throw IncorrectNumArgs("Pool");
+  if (IsBit(ElementType(args_[0])))
+    throw IncompatibleTypes("Pool");
+
+  const Shape &input = args_[0]->shape;
+  if (params_.pool_h == 0 || params_.pool_w == 0 || params_.stride_h == 0 ||
+      params_.stride_w == 0)
+    throw IncompatibleShapes("Pool");
+  // Every window has to see at least one real element
+  if (params_.pad_h >= params_.pool_h || params_.pad_w >= params_.pool_w)
+    throw IncompatibleShapes("Pool");
+
+  const uint64_t h = input.GetAxisSize(H) + 2 * params_.pad_h;
+  const uint64_t w = input.GetAxisSize(W) + 2 * params_.pad_w;
+  if (h < params_.pool_h || w < params_.pool_w)
+    throw IncompatibleShapes("Pool");
+
+  h_out_ = (h - params_.pool_h) / params_.stride_h + 1;
+  w_out_ = (w - params_.pool_w) / params_.stride_w + 1;
+}
+
+Hobbit::Tensor *Hobbit::core::Pool::GetOutput() {
+  Tensor *output_tensor =
+      Variable::Create(args_[0]->parent_func, args_[0]->type,
+                       Shape(args_[0]->shape.GetAxisSize(K), h_out_, w_out_));
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+llvm::Value *Hobbit::core::Pool::Combine(llvm::IRBuilder<> &builder,
+                                         llvm::Value *acc, llvm::Value *val) {
+  if (op_ == POOL_MAX)
+    return EmitMax(builder, acc, val);
+  return EmitAdd(builder, acc, val);
+}
+
+llvm::Constant *Hobbit::core::Pool::Counts(llvm::Type *type, uint64_t size,
+                                           uint64_t out_size, uint64_t window,
+                                           uint64_t stride, uint64_t pad) {
+  std::vector<llvm::Constant *> counts;
+  for (uint64_t o = 0; o < out_size; o++) {
+    const int64_t start = (int64_t)(o * stride) - (int64_t)pad;
+    const int64_t end = std::min(start + (int64_t)window, (int64_t)size);
+    counts.push_back(ConstantValue(type, end - std::max(start, (int64_t)0)));
+  }
+  return llvm::ConstantArray::get(llvm::ArrayType::get(type, out_size),
+                                  counts);
+}
+
+// Pooling is separable, so each output row is done in two steps that both
+// run along contiguous memory:
+//  1. The window's input rows are folded into one padded row buffer, so
+//     each input element is loaded pool_h / stride_h times rather than
+//     pool_h * pool_w / (stride_h * stride_w) times.
+//  2. The window slides along that buffer, which stays in L1. With
+//     stride_w > 1 every window offset is one wide load and a shuffle that
+//     keeps every stride_w-th lane.
+llvm::Value *Hobbit::core::Pool::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB =
+      llvm::BasicBlock::Create(func->getContext(), "hobbit.pool.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+
+  llvm::Value *input = BufferPointer(builder, args_[0]);
+  llvm::Value *output = BufferPointer(builder, args_[1]);
+
+  const Shape &shape = args_[0]->shape;
+  const uint64_t k = shape.GetAxisSize(K);
+  const uint64_t h = shape.GetAxisSize(H);
+  const uint64_t w = shape.GetAxisSize(W);
+  const uint64_t pool_h = params_.pool_h, pool_w = params_.pool_w;
+  const uint64_t stride_h = params_.stride_h, stride_w = params_.stride_w;
+  const uint64_t pad_h = params_.pad_h, pad_w = params_.pad_w;
+  const bool avg = op_ == POOL_AVG;
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  const uint64_t vw = VectorWidth(elt_type);
+
+  // The strided loads in step 2 read up to stride_w - 1 elements past the
+  // last window, those lanes get shuffled away
+  const uint64_t row_size = w + 2 * pad_w;
+  llvm::Value *row =
+      EntryAlloca(func, elt_type, row_size + stride_w, "hobbit.pool.row");
+
+  llvm::Value *identity =
+      avg ? llvm::Constant::getNullValue(elt_type)
+          : ConstantValue(elt_type, -std::numeric_limits<double>::infinity());
+  for (uint64_t i = 0; i < pad_w; i++) {
+    builder.CreateStore(identity, builder.CreateGEP(row, builder.getInt64(i)));
+    builder.CreateStore(
+        identity, builder.CreateGEP(row, builder.getInt64(pad_w + w + i)));
+  }
+
+  // Padding changes the divisor near the edges
+  llvm::Value *row_counts = nullptr, *col_counts = nullptr;
+  if (avg && pad_h > 0)
+    row_counts = GlobalConstant(
+        func->getParent(),
+        Counts(elt_type, h, h_out_, pool_h, stride_h, pad_h));
+  if (avg && pad_w > 0)
+    col_counts = GlobalConstant(
+        func->getParent(),
+        Counts(elt_type, w, w_out_, pool_w, stride_w, pad_w));
+
+  EmitLoop(builder, "hobbit.pool.k", builder.getInt64(0), builder.getInt64(k),
+           1, [&](llvm::Value *kk) {
+    llvm::Value *in_plane = builder.CreateGEP(
+        input, builder.CreateMul(kk, builder.getInt64(h * w)));
+    llvm::Value *out_plane = builder.CreateGEP(
+        output, builder.CreateMul(kk, builder.getInt64(h_out_ * w_out_)));
+
+    EmitLoop(builder, "hobbit.pool.h", builder.getInt64(0),
+             builder.getInt64(h_out_), 1, [&](llvm::Value *oh) {
+      // Rows of the window, clamped into the input. A repeated row doesn't
+      // change a max, and the average masks them out.
+      llvm::Value *top = builder.CreateSub(
+          builder.CreateMul(oh, builder.getInt64(stride_h)),
+          builder.getInt64(pad_h));
+      std::vector<llvm::Value *> in_rows, valid;
+      for (uint64_t r = 0; r < pool_h; r++) {
+        llvm::Value *ih = builder.CreateAdd(top, builder.getInt64(r));
+        llvm::Value *clamped =
+            EmitMin(builder, EmitMax(builder, ih, builder.getInt64(0)),
+                    builder.getInt64(h - 1));
+        in_rows.push_back(builder.CreateGEP(
+            in_plane, builder.CreateMul(clamped, builder.getInt64(w))));
+        valid.push_back(builder.CreateICmpEQ(ih, clamped));
+      }
+
+      EmitVectorLoop(builder, "hobbit.pool.rows", w, vw,
+                     [&](llvm::Value *iw, bool vector) {
+        const unsigned lanes = vector ? vw : 1;
+        llvm::Value *acc = nullptr;
+        for (uint64_t r = 0; r < pool_h; r++) {
+          llvm::Value *val = EmitLoadLanes(builder, in_rows[r], iw, lanes);
+          if (avg && pad_h > 0) {
+            llvm::Value *keep =
+                vector ? builder.CreateVectorSplat(vw, valid[r]) : valid[r];
+            val = builder.CreateSelect(
+                keep, val, llvm::Constant::getNullValue(val->getType()));
+          }
+          acc = acc == nullptr ? val : Combine(builder, acc, val);
+        }
+        EmitStoreLanes(builder, acc, row,
+                       builder.CreateAdd(iw, builder.getInt64(pad_w)));
+      });
+
+      llvm::Value *out_row = builder.CreateGEP(
+          out_plane, builder.CreateMul(oh, builder.getInt64(w_out_)));
+      llvm::Value *row_count = ConstantValue(elt_type, pool_h);
+      if (row_counts)
+        row_count = builder.CreateLoad(builder.CreateGEP(row_counts, oh));
+
+      EmitVectorLoop(builder, "hobbit.pool.cols", w_out_, vw,
+                     [&](llvm::Value *ow, bool vector) {
+        const unsigned lanes = vector ? vw : 1;
+        llvm::Value *start =
+            builder.CreateMul(ow, builder.getInt64(stride_w));
+
+        llvm::SmallVector<uint32_t, 16> every_stride;
+        for (uint64_t l = 0; l < vw; l++)
+          every_stride.push_back(l * stride_w);
+
+        llvm::Value *acc = nullptr;
+        for (uint64_t j = 0; j < pool_w; j++) {
+          llvm::Value *col = builder.CreateAdd(start, builder.getInt64(j));
+          llvm::Value *val;
+          if (!vector || stride_w == 1) {
+            val = EmitLoadLanes(builder, row, col, lanes);
+          } else {
+            llvm::Value *wide =
+                EmitLoadLanes(builder, row, col, vw * stride_w);
+            val = builder.CreateShuffleVector(
+                wide, llvm::UndefValue::get(wide->getType()), every_stride);
+          }
+          acc = acc == nullptr ? val : Combine(builder, acc, val);
+        }
+
+        if (avg) {
+          llvm::Value *count = vector
+                                   ? builder.CreateVectorSplat(vw, row_count)
+                                   : row_count;
+          if (col_counts)
+            count = EmitMul(builder, count,
+                            EmitLoadLanes(builder, col_counts, ow, lanes));
+          else
+            count = EmitMul(builder, count,
+                            ConstantValue(count->getType(), pool_w));
+          acc = EmitDiv(builder, acc, count);
+        }
+        EmitStoreLanes(builder, acc, out_row, ow);
+      });
+    });
+  });
+
+  return output;
+}
@@ -0,0 +1,523 @@
+//
+// Created by Aman LaChapelle on 4/1/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+
+#include <llvm/Config/llvm-config.h>
+
+#include "Codegen.hpp"
+
+namespace {
+  // int8 lanes per vector step, one 128-bit load (256 bits with VNNI)
+  const uint64_t kQDotLanes = 16;
+  const uint64_t kQDotVnniLanes = 32;
+  // rhs columns that share one pass over a lhs row
+  const uint64_t kQGemmColumns = 4;
+  // rhs columns transposed into the packing buffer at a time
+  const uint64_t kQGemmPanel = 64;
+
+  // The instructions the vector body of EmitDots is built around
+  enum class DotKind {
+    // Sign extend to i32, multiply and add neighbouring products. Runs
+    // anywhere; what it turns into is up to the backend.
+    Generic,
+    // vpmaddwd on lanes sign extended to i16 (AVX2)
+    Pmaddwd,
+    // vpdpbusd (AVX512-VNNI), four u8 * s8 products into each i32 lane.
+    // lhs is biased by 128 to make it unsigned, which adds 128 * sum b to
+    // each dot product, so it needs the rhs row sums to take that off.
+    Vnni
+  };
+
+  // Only modules in host mode (Module::TargetHost) go past Generic
+  DotKind DotKindFor(Hobbit::core::Symbol *sym) {
+    using Hobbit::core::HasCPUFeature;
+    if (HasCPUFeature(sym, "avx512vnni") && HasCPUFeature(sym, "avx512vl"))
+      return DotKind::Vnni;
+    if (HasCPUFeature(sym, "avx2"))
+      return DotKind::Pmaddwd;
+    return DotKind::Generic;
+  }
+
+  bool IsInt8(Hobbit::core::Symbol *sym) {
+    return Hobbit::core::ElementType(sym)->isIntegerTy(8);
+  }
+
+  bool ValidQuant(const Hobbit::QuantParams &quant, uint64_t channels) {
+    auto valid = [&](uint64_t size) {
+      return size == 1 || size == channels;
+    };
+    return valid(quant.scale.size()) && valid(quant.zero_point.size());
+  }
+
+  llvm::Type *OutputType(llvm::LLVMContext &ctx,
+                         const Hobbit::OpParams &params) {
+    if (params.requantize)
+      return llvm::Type::getInt8PtrTy(ctx);
+    return llvm::Type::getInt32PtrTy(ctx);
+  }
+
+  // acc + the products of the int8 vectors a and b added in neighbouring
+  // groups, as a vector of kQDotLanes / 2 int32
+  llvm::Value *EmitDotStep(llvm::IRBuilder<> &builder, DotKind kind,
+                           llvm::Value *acc, llvm::Value *a, llvm::Value *b) {
+    llvm::Module *module = builder.GetInsertBlock()->getModule();
+    llvm::Type *acc_type = acc->getType();
+
+    if (kind == DotKind::Vnni) {
+      llvm::Value *a_u = builder.CreateXor(
+          a, llvm::ConstantInt::get(a->getType(), 0x80));
+      a_u = builder.CreateBitCast(a_u, acc_type);
+      b = builder.CreateBitCast(b, acc_type);
+#if LLVM_VERSION_MAJOR >= 7
+      llvm::Function *vpdpbusd = llvm::Intrinsic::getDeclaration(
+          module, llvm::Intrinsic::x86_avx512_vpdpbusd_256);
+      return builder.CreateCall(vpdpbusd, {acc, a_u, b});
+#else
+      llvm::Function *vpdpbusd = llvm::Intrinsic::getDeclaration(
+          module, llvm::Intrinsic::x86_avx512_mask_vpdpbusd_256);
+      return builder.CreateCall(vpdpbusd,
+                                {acc, a_u, b, builder.getInt8(0xff)});
+#endif
+    }
+
+    if (kind == DotKind::Pmaddwd) {
+      llvm::Type *wide_type =
+          llvm::VectorType::get(builder.getInt16Ty(), kQDotLanes);
+      llvm::Function *pmaddwd = llvm::Intrinsic::getDeclaration(
+          module, llvm::Intrinsic::x86_avx2_pmadd_wd);
+      llvm::Value *pairs = builder.CreateCall(
+          pmaddwd, {builder.CreateSExt(a, wide_type),
+                    builder.CreateSExt(b, wide_type)});
+      return builder.CreateAdd(acc, pairs);
+    }
+
+    llvm::Type *wide_type =
+        llvm::VectorType::get(builder.getInt32Ty(), kQDotLanes);
+    llvm::SmallVector<uint32_t, 16> even, odd;
+    for (uint64_t i = 0; i < kQDotLanes / 2; i++) {
+      even.push_back(2 * i);
+      odd.push_back(2 * i + 1);
+    }
+    llvm::Value *prod = builder.CreateMul(builder.CreateSExt(a, wide_type),
+                                          builder.CreateSExt(b, wide_type));
+    llvm::Value *undef = llvm::UndefValue::get(wide_type);
+    llvm::Value *pairs =
+        builder.CreateAdd(builder.CreateShuffleVector(prod, undef, even),
+                          builder.CreateShuffleVector(prod, undef, odd));
+    return builder.CreateAdd(acc, pairs);
+  }
+
+  // Dot products of the int8 row a with each of rows, n elements long, in
+  // int32. row_sums (the int32 sum of each of rows) are only used, and
+  // only need to be passed, for DotKind::Vnni.
+  std::vector<llvm::Value *>
+  EmitDots(llvm::IRBuilder<> &builder, DotKind kind, llvm::Value *a,
+           const std::vector<llvm::Value *> &rows,
+           const std::vector<llvm::Value *> &row_sums, uint64_t n) {
+    using namespace Hobbit::core;
+    llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+    llvm::Type *i32 = builder.getInt32Ty();
+    const bool vnni = kind == DotKind::Vnni;
+    const uint64_t lanes = vnni ? kQDotVnniLanes : kQDotLanes;
+    llvm::Type *acc_type = llvm::VectorType::get(i32, kQDotLanes / 2);
+    const uint64_t count = rows.size();
+    const uint64_t n_vec = n - n % lanes;
+
+    llvm::Value *vec_acc =
+        EntryAlloca(func, acc_type, count, "hobbit.qdot.vacc");
+    llvm::Value *acc = EntryAlloca(func, i32, count, "hobbit.qdot.acc");
+    for (uint64_t r = 0; r < count; r++) {
+      builder.CreateStore(llvm::Constant::getNullValue(acc_type),
+                          builder.CreateGEP(vec_acc, builder.getInt64(r)));
+      builder.CreateStore(builder.getInt32(0),
+                          builder.CreateGEP(acc, builder.getInt64(r)));
+    }
+
+    EmitLoop(builder, "hobbit.qdot.vec", builder.getInt64(0),
+             builder.getInt64(n_vec), lanes, [&](llvm::Value *i) {
+      llvm::Value *a_val = EmitLoadLanes(builder, a, i, lanes);
+      for (uint64_t r = 0; r < count; r++) {
+        llvm::Value *b_val = EmitLoadLanes(builder, rows[r], i, lanes);
+        llvm::Value *ptr = builder.CreateGEP(vec_acc, builder.getInt64(r));
+        builder.CreateStore(EmitDotStep(builder, kind, builder.CreateLoad(ptr),
+                                        a_val, b_val),
+                            ptr);
+      }
+    });
+
+    // The tail keeps the bias on a, so the correction covers all of n
+    EmitLoop(builder, "hobbit.qdot.tail", builder.getInt64(n_vec),
+             builder.getInt64(n), 1, [&](llvm::Value *i) {
+      llvm::Value *a_val = builder.CreateLoad(builder.CreateGEP(a, i));
+      a_val = vnni ? builder.CreateZExt(
+                         builder.CreateXor(a_val, builder.getInt8(0x80)), i32)
+                   : builder.CreateSExt(a_val, i32);
+      for (uint64_t r = 0; r < count; r++) {
+        llvm::Value *b_val = builder.CreateSExt(
+            builder.CreateLoad(builder.CreateGEP(rows[r], i)), i32);
+        llvm::Value *ptr = builder.CreateGEP(acc, builder.getInt64(r));
+        builder.CreateStore(
+            builder.CreateAdd(builder.CreateLoad(ptr),
+                              builder.CreateMul(a_val, b_val)),
+            ptr);
+      }
+    });
+
+    std::vector<llvm::Value *> dots;
+    for (uint64_t r = 0; r < count; r++) {
+      llvm::Value *vec = builder.CreateLoad(
+          builder.CreateGEP(vec_acc, builder.getInt64(r)));
+      llvm::Value *dot = builder.CreateAdd(
+          EmitHorizontalAdd(builder, vec),
+          builder.CreateLoad(builder.CreateGEP(acc, builder.getInt64(r))));
+      if (vnni)
+        dot = builder.CreateSub(
+            dot, builder.CreateMul(builder.getInt32(128), row_sums[r]));
+      dots.push_back(dot);
+    }
+    return dots;
+  }
+
+  // Sum of n int8 values as int32
+  llvm::Value *EmitSum(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                       uint64_t n) {
+    using namespace Hobbit::core;
+    llvm::Function *func = builder.GetInsertBlock()->getParent();
+    llvm::Value *acc =
+        EntryAlloca(func, builder.getInt32Ty(), 1, "hobbit.qdot.sum");
+    builder.CreateStore(builder.getInt32(0), acc);
+    EmitLoop(builder, "hobbit.qdot.sum", builder.getInt64(0),
+             builder.getInt64(n), 1, [&](llvm::Value *i) {
+      llvm::Value *val = builder.CreateSExt(
+          builder.CreateLoad(builder.CreateGEP(ptr, i)), builder.getInt32Ty());
+      builder.CreateStore(builder.CreateAdd(builder.CreateLoad(acc), val), acc);
+    });
+    return builder.CreateLoad(acc);
+  }
+
+  // round(acc * multiplier) + zero_point, saturated to int8. The saturation
+  // happens in float: fptosi of anything outside int32 is poison, and a
+  // large multiplier gets there easily.
+  llvm::Value *EmitRequantize(llvm::IRBuilder<> &builder, llvm::Value *acc,
+                              llvm::Value *multiplier, int32_t zero_point) {
+    using namespace Hobbit::core;
+    llvm::Type *f32 = builder.getFloatTy();
+    llvm::Value *scaled =
+        builder.CreateFMul(builder.CreateSIToFP(acc, f32), multiplier);
+    scaled = EmitMin(
+        builder,
+        EmitMax(builder, scaled,
+                llvm::ConstantFP::get(f32, -128.0 - zero_point)),
+        llvm::ConstantFP::get(f32, 127.0 - zero_point));
+    llvm::Value *half = builder.CreateSelect(
+        builder.CreateFCmpOLT(scaled, llvm::ConstantFP::get(f32, 0.0)),
+        llvm::ConstantFP::get(f32, -0.5), llvm::ConstantFP::get(f32, 0.5));
+    llvm::Value *q = builder.CreateAdd(
+        builder.CreateFPToSI(builder.CreateFAdd(scaled, half),
+                             builder.getInt32Ty()),
+        builder.getInt32(zero_point));
+    return builder.CreateTrunc(q, builder.getInt8Ty());
+  }
+
+  // A per tensor or per channel quantity. Per channel values live in a
+  // constant table indexed by the output column.
+  template <typename T>
+  llvm::Value *EmitChannelValue(llvm::IRBuilder<> &builder,
+                                const std::vector<T> &values,
+                                llvm::Value *channel) {
+    llvm::Module *module = builder.GetInsertBlock()->getModule();
+    if (values.size() == 1)
+      return llvm::ConstantDataArray::get(module->getContext(), values)
+          ->getAggregateElement(0u);
+    llvm::Constant *table = Hobbit::core::GlobalConstant(
+        module, llvm::ConstantDataArray::get(module->getContext(), values));
+    return builder.CreateLoad(builder.CreateGEP(table, channel));
+  }
+
+  // sum (a - za)(b - zb) = sum ab - zb sum a - za sum b + n za zb
+  llvm::Value *EmitZeroPointCorrection(llvm::IRBuilder<> &builder,
+                                       llvm::Value *dot, llvm::Value *sum_a,
+                                       llvm::Value *sum_b, int32_t za,
+                                       llvm::Value *zb, uint64_t n) {
+    llvm::Value *result = dot;
+    if (sum_a != nullptr)
+      result = builder.CreateSub(result, builder.CreateMul(zb, sum_a));
+    if (za != 0) {
+      llvm::Value *za_val = builder.getInt32(za);
+      result = builder.CreateSub(result, builder.CreateMul(za_val, sum_b));
+      result = builder.CreateAdd(
+          result,
+          builder.CreateMul(builder.getInt32(n * za), zb));
+    }
+    return result;
+  }
+
+  // lhs scale * rhs scale / output scale, per output column
+  std::vector<float> Multipliers(const Hobbit::OpParams &params) {
+    std::vector<float> multipliers;
+    for (auto &rhs_scale : params.rhs_quant.scale)
+      multipliers.push_back(params.lhs_quant.scale[0] * rhs_scale /
+                            params.out_quant.scale[0]);
+    return multipliers;
+  }
+
+  bool AnyNonZero(const std::vector<int32_t> &values) {
+    return std::any_of(values.begin(), values.end(),
+                       [](int32_t v) { return v != 0; });
+  }
+}
+
+void Hobbit::core::QDot::CheckArgs() {
+  if (args_.size() != 2)
+    throw IncorrectNumArgs("QDot");
+  if (args_[0]->shape != args_[1]->shape)
+    throw IncompatibleShapes("QDot");
+  if (!IsInt8(args_[0]) || !IsInt8(args_[1]))
+    throw IncompatibleTypes("QDot");
+  if (!ValidQuant(params_.lhs_quant, 1) || !ValidQuant(params_.rhs_quant, 1) ||
+      !ValidQuant(params_.out_quant, 1))
+    throw IncompatibleShapes("QDot");
+}
+
+Hobbit::Tensor *Hobbit::core::QDot::GetOutput() {
+  Tensor *output_tensor = Variable::Create(
+      args_[0]->parent_func, OutputType(args_[0]->type->getContext(), params_),
+      Shape(1, 1, 1));
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+llvm::Value *Hobbit::core::QDot::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB =
+      llvm::BasicBlock::Create(func->getContext(), "hobbit.qdot.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+
+  llvm::Value *lhs = BufferPointer(builder, args_[0]);
+  llvm::Value *rhs = BufferPointer(builder, args_[1]);
+  llvm::Value *output = BufferPointer(builder, args_[2]);
+
+  const uint64_t n = args_[0]->shape.GetSize();
+  const int32_t za = params_.lhs_quant.zero_point[0];
+  const int32_t zb = params_.rhs_quant.zero_point[0];
+
+  const DotKind kind = DotKindFor(args_[0]);
+  llvm::Value *rhs_sum = za != 0 || kind == DotKind::Vnni
+                             ? EmitSum(builder, rhs, n)
+                             : nullptr;
+
+  llvm::Value *result = EmitDots(builder, kind, lhs, {rhs}, {rhs_sum}, n)[0];
+  result = EmitZeroPointCorrection(
+      builder, result, zb != 0 ? EmitSum(builder, lhs, n) : nullptr, rhs_sum,
+      za, builder.getInt32(zb), n);
+
+  if (params_.requantize)
+    result = EmitRequantize(
+        builder, result,
+        llvm::ConstantFP::get(builder.getFloatTy(), Multipliers(params_)[0]),
+        params_.out_quant.zero_point[0]);
+  builder.CreateStore(result, output);
+
+  return output;
+}
+
+void Hobbit::core::QGemm::CheckArgs() {
+  if (args_.size() != 2)
+    throw IncorrectNumArgs("QGemm");
+
+  const Shape &lhs = args_[0]->shape;
+  const Shape &rhs = args_[1]->shape;
+  if (lhs.GetAxisSize(W) != rhs.GetAxisSize(H))
+    throw IncompatibleShapes("QGemm");
+  if (rhs.GetAxisSize(K) != 1 && rhs.GetAxisSize(K) != lhs.GetAxisSize(K))
+    throw IncompatibleShapes("QGemm");
+  if (!IsInt8(args_[0]) || !IsInt8(args_[1]))
+    throw IncompatibleTypes("QGemm");
+  if (!ValidQuant(params_.lhs_quant, 1) ||
+      !ValidQuant(params_.rhs_quant, rhs.GetAxisSize(W)) ||
+      !ValidQuant(params_.out_quant, 1))
+    throw IncompatibleShapes("QGemm");
+}
+
+Hobbit::Tensor *Hobbit::core::QGemm::GetOutput() {
+  const Shape &lhs = args_[0]->shape;
+  const Shape &rhs = args_[1]->shape;
+
+  Tensor *output_tensor = Variable::Create(
+      args_[0]->parent_func, OutputType(args_[0]->type->getContext(), params_),
+      Shape(lhs.GetAxisSize(K), lhs.GetAxisSize(H), rhs.GetAxisSize(W)));
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+// Every batch goes a panel of kQGemmPanel rhs columns at a time. The panel
+// is transposed into a buffer so each output is a dot product of two
+// contiguous int8 rows, and kQGemmColumns of those share the loads of the
+// lhs row. The column sums for the zero point correction (and the VNNI
+// bias) fall out of the packing, the lhs row sums are computed once per batch.
+llvm::Value *Hobbit::core::QGemm::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB =
+      llvm::BasicBlock::Create(func->getContext(), "hobbit.qgemm.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+
+  const Shape &lhs_shape = args_[0]->shape;
+  const Shape &rhs_shape = args_[1]->shape;
+  const uint64_t batch = lhs_shape.GetAxisSize(K);
+  const uint64_t m = lhs_shape.GetAxisSize(H);
+  const uint64_t k = lhs_shape.GetAxisSize(W);
+  const uint64_t n = rhs_shape.GetAxisSize(W);
+  const bool rhs_batched = rhs_shape.GetAxisSize(K) != 1;
+
+  const int32_t za = params_.lhs_quant.zero_point[0];
+  const bool rhs_zero_point = AnyNonZero(params_.rhs_quant.zero_point);
+  const std::vector<float> multipliers = Multipliers(params_);
+  const DotKind kind = DotKindFor(args_[0]);
+
+  llvm::Value *lhs = BufferPointer(builder, args_[0]);
+  llvm::Value *rhs = BufferPointer(builder, args_[1]);
+  llvm::Value *output = BufferPointer(builder, args_[2]);
+
+  llvm::Type *i32 = builder.getInt32Ty();
+  llvm::Value *packed = EntryAlloca(func, builder.getInt8Ty(),
+                                    kQGemmPanel * k, "hobbit.qgemm.packed");
+  llvm::Value *col_sums =
+      EntryAlloca(func, i32, kQGemmPanel, "hobbit.qgemm.colsum");
+  llvm::Value *row_sums =
+      rhs_zero_point ? EntryAlloca(func, i32, m, "hobbit.qgemm.rowsum")
+                     : nullptr;
+
+  EmitLoop(builder, "hobbit.qgemm.batch", builder.getInt64(0),
+           builder.getInt64(batch), 1, [&](llvm::Value *b) {
+    llvm::Value *a =
+        builder.CreateGEP(lhs, builder.CreateMul(b, builder.getInt64(m * k)));
+    llvm::Value *bmat = rhs;
+    if (rhs_batched)
+      bmat =
+          builder.CreateGEP(rhs, builder.CreateMul(b, builder.getInt64(k * n)));
+    llvm::Value *c = builder.CreateGEP(
+        output, builder.CreateMul(b, builder.getInt64(m * n)));
+
+    if (rhs_zero_point) {
+      EmitLoop(builder, "hobbit.qgemm.rowsum", builder.getInt64(0),
+               builder.getInt64(m), 1, [&](llvm::Value *i) {
+        llvm::Value *row =
+            builder.CreateGEP(a, builder.CreateMul(i, builder.getInt64(k)));
+        builder.CreateStore(EmitSum(builder, row, k),
+                            builder.CreateGEP(row_sums, i));
+      });
+    }
+
+    EmitLoop(builder, "hobbit.qgemm.panel", builder.getInt64(0),
+             builder.getInt64(n), kQGemmPanel, [&](llvm::Value *p0) {
+      llvm::Value *width =
+          EmitMin(builder, builder.getInt64(kQGemmPanel),
+                  builder.CreateSub(builder.getInt64(n), p0));
+
+      EmitLoop(builder, "hobbit.qgemm.zero", builder.getInt64(0), width, 1,
+               [&](llvm::Value *pp) {
+        builder.CreateStore(builder.getInt32(0),
+                            builder.CreateGEP(col_sums, pp));
+      });
+      EmitLoop(builder, "hobbit.qgemm.pack", builder.getInt64(0),
+               builder.getInt64(k), 1, [&](llvm::Value *kk) {
+        llvm::Value *src = builder.CreateGEP(
+            bmat,
+            builder.CreateAdd(builder.CreateMul(kk, builder.getInt64(n)), p0));
+        EmitLoop(builder, "hobbit.qgemm.packrow", builder.getInt64(0), width,
+                 1, [&](llvm::Value *pp) {
+          llvm::Value *val = builder.CreateLoad(builder.CreateGEP(src, pp));
+          builder.CreateStore(
+              val, builder.CreateGEP(
+                       packed, builder.CreateAdd(
+                                   builder.CreateMul(pp, builder.getInt64(k)),
+                                   kk)));
+          llvm::Value *sum = builder.CreateGEP(col_sums, pp);
+          builder.CreateStore(
+              builder.CreateAdd(builder.CreateLoad(sum),
+                                builder.CreateSExt(val, i32)),
+              sum);
+        });
+      });
+
+      // Columns in groups of kQGemmColumns, then one at a time
+      llvm::Value *grouped = builder.CreateSub(
+          width, builder.CreateURem(width, builder.getInt64(kQGemmColumns)));
+
+      EmitLoop(builder, "hobbit.qgemm.row", builder.getInt64(0),
+               builder.getInt64(m), 1, [&](llvm::Value *i) {
+        llvm::Value *a_row =
+            builder.CreateGEP(a, builder.CreateMul(i, builder.getInt64(k)));
+        llvm::Value *c_row =
+            builder.CreateGEP(c, builder.CreateMul(i, builder.getInt64(n)));
+        llvm::Value *row_sum =
+            rhs_zero_point ? builder.CreateLoad(builder.CreateGEP(row_sums, i))
+                           : nullptr;
+
+        auto columns = [&](llvm::Value *pp, uint64_t count) {
+          std::vector<llvm::Value *> rows, sums;
+          for (uint64_t j = 0; j < count; j++) {
+            llvm::Value *local = builder.CreateAdd(pp, builder.getInt64(j));
+            rows.push_back(builder.CreateGEP(
+                packed, builder.CreateMul(local, builder.getInt64(k))));
+            sums.push_back(
+                builder.CreateLoad(builder.CreateGEP(col_sums, local)));
+          }
+          std::vector<llvm::Value *> dots =
+              EmitDots(builder, kind, a_row, rows, sums, k);
+
+          for (uint64_t j = 0; j < count; j++) {
+            llvm::Value *local = builder.CreateAdd(pp, builder.getInt64(j));
+            llvm::Value *col = builder.CreateAdd(p0, local);
+            llvm::Value *result = EmitZeroPointCorrection(
+                builder, dots[j], row_sum, sums[j], za,
+                EmitChannelValue(builder, params_.rhs_quant.zero_point, col),
+                k);
+            if (params_.requantize)
+              result = EmitRequantize(
+                  builder, result,
+                  EmitChannelValue(builder, multipliers, col),
+                  params_.out_quant.zero_point[0]);
+            builder.CreateStore(result, builder.CreateGEP(c_row, col));
+          }
+        };
+
+        EmitLoop(builder, "hobbit.qgemm.cols", builder.getInt64(0), grouped,
+                 kQGemmColumns, [&](llvm::Value *pp) {
+          columns(pp, kQGemmColumns);
+        });
+        EmitLoop(builder, "hobbit.qgemm.col", grouped, width, 1,
+                 [&](llvm::Value *pp) { columns(pp, 1); });
+      });
+    });
+  });
+
+  return output;
+}
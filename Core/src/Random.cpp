@@ -0,0 +1,202 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Codegen.hpp"
+
+namespace {
+  // Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2,
+  // 3"). The multipliers and the Weyl sequence bumping the key.
+  const uint32_t kPhiloxM0 = 0xD2511F53;
+  const uint32_t kPhiloxM1 = 0xCD9E8D57;
+  const uint32_t kPhiloxW0 = 0x9E3779B9;
+  const uint32_t kPhiloxW1 = 0xBB67AE85;
+  const int kPhiloxRounds = 10;
+
+  // lo and hi halves of the 64 bit product of a and the constant m
+  std::pair<llvm::Value *, llvm::Value *>
+  MulHiLo(llvm::IRBuilder<> &builder, llvm::Value *a, uint32_t m) {
+    llvm::Type *i32 = a->getType();
+    llvm::Type *i64 = llvm::IntegerType::get(builder.getContext(), 64);
+    if (i32->isVectorTy())
+      i64 = llvm::VectorType::get(i64, i32->getVectorNumElements());
+    llvm::Value *prod = builder.CreateMul(builder.CreateZExt(a, i64),
+                                          llvm::ConstantInt::get(i64, m));
+    return {builder.CreateTrunc(prod, i32),
+            builder.CreateTrunc(builder.CreateLShr(prod, 32), i32)};
+  }
+
+  // The four output words for the 64 bit counters in `counter` (scalar or
+  // vector of i64), with the upper half of the 128 bit counter zero. All
+  // lanes are independent, so this vectorizes as it is.
+  std::vector<llvm::Value *> Philox(llvm::IRBuilder<> &builder,
+                                    llvm::Value *counter, uint64_t seed) {
+    llvm::Type *i32 = builder.getInt32Ty();
+    if (counter->getType()->isVectorTy())
+      i32 = llvm::VectorType::get(i32,
+                                  counter->getType()->getVectorNumElements());
+
+    llvm::Value *c[4] = {
+        builder.CreateTrunc(counter, i32),
+        builder.CreateTrunc(builder.CreateLShr(counter, 32), i32),
+        llvm::Constant::getNullValue(i32), llvm::Constant::getNullValue(i32)};
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+
+    for (int round = 0; round < kPhiloxRounds; round++) {
+      auto p0 = MulHiLo(builder, c[0], kPhiloxM0);
+      auto p1 = MulHiLo(builder, c[2], kPhiloxM1);
+      llvm::Value *next[4] = {
+          builder.CreateXor(builder.CreateXor(p1.second, c[1]),
+                            llvm::ConstantInt::get(i32, k0)),
+          p1.first,
+          builder.CreateXor(builder.CreateXor(p0.second, c[3]),
+                            llvm::ConstantInt::get(i32, k1)),
+          p0.first};
+      std::copy(next, next + 4, c);
+      k0 += kPhiloxW0;
+      k1 += kPhiloxW1;
+    }
+
+    return std::vector<llvm::Value *>(c, c + 4);
+  }
+}
+
+void Hobbit::core::Random::CheckArgs() {
+  llvm::Type *type = ComputeType(ElementType(args_[0]));
+  if (op_ == RANDOM_UNIFORM && !type->isFloatingPointTy())
+    throw IncompatibleTypes("Random");
+  if (op_ == RANDOM_BERNOULLI &&
+      (type == BitTy(type->getContext()) || !(params_.random_p >= 0) ||
+       params_.random_p > 1))
+    throw IncompatibleTypes("Random");
+}
+
+llvm::Value *Hobbit::core::Random::EmitElement(
+    llvm::IRBuilder<> & /*builder*/,
+    const std::vector<llvm::Value *> & /*operands*/) {
+  // Only the base EmitElementAt calls this, and Random overrides it
+  return nullptr;
+}
+
+llvm::Value *Hobbit::core::Random::EmitElementAt(
+    llvm::IRBuilder<> &builder, const std::vector<llvm::Value *> &operands,
+    llvm::Value *index) {
+  llvm::Type *type = operands[0]->getType();
+  llvm::Type *elt_type = type->getScalarType();
+  const unsigned lanes = type->isVectorTy() ? type->getVectorNumElements() : 1;
+
+  // Each element takes one word of a block (double takes two), so every
+  // counter covers per_counter consecutive elements
+  const unsigned per_element =
+      op_ == RANDOM_UNIFORM && elt_type->isDoubleTy() ? 2 : 1;
+  const unsigned per_counter = 4 / per_element;
+
+  llvm::Value *element =
+      builder.CreateAdd(index, builder.getInt64(params_.random_offset));
+  llvm::Value *counter =
+      builder.CreateUDiv(element, builder.getInt64(per_counter));
+  llvm::Value *phase =
+      builder.CreateURem(element, builder.getInt64(per_counter));
+
+  // Enough consecutive counters for the lanes wherever the first one starts
+  // in its block
+  const unsigned counters =
+      lanes > 1 ? (lanes + per_counter - 1) / per_counter + 1 : 1;
+  if (counters > 1) {
+    std::vector<llvm::Constant *> iota;
+    for (unsigned i = 0; i < counters; i++)
+      iota.push_back(builder.getInt64(i));
+    counter = builder.CreateAdd(builder.CreateVectorSplat(counters, counter),
+                                llvm::ConstantVector::get(iota));
+  }
+  std::vector<llvm::Value *> blocks =
+      Philox(builder, counter, params_.random_seed);
+
+  // All the words side by side, word w of counter c at w * counters + c
+  auto concat = [&](llvm::Value *a, llvm::Value *b) {
+    std::vector<uint32_t> mask;
+    for (unsigned i = 0; i < 2 * a->getType()->getVectorNumElements(); i++)
+      mask.push_back(i);
+    return builder.CreateShuffleVector(a, b, mask);
+  };
+  llvm::Value *all = nullptr;
+  if (counters > 1)
+    all = concat(concat(blocks[0], blocks[1]), concat(blocks[2], blocks[3]));
+
+  // Word t of every lane's element when the first lane is element s of
+  // its counter's block
+  auto pick = [&](unsigned t, unsigned s) -> llvm::Value * {
+    if (counters == 1)
+      return blocks[per_element * s + t];
+    std::vector<uint32_t> mask;
+    for (unsigned l = 0; l < lanes; l++) {
+      const unsigned e = s + l;
+      mask.push_back((per_element * (e % per_counter) + t) * counters +
+                     e / per_counter);
+    }
+    return builder.CreateShuffleVector(
+        all, llvm::UndefValue::get(all->getType()), mask);
+  };
+  std::vector<llvm::Value *> words;
+  for (unsigned t = 0; t < per_element; t++) {
+    llvm::Value *word = pick(t, per_counter - 1);
+    for (unsigned s = per_counter - 1; s-- > 0;) {
+      word = builder.CreateSelect(
+          builder.CreateICmpEQ(phase, builder.getInt64(s)), pick(t, s), word);
+    }
+    words.push_back(word);
+  }
+
+  auto of_width = [&](llvm::Type *t) -> llvm::Type * {
+    return lanes > 1 ? llvm::VectorType::get(t, lanes) : t;
+  };
+  llvm::Type *i64 = of_width(builder.getInt64Ty());
+
+  if (op_ == RANDOM_BERNOULLI) {
+    // u < p * 2^32 in 64 bits, so p = 1 is always true
+    const uint64_t threshold =
+        (uint64_t)std::ldexp(params_.random_p, 32);
+    llvm::Value *hit =
+        builder.CreateICmpULT(builder.CreateZExt(words[0], i64),
+                              llvm::ConstantInt::get(i64, threshold));
+    return builder.CreateSelect(hit, ConstantValue(type, 1.0),
+                                llvm::Constant::getNullValue(type));
+  }
+
+  // The top mantissa-width bits, scaled into [0, 1). Both steps are exact.
+  if (elt_type->isDoubleTy()) {
+    llvm::Value *bits = builder.CreateOr(
+        builder.CreateShl(builder.CreateZExt(words[0], i64), 21),
+        builder.CreateLShr(builder.CreateZExt(words[1], i64), 11));
+    return builder.CreateFMul(builder.CreateUIToFP(bits, type),
+                              ConstantValue(type, std::ldexp(1.0, -53)));
+  }
+  llvm::Type *f32 = of_width(builder.getFloatTy());
+  llvm::Value *uniform = builder.CreateFMul(
+      builder.CreateUIToFP(builder.CreateLShr(words[0], 8), f32),
+      ConstantValue(f32, std::ldexp(1.0, -24)));
+  return builder.CreateFPCast(uniform, type);
+}
@@ -0,0 +1,189 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include "Codegen.hpp"
+#include "Kernels.hpp"
+#include "Math.hpp"
+
+void Hobbit::core::RecurrentCell::CheckArgs() {
+  if (args_.size() != 4)
+    throw IncorrectNumArgs("RecurrentCell");
+
+  gates_ = op_ == LSTM_CELL ? 4 : 3;
+  const Shape &x = args_[0]->shape;
+  const Shape &state = args_[1]->shape;
+  const Shape &weights = args_[2]->shape;
+  const Shape &bias = args_[3]->shape;
+  batch_ = x.GetAxisSize(H);
+  input_ = x.GetAxisSize(W);
+  hidden_ = state.GetAxisSize(W);
+
+  if (x.GetAxisSize(K) != 1 || state.GetAxisSize(H) != batch_ ||
+      state.GetAxisSize(K) != (op_ == LSTM_CELL ? 2 : 1))
+    throw IncompatibleShapes("RecurrentCell");
+  if (weights != Shape(1, input_ + hidden_, gates_ * hidden_))
+    throw IncompatibleShapes("RecurrentCell");
+  if (bias != Shape(1, op_ == LSTM_CELL ? 1 : 2, gates_ * hidden_))
+    throw IncompatibleShapes("RecurrentCell");
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  for (uint64_t i = 1; i < args_.size(); i++) {
+    if (ElementType(args_[i]) != elt_type)
+      throw IncompatibleTypes("RecurrentCell");
+  }
+  if (!ComputeType(elt_type)->isFloatingPointTy())
+    throw IncompatibleTypes("RecurrentCell");
+}
+
+Hobbit::Tensor *Hobbit::core::RecurrentCell::GetOutput() {
+  Tensor *output_tensor = Variable::Create(
+      args_[0]->parent_func, args_[1]->type, args_[1]->shape);
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+// Two GEMVs (GEMMs for a batch) over the packed weights, one for the input
+// rows and one for the hidden rows, each producing every gate at once. W is
+// read exactly once per step. A single loop over the hidden units then adds
+// the halves and the bias, applies the gate nonlinearities and writes the
+// new state; the gate pre-activations never leave the stack.
+llvm::Value *Hobbit::core::RecurrentCell::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.recurrent.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+  const FPPolicy &policy = args_[0]->parent_func->GetFPPolicy();
+
+  llvm::Value *x = BufferPointer(builder, args_[0]);
+  llvm::Value *state = BufferPointer(builder, args_[1]);
+  llvm::Value *weights = BufferPointer(builder, args_[2]);
+  llvm::Value *bias = BufferPointer(builder, args_[3]);
+  llvm::Value *output = BufferPointer(builder, args_[4]);
+
+  llvm::Type *elt_type = ComputeType(ElementType(args_[0]));
+  const uint64_t vw = VectorWidth(elt_type);
+  const uint64_t n = gates_ * hidden_;
+
+  llvm::Value *gx =
+      EntryAlloca(func, elt_type, batch_ * n, "hobbit.recurrent.gx");
+  llvm::Value *gh =
+      EntryAlloca(func, elt_type, batch_ * n, "hobbit.recurrent.gh");
+
+  GemmOperands ops;
+  ops.a = x;
+  ops.b = weights;
+  ops.c = gx;
+  ops.m = batch_;
+  ops.n = n;
+  ops.k = input_;
+  ops.lda = input_;
+  ops.ldb = n;
+  ops.ldc = n;
+  EmitGemm(builder, ops);
+
+  // The hidden state is the first K slice of the state either way
+  ops.a = state;
+  ops.b = builder.CreateGEP(weights, builder.getInt64(input_ * n));
+  ops.c = gh;
+  ops.k = hidden_;
+  ops.lda = hidden_;
+  EmitGemm(builder, ops);
+
+  llvm::Value *cell =
+      builder.CreateGEP(state, builder.getInt64(batch_ * hidden_));
+  llvm::Value *out_cell =
+      builder.CreateGEP(output, builder.getInt64(batch_ * hidden_));
+  llvm::Value *hidden_bias = builder.CreateGEP(bias, builder.getInt64(n));
+
+  EmitLoop(builder, "hobbit.recurrent.batch", builder.getInt64(0),
+           builder.getInt64(batch_), 1, [&](llvm::Value *b) {
+    llvm::Value *gx_b =
+        builder.CreateGEP(gx, builder.CreateMul(b, builder.getInt64(n)));
+    llvm::Value *gh_b =
+        builder.CreateGEP(gh, builder.CreateMul(b, builder.getInt64(n)));
+    llvm::Value *row = builder.CreateMul(b, builder.getInt64(hidden_));
+
+    EmitVectorLoop(builder, "hobbit.recurrent.update", hidden_, vw,
+                   [&](llvm::Value *j, bool vector) {
+      const unsigned lanes = vector ? vw : 1;
+      auto at = [&](llvm::Value *ptr, uint64_t gate) {
+        return builder.CreateGEP(ptr, builder.getInt64(gate * hidden_));
+      };
+      // Input half, with the input bias, and hidden half of a gate
+      auto input_part = [&](uint64_t gate) {
+        return builder.CreateFAdd(
+            EmitLoadLanes(builder, at(gx_b, gate), j, lanes),
+            EmitLoadCompute(builder, at(bias, gate), j, lanes));
+      };
+      auto hidden_part = [&](uint64_t gate) {
+        llvm::Value *val = EmitLoadLanes(builder, at(gh_b, gate), j, lanes);
+        if (op_ == LSTM_CELL)
+          return val;
+        return builder.CreateFAdd(
+            val, EmitLoadCompute(builder, at(hidden_bias, gate), j, lanes));
+      };
+      auto gate = [&](uint64_t g) {
+        return builder.CreateFAdd(input_part(g), hidden_part(g));
+      };
+      llvm::Value *h_idx = builder.CreateAdd(row, j);
+
+      if (op_ == LSTM_CELL) {
+        // Gates i, f, g, o
+        llvm::Value *i = EmitSigmoid(builder, gate(0), policy.math);
+        llvm::Value *f = EmitSigmoid(builder, gate(1), policy.math);
+        llvm::Value *g = EmitTanh(builder, gate(2), policy.math);
+        llvm::Value *o = EmitSigmoid(builder, gate(3), policy.math);
+        llvm::Value *c_new = EmitMulAdd(
+            builder, f, EmitLoadCompute(builder, cell, h_idx, lanes),
+            builder.CreateFMul(i, g), policy.fma);
+        EmitStoreCompute(builder, c_new, out_cell, h_idx);
+        EmitStoreCompute(
+            builder,
+            builder.CreateFMul(o, EmitTanh(builder, c_new, policy.math)),
+            output, h_idx);
+      } else {
+        // Gates r, z, n. The reset gate scales the hidden half of n.
+        llvm::Value *r = EmitSigmoid(builder, gate(0), policy.math);
+        llvm::Value *z = EmitSigmoid(builder, gate(1), policy.math);
+        llvm::Value *n_gate = EmitTanh(
+            builder, EmitMulAdd(builder, r, hidden_part(2), input_part(2),
+                                policy.fma),
+            policy.math);
+        // (1 - z) n + z h
+        llvm::Value *h = EmitLoadCompute(builder, state, h_idx, lanes);
+        llvm::Value *one = ConstantValue(z->getType(), 1.0);
+        EmitStoreCompute(
+            builder,
+            EmitMulAdd(builder, builder.CreateFSub(one, z), n_gate,
+                       builder.CreateFMul(z, h), policy.fma),
+            output, h_idx);
+      }
+    });
+  });
+
+  return output;
+}
@@ -0,0 +1,445 @@
+//
+// Created by Aman LaChapelle on 3/28/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+
+#include "Codegen.hpp"
+
+namespace {
+  // Independent vector accumulators for reductions along contiguous memory
+  const uint64_t kReduceAccumulators = 4;
+
+  // Argmax step: is (val, idx) better than (best, best_idx)? Bigger wins,
+  // and ties go to the smaller index so the first maximum is reported
+  // whatever order the lanes are combined in.
+  llvm::Value *ArgmaxBetter(llvm::IRBuilder<> &builder, llvm::Value *val,
+                            llvm::Value *idx, llvm::Value *best,
+                            llvm::Value *best_idx) {
+    llvm::Value *greater, *equal;
+    if (val->getType()->isFPOrFPVectorTy()) {
+      greater = builder.CreateFCmpOGT(val, best);
+      equal = builder.CreateFCmpOEQ(val, best);
+    } else {
+      greater = builder.CreateICmpSGT(val, best);
+      equal = builder.CreateICmpEQ(val, best);
+    }
+    llvm::Value *earlier = builder.CreateICmpULT(idx, best_idx);
+    return builder.CreateOr(greater, builder.CreateAnd(equal, earlier));
+  }
+
+  llvm::Value *Iota(llvm::IRBuilder<> &builder, uint64_t width) {
+    std::vector<llvm::Constant *> lanes;
+    for (uint64_t i = 0; i < width; i++)
+      lanes.push_back(builder.getInt64(i));
+    return llvm::ConstantVector::get(lanes);
+  }
+}
+
+void Hobbit::core::Reduce::CheckArgs() {
+  if (args_.size() != 1)
+    throw IncorrectNumArgs("Reduce");
+  if (IsBit(ElementType(args_[0])))
+    throw IncompatibleTypes("Reduce");
+
+  const Shape &shape = args_[0]->shape;
+  std::vector<Axis> axes = params_.reduce_axes;
+  if (axes.empty())
+    axes = {K, H, W};
+
+  // Fold the three axes into {outer, reduced, kept, inner}. Size 1 axes
+  // don't matter, and neighbouring axes that are both reduced (or both
+  // kept) are contiguous so they merge.
+  uint64_t dims[4] = {1, 1, 1, 1};
+  uint64_t out_dims[3];
+  int level = 0;
+  const Axis all_axes[] = {K, H, W};
+  for (int i = 0; i < 3; i++) {
+    const uint64_t size = shape.GetAxisSize(all_axes[i]);
+    const bool reduced =
+        std::find(axes.begin(), axes.end(), all_axes[i]) != axes.end();
+    out_dims[i] = reduced ? 1 : size;
+    if (size == 1)
+      continue;
+
+    // Even levels are kept, odd levels are reduced
+    if (reduced != (level % 2 == 1))
+      level++;
+    dims[level] *= size;
+  }
+
+  // Nothing kept in between means the reduced axes are one contiguous run
+  if (dims[2] == 1) {
+    dims[3] *= dims[1];
+    dims[1] = 1;
+  }
+
+  outer_ = dims[0];
+  reduced_ = dims[1];
+  kept_ = dims[2];
+  inner_ = dims[3];
+  out_shape_ = Shape(out_dims[0], out_dims[1], out_dims[2]);
+}
+
+Hobbit::Tensor *Hobbit::core::Reduce::GetOutput() {
+  llvm::Type *type = args_[0]->type;
+  if (op_ == REDUCE_ARGMAX)
+    type = llvm::Type::getInt64PtrTy(type->getContext());
+
+  Tensor *output_tensor =
+      Variable::Create(args_[0]->parent_func, type, out_shape_);
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+llvm::Value *Hobbit::core::Reduce::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB =
+      llvm::BasicBlock::Create(func->getContext(), "hobbit.reduce.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+
+  llvm::Value *input = BufferPointer(builder, args_[0]);
+  // With an epilogue, the reduction itself never reaches memory
+  llvm::Value *output = BufferPointer(
+      builder,
+      epilogue_.empty() ? args_[1] : epilogue_.back()->GetArgs().back());
+
+  if (inner_ > 1)
+    EmitInner(builder, input, output);
+  else
+    EmitOuter(builder, input, output);
+
+  return output;
+}
+
+bool Hobbit::core::Reduce::SetEpilogue(const std::vector<Elementwise *> &ops) {
+  // The reduction computes in its own type, narrow floats would need to be
+  // widened first
+  llvm::Type *elt_type = ElementType(args_[1]);
+  if (ComputeType(elt_type) != elt_type)
+    return false;
+
+  // EmitOuter's vectors run along kept_, which can cover more than one row
+  // of the output. That only works if nothing has to be broadcast.
+  if (inner_ == 1 && kept_ != out_shape_.GetAxisSize(W)) {
+    for (auto &op : ops) {
+      for (auto &input : op->GetInputs()) {
+        if (input->shape != out_shape_)
+          return false;
+      }
+    }
+  }
+
+  epilogue_ = ops;
+  return true;
+}
+
+// val with the epilogue applied, for the output elements starting at the
+// flat index `index`
+llvm::Value *Hobbit::core::Reduce::Finish(llvm::IRBuilder<> &builder,
+                                          llvm::Value *val,
+                                          llvm::Value *index) {
+  if (epilogue_.empty())
+    return val;
+  llvm::Value *width = builder.getInt64(out_shape_.GetAxisSize(W));
+  return Elementwise::EmitEpilogue(builder, epilogue_, args_[1], val,
+                                   builder.CreateUDiv(index, width),
+                                   builder.CreateURem(index, width));
+}
+
+llvm::Value *Hobbit::core::Reduce::Identity(llvm::Type *type) {
+  switch (op_) {
+  case REDUCE_SUM:
+  case REDUCE_MEAN:
+    return llvm::Constant::getNullValue(type);
+  case REDUCE_MIN:
+    return ConstantValue(type, std::numeric_limits<double>::infinity());
+  default:
+    return ConstantValue(type, -std::numeric_limits<double>::infinity());
+  }
+}
+
+llvm::Value *Hobbit::core::Reduce::Combine(llvm::IRBuilder<> &builder,
+                                           llvm::Value *acc,
+                                           llvm::Value *val) {
+  switch (op_) {
+  case REDUCE_SUM:
+  case REDUCE_MEAN:
+    return EmitAdd(builder, acc, val);
+  case REDUCE_MIN:
+    return EmitMin(builder, acc, val);
+  default:
+    return EmitMax(builder, acc, val);
+  }
+}
+
+// The reduction runs along contiguous memory: for every output element,
+// kReduceAccumulators vector accumulators sweep the inner run of each
+// reduced row, then get combined pairwise and across lanes. The leftover
+// columns of each row are folded in one at a time. FP sums only take the
+// vector path when the FPPolicy allows reassociation.
+void Hobbit::core::Reduce::EmitInner(llvm::IRBuilder<> &builder,
+                                     llvm::Value *input, llvm::Value *output) {
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  llvm::Type *idx_type = builder.getInt64Ty();
+  const uint64_t vw = VectorWidth(elt_type);
+  const bool argmax = op_ == REDUCE_ARGMAX;
+  const bool ordered = (op_ == REDUCE_SUM || op_ == REDUCE_MEAN) &&
+                       elt_type->isFloatingPointTy() &&
+                       !args_[0]->parent_func->GetFPPolicy().reassociate;
+  const uint64_t n_acc =
+      ordered ? 0 : std::min(kReduceAccumulators, inner_ / vw);
+  const uint64_t step = n_acc * vw;
+  const uint64_t vec_end = n_acc > 0 ? inner_ - inner_ % step : 0;
+
+  llvm::VectorType *vec_type = llvm::VectorType::get(elt_type, vw);
+  llvm::VectorType *idx_vec_type = llvm::VectorType::get(idx_type, vw);
+
+  llvm::Value *acc = EntryAlloca(func, elt_type, 1, "hobbit.reduce.acc");
+  llvm::Value *acc_idx = EntryAlloca(func, idx_type, 1, "hobbit.reduce.idx");
+  llvm::Value *vec_acc = nullptr, *vec_idx = nullptr;
+  if (n_acc > 0) {
+    vec_acc = EntryAlloca(func, vec_type, n_acc, "hobbit.reduce.vacc");
+    vec_idx = EntryAlloca(func, idx_vec_type, n_acc, "hobbit.reduce.vidx");
+  }
+
+  // Folds (val, idx) into the accumulator at acc_ptr (and idx_ptr)
+  auto accumulate = [&](llvm::Value *acc_ptr, llvm::Value *idx_ptr,
+                        llvm::Value *val, llvm::Value *idx) {
+    llvm::Value *best = builder.CreateLoad(acc_ptr);
+    if (!argmax) {
+      builder.CreateStore(Combine(builder, best, val), acc_ptr);
+      return;
+    }
+    llvm::Value *best_idx = builder.CreateLoad(idx_ptr);
+    llvm::Value *better = ArgmaxBetter(builder, val, idx, best, best_idx);
+    builder.CreateStore(builder.CreateSelect(better, val, best), acc_ptr);
+    builder.CreateStore(builder.CreateSelect(better, idx, best_idx), idx_ptr);
+  };
+
+  EmitLoop(builder, "hobbit.reduce.outer", builder.getInt64(0),
+           builder.getInt64(outer_), 1, [&](llvm::Value *x1) {
+    EmitLoop(builder, "hobbit.reduce.kept", builder.getInt64(0),
+             builder.getInt64(kept_), 1, [&](llvm::Value *x2) {
+      llvm::Value *base = builder.CreateGEP(
+          input,
+          builder.CreateMul(
+              builder.CreateAdd(
+                  builder.CreateMul(x1, builder.getInt64(reduced_ * kept_)),
+                  x2),
+              builder.getInt64(inner_)));
+      auto row = [&](llvm::Value *r1) {
+        return builder.CreateGEP(
+            base, builder.CreateMul(r1, builder.getInt64(kept_ * inner_)));
+      };
+      auto flat_idx = [&](llvm::Value *r1, llvm::Value *r2) {
+        return builder.CreateAdd(
+            builder.CreateMul(r1, builder.getInt64(inner_)), r2);
+      };
+
+      builder.CreateStore(Identity(elt_type), acc);
+      builder.CreateStore(builder.getInt64(0), acc_idx);
+
+      if (n_acc > 0) {
+        for (uint64_t a = 0; a < n_acc; a++) {
+          builder.CreateStore(Identity(vec_type),
+                              builder.CreateGEP(vec_acc, builder.getInt64(a)));
+          builder.CreateStore(llvm::Constant::getNullValue(idx_vec_type),
+                              builder.CreateGEP(vec_idx, builder.getInt64(a)));
+        }
+
+        EmitLoop(builder, "hobbit.reduce.vrow", builder.getInt64(0),
+                 builder.getInt64(reduced_), 1, [&](llvm::Value *r1) {
+          llvm::Value *in_row = row(r1);
+          EmitLoop(builder, "hobbit.reduce.vcol", builder.getInt64(0),
+                   builder.getInt64(vec_end), step, [&](llvm::Value *r2) {
+            for (uint64_t a = 0; a < n_acc; a++) {
+              llvm::Value *col =
+                  builder.CreateAdd(r2, builder.getInt64(a * vw));
+              llvm::Value *val = EmitLoadLanes(builder, in_row, col, vw);
+              llvm::Value *idx = nullptr;
+              if (argmax)
+                idx = builder.CreateAdd(
+                    builder.CreateVectorSplat(vw, flat_idx(r1, col)),
+                    Iota(builder, vw));
+              accumulate(builder.CreateGEP(vec_acc, builder.getInt64(a)),
+                         builder.CreateGEP(vec_idx, builder.getInt64(a)), val,
+                         idx);
+            }
+          });
+        });
+
+        // Pairwise over the accumulators, then halving across the lanes
+        std::vector<llvm::Value *> vals, idxs;
+        for (uint64_t a = 0; a < n_acc; a++) {
+          vals.push_back(builder.CreateLoad(
+              builder.CreateGEP(vec_acc, builder.getInt64(a))));
+          idxs.push_back(builder.CreateLoad(
+              builder.CreateGEP(vec_idx, builder.getInt64(a))));
+        }
+        auto merge = [&](uint64_t dst, llvm::Value *val, llvm::Value *idx) {
+          if (!argmax) {
+            vals[dst] = Combine(builder, vals[dst], val);
+            return;
+          }
+          llvm::Value *better =
+              ArgmaxBetter(builder, val, idx, vals[dst], idxs[dst]);
+          vals[dst] = builder.CreateSelect(better, val, vals[dst]);
+          idxs[dst] = builder.CreateSelect(better, idx, idxs[dst]);
+        };
+        for (uint64_t n = n_acc; n > 1; n = (n + 1) / 2) {
+          for (uint64_t a = 0; a + (n + 1) / 2 < n; a++)
+            merge(a, vals[a + (n + 1) / 2], idxs[a + (n + 1) / 2]);
+        }
+        for (uint64_t width = vw / 2; width > 0; width /= 2) {
+          // Upper half onto the lower half, the other lanes are dead
+          llvm::SmallVector<uint32_t, 16> mask;
+          for (uint64_t i = 0; i < vw; i++)
+            mask.push_back(i < width ? i + width : i);
+          auto upper = [&](llvm::Value *v) {
+            return builder.CreateShuffleVector(
+                v, llvm::UndefValue::get(v->getType()), mask);
+          };
+          merge(0, upper(vals[0]), argmax ? upper(idxs[0]) : nullptr);
+        }
+        builder.CreateStore(
+            builder.CreateExtractElement(vals[0], builder.getInt64(0)), acc);
+        if (argmax)
+          builder.CreateStore(
+              builder.CreateExtractElement(idxs[0], builder.getInt64(0)),
+              acc_idx);
+      }
+
+      if (vec_end < inner_) {
+        EmitLoop(builder, "hobbit.reduce.row", builder.getInt64(0),
+                 builder.getInt64(reduced_), 1, [&](llvm::Value *r1) {
+          llvm::Value *in_row = row(r1);
+          EmitLoop(builder, "hobbit.reduce.col", builder.getInt64(vec_end),
+                   builder.getInt64(inner_), 1, [&](llvm::Value *r2) {
+            accumulate(acc, acc_idx,
+                       builder.CreateLoad(builder.CreateGEP(in_row, r2)),
+                       flat_idx(r1, r2));
+          });
+        });
+      }
+
+      llvm::Value *result = argmax ? builder.CreateLoad(acc_idx)
+                                   : builder.CreateLoad(acc);
+      if (op_ == REDUCE_MEAN)
+        result = EmitDiv(builder, result,
+                         ConstantValue(elt_type, reduced_ * inner_));
+      llvm::Value *out_idx =
+          builder.CreateAdd(builder.CreateMul(x1, builder.getInt64(kept_)), x2);
+      builder.CreateStore(Finish(builder, result, out_idx),
+                          builder.CreateGEP(output, out_idx));
+    });
+  });
+}
+
+// The reduced axes are outside the kept ones, so every reduced index is a
+// whole contiguous row of kept elements. Rows are folded into the output
+// row one after another, which keeps the access pattern sequential and
+// vectorizes along the row without reordering any element's sum.
+void Hobbit::core::Reduce::EmitOuter(llvm::IRBuilder<> &builder,
+                                     llvm::Value *input, llvm::Value *output) {
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  const uint64_t vw = VectorWidth(elt_type);
+  const bool argmax = op_ == REDUCE_ARGMAX;
+
+  // Argmax keeps the best values on the side and the indices in the output
+  llvm::Value *best =
+      argmax ? EntryAlloca(func, elt_type, kept_, "hobbit.reduce.best")
+             : nullptr;
+
+  EmitLoop(builder, "hobbit.reduce.outer", builder.getInt64(0),
+           builder.getInt64(outer_), 1, [&](llvm::Value *x1) {
+    llvm::Value *in_block = builder.CreateGEP(
+        input, builder.CreateMul(x1, builder.getInt64(reduced_ * kept_)));
+    llvm::Value *out_row = builder.CreateGEP(
+        output, builder.CreateMul(x1, builder.getInt64(kept_)));
+    llvm::Value *acc_row = argmax ? best : out_row;
+
+    EmitVectorLoop(builder, "hobbit.reduce.init", kept_, vw,
+                   [&](llvm::Value *x2, bool vector) {
+      const unsigned lanes = vector ? vw : 1;
+      EmitStoreLanes(builder, EmitLoadLanes(builder, in_block, x2, lanes),
+                     acc_row, x2);
+      if (argmax) {
+        llvm::Type *idx_type = builder.getInt64Ty();
+        if (vector)
+          idx_type = llvm::VectorType::get(idx_type, vw);
+        EmitStoreLanes(builder, llvm::Constant::getNullValue(idx_type),
+                       out_row, x2);
+      }
+    });
+
+    EmitLoop(builder, "hobbit.reduce.row", builder.getInt64(1),
+             builder.getInt64(reduced_), 1, [&](llvm::Value *r1) {
+      llvm::Value *in_row = builder.CreateGEP(
+          in_block, builder.CreateMul(r1, builder.getInt64(kept_)));
+
+      EmitVectorLoop(builder, "hobbit.reduce.col", kept_, vw,
+                     [&](llvm::Value *x2, bool vector) {
+        const unsigned lanes = vector ? vw : 1;
+        llvm::Value *val = EmitLoadLanes(builder, in_row, x2, lanes);
+        llvm::Value *acc = EmitLoadLanes(builder, acc_row, x2, lanes);
+        if (!argmax) {
+          EmitStoreLanes(builder, Combine(builder, acc, val), acc_row, x2);
+          return;
+        }
+
+        // Rows come in order, so strictly greater keeps the first maximum
+        llvm::Value *better = elt_type->isFloatingPointTy()
+                                  ? builder.CreateFCmpOGT(val, acc)
+                                  : builder.CreateICmpSGT(val, acc);
+        llvm::Value *idx = EmitLoadLanes(builder, out_row, x2, lanes);
+        llvm::Value *r1_lanes = vector ? builder.CreateVectorSplat(vw, r1) : r1;
+        EmitStoreLanes(builder, builder.CreateSelect(better, val, acc),
+                       acc_row, x2);
+        EmitStoreLanes(builder, builder.CreateSelect(better, r1_lanes, idx),
+                       out_row, x2);
+      });
+    });
+
+    // The row is still in L1, so the mean and the epilogue are one more
+    // pass over it
+    if (op_ == REDUCE_MEAN || !epilogue_.empty()) {
+      EmitVectorLoop(builder, "hobbit.reduce.finish", kept_, vw,
+                     [&](llvm::Value *x2, bool vector) {
+        llvm::Value *acc = EmitLoadLanes(builder, out_row, x2, vector ? vw : 1);
+        if (op_ == REDUCE_MEAN)
+          acc = EmitDiv(builder, acc, ConstantValue(acc->getType(), reduced_));
+        llvm::Value *out_idx = builder.CreateAdd(
+            builder.CreateMul(x1, builder.getInt64(kept_)), x2);
+        EmitStoreLanes(builder, Finish(builder, acc, out_idx), out_row, x2);
+      });
+    }
+  });
+}
@@ -112,7 +112,7 @@ Hobbit::Range Hobbit::Shape::GetChunkIdx(const Hobbit::Range &k_range,
 
 uint64_t Hobbit::Shape::GetSize() const { return k_ * h_ * w_; }
 
-uint64_t Hobbit::Shape::GetAxisSize(Axis &axis) const {
+uint64_t Hobbit::Shape::GetAxisSize(const Axis &axis) const {
   switch (axis) {
   case K:
     return k_;
@@ -124,3 +124,19 @@ uint64_t Hobbit::Shape::GetAxisSize(Axis &axis) const {
 
   return 0;
 }
+
+bool Hobbit::Shape::Broadcast(const Hobbit::Shape &other,
+                              Hobbit::Shape &result) const {
+  uint64_t sizes[3];
+  const uint64_t lhs[] = {k_, h_, w_};
+  const uint64_t rhs[] = {other.k_, other.h_, other.w_};
+
+  for (int i = 0; i < 3; i++) {
+    if (lhs[i] != rhs[i] && lhs[i] != 1 && rhs[i] != 1)
+      return false;
+    sizes[i] = lhs[i] == 1 ? rhs[i] : lhs[i];
+  }
+
+  result = Shape(sizes[0], sizes[1], sizes[2]);
+  return true;
+}
@@ -0,0 +1,221 @@
+//
+// Created by Aman LaChapelle on 3/29/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "Codegen.hpp"
+#include "Math.hpp"
+
+namespace {
+  // Independent (max, sum) vector pairs in the statistics pass. Each update
+  // depends on the previous max, so more than one chain hides the latency
+  // of the exp.
+  const uint64_t kSoftmaxAccumulators = 2;
+
+  // Folds x into the running (max, sum of e^(x - max)) pair. Only one
+  // exponential is needed: whichever of x and max is smaller gets scaled
+  // by e^-|x - max|.
+  void Update(llvm::IRBuilder<> &builder, llvm::Value *&max,
+              llvm::Value *&sum, llvm::Value *x,
+              Hobbit::MathAccuracy accuracy) {
+    llvm::Value *greater = builder.CreateFCmpOGT(x, max);
+    llvm::Value *e = Hobbit::core::EmitExp(
+        builder,
+        builder.CreateSelect(greater, builder.CreateFSub(max, x),
+                             builder.CreateFSub(x, max)),
+        accuracy);
+    llvm::Value *one = Hobbit::core::ConstantValue(x->getType(), 1.0);
+    sum = builder.CreateSelect(
+        greater, builder.CreateFAdd(builder.CreateFMul(sum, e), one),
+        builder.CreateFAdd(sum, e));
+    max = builder.CreateSelect(greater, x, max);
+  }
+
+  // Combines two (max, sum) pairs
+  void Merge(llvm::IRBuilder<> &builder, llvm::Value *&max, llvm::Value *&sum,
+             llvm::Value *other_max, llvm::Value *other_sum,
+             Hobbit::MathAccuracy accuracy) {
+    llvm::Value *new_max = Hobbit::core::EmitMax(builder, max, other_max);
+    llvm::Value *scale = Hobbit::core::EmitExp(
+        builder, builder.CreateFSub(max, new_max), accuracy);
+    llvm::Value *other_scale = Hobbit::core::EmitExp(
+        builder, builder.CreateFSub(other_max, new_max), accuracy);
+    sum = builder.CreateFAdd(builder.CreateFMul(sum, scale),
+                             builder.CreateFMul(other_sum, other_scale));
+    max = new_max;
+  }
+}
+
+void Hobbit::core::Softmax::CheckArgs() {
+  if (args_.size() != 1)
+    throw IncorrectNumArgs("Softmax");
+
+  // The exponentials are only emitted for floating point
+  llvm::Type *elt_type = ElementType(args_[0]);
+  if (IsBit(elt_type) || !ComputeType(elt_type)->isFloatingPointTy())
+    throw IncompatibleTypes("Softmax");
+}
+
+Hobbit::Tensor *Hobbit::core::Softmax::GetOutput() {
+  Tensor *output_tensor = Variable::Create(args_[0]->parent_func,
+                                           args_[0]->type, args_[0]->shape);
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+llvm::Value *Hobbit::core::Softmax::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.softmax.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+
+  llvm::Value *input = BufferPointer(builder, args_[0]);
+  llvm::Value *output = BufferPointer(builder, args_[1]);
+
+  const Shape &shape = args_[0]->shape;
+  const uint64_t rows = shape.GetAxisSize(K) * shape.GetAxisSize(H);
+  const uint64_t width = shape.GetAxisSize(W);
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  const uint64_t vw = VectorWidth(elt_type);
+  const uint64_t n_acc = std::min(kSoftmaxAccumulators, width / vw);
+  const uint64_t step = n_acc * vw;
+  const uint64_t vec_end = n_acc > 0 ? width - width % step : 0;
+  llvm::VectorType *vec_type = llvm::VectorType::get(elt_type, vw);
+
+  llvm::Value *vec_max = nullptr, *vec_sum = nullptr;
+  if (n_acc > 0) {
+    vec_max = EntryAlloca(func, vec_type, n_acc, "hobbit.softmax.vmax");
+    vec_sum = EntryAlloca(func, vec_type, n_acc, "hobbit.softmax.vsum");
+  }
+  llvm::Value *max_ptr = EntryAlloca(func, elt_type, 1, "hobbit.softmax.max");
+  llvm::Value *sum_ptr = EntryAlloca(func, elt_type, 1, "hobbit.softmax.sum");
+
+  const double inf = std::numeric_limits<double>::infinity();
+  const MathAccuracy accuracy = args_[0]->parent_func->GetFPPolicy().math;
+
+  EmitLoop(builder, "hobbit.softmax.row", builder.getInt64(0),
+           builder.getInt64(rows), 1, [&](llvm::Value *row) {
+    llvm::Value *offset = builder.CreateMul(row, builder.getInt64(width));
+    llvm::Value *in_row = builder.CreateGEP(input, offset);
+    llvm::Value *out_row = builder.CreateGEP(output, offset);
+
+    builder.CreateStore(ConstantValue(elt_type, -inf), max_ptr);
+    builder.CreateStore(llvm::Constant::getNullValue(elt_type), sum_ptr);
+
+    if (n_acc > 0) {
+      for (uint64_t a = 0; a < n_acc; a++) {
+        builder.CreateStore(ConstantValue(vec_type, -inf),
+                            builder.CreateGEP(vec_max, builder.getInt64(a)));
+        builder.CreateStore(llvm::Constant::getNullValue(vec_type),
+                            builder.CreateGEP(vec_sum, builder.getInt64(a)));
+      }
+
+      EmitLoop(builder, "hobbit.softmax.vstats", builder.getInt64(0),
+               builder.getInt64(vec_end), step, [&](llvm::Value *w) {
+        for (uint64_t a = 0; a < n_acc; a++) {
+          llvm::Value *max_a = builder.CreateGEP(vec_max, builder.getInt64(a));
+          llvm::Value *sum_a = builder.CreateGEP(vec_sum, builder.getInt64(a));
+          llvm::Value *max = builder.CreateLoad(max_a);
+          llvm::Value *sum = builder.CreateLoad(sum_a);
+          Update(builder, max, sum,
+                 EmitLoadLanes(builder, in_row,
+                               builder.CreateAdd(w, builder.getInt64(a * vw)),
+                               vw),
+                 accuracy);
+          builder.CreateStore(max, max_a);
+          builder.CreateStore(sum, sum_a);
+        }
+      });
+
+      // Accumulators into the first one, then halving across the lanes
+      llvm::Value *max = builder.CreateLoad(vec_max);
+      llvm::Value *sum = builder.CreateLoad(vec_sum);
+      for (uint64_t a = 1; a < n_acc; a++)
+        Merge(builder, max, sum,
+              builder.CreateLoad(
+                  builder.CreateGEP(vec_max, builder.getInt64(a))),
+              builder.CreateLoad(
+                  builder.CreateGEP(vec_sum, builder.getInt64(a))),
+              accuracy);
+      for (uint64_t half = vw / 2; half > 0; half /= 2) {
+        llvm::SmallVector<uint32_t, 16> mask;
+        for (uint64_t i = 0; i < vw; i++)
+          mask.push_back(i < half ? i + half : i);
+        auto upper = [&](llvm::Value *v) {
+          return builder.CreateShuffleVector(
+              v, llvm::UndefValue::get(v->getType()), mask);
+        };
+        Merge(builder, max, sum, upper(max), upper(sum), accuracy);
+      }
+      builder.CreateStore(
+          builder.CreateExtractElement(max, builder.getInt64(0)), max_ptr);
+      builder.CreateStore(
+          builder.CreateExtractElement(sum, builder.getInt64(0)), sum_ptr);
+    }
+
+    if (vec_end < width) {
+      EmitLoop(builder, "hobbit.softmax.stats", builder.getInt64(vec_end),
+               builder.getInt64(width), 1, [&](llvm::Value *w) {
+        llvm::Value *max = builder.CreateLoad(max_ptr);
+        llvm::Value *sum = builder.CreateLoad(sum_ptr);
+        Update(builder, max, sum,
+               builder.CreateLoad(builder.CreateGEP(in_row, w)), accuracy);
+        builder.CreateStore(max, max_ptr);
+        builder.CreateStore(sum, sum_ptr);
+      });
+    }
+
+    llvm::Value *max = builder.CreateLoad(max_ptr);
+    llvm::Value *sum = builder.CreateLoad(sum_ptr);
+    llvm::Value *scale;
+    if (op_ == LOG_SOFTMAX) {
+      scale = builder.CreateFAdd(max, EmitLog(builder, sum, accuracy));
+    } else {
+      scale = builder.CreateFDiv(ConstantValue(elt_type, 1.0), sum);
+    }
+
+    EmitVectorLoop(builder, "hobbit.softmax", width, vw,
+                   [&](llvm::Value *w, bool vector) {
+      llvm::Value *x = EmitLoadLanes(builder, in_row, w, vector ? vw : 1);
+      auto lanes = [&](llvm::Value *v) {
+        return vector ? builder.CreateVectorSplat(vw, v) : v;
+      };
+      llvm::Value *y;
+      if (op_ == LOG_SOFTMAX)
+        y = builder.CreateFSub(x, lanes(scale));
+      else
+        y = builder.CreateFMul(
+            EmitExp(builder, builder.CreateFSub(x, lanes(max)), accuracy),
+            lanes(scale));
+      EmitStoreLanes(builder, y, out_row, w);
+    });
+  });
+
+  return output;
+}
@@ -0,0 +1,253 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include "Codegen.hpp"
+
+namespace {
+  // Constant matrices with at most this many nonzeros are compiled into
+  // straight-line code, with the values and column offsets as immediates.
+  // Bigger ones would mostly be instruction cache misses, so they go
+  // through the same loops as a SparseVariable.
+  const uint64_t kSparseUnrollNonzeros = 4096;
+  // Vectors of an output row SPMM keeps in registers while it walks the
+  // row's nonzeros
+  const uint64_t kSpmmVectors = 4;
+
+  uint64_t IndexAt(llvm::Constant *array, uint64_t i) {
+    return llvm::cast<llvm::ConstantInt>(array->getAggregateElement(i))
+        ->getZExtValue();
+  }
+
+  // Element i of a values array, in the compute type (type) the way
+  // EmitLoadCompute would widen it
+  llvm::Constant *ValueAt(llvm::Constant *array, uint64_t i,
+                          llvm::Type *type) {
+    llvm::Constant *v = array->getAggregateElement(i);
+    if (v->getType() == type)
+      return v;
+
+    llvm::APFloat value(0.0f);
+    if (v->getType()->isHalfTy()) {
+      bool lost;
+      value = llvm::cast<llvm::ConstantFP>(v)->getValueAPF();
+      value.convert(llvm::APFloat::IEEEsingle(),
+                    llvm::APFloat::rmNearestTiesToEven, &lost);
+    } else {
+      // bfloat16 is the top half of a float
+      const uint64_t bits = IndexAt(v, 0);
+      value = llvm::APFloat(llvm::APFloat::IEEEsingle(),
+                            llvm::APInt(32, bits << 16));
+    }
+    return llvm::ConstantFP::get(type->getContext(), value);
+  }
+
+  llvm::Value *LoadIndex(llvm::IRBuilder<> &builder, llvm::Value *ptr,
+                         llvm::Value *idx) {
+    return builder.CreateZExt(builder.CreateLoad(builder.CreateGEP(ptr, idx)),
+                              builder.getInt64Ty());
+  }
+}
+
+void Hobbit::core::SparseMatMul::CheckArgs() {
+  if (args_.size() != 2)
+    throw IncorrectNumArgs("SparseMatMul");
+  if (!args_[0]->IsSparse() || args_[1]->IsSparse())
+    throw IncompatibleTypes("SparseMatMul");
+  if (ElementType(args_[0]) != ElementType(args_[1]))
+    throw IncompatibleTypes("SparseMatMul");
+
+  const Shape &lhs = args_[0]->shape;
+  const Shape &rhs = args_[1]->shape;
+  if (lhs.GetAxisSize(K) != 1)
+    throw IncompatibleShapes("SparseMatMul");
+  if (op_ == SPMV) {
+    if (rhs.GetSize() != lhs.GetAxisSize(W))
+      throw IncompatibleShapes("SparseMatMul");
+    n_ = 1;
+  } else {
+    if (rhs.GetAxisSize(K) != 1 || rhs.GetAxisSize(H) != lhs.GetAxisSize(W))
+      throw IncompatibleShapes("SparseMatMul");
+    n_ = rhs.GetAxisSize(W);
+  }
+}
+
+Hobbit::Tensor *Hobbit::core::SparseMatMul::GetOutput() {
+  const uint64_t m = args_[0]->shape.GetAxisSize(H);
+  Tensor *output_tensor = Variable::Create(
+      args_[1]->parent_func, args_[1]->type,
+      op_ == SPMV ? Shape(1, 1, m) : Shape(1, m, n_));
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+// SPMV is SPMM with a single column, so both go through the same code. A
+// row of the output is the sum of the dense rows picked out by the sparse
+// row's column indices, each scaled by its value.
+llvm::Value *Hobbit::core::SparseMatMul::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.sparse.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[1]);
+
+  llvm::Value *dense = BufferPointer(builder, args_[1]);
+  llvm::Value *output = BufferPointer(builder, args_[2]);
+
+  const CSR &csr = args_[0]->csr;
+  llvm::Constant *row_ptr = ConstantInitializer(csr.row_ptr);
+  if (row_ptr != nullptr && ConstantInitializer(csr.col_idx) != nullptr &&
+      ConstantInitializer(csr.values) != nullptr &&
+      IndexAt(row_ptr, args_[0]->shape.GetAxisSize(H)) <=
+          kSparseUnrollNonzeros)
+    EmitUnrolled(builder, dense, output);
+  else
+    EmitRows(builder, dense, output);
+
+  return output;
+}
+
+// Every output row is its own loop over the columns, with the row's
+// nonzeros unrolled inside and empty rows reduced to a fill with zeros
+void Hobbit::core::SparseMatMul::EmitUnrolled(llvm::IRBuilder<> &builder,
+                                              llvm::Value *dense,
+                                              llvm::Value *output) {
+  const CSR &csr = args_[0]->csr;
+  llvm::Constant *row_ptr = ConstantInitializer(csr.row_ptr);
+  llvm::Constant *col_idx = ConstantInitializer(csr.col_idx);
+  llvm::Constant *values = ConstantInitializer(csr.values);
+
+  llvm::Type *elt_type = ComputeType(ElementType(args_[1]));
+  const uint64_t vw = VectorWidth(elt_type);
+  const bool fma = args_[1]->parent_func->GetFPPolicy().fma;
+
+  for (uint64_t r = 0; r < args_[0]->shape.GetAxisSize(H); r++) {
+    const uint64_t begin = IndexAt(row_ptr, r);
+    const uint64_t end = IndexAt(row_ptr, r + 1);
+    llvm::Value *out_row = builder.CreateGEP(output, builder.getInt64(r * n_));
+
+    EmitVectorLoop(builder, "hobbit.sparse.row", n_, vw,
+                   [&](llvm::Value *j, bool vector) {
+      const unsigned lanes = vector ? vw : 1;
+      llvm::Value *acc = llvm::Constant::getNullValue(
+          vector ? llvm::VectorType::get(elt_type, vw) : elt_type);
+      for (uint64_t p = begin; p < end; p++) {
+        llvm::Value *v = ValueAt(values, p, elt_type);
+        if (vector)
+          v = builder.CreateVectorSplat(vw, v);
+        llvm::Value *x = EmitLoadCompute(
+            builder, dense,
+            builder.CreateAdd(j, builder.getInt64(IndexAt(col_idx, p) * n_)),
+            lanes);
+        acc = p == begin ? EmitMul(builder, v, x)
+                         : EmitMulAdd(builder, v, x, acc, fma);
+      }
+      EmitStoreCompute(builder, acc, out_row, j);
+    });
+  }
+}
+
+// The pattern is read as the rows are walked. Each row is done in blocks
+// of kSpmmVectors vectors of columns, then single vectors, then single
+// columns, with the block's accumulators held across the row's nonzeros.
+void Hobbit::core::SparseMatMul::EmitRows(llvm::IRBuilder<> &builder,
+                                          llvm::Value *dense,
+                                          llvm::Value *output) {
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+  const CSR &csr = args_[0]->csr;
+  llvm::Value *row_ptr = BufferPointer(builder, csr.row_ptr);
+  llvm::Value *col_idx = BufferPointer(builder, csr.col_idx);
+  llvm::Value *values = BufferPointer(builder, csr.values);
+
+  llvm::Type *elt_type = ComputeType(ElementType(args_[1]));
+  const uint64_t vw = VectorWidth(elt_type);
+  const bool fma = args_[1]->parent_func->GetFPPolicy().fma;
+  llvm::VectorType *vec_type = llvm::VectorType::get(elt_type, vw);
+
+  llvm::Value *vec_acc =
+      EntryAlloca(func, vec_type, kSpmmVectors, "hobbit.sparse.vacc");
+  llvm::Value *acc = EntryAlloca(func, elt_type, 1, "hobbit.sparse.acc");
+
+  const uint64_t n_blocks = n_ - n_ % (kSpmmVectors * vw);
+  const uint64_t n_vectors = n_ - n_ % vw;
+
+  EmitLoop(builder, "hobbit.sparse.row", builder.getInt64(0),
+           builder.getInt64(args_[0]->shape.GetAxisSize(H)), 1,
+           [&](llvm::Value *r) {
+    llvm::Value *begin = LoadIndex(builder, row_ptr, r);
+    llvm::Value *end =
+        LoadIndex(builder, row_ptr, builder.CreateAdd(r, builder.getInt64(1)));
+    llvm::Value *out_row =
+        builder.CreateGEP(output, builder.CreateMul(r, builder.getInt64(n_)));
+
+    auto block = [&](llvm::Value *j, uint64_t vectors, unsigned lanes) {
+      llvm::Value *accs = lanes == 1 ? acc : vec_acc;
+      llvm::Type *acc_type = lanes == 1 ? elt_type : vec_type;
+      auto acc_ptr = [&](uint64_t i) {
+        return builder.CreateGEP(accs, builder.getInt64(i));
+      };
+      auto column = [&](uint64_t i) {
+        return builder.CreateAdd(j, builder.getInt64(i * lanes));
+      };
+
+      for (uint64_t i = 0; i < vectors; i++)
+        builder.CreateStore(llvm::Constant::getNullValue(acc_type),
+                            acc_ptr(i));
+      EmitLoop(builder, "hobbit.sparse.nz", begin, end, 1,
+               [&](llvm::Value *p) {
+        llvm::Value *v = EmitLoadCompute(builder, values, p, 1);
+        if (lanes > 1)
+          v = builder.CreateVectorSplat(lanes, v);
+        llvm::Value *dense_row = builder.CreateGEP(
+            dense, builder.CreateMul(LoadIndex(builder, col_idx, p),
+                                     builder.getInt64(n_)));
+        for (uint64_t i = 0; i < vectors; i++) {
+          llvm::Value *x =
+              EmitLoadCompute(builder, dense_row, column(i), lanes);
+          builder.CreateStore(EmitMulAdd(builder, v, x,
+                                         builder.CreateLoad(acc_ptr(i)), fma),
+                              acc_ptr(i));
+        }
+      });
+      for (uint64_t i = 0; i < vectors; i++)
+        EmitStoreCompute(builder, builder.CreateLoad(acc_ptr(i)), out_row,
+                         column(i));
+    };
+
+    if (n_blocks > 0)
+      EmitLoop(builder, "hobbit.sparse.blocks", builder.getInt64(0),
+               builder.getInt64(n_blocks), kSpmmVectors * vw,
+               [&](llvm::Value *j) { block(j, kSpmmVectors, vw); });
+    if (n_vectors > n_blocks)
+      EmitLoop(builder, "hobbit.sparse.vectors", builder.getInt64(n_blocks),
+               builder.getInt64(n_vectors), vw,
+               [&](llvm::Value *j) { block(j, 1, vw); });
+    if (n_ > n_vectors)
+      EmitLoop(builder, "hobbit.sparse.tail", builder.getInt64(n_vectors),
+               builder.getInt64(n_), 1,
+               [&](llvm::Value *j) { block(j, 1, 1); });
+  });
+}
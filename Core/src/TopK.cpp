@@ -0,0 +1,330 @@
+//
+// Created by Aman LaChapelle on 4/2/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "Codegen.hpp"
+
+namespace {
+  // Independent (value, index) vector accumulators of the k = 1 argmax
+  const uint64_t kTopKAccumulators = 4;
+
+  // Does `kept` rank ahead of `val`? Bigger values first, NaN last, and
+  // ties keep the element that got there first (the smaller index, since
+  // rows are read in order).
+  llvm::Value *Ahead(llvm::IRBuilder<> &builder, llvm::Value *kept,
+                     llvm::Value *val) {
+    if (!val->getType()->isFPOrFPVectorTy())
+      return builder.CreateICmpSGE(kept, val);
+    return builder.CreateOr(builder.CreateFCmpOGE(kept, val),
+                            builder.CreateFCmpUNO(val, val));
+  }
+
+  // Argmax step: is (val, idx) better than (best, best_idx)? Ties go to the
+  // smaller index whatever order the lanes are combined in.
+  llvm::Value *ArgmaxBetter(llvm::IRBuilder<> &builder, llvm::Value *val,
+                            llvm::Value *idx, llvm::Value *best,
+                            llvm::Value *best_idx) {
+    llvm::Value *greater, *equal;
+    if (val->getType()->isFPOrFPVectorTy()) {
+      greater = builder.CreateFCmpOGT(val, best);
+      equal = builder.CreateFCmpOEQ(val, best);
+    } else {
+      greater = builder.CreateICmpSGT(val, best);
+      equal = builder.CreateICmpEQ(val, best);
+    }
+    llvm::Value *earlier = builder.CreateICmpULT(idx, best_idx);
+    return builder.CreateOr(greater, builder.CreateAnd(equal, earlier));
+  }
+
+  llvm::Value *Iota(llvm::IRBuilder<> &builder, uint64_t width) {
+    std::vector<llvm::Constant *> lanes;
+    for (uint64_t i = 0; i < width; i++)
+      lanes.push_back(builder.getInt64(i));
+    return llvm::ConstantVector::get(lanes);
+  }
+}
+
+void Hobbit::core::TopK::CheckArgs() {
+  if (args_.size() != 1)
+    throw IncorrectNumArgs("TopK");
+
+  const uint64_t w = args_[0]->shape.GetAxisSize(W);
+  if (params_.top_k == 0 || params_.top_k > w)
+    throw IncompatibleShapes("TopK");
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  if (elt_type == BitTy(elt_type->getContext()))
+    throw IncompatibleTypes("TopK");
+}
+
+Hobbit::Tensor *Hobbit::core::TopK::GetOutput() {
+  const Shape &shape = args_[0]->shape;
+  const Shape out_shape(shape.GetAxisSize(K), shape.GetAxisSize(H),
+                        params_.top_k);
+
+  Tensor *values =
+      Variable::Create(args_[0]->parent_func, args_[0]->type, out_shape);
+  indices_ = Variable::Create(
+      args_[0]->parent_func,
+      llvm::Type::getInt64PtrTy(args_[0]->type->getContext()), out_shape);
+
+  args_.push_back(values->GetSymbol());
+  args_.push_back(indices_->GetSymbol());
+
+  return values;
+}
+
+std::vector<Hobbit::Tensor *> Hobbit::core::TopK::GetExtraOutputs() {
+  return {indices_};
+}
+
+llvm::Value *Hobbit::core::TopK::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB =
+      llvm::BasicBlock::Create(func->getContext(), "hobbit.topk.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+  ApplyFPPolicy(builder, args_[0]);
+
+  llvm::Value *input = BufferPointer(builder, args_[0]);
+  llvm::Value *values = BufferPointer(builder, args_[1]);
+  llvm::Value *indices = BufferPointer(builder, args_[2]);
+
+  const Shape &shape = args_[0]->shape;
+  const uint64_t w = shape.GetAxisSize(W);
+  const uint64_t k = params_.top_k;
+
+  EmitLoop(builder, "hobbit.topk.row", builder.getInt64(0),
+           builder.getInt64(shape.GetAxisSize(K) * shape.GetAxisSize(H)), 1,
+           [&](llvm::Value *r) {
+    llvm::Value *in_row =
+        builder.CreateGEP(input, builder.CreateMul(r, builder.getInt64(w)));
+    llvm::Value *out_offset = builder.CreateMul(r, builder.getInt64(k));
+    llvm::Value *val_row = builder.CreateGEP(values, out_offset);
+    llvm::Value *idx_row = builder.CreateGEP(indices, out_offset);
+
+    if (k == 1)
+      EmitArgmax(builder, in_row, val_row, idx_row);
+    else
+      EmitSelect(builder, in_row, val_row, idx_row);
+  });
+
+  return values;
+}
+
+// kTopKAccumulators vector accumulators keep the best value and its index
+// per lane, they're merged pairwise and then across the lanes, and the
+// leftover columns are folded in one at a time. The value is read back from
+// the winning index, so it's the input element even for a row of NaNs.
+void Hobbit::core::TopK::EmitArgmax(llvm::IRBuilder<> &builder,
+                                    llvm::Value *in_row, llvm::Value *val_row,
+                                    llvm::Value *idx_row) {
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+  llvm::Type *elt_type = ComputeType(ElementType(args_[0]));
+  llvm::Type *idx_type = builder.getInt64Ty();
+  const uint64_t w = args_[0]->shape.GetAxisSize(W);
+  const uint64_t vw = VectorWidth(elt_type);
+  const uint64_t n_acc = std::min(kTopKAccumulators, w / vw);
+  const uint64_t step = n_acc * vw;
+  const uint64_t vec_end = n_acc > 0 ? w - w % step : 0;
+  const double inf = std::numeric_limits<double>::infinity();
+
+  llvm::VectorType *vec_type = llvm::VectorType::get(elt_type, vw);
+  llvm::VectorType *idx_vec_type = llvm::VectorType::get(idx_type, vw);
+
+  llvm::Value *best = EntryAlloca(func, elt_type, 1, "hobbit.topk.best");
+  llvm::Value *best_idx = EntryAlloca(func, idx_type, 1, "hobbit.topk.idx");
+  builder.CreateStore(ConstantValue(elt_type, -inf), best);
+  builder.CreateStore(builder.getInt64(0), best_idx);
+
+  // Folds (val, idx) into the pair at acc_ptr and idx_ptr
+  auto accumulate = [&](llvm::Value *acc_ptr, llvm::Value *idx_ptr,
+                        llvm::Value *val, llvm::Value *idx) {
+    llvm::Value *acc = builder.CreateLoad(acc_ptr);
+    llvm::Value *acc_idx = builder.CreateLoad(idx_ptr);
+    llvm::Value *better = ArgmaxBetter(builder, val, idx, acc, acc_idx);
+    builder.CreateStore(builder.CreateSelect(better, val, acc), acc_ptr);
+    builder.CreateStore(builder.CreateSelect(better, idx, acc_idx), idx_ptr);
+  };
+
+  if (n_acc > 0) {
+    llvm::Value *vec_acc =
+        EntryAlloca(func, vec_type, n_acc, "hobbit.topk.vacc");
+    llvm::Value *vec_idx =
+        EntryAlloca(func, idx_vec_type, n_acc, "hobbit.topk.vidx");
+    for (uint64_t a = 0; a < n_acc; a++) {
+      builder.CreateStore(ConstantValue(vec_type, -inf),
+                          builder.CreateGEP(vec_acc, builder.getInt64(a)));
+      builder.CreateStore(llvm::Constant::getNullValue(idx_vec_type),
+                          builder.CreateGEP(vec_idx, builder.getInt64(a)));
+    }
+
+    EmitLoop(builder, "hobbit.topk.vmax", builder.getInt64(0),
+             builder.getInt64(vec_end), step, [&](llvm::Value *c) {
+      for (uint64_t a = 0; a < n_acc; a++) {
+        llvm::Value *col = builder.CreateAdd(c, builder.getInt64(a * vw));
+        accumulate(builder.CreateGEP(vec_acc, builder.getInt64(a)),
+                   builder.CreateGEP(vec_idx, builder.getInt64(a)),
+                   EmitLoadCompute(builder, in_row, col, vw),
+                   builder.CreateAdd(builder.CreateVectorSplat(vw, col),
+                                     Iota(builder, vw)));
+      }
+    });
+
+    std::vector<llvm::Value *> vals, idxs;
+    for (uint64_t a = 0; a < n_acc; a++) {
+      vals.push_back(
+          builder.CreateLoad(builder.CreateGEP(vec_acc, builder.getInt64(a))));
+      idxs.push_back(
+          builder.CreateLoad(builder.CreateGEP(vec_idx, builder.getInt64(a))));
+    }
+    auto merge = [&](uint64_t dst, llvm::Value *val, llvm::Value *idx) {
+      llvm::Value *better =
+          ArgmaxBetter(builder, val, idx, vals[dst], idxs[dst]);
+      vals[dst] = builder.CreateSelect(better, val, vals[dst]);
+      idxs[dst] = builder.CreateSelect(better, idx, idxs[dst]);
+    };
+    for (uint64_t n = n_acc; n > 1; n = (n + 1) / 2) {
+      for (uint64_t a = 0; a + (n + 1) / 2 < n; a++)
+        merge(a, vals[a + (n + 1) / 2], idxs[a + (n + 1) / 2]);
+    }
+    for (uint64_t width = vw / 2; width > 0; width /= 2) {
+      llvm::SmallVector<uint32_t, 16> mask;
+      for (uint64_t i = 0; i < vw; i++)
+        mask.push_back(i < width ? i + width : i);
+      auto upper = [&](llvm::Value *v) {
+        return builder.CreateShuffleVector(
+            v, llvm::UndefValue::get(v->getType()), mask);
+      };
+      merge(0, upper(vals[0]), upper(idxs[0]));
+    }
+    builder.CreateStore(
+        builder.CreateExtractElement(vals[0], builder.getInt64(0)), best);
+    builder.CreateStore(
+        builder.CreateExtractElement(idxs[0], builder.getInt64(0)), best_idx);
+  }
+
+  EmitLoop(builder, "hobbit.topk.max", builder.getInt64(vec_end),
+           builder.getInt64(w), 1, [&](llvm::Value *c) {
+    accumulate(best, best_idx, EmitLoadCompute(builder, in_row, c, 1), c);
+  });
+
+  llvm::Value *idx = builder.CreateLoad(best_idx);
+  EmitStoreCompute(builder, EmitLoadCompute(builder, in_row, idx, 1), val_row,
+                   builder.getInt64(0));
+  builder.CreateStore(idx, idx_row);
+}
+
+// The output row itself is the selection: k slots kept sorted, best first.
+// The first k elements are inserted as they come, after that an element
+// only goes in if it beats the last slot. Whole vectors are compared
+// against that threshold first, and only the (rare, once the row has been
+// going a while) vectors with a lane that beats it are looked at one lane
+// at a time. Inserting is a branch-free pass over the slots that moves the
+// ones behind the new element down by one.
+void Hobbit::core::TopK::EmitSelect(llvm::IRBuilder<> &builder,
+                                    llvm::Value *in_row, llvm::Value *val_row,
+                                    llvm::Value *idx_row) {
+  llvm::Type *elt_type = ComputeType(ElementType(args_[0]));
+  const uint64_t w = args_[0]->shape.GetAxisSize(W);
+  const uint64_t k = params_.top_k;
+  const uint64_t vw = VectorWidth(elt_type);
+  const uint64_t vec_end = k + (w - k) - (w - k) % vw;
+
+  auto load_val = [&](llvm::Value *j) {
+    return EmitLoadCompute(builder, val_row, j, 1);
+  };
+  auto load_idx = [&](llvm::Value *j) {
+    return builder.CreateLoad(builder.CreateGEP(idx_row, j));
+  };
+
+  // Inserts (val, idx) into the first `count` slots, dropping the last one
+  // if they're all taken
+  auto insert = [&](llvm::Value *val, llvm::Value *idx, llvm::Value *count) {
+    auto ahead = [&](llvm::Value *j) {
+      return builder.CreateAnd(builder.CreateICmpULT(j, count),
+                               Ahead(builder, load_val(j), val));
+    };
+    // Slot j takes its own element, the new one or the one above it
+    auto update = [&](llvm::Value *j, llvm::Value *from_above,
+                      llvm::Value *above) {
+      llvm::Value *stays = ahead(j);
+      llvm::Value *new_val = builder.CreateSelect(
+          stays, load_val(j),
+          builder.CreateSelect(from_above, load_val(above), val));
+      llvm::Value *new_idx = builder.CreateSelect(
+          stays, load_idx(j),
+          builder.CreateSelect(from_above, load_idx(above), idx));
+      EmitStoreCompute(builder, new_val, val_row, j);
+      builder.CreateStore(new_idx, builder.CreateGEP(idx_row, j));
+    };
+
+    // Bottom up, so the slot above hasn't moved yet
+    EmitLoop(builder, "hobbit.topk.insert", builder.getInt64(0),
+             builder.getInt64(k - 1), 1, [&](llvm::Value *t) {
+      llvm::Value *j = builder.CreateSub(builder.getInt64(k - 1), t);
+      llvm::Value *above = builder.CreateSub(j, builder.getInt64(1));
+      update(j, builder.CreateNot(ahead(above)), above);
+    });
+    update(builder.getInt64(0), builder.getFalse(), builder.getInt64(0));
+  };
+
+  // Does val make it past the last slot?
+  auto beats_last = [&](llvm::Value *val) {
+    llvm::Value *last = load_val(builder.getInt64(k - 1));
+    if (val->getType()->isVectorTy())
+      last = builder.CreateVectorSplat(vw, last);
+    return builder.CreateNot(Ahead(builder, last, val));
+  };
+  auto consider = [&](llvm::Value *val, llvm::Value *idx) {
+    EmitIf(builder, "hobbit.topk.beats", beats_last(val),
+           [&]() { insert(val, idx, builder.getInt64(k)); });
+  };
+
+  EmitLoop(builder, "hobbit.topk.fill", builder.getInt64(0),
+           builder.getInt64(k), 1, [&](llvm::Value *c) {
+    insert(EmitLoadCompute(builder, in_row, c, 1), c, c);
+  });
+
+  EmitLoop(builder, "hobbit.topk.filter", builder.getInt64(k),
+           builder.getInt64(vec_end), vw, [&](llvm::Value *c) {
+    llvm::Value *vals = EmitLoadCompute(builder, in_row, c, vw);
+    llvm::Value *mask = builder.CreateBitCast(
+        beats_last(vals), builder.getIntNTy((unsigned)vw));
+    EmitIf(builder, "hobbit.topk.any",
+           builder.CreateICmpNE(mask, builder.getIntN((unsigned)vw, 0)),
+           [&]() {
+      for (uint64_t l = 0; l < vw; l++)
+        consider(builder.CreateExtractElement(vals, builder.getInt64(l)),
+                 builder.CreateAdd(c, builder.getInt64(l)));
+    });
+  });
+
+  EmitLoop(builder, "hobbit.topk.tail", builder.getInt64(vec_end),
+           builder.getInt64(w), 1, [&](llvm::Value *c) {
+    consider(EmitLoadCompute(builder, in_row, c, 1), c);
+  });
+}
@@ -0,0 +1,257 @@
+//
+// Created by Aman LaChapelle on 3/31/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include <algorithm>
+
+#include "Codegen.hpp"
+
+namespace {
+  // Side of the square tiles the blocks are walked in, so that the output
+  // lines a tile writes are still in cache when the next block fills them
+  const uint64_t kTransposeTile = 64;
+  // Largest in-register block. Bigger blocks are split across 128-bit
+  // registers on the baseline target and end up slower.
+  const uint64_t kTransposeMaxBlock = 4;
+
+  // Transposes the square block held in rows (rows[i] is row i) in
+  // log2(n) rounds of two-input shuffles. Round k swaps the off-diagonal
+  // k x k sub-blocks of every 2k x 2k block.
+  void TransposeBlock(llvm::IRBuilder<> &builder,
+                      std::vector<llvm::Value *> &rows) {
+    const uint64_t n = rows.size();
+    for (uint64_t k = n / 2; k > 0; k /= 2) {
+      llvm::SmallVector<uint32_t, 16> lo, hi;
+      for (uint64_t j = 0; j < n; j++) {
+        lo.push_back((j & k) ? n + j - k : j);
+        hi.push_back((j & k) ? n + j : j + k);
+      }
+      for (uint64_t i = 0; i < n; i++) {
+        if (i & k)
+          continue;
+        llvm::Value *a = rows[i], *b = rows[i + k];
+        rows[i] = builder.CreateShuffleVector(a, b, lo);
+        rows[i + k] = builder.CreateShuffleVector(a, b, hi);
+      }
+    }
+  }
+
+  uint64_t InputStride(const Hobbit::Shape &shape, Hobbit::Axis axis) {
+    if (axis == Hobbit::K)
+      return shape.GetAxisSize(Hobbit::H) * shape.GetAxisSize(Hobbit::W);
+    if (axis == Hobbit::H)
+      return shape.GetAxisSize(Hobbit::W);
+    return 1;
+  }
+}
+
+void Hobbit::core::Transpose::CheckArgs() {
+  if (args_.size() != 1)
+    throw IncorrectNumArgs("Transpose");
+  // Packed words can't be split into their elements
+  if (IsBit(ElementType(args_[0])))
+    throw IncompatibleTypes("Transpose");
+
+  std::vector<Axis> perm = params_.permutation;
+  if (perm.empty())
+    perm = {K, W, H};
+  const std::vector<Axis> axes = {K, H, W};
+  if (perm.size() != 3 ||
+      !std::is_permutation(perm.begin(), perm.end(), axes.begin()))
+    throw IncompatibleShapes("Transpose");
+
+  const Shape &shape = args_[0]->shape;
+  std::copy(perm.begin(), perm.end(), perm_);
+  out_shape_ = Shape(shape.GetAxisSize(perm_[0]), shape.GetAxisSize(perm_[1]),
+                     shape.GetAxisSize(perm_[2]));
+}
+
+Hobbit::Tensor *Hobbit::core::Transpose::GetOutput() {
+  Tensor *output_tensor =
+      Variable::Create(args_[0]->parent_func, args_[0]->type, out_shape_);
+
+  args_.push_back(output_tensor->GetSymbol());
+
+  return output_tensor;
+}
+
+llvm::Value *Hobbit::core::Transpose::Emit(llvm::Function *func) {
+  llvm::BasicBlock *entryBB = llvm::BasicBlock::Create(
+      func->getContext(), "hobbit.transpose.entry", func);
+
+  llvm::IRBuilder<> builder(entryBB);
+
+  llvm::Value *input = BufferPointer(builder, args_[0]);
+  llvm::Value *output = BufferPointer(builder, args_[1]);
+
+  if (perm_[2] == W)
+    EmitRowCopy(builder, input, output);
+  else
+    EmitBlocked(builder, input, output);
+
+  return output;
+}
+
+// W stays innermost, so whole rows move and only their order changes
+void Hobbit::core::Transpose::EmitRowCopy(llvm::IRBuilder<> &builder,
+                                          llvm::Value *input,
+                                          llvm::Value *output) {
+  const Shape &shape = args_[0]->shape;
+  const uint64_t w = shape.GetAxisSize(W);
+  const uint64_t vw = VectorWidth(ElementType(args_[0]));
+
+  EmitLoop(builder, "hobbit.transpose.o0", builder.getInt64(0),
+           builder.getInt64(out_shape_.GetAxisSize(K)), 1,
+           [&](llvm::Value *o0) {
+    EmitLoop(builder, "hobbit.transpose.o1", builder.getInt64(0),
+             builder.getInt64(out_shape_.GetAxisSize(H)), 1,
+             [&](llvm::Value *o1) {
+      llvm::Value *in_row = builder.CreateGEP(
+          input,
+          builder.CreateAdd(
+              builder.CreateMul(o0,
+                                builder.getInt64(InputStride(shape, perm_[0]))),
+              builder.CreateMul(
+                  o1, builder.getInt64(InputStride(shape, perm_[1])))));
+      llvm::Value *out_row = builder.CreateGEP(
+          output, builder.CreateMul(
+                      builder.CreateAdd(
+                          builder.CreateMul(
+                              o0, builder.getInt64(out_shape_.GetAxisSize(H))),
+                          o1),
+                      builder.getInt64(w)));
+
+      EmitVectorLoop(builder, "hobbit.transpose.copy", w, vw,
+                     [&](llvm::Value *i, bool vector) {
+        EmitStoreLanes(builder,
+                       EmitLoadLanes(builder, in_row, i, vector ? vw : 1),
+                       out_row, i);
+      });
+    });
+  });
+}
+
+// Input axis X becomes the output's contiguous axis, so every plane of the
+// remaining axis Z is a 2D transpose of {X, W}. The plane is cut into
+// kTransposeTile tiles, and those into square blocks that are loaded as
+// rows, transposed with shuffles and stored as rows. Leftover rows and
+// columns are copied one element at a time.
+void Hobbit::core::Transpose::EmitBlocked(llvm::IRBuilder<> &builder,
+                                          llvm::Value *input,
+                                          llvm::Value *output) {
+  const Shape &shape = args_[0]->shape;
+  const Axis x_axis = perm_[2];
+  const Axis z_axis = x_axis == K ? H : K;
+
+  // Output strides by input axis
+  uint64_t out_stride[3];
+  out_stride[perm_[0]] = out_shape_.GetAxisSize(H) * out_shape_.GetAxisSize(W);
+  out_stride[perm_[1]] = out_shape_.GetAxisSize(W);
+  out_stride[perm_[2]] = 1;
+
+  const uint64_t nx = shape.GetAxisSize(x_axis);
+  const uint64_t nw = shape.GetAxisSize(W);
+  const uint64_t in_x = InputStride(shape, x_axis);
+  const uint64_t out_w = out_stride[W];
+
+  const uint64_t b = std::min<uint64_t>(VectorWidth(ElementType(args_[0])),
+                                        kTransposeMaxBlock);
+  const uint64_t x_blocks = nx - nx % b, w_blocks = nw - nw % b;
+
+  // out[w * out_w + x] = in[x * in_x + w] within a plane
+  auto copy = [&](llvm::Value *in_plane, llvm::Value *out_plane,
+                  llvm::Value *x, llvm::Value *w) {
+    llvm::Value *val = builder.CreateLoad(builder.CreateGEP(
+        in_plane,
+        builder.CreateAdd(builder.CreateMul(x, builder.getInt64(in_x)), w)));
+    builder.CreateStore(
+        val, builder.CreateGEP(
+                 out_plane, builder.CreateAdd(
+                                builder.CreateMul(w, builder.getInt64(out_w)),
+                                x)));
+  };
+
+  EmitLoop(builder, "hobbit.transpose.z", builder.getInt64(0),
+           builder.getInt64(shape.GetAxisSize(z_axis)), 1,
+           [&](llvm::Value *z) {
+    llvm::Value *in_plane = builder.CreateGEP(
+        input,
+        builder.CreateMul(z, builder.getInt64(InputStride(shape, z_axis))));
+    llvm::Value *out_plane = builder.CreateGEP(
+        output, builder.CreateMul(z, builder.getInt64(out_stride[z_axis])));
+
+    EmitLoop(builder, "hobbit.transpose.xt", builder.getInt64(0),
+             builder.getInt64(x_blocks), kTransposeTile,
+             [&](llvm::Value *xt) {
+      llvm::Value *x_end = EmitMin(
+          builder, builder.CreateAdd(xt, builder.getInt64(kTransposeTile)),
+          builder.getInt64(x_blocks));
+      EmitLoop(builder, "hobbit.transpose.wt", builder.getInt64(0),
+               builder.getInt64(w_blocks), kTransposeTile,
+               [&](llvm::Value *wt) {
+        llvm::Value *w_end = EmitMin(
+            builder, builder.CreateAdd(wt, builder.getInt64(kTransposeTile)),
+            builder.getInt64(w_blocks));
+        EmitLoop(builder, "hobbit.transpose.x", xt, x_end, b,
+                 [&](llvm::Value *x) {
+          EmitLoop(builder, "hobbit.transpose.w", wt, w_end, b,
+                   [&](llvm::Value *w) {
+            std::vector<llvm::Value *> rows;
+            for (uint64_t i = 0; i < b; i++) {
+              llvm::Value *row = builder.CreateAdd(x, builder.getInt64(i));
+              rows.push_back(EmitLoadLanes(
+                  builder, in_plane,
+                  builder.CreateAdd(
+                      builder.CreateMul(row, builder.getInt64(in_x)), w),
+                  b));
+            }
+            TransposeBlock(builder, rows);
+            for (uint64_t i = 0; i < b; i++) {
+              llvm::Value *col = builder.CreateAdd(w, builder.getInt64(i));
+              EmitStoreLanes(
+                  builder, rows[i], out_plane,
+                  builder.CreateAdd(
+                      builder.CreateMul(col, builder.getInt64(out_w)), x));
+            }
+          });
+        });
+      });
+    });
+
+    // Columns past the last full block, then rows past it
+    EmitLoop(builder, "hobbit.transpose.xr", builder.getInt64(0),
+             builder.getInt64(x_blocks), 1, [&](llvm::Value *x) {
+      EmitLoop(builder, "hobbit.transpose.wr", builder.getInt64(w_blocks),
+               builder.getInt64(nw), 1, [&](llvm::Value *w) {
+        copy(in_plane, out_plane, x, w);
+      });
+    });
+    EmitLoop(builder, "hobbit.transpose.xe", builder.getInt64(x_blocks),
+             builder.getInt64(nx), 1, [&](llvm::Value *x) {
+      EmitLoop(builder, "hobbit.transpose.we", builder.getInt64(0),
+               builder.getInt64(nw), 1, [&](llvm::Value *w) {
+        copy(in_plane, out_plane, x, w);
+      });
+    });
+  });
+}
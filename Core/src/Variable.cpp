@@ -21,3 +21,51 @@
  */
 
 #include "Variable.hpp"
+
+#include <llvm/IR/DerivedTypes.h>
+
+Hobbit::SparseTensor::SparseTensor(std::unique_ptr<Function> &f,
+                                   const Shape &s, Tensor *row_ptr,
+                                   Tensor *col_idx, Tensor *values)
+    : Tensor(new core::Symbol(f, s, values->GetType())), row_ptr_(row_ptr),
+      col_idx_(col_idx), values_(values) {
+  s_->csr.row_ptr = row_ptr->GetSymbol();
+  s_->csr.col_idx = col_idx->GetSymbol();
+  s_->csr.values = values->GetSymbol();
+  f->AddSymbol(this, s_);
+}
+
+Hobbit::SparseVariable *
+Hobbit::SparseVariable::Create(std::unique_ptr<Function> &f, llvm::Type *type,
+                               const Shape &s, uint64_t nnz) {
+  core::Type<int *, 32> index_type;
+  Tensor *row_ptr =
+      Variable::Create(f, &index_type, Shape(1, 1, s.GetAxisSize(H) + 1));
+  Tensor *col_idx = Variable::Create(f, &index_type, Shape(1, 1, nnz));
+  Tensor *values = Variable::Create(f, type, Shape(1, 1, nnz));
+
+  return new SparseVariable(f, s, row_ptr, col_idx, values);
+}
+
+Hobbit::SparseConstant *
+Hobbit::SparseConstant::Create(std::unique_ptr<Function> &f, llvm::Type *type,
+                               const Shape &s, int32_t *row_ptr,
+                               int32_t *col_idx, void *values) {
+  const uint64_t rows = s.GetAxisSize(H);
+  const uint64_t nnz = row_ptr[rows];
+  llvm::Type *index_type = llvm::Type::getInt32PtrTy(*f->GetContext());
+  // A null buffer would make them variables. Nothing is read from them
+  // when there are no nonzeros.
+  if (nnz == 0) {
+    col_idx = row_ptr;
+    values = row_ptr;
+  }
+  Tensor *row_ptr_tensor =
+      Constant::Create(f, index_type, Shape(1, 1, rows + 1), row_ptr);
+  Tensor *col_idx_tensor =
+      Constant::Create(f, index_type, Shape(1, 1, nnz), col_idx);
+  Tensor *values_tensor = Constant::Create(f, type, Shape(1, 1, nnz), values);
+
+  return new SparseConstant(f, s, row_ptr_tensor, col_idx_tensor,
+                            values_tensor);
+}
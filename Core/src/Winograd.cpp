@@ -0,0 +1,400 @@
+//
+// Created by Aman LaChapelle on 3/26/18.
+//
+// Hobbit
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at Hobbit/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "OpNode.hpp"
+
+#include "Codegen.hpp"
+#include "Kernels.hpp"
+
+// Winograd minimal filtering (Lavin & Gray). An output tile Y (m x m) of a
+// 3x3 convolution is A^T [(G g G^T) . (B^T d B)] A for the a x a input
+// patch d, a = m + 2. The elementwise products over all channels are a
+// batch of a^2 GEMMs, which is where the multiplies are saved.
+
+namespace {
+  struct WinogradMatrices {
+    uint64_t m, a;
+    const double *bt; // a x a
+    const double *g;  // a x 3
+    const double *at; // m x a
+  };
+
+  const double kF2BT[] = {1, 0,  -1, 0, 0, 1, 1, 0,
+                          0, -1, 1,  0, 0, 1, 0, -1};
+  const double kF2G[] = {1, 0, 0, 0.5, 0.5, 0.5, 0.5, -0.5, 0.5, 0, 0, 1};
+  const double kF2AT[] = {1, 1, 1, 0, 0, 1, -1, -1};
+
+  const double kF4BT[] = {4,  0,  -5, 0,  1, 0, 0, -4, -4, 1,  1, 0,
+                          0,  4,  -4, -1, 1, 0, 0, -2, -1, 2,  1, 0,
+                          0,  2,  -1, -2, 1, 0, 0, 4,  0,  -5, 0, 1};
+  const double kF4G[] = {1.0 / 4,   0,          0,         -1.0 / 6,
+                         -1.0 / 6,  -1.0 / 6,   -1.0 / 6,  1.0 / 6,
+                         -1.0 / 6,  1.0 / 24,   1.0 / 12,  1.0 / 6,
+                         1.0 / 24,  -1.0 / 12,  1.0 / 6,   0,
+                         0,         1};
+  const double kF4AT[] = {1, 1, 1,  1, 1,  0, 0, 1, -1, 2,  -2, 0,
+                          0, 1, 1,  4, 4,  0, 0, 1, -1, 8,  -8, 1};
+
+  const WinogradMatrices kF2 = {2, 4, kF2BT, kF2G, kF2AT};
+  const WinogradMatrices kF4 = {4, 6, kF4BT, kF4G, kF4AT};
+
+  // sum(coeffs[k] * vals[k]) with the multiplies by 0 and +-1 folded away.
+  llvm::Value *EmitCombination(llvm::IRBuilder<> &builder,
+                               llvm::Type *elt_type, const double *coeffs,
+                               const std::vector<llvm::Value *> &vals) {
+    llvm::Value *sum = nullptr;
+    for (uint64_t k = 0; k < vals.size(); k++) {
+      const double c = coeffs[k];
+      if (c == 0)
+        continue;
+
+      llvm::Value *term = vals[k];
+      if (sum != nullptr && c == -1) {
+        sum = builder.CreateFSub(sum, term);
+        continue;
+      }
+      if (c != 1)
+        term = builder.CreateFMul(term, llvm::ConstantFP::get(elt_type, c));
+      sum = sum == nullptr ? term : builder.CreateFAdd(sum, term);
+    }
+
+    if (sum == nullptr)
+      return llvm::ConstantFP::get(elt_type, 0);
+    return sum;
+  }
+
+  // X^T d X for the q x q patch d (row-major) and p x q matrix X^T.
+  std::vector<llvm::Value *>
+  EmitTransform(llvm::IRBuilder<> &builder, llvm::Type *elt_type,
+                const double *xt, uint64_t p, uint64_t q,
+                const std::vector<llvm::Value *> &d) {
+    std::vector<llvm::Value *> tmp(p * q), out(p * p), terms(q);
+
+    for (uint64_t i = 0; i < p; i++) {
+      for (uint64_t c = 0; c < q; c++) {
+        for (uint64_t k = 0; k < q; k++)
+          terms[k] = d[k * q + c];
+        tmp[i * q + c] = EmitCombination(builder, elt_type, xt + i * q, terms);
+      }
+    }
+
+    for (uint64_t i = 0; i < p; i++) {
+      for (uint64_t j = 0; j < p; j++) {
+        for (uint64_t k = 0; k < q; k++)
+          terms[k] = tmp[i * q + k];
+        out[i * p + j] = EmitCombination(builder, elt_type, xt + j * q, terms);
+      }
+    }
+
+    return out;
+  }
+
+  // Host side version of EmitTransform for filters known at compile time.
+  void Transform(const double *xt, uint64_t p, uint64_t q, const double *d,
+                 double *out) {
+    std::vector<double> tmp(p * q, 0);
+    for (uint64_t i = 0; i < p; i++)
+      for (uint64_t c = 0; c < q; c++)
+        for (uint64_t k = 0; k < q; k++)
+          tmp[i * q + c] += xt[i * q + k] * d[k * q + c];
+
+    for (uint64_t i = 0; i < p; i++) {
+      for (uint64_t j = 0; j < p; j++) {
+        out[i * p + j] = 0;
+        for (uint64_t k = 0; k < q; k++)
+          out[i * p + j] += tmp[i * q + k] * xt[j * q + k];
+      }
+    }
+  }
+
+  double ConstantElement(llvm::Constant *array, uint64_t i) {
+    llvm::ConstantFP *elt =
+        llvm::cast<llvm::ConstantFP>(array->getAggregateElement(i));
+    llvm::APFloat val = elt->getValueAPF();
+    bool lost;
+    val.convert(llvm::APFloat::IEEEdouble(), llvm::APFloat::rmNearestTiesToEven,
+                &lost);
+    return val.convertToDouble();
+  }
+
+  uint64_t CeilDiv(uint64_t x, uint64_t y) { return (x + y - 1) / y; }
+}
+
+bool Hobbit::core::Conv2D::WinogradApplies() const {
+  const Shape &filter = args_[1]->shape;
+  return ElementType(args_[0])->isFloatingPointTy() &&
+         filter.GetAxisSize(H) == 3 && filter.GetAxisSize(W) == 3 &&
+         params_.stride_h == 1 && params_.stride_w == 1 &&
+         params_.dilation_h == 1 && params_.dilation_w == 1;
+}
+
+uint64_t Hobbit::core::Conv2D::WinogradElements(uint64_t tile) const {
+  const uint64_t alpha = tile + 2;
+  const uint64_t tiles = CeilDiv(h_out_, tile) * CeilDiv(w_out_, tile);
+  return alpha * alpha * tiles * (args_[0]->shape.GetAxisSize(K) + c_out_);
+}
+
+// The three transforms each get their own pass over memory so that the
+// middle step is a plain (batched) GEMM:
+//   U[xi][co][ci] = (G g G^T)[xi]            (folded at JIT time if constant)
+//   V[xi][ci][t]  = (B^T d B)[xi]            per input tile t
+//   M[xi]         = U[xi] * V[xi]            alpha^2 GEMMs
+//   Y             = A^T M A                  per output tile, edges clipped
+void Hobbit::core::Conv2D::EmitWinograd(llvm::IRBuilder<> &builder,
+                                        llvm::Value *input,
+                                        llvm::Value *filter,
+                                        llvm::Value *output, uint64_t tile) {
+  llvm::Function *func = builder.GetInsertBlock()->getParent();
+
+  const WinogradMatrices &mat = tile == 4 ? kF4 : kF2;
+  const uint64_t m = mat.m;
+  const uint64_t alpha = mat.a;
+  const uint64_t alpha2 = alpha * alpha;
+
+  const Shape &in_shape = args_[0]->shape;
+  const uint64_t c_in = in_shape.GetAxisSize(K);
+  const uint64_t h = in_shape.GetAxisSize(H);
+  const uint64_t w = in_shape.GetAxisSize(W);
+  const uint64_t tiles_h = CeilDiv(h_out_, m);
+  const uint64_t tiles_w = CeilDiv(w_out_, m);
+  const uint64_t tiles = tiles_h * tiles_w;
+
+  llvm::Type *elt_type = ElementType(args_[0]);
+  llvm::Value *zero = llvm::Constant::getNullValue(elt_type);
+  llvm::Value *i64_0 = builder.getInt64(0);
+
+  // Filter transform
+  llvm::Value *u;
+  llvm::Constant *filter_init = ConstantInitializer(args_[1]);
+  if (filter_init != nullptr) {
+    std::vector<llvm::Constant *> u_elts(alpha2 * c_out_ * c_in);
+    std::vector<double> g(9), ug(alpha2);
+    for (uint64_t co = 0; co < c_out_; co++) {
+      for (uint64_t ci = 0; ci < c_in; ci++) {
+        for (uint64_t i = 0; i < 9; i++)
+          g[i] = ConstantElement(filter_init, (co * c_in + ci) * 9 + i);
+        Transform(mat.g, alpha, 3, g.data(), ug.data());
+        for (uint64_t xi = 0; xi < alpha2; xi++)
+          u_elts[(xi * c_out_ + co) * c_in + ci] =
+              llvm::ConstantFP::get(elt_type, ug[xi]);
+      }
+    }
+    u = GlobalConstant(
+        func->getParent(),
+        llvm::ConstantArray::get(
+            llvm::ArrayType::get(elt_type, u_elts.size()), u_elts));
+  } else {
+    u = EntryAlloca(func, elt_type, alpha2 * c_out_ * c_in,
+                    "hobbit.winograd.u");
+    EmitLoop(builder, "hobbit.winograd.fco", i64_0, builder.getInt64(c_out_),
+             1, [&](llvm::Value *co) {
+      EmitLoop(builder, "hobbit.winograd.fci", i64_0, builder.getInt64(c_in),
+               1, [&](llvm::Value *ci) {
+        llvm::Value *idx = builder.CreateAdd(
+            builder.CreateMul(co, builder.getInt64(c_in)), ci);
+        llvm::Value *src = builder.CreateGEP(
+            filter, builder.CreateMul(idx, builder.getInt64(9)));
+
+        std::vector<llvm::Value *> g(9);
+        for (uint64_t i = 0; i < 9; i++)
+          g[i] = builder.CreateLoad(
+              builder.CreateGEP(src, builder.getInt64(i)));
+
+        std::vector<llvm::Value *> ug =
+            EmitTransform(builder, elt_type, mat.g, alpha, 3, g);
+        for (uint64_t xi = 0; xi < alpha2; xi++) {
+          llvm::Value *dst = builder.CreateGEP(
+              u, builder.CreateAdd(builder.getInt64(xi * c_out_ * c_in), idx));
+          builder.CreateStore(ug[xi], dst);
+        }
+      });
+    });
+  }
+
+  // Input transform. Patches overlap by two rows/columns and hang off the
+  // padded edges, anything outside the input reads as zero.
+  llvm::Value *v =
+      EntryAlloca(func, elt_type, alpha2 * c_in * tiles, "hobbit.winograd.v");
+  EmitLoop(builder, "hobbit.winograd.ci", i64_0, builder.getInt64(c_in), 1,
+           [&](llvm::Value *ci) {
+    llvm::Value *in_channel = builder.CreateGEP(
+        input, builder.CreateMul(ci, builder.getInt64(h * w)));
+
+    EmitLoop(builder, "hobbit.winograd.th", i64_0, builder.getInt64(tiles_h),
+             1, [&](llvm::Value *th) {
+      EmitLoop(builder, "hobbit.winograd.tw", i64_0, builder.getInt64(tiles_w),
+               1, [&](llvm::Value *tw) {
+        // May wrap around, which fails the unsigned bounds checks
+        llvm::Value *ih0 =
+            builder.CreateSub(builder.CreateMul(th, builder.getInt64(m)),
+                              builder.getInt64(params_.pad_h));
+        llvm::Value *iw0 =
+            builder.CreateSub(builder.CreateMul(tw, builder.getInt64(m)),
+                              builder.getInt64(params_.pad_w));
+
+        std::vector<llvm::Value *> row_ok(alpha), col_ok(alpha), rows(alpha),
+            cols(alpha);
+        for (uint64_t i = 0; i < alpha; i++) {
+          rows[i] = builder.CreateAdd(ih0, builder.getInt64(i));
+          row_ok[i] = builder.CreateICmpULT(rows[i], builder.getInt64(h));
+          cols[i] = builder.CreateAdd(iw0, builder.getInt64(i));
+          col_ok[i] = builder.CreateICmpULT(cols[i], builder.getInt64(w));
+        }
+
+        std::vector<llvm::Value *> d(alpha2);
+        for (uint64_t i = 0; i < alpha; i++) {
+          for (uint64_t j = 0; j < alpha; j++) {
+            llvm::Value *ok = builder.CreateAnd(row_ok[i], col_ok[j]);
+            llvm::Value *offset = builder.CreateSelect(
+                ok,
+                builder.CreateAdd(
+                    builder.CreateMul(rows[i], builder.getInt64(w)), cols[j]),
+                i64_0);
+            d[i * alpha + j] = builder.CreateSelect(
+                ok, builder.CreateLoad(builder.CreateGEP(in_channel, offset)),
+                zero);
+          }
+        }
+
+        std::vector<llvm::Value *> vd =
+            EmitTransform(builder, elt_type, mat.bt, alpha, alpha, d);
+
+        llvm::Value *t = builder.CreateAdd(
+            builder.CreateMul(th, builder.getInt64(tiles_w)), tw);
+        llvm::Value *dst = builder.CreateGEP(
+            v, builder.CreateAdd(
+                   builder.CreateMul(ci, builder.getInt64(tiles)), t));
+        for (uint64_t xi = 0; xi < alpha2; xi++) {
+          builder.CreateStore(
+              vd[xi],
+              builder.CreateGEP(dst, builder.getInt64(xi * c_in * tiles)));
+        }
+      });
+    });
+  });
+
+  // One {C_out x C_in} * {C_in x tiles} GEMM per transform position
+  llvm::Value *prod = EntryAlloca(func, elt_type, alpha2 * c_out_ * tiles,
+                                  "hobbit.winograd.m");
+  EmitLoop(builder, "hobbit.winograd.xi", i64_0, builder.getInt64(alpha2), 1,
+           [&](llvm::Value *xi) {
+    GemmOperands ops;
+    ops.a = builder.CreateGEP(
+        u, builder.CreateMul(xi, builder.getInt64(c_out_ * c_in)));
+    ops.b = builder.CreateGEP(
+        v, builder.CreateMul(xi, builder.getInt64(c_in * tiles)));
+    ops.c = builder.CreateGEP(
+        prod, builder.CreateMul(xi, builder.getInt64(c_out_ * tiles)));
+    ops.m = c_out_;
+    ops.n = tiles;
+    ops.k = c_in;
+    ops.lda = c_in;
+    ops.ldb = tiles;
+    ops.ldc = tiles;
+    EmitGemm(builder, ops);
+  });
+
+  // Output transform, tiles on the bottom/right edge go through a staging
+  // buffer and only their valid part is copied out
+  llvm::Value *staging =
+      EntryAlloca(func, elt_type, m * m, "hobbit.winograd.y");
+  EmitLoop(builder, "hobbit.winograd.co", i64_0, builder.getInt64(c_out_), 1,
+           [&](llvm::Value *co) {
+    llvm::Value *out_channel = builder.CreateGEP(
+        output, builder.CreateMul(co, builder.getInt64(h_out_ * w_out_)));
+
+    EmitLoop(builder, "hobbit.winograd.oh", i64_0, builder.getInt64(tiles_h),
+             1, [&](llvm::Value *th) {
+      EmitLoop(builder, "hobbit.winograd.ow", i64_0, builder.getInt64(tiles_w),
+               1, [&](llvm::Value *tw) {
+        llvm::Value *t = builder.CreateAdd(
+            builder.CreateMul(th, builder.getInt64(tiles_w)), tw);
+        llvm::Value *src = builder.CreateGEP(
+            prod, builder.CreateAdd(
+                      builder.CreateMul(co, builder.getInt64(tiles)), t));
+
+        std::vector<llvm::Value *> md(alpha2);
+        for (uint64_t xi = 0; xi < alpha2; xi++) {
+          md[xi] = builder.CreateLoad(builder.CreateGEP(
+              src, builder.getInt64(xi * c_out_ * tiles)));
+        }
+
+        std::vector<llvm::Value *> y =
+            EmitTransform(builder, elt_type, mat.at, m, alpha, md);
+
+        llvm::Value *oh0 = builder.CreateMul(th, builder.getInt64(m));
+        llvm::Value *ow0 = builder.CreateMul(tw, builder.getInt64(m));
+        llvm::Value *dst = builder.CreateGEP(
+            out_channel,
+            builder.CreateAdd(
+                builder.CreateMul(oh0, builder.getInt64(w_out_)), ow0));
+        llvm::Value *full = builder.CreateAnd(
+            builder.CreateICmpULE(builder.CreateAdd(oh0, builder.getInt64(m)),
+                                  builder.getInt64(h_out_)),
+            builder.CreateICmpULE(builder.CreateAdd(ow0, builder.getInt64(m)),
+                                  builder.getInt64(w_out_)));
+
+        EmitIf(builder, "hobbit.winograd.full", full,
+               [&]() {
+                 for (uint64_t i = 0; i < m; i++) {
+                   for (uint64_t j = 0; j < m; j++) {
+                     builder.CreateStore(
+                         y[i * m + j],
+                         builder.CreateGEP(
+                             dst, builder.getInt64(i * w_out_ + j)));
+                   }
+                 }
+               },
+               [&]() {
+                 for (uint64_t i = 0; i < m * m; i++) {
+                   builder.CreateStore(
+                       y[i], builder.CreateGEP(staging, builder.getInt64(i)));
+                 }
+
+                 llvm::Value *rows = EmitMin(
+                     builder, builder.getInt64(m),
+                     builder.CreateSub(builder.getInt64(h_out_), oh0));
+                 llvm::Value *cols = EmitMin(
+                     builder, builder.getInt64(m),
+                     builder.CreateSub(builder.getInt64(w_out_), ow0));
+                 EmitLoop(builder, "hobbit.winograd.edge.i", i64_0, rows, 1,
+                          [&](llvm::Value *i) {
+                   EmitLoop(builder, "hobbit.winograd.edge.j", i64_0, cols, 1,
+                            [&](llvm::Value *j) {
+                     llvm::Value *val = builder.CreateLoad(builder.CreateGEP(
+                         staging,
+                         builder.CreateAdd(
+                             builder.CreateMul(i, builder.getInt64(m)), j)));
+                     builder.CreateStore(
+                         val,
+                         builder.CreateGEP(
+                             dst, builder.CreateAdd(
+                                      builder.CreateMul(
+                                          i, builder.getInt64(w_out_)),
+                                      j)));
+                   });
+                 });
+               });
+      });
+    });
+  });
+}
@@ -20,6 +20,11 @@
     limitations under the License.
  */
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include <random>
 
 #include <gtest/gtest.h>
@@ -43,148 +48,2548 @@ template <size_t N> float ref_sdot(float *lhs, float *rhs) {
 
 using namespace Hobbit;
 
+// Emits func with the signature args into module, compiles it at -O3 for
+// the default target and returns a pointer to it
+void *build_and_jit(Module &module, std::unique_ptr<Function> &func,
+                    const std::vector<Tensor *> &args) {
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  return module.GetFunctionPtr(func->GetName());
+}
+
+// Builds a single Conv2D with the given params, runs it on random data and
+// checks it against a naive loop nest. With constant_filter the filter is
+// baked into the function instead of being an argument. Returns how long the
+// convolution itself took, in seconds.
+double check_conv2d(const OpParams &params, uint64_t c_in, uint64_t h,
+                    uint64_t w, uint64_t c_out, uint64_t r_size,
+                    uint64_t s_size, bool constant_filter = false) {
+  llvm::LLVMContext ctx;
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(0.0, 1.0);
+
+  std::vector<float> in_data(c_in * h * w),
+      filter_data(c_out * c_in * r_size * s_size);
+  for (auto &v : in_data)
+    v = dis(gen);
+  for (auto &v : filter_data)
+    v = dis(gen);
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> type;
+  Shape filter_shape(c_out * c_in, r_size, s_size);
+  Tensor *input, *filter, *output;
+  EXPECT_NO_THROW(input = Variable::Create(func, &type, Shape(c_in, h, w)));
+  if (constant_filter) {
+    EXPECT_NO_THROW(filter = Constant::Create(func, &type, filter_shape,
+                                              filter_data.data()));
+  } else {
+    EXPECT_NO_THROW(filter = Variable::Create(func, &type, filter_shape));
+  }
+  EXPECT_NO_THROW(output = func->AddOpNode({input, filter}, CONV2D, params));
+
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(filter));
+
+  void *conv = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  const Shape &out_shape = output->GetShape();
+  const uint64_t h_out = out_shape.GetAxisSize(H);
+  const uint64_t w_out = out_shape.GetAxisSize(W);
+  std::vector<float> out_data(out_shape.GetSize());
+
+  auto start = std::chrono::high_resolution_clock::now();
+  if (constant_filter) {
+    ((void (*)(float *, float *))conv)(in_data.data(), out_data.data());
+  } else {
+    ((void (*)(float *, float *, float *))conv)(
+        in_data.data(), filter_data.data(), out_data.data());
+  }
+  auto finish = std::chrono::high_resolution_clock::now();
+
+  // Everything is positive, so ref is also the scale the error is relative to
+  const float tolerance = std::max(5e-6f, params.conv_tolerance);
+  for (uint64_t co = 0; co < c_out; co++) {
+    for (uint64_t oh = 0; oh < h_out; oh++) {
+      for (uint64_t ow = 0; ow < w_out; ow++) {
+        float ref = 0;
+        for (uint64_t ci = 0; ci < c_in; ci++) {
+          for (uint64_t r = 0; r < r_size; r++) {
+            for (uint64_t s = 0; s < s_size; s++) {
+              int64_t ih = oh * params.stride_h + r * params.dilation_h -
+                           params.pad_h;
+              int64_t iw = ow * params.stride_w + s * params.dilation_w -
+                           params.pad_w;
+              if (ih < 0 || ih >= (int64_t)h || iw < 0 || iw >= (int64_t)w)
+                continue;
+              ref += in_data[(ci * h + ih) * w + iw] *
+                     filter_data[((co * c_in + ci) * r_size + r) * s_size + s];
+            }
+          }
+        }
+        EXPECT_NEAR(out_data[(co * h_out + oh) * w_out + ow], ref,
+                    ref * tolerance);
+      }
+    }
+  }
+
+  std::chrono::duration<double> elapsed = (finish - start);
+  return elapsed.count();
+}
+
+// Reduces a random {k, h, w} tensor over params.reduce_axes and checks it
+// against a naive loop. Argmax gets a handful of distinct values so there
+// are plenty of ties to break.
+void check_reduce(OpCode op, const OpParams &params, uint64_t k, uint64_t h,
+                  uint64_t w, bool reassociate = false) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  FPPolicy policy;
+  policy.reassociate = reassociate;
+  func->SetFPPolicy(policy);
+
+  core::Type<float *, 32> type;
+  Tensor *input, *output;
+  EXPECT_NO_THROW(input = Variable::Create(func, &type, Shape(k, h, w)));
+  EXPECT_NO_THROW(output = func->AddOpNode({input}, op, params));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+
+  void *reduce = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(0.0, 1.0);
+
+  std::vector<float> in_data(k * h * w);
+  for (auto &v : in_data)
+    v = op == REDUCE_ARGMAX ? std::floor(dis(gen) * 4) : dis(gen);
+
+  const Shape &out_shape = output->GetShape();
+  std::vector<float> out_data(out_shape.GetSize());
+  std::vector<int64_t> out_idx(out_shape.GetSize());
+  if (op == REDUCE_ARGMAX)
+    ((void (*)(float *, int64_t *))reduce)(in_data.data(), out_idx.data());
+  else
+    ((void (*)(float *, float *))reduce)(in_data.data(), out_data.data());
+
+  std::vector<Axis> axes = params.reduce_axes;
+  if (axes.empty())
+    axes = {K, H, W};
+  auto reduced = [&](Axis a) {
+    return std::find(axes.begin(), axes.end(), a) != axes.end();
+  };
+  const uint64_t rk = reduced(K) ? k : 1, rh = reduced(H) ? h : 1,
+                 rw = reduced(W) ? w : 1;
+
+  for (uint64_t ok = 0; ok < out_shape.GetAxisSize(K); ok++) {
+    for (uint64_t oh = 0; oh < out_shape.GetAxisSize(H); oh++) {
+      for (uint64_t ow = 0; ow < out_shape.GetAxisSize(W); ow++) {
+        double sum = 0;
+        float best_max = -INFINITY, best_min = INFINITY;
+        int64_t best_idx = 0, idx = 0;
+        for (uint64_t ik = 0; ik < rk; ik++) {
+          for (uint64_t ih = 0; ih < rh; ih++) {
+            for (uint64_t iw = 0; iw < rw; iw++, idx++) {
+              float v = in_data[((ok + ik) * h + oh + ih) * w + ow + iw];
+              sum += v;
+              best_min = std::min(best_min, v);
+              if (v > best_max) {
+                best_max = v;
+                best_idx = idx;
+              }
+            }
+          }
+        }
+
+        const uint64_t o = (ok * out_shape.GetAxisSize(H) + oh) *
+                               out_shape.GetAxisSize(W) + ow;
+        switch (op) {
+        case REDUCE_SUM:
+          EXPECT_NEAR(out_data[o], sum, sum * 1e-5);
+          break;
+        case REDUCE_MEAN:
+          EXPECT_NEAR(out_data[o], sum / idx, sum / idx * 1e-5);
+          break;
+        case REDUCE_MAX:
+          EXPECT_EQ(out_data[o], best_max);
+          break;
+        case REDUCE_MIN:
+          EXPECT_EQ(out_data[o], best_min);
+          break;
+        default:
+          EXPECT_EQ(out_idx[o], best_idx);
+          break;
+        }
+      }
+    }
+  }
+}
+
+void check_softmax(OpCode op, uint64_t k, uint64_t h, uint64_t w) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> type;
+  Tensor *input, *output;
+  EXPECT_NO_THROW(input = Variable::Create(func, &type, Shape(k, h, w)));
+  EXPECT_NO_THROW(output = func->AddOpNode({input}, op));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+
+  void *softmax = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(-20.0, 20.0);
+
+  std::vector<float> in_data(k * h * w), out_data(k * h * w);
+  for (auto &v : in_data)
+    v = dis(gen);
+
+  ((void (*)(float *, float *))softmax)(in_data.data(), out_data.data());
+
+  for (uint64_t r = 0; r < k * h; r++) {
+    const float *x = &in_data[r * w];
+    double max = -INFINITY, sum = 0;
+    for (uint64_t i = 0; i < w; i++)
+      max = std::max(max, (double)x[i]);
+    for (uint64_t i = 0; i < w; i++)
+      sum += std::exp(x[i] - max);
+    for (uint64_t i = 0; i < w; i++) {
+      double expected = x[i] - max - std::log(sum);
+      if (op == LOG_SOFTMAX) {
+        EXPECT_NEAR(out_data[r * w + i], expected, 1e-4);
+      } else {
+        EXPECT_NEAR(out_data[r * w + i], std::exp(expected),
+                    std::exp(expected) * 1e-5);
+      }
+    }
+  }
+}
+
+// Largest error of an activation against the libm reference, relative to
+// max(|reference|, floor)
+template <typename T, unsigned int BITS>
+double check_activation(OpCode op, MathAccuracy accuracy, T lo, T hi,
+                        double floor) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  FPPolicy policy;
+  policy.math = accuracy;
+  func->SetFPPolicy(policy);
+
+  const uint64_t n = 10007;
+  core::Type<T *, BITS> type;
+  Tensor *input, *output;
+  EXPECT_NO_THROW(input = Variable::Create(func, &type, Shape(1, 1, n)));
+  EXPECT_NO_THROW(output = func->AddOpNode({input}, op));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+
+  void (*activation)(T *, T *) = (void (*)(T *, T *))build_and_jit(
+      module, func, func->GetSignatureArgs({output}));
+
+  std::vector<T> in_data(n), out_data(n);
+  for (uint64_t i = 0; i < n; i++)
+    in_data[i] = lo + (hi - lo) * i / (n - 1);
+
+  activation(in_data.data(), out_data.data());
+
+  double max_error = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    const double x = in_data[i];
+    double expected;
+    switch (op) {
+    case EXP:
+      expected = std::exp(x);
+      break;
+    case LOG:
+      expected = std::log(x);
+      break;
+    case TANH:
+      expected = std::tanh(x);
+      break;
+    case SIGMOID:
+      expected = 1 / (1 + std::exp(-x));
+      break;
+    case ERF:
+      expected = std::erf(x);
+      break;
+    default:
+      expected = x * (1 + std::erf(x * M_SQRT1_2)) / 2;
+      break;
+    }
+    max_error = std::max(max_error, std::abs(out_data[i] - expected) /
+                                        std::max(std::abs(expected), floor));
+  }
+  return max_error;
+}
+
+void check_pool(OpCode op, const OpParams &params, uint64_t k, uint64_t h,
+                uint64_t w) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> type;
+  Tensor *input, *output;
+  EXPECT_NO_THROW(input = Variable::Create(func, &type, Shape(k, h, w)));
+  EXPECT_NO_THROW(output = func->AddOpNode({input}, op, params));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+
+  void *pool = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(-1.0, 1.0);
+
+  std::vector<float> in_data(k * h * w);
+  for (auto &v : in_data)
+    v = dis(gen);
+
+  const Shape &out_shape = output->GetShape();
+  const uint64_t h_out = out_shape.GetAxisSize(H);
+  const uint64_t w_out = out_shape.GetAxisSize(W);
+  EXPECT_EQ(h_out,
+            (h + 2 * params.pad_h - params.pool_h) / params.stride_h + 1);
+  EXPECT_EQ(w_out,
+            (w + 2 * params.pad_w - params.pool_w) / params.stride_w + 1);
+  std::vector<float> out_data(out_shape.GetSize());
+
+  ((void (*)(float *, float *))pool)(in_data.data(), out_data.data());
+
+  for (uint64_t kk = 0; kk < k; kk++) {
+    for (uint64_t oh = 0; oh < h_out; oh++) {
+      for (uint64_t ow = 0; ow < w_out; ow++) {
+        float max = -INFINITY, sum = 0;
+        int count = 0;
+        for (uint64_t r = 0; r < params.pool_h; r++) {
+          for (uint64_t c = 0; c < params.pool_w; c++) {
+            int64_t ih = oh * params.stride_h + r - params.pad_h;
+            int64_t iw = ow * params.stride_w + c - params.pad_w;
+            if (ih < 0 || ih >= (int64_t)h || iw < 0 || iw >= (int64_t)w)
+              continue;
+            float v = in_data[(kk * h + ih) * w + iw];
+            max = std::max(max, v);
+            sum += v;
+            count++;
+          }
+        }
+        float result = out_data[(kk * h_out + oh) * w_out + ow];
+        if (op == POOL_MAX) {
+          EXPECT_EQ(result, max);
+        } else {
+          EXPECT_NEAR(result, sum / count, 1e-5);
+        }
+      }
+    }
+  }
+}
+
+void check_transpose(const std::vector<Axis> &perm, uint64_t k, uint64_t h,
+                     uint64_t w) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  OpParams params;
+  params.permutation = perm;
+
+  core::Type<float *, 32> type;
+  Tensor *input, *output;
+  EXPECT_NO_THROW(input = Variable::Create(func, &type, Shape(k, h, w)));
+  EXPECT_NO_THROW(output = func->AddOpNode({input}, TRANSPOSE, params));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+
+  void *transpose =
+      build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::vector<float> in_data(k * h * w), out_data(k * h * w);
+  for (uint64_t i = 0; i < in_data.size(); i++)
+    in_data[i] = i;
+
+  ((void (*)(float *, float *))transpose)(in_data.data(), out_data.data());
+
+  const std::vector<Axis> p = perm.empty() ? std::vector<Axis>{K, W, H} : perm;
+  const Shape &out_shape = output->GetShape();
+  const uint64_t in_sizes[3] = {k, h, w};
+  for (int i = 0; i < 3; i++)
+    EXPECT_EQ(out_shape.GetAxisSize(Axis(i)), in_sizes[p[i]]);
+
+  uint64_t idx[3], errors = 0;
+  for (idx[0] = 0; idx[0] < k; idx[0]++) {
+    for (idx[1] = 0; idx[1] < h; idx[1]++) {
+      for (idx[2] = 0; idx[2] < w; idx[2]++) {
+        const uint64_t o = (idx[p[0]] * out_shape.GetAxisSize(H) + idx[p[1]]) *
+                               out_shape.GetAxisSize(W) + idx[p[2]];
+        errors += out_data[o] != in_data[(idx[0] * h + idx[1]) * w + idx[2]];
+      }
+    }
+  }
+  EXPECT_EQ(errors, 0);
+}
+
+int32_t requantize_ref(int64_t acc, float multiplier, int32_t zero_point) {
+  const float scaled = (float)acc * multiplier;
+  int64_t q = (int64_t)(scaled + (scaled < 0 ? -0.5f : 0.5f)) + zero_point;
+  return (int32_t)std::min<int64_t>(127, std::max<int64_t>(-128, q));
+}
+
+// Fills lhs (k x m x depth) and rhs (1 x depth x n) with random int8, runs
+// QGEMM (or QDOT when m == n == 0) and compares to the int64 reference.
+// host compiles for this CPU, with whatever dot product instructions it has
+void check_quantized(const OpParams &params, uint64_t k, uint64_t m,
+                     uint64_t depth, uint64_t n, bool host = false) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+  if (host)
+    module.TargetHost();
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  const bool dot = m == 0;
+  const Shape lhs_shape = dot ? Shape(1, 1, depth) : Shape(k, m, depth);
+  const Shape rhs_shape = dot ? Shape(1, 1, depth) : Shape(1, depth, n);
+  if (dot)
+    k = m = n = 1;
+
+  core::Type<int *, 8> type;
+  Tensor *lhs, *rhs, *output;
+  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, lhs_shape));
+  EXPECT_NO_THROW(rhs = Variable::Create(func, &type, rhs_shape));
+  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, dot ? QDOT : QGEMM,
+                                           params));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  void *kernel = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::mt19937 gen(7);
+  std::uniform_int_distribution<int> dist(-128, 127);
+  std::vector<int8_t> lhs_data(k * m * depth), rhs_data(depth * n);
+  for (auto &v : lhs_data)
+    v = dist(gen);
+  for (auto &v : rhs_data)
+    v = dist(gen);
+  std::vector<int8_t> out8(k * m * n);
+  std::vector<int32_t> out32(k * m * n);
+  void *out_data = params.requantize ? (void *)out8.data() : out32.data();
+
+  ((void (*)(int8_t *, int8_t *, void *))kernel)(lhs_data.data(),
+                                                 rhs_data.data(), out_data);
+
+  auto channel = [](const std::vector<int32_t> &v, uint64_t j) {
+    return v.size() == 1 ? v[0] : v[j];
+  };
+  auto scale = [](const std::vector<float> &v, uint64_t j) {
+    return v.size() == 1 ? v[0] : v[j];
+  };
+  const int32_t za = params.lhs_quant.zero_point[0];
+
+  uint64_t errors = 0;
+  for (uint64_t b = 0; b < k; b++) {
+    for (uint64_t i = 0; i < m; i++) {
+      for (uint64_t j = 0; j < n; j++) {
+        const int32_t zb = channel(params.rhs_quant.zero_point, j);
+        int64_t acc = 0;
+        for (uint64_t d = 0; d < depth; d++)
+          acc += (int64_t)(lhs_data[(b * m + i) * depth + d] - za) *
+                 (rhs_data[d * n + j] - zb);
+        const uint64_t o = (b * m + i) * n + j;
+        if (params.requantize) {
+          const float multiplier = params.lhs_quant.scale[0] *
+                                   scale(params.rhs_quant.scale, j) /
+                                   params.out_quant.scale[0];
+          const int32_t expected =
+              requantize_ref(acc, multiplier, params.out_quant.zero_point[0]);
+          // Float rounding of the product can land on either side of .5
+          errors += std::abs(out8[o] - expected) > 1;
+        } else {
+          errors += out32[o] != acc;
+        }
+      }
+    }
+  }
+  EXPECT_EQ(errors, 0);
+}
+
+float half_to_float_ref(uint16_t h) {
+  const int e = (h >> 10) & 0x1f, m = h & 0x3ff;
+  float v;
+  if (e == 0)
+    v = std::ldexp((float)m, -24);
+  else if (e == 31)
+    v = m ? std::numeric_limits<float>::quiet_NaN()
+          : std::numeric_limits<float>::infinity();
+  else
+    v = std::ldexp((float)(m | 0x400), e - 25);
+  return (h & 0x8000) ? -v : v;
+}
+
+// Round to nearest even, through the FPU's default rounding mode
+uint16_t float_to_half_ref(float f) {
+  const uint16_t sign = std::signbit(f) ? 0x8000 : 0;
+  const double a = std::fabs((double)f);
+  if (std::isnan(f))
+    return sign | 0x7e00;
+  // Halfway between the largest half and 2^16 rounds up
+  if (a >= 65520.0)
+    return sign | 0x7c00;
+  if (a < std::ldexp(1.0, -14))
+    return sign | (uint16_t)std::nearbyint(std::ldexp(a, 24));
+  int e;
+  std::frexp(a, &e);
+  const double m = std::nearbyint(std::ldexp(a, 11 - e));
+  return sign | (uint16_t)(((e + 14) << 10) + (uint64_t)m - 1024);
+}
+
+float bfloat16_to_float_ref(uint16_t h) {
+  const uint32_t u = (uint32_t)h << 16;
+  float f;
+  std::memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+// Whichever of the two bfloat16s around f is nearer, the even one on a tie
+uint16_t float_to_bfloat16_ref(float f) {
+  uint32_t u;
+  std::memcpy(&u, &f, sizeof(u));
+  if (std::isnan(f))
+    return (u >> 16) | 0x40;
+  const uint16_t lo = u >> 16, hi = lo + 1;
+  if (std::isinf(f) || (u & 0xffff) == 0)
+    return lo;
+  // Past the largest bfloat16 the next step up is 2^128, which is infinity
+  const double v_hi = (hi & 0x7f80) == 0x7f80
+                          ? std::copysign(std::ldexp(1.0, 128), f)
+                          : bfloat16_to_float_ref(hi);
+  const double d_lo = std::fabs((double)f - bfloat16_to_float_ref(lo));
+  const double d_hi = std::fabs((double)f - v_hi);
+  if (d_lo < d_hi || (d_lo == d_hi && (lo & 1) == 0))
+    return lo;
+  return hi;
+}
+
+// The 16 bit storage formats, with the casts into and out of them
+struct HalfFormat {
+  typedef core::Type<float *, 16> Type;
+  static const OpCode kCast = CAST_HALF;
+  static float ToFloat(uint16_t h) { return half_to_float_ref(h); }
+  static uint16_t FromFloat(float f) { return float_to_half_ref(f); }
+};
+
+struct BFloat16Format {
+  typedef core::Type<core::bfloat16 *, 16> Type;
+  static const OpCode kCast = CAST_BFLOAT16;
+  static float ToFloat(uint16_t h) { return bfloat16_to_float_ref(h); }
+  static uint16_t FromFloat(float f) { return float_to_bfloat16_ref(f); }
+};
+
+// CAST_FLOAT of every 16 bit value, and the cast into Format of edge cases,
+// halfway points and random floats
+template <typename Format> void check_cast() {
+  std::vector<uint16_t> halfs(1 << 16);
+  for (uint64_t i = 0; i < halfs.size(); i++)
+    halfs[i] = i;
+
+  std::mt19937 gen(3);
+  std::uniform_int_distribution<uint32_t> bits;
+  std::vector<float> floats = {0.0f, -0.0f, 65504.0f, 65519.99f, 65520.0f,
+                               1e9f, std::ldexp(1.0f, -24),
+                               std::ldexp(1.0f, -25), std::ldexp(3.0f, -26),
+                               std::ldexp(1.5f, -25),
+                               std::numeric_limits<float>::infinity(),
+                               -std::numeric_limits<float>::infinity(),
+                               std::numeric_limits<float>::quiet_NaN(),
+                               std::numeric_limits<float>::max(),
+                               std::numeric_limits<float>::denorm_min()};
+  // Halfway points between neighbouring finite values
+  for (uint32_t h = 0; h < 0x7bff; h += 7)
+    floats.push_back(
+        (Format::ToFloat(h) + Format::ToFloat(h + 1)) / 2);
+  while (floats.size() < 200000) {
+    uint32_t u = bits(gen);
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    floats.push_back(f);
+  }
+
+  for (OpCode op : {CAST_FLOAT, Format::kCast}) {
+    llvm::LLVMContext ctx;
+
+    Module module("test_module", ctx);
+
+    std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+    typename Format::Type f16;
+    core::Type<float *, 32> f32;
+    const uint64_t size = op == CAST_FLOAT ? halfs.size() : floats.size();
+    Tensor *input, *output;
+    if (op == CAST_FLOAT) {
+      EXPECT_NO_THROW(input = Variable::Create(func, &f16, Shape(1, 1, size)));
+    } else {
+      EXPECT_NO_THROW(input = Variable::Create(func, &f32, Shape(1, 1, size)));
+    }
+    EXPECT_NO_THROW(output = func->AddOpNode({input}, op));
+    EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+
+    void *cast = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+    uint64_t errors = 0;
+    if (op == CAST_FLOAT) {
+      std::vector<float> out(size);
+      ((void (*)(uint16_t *, float *))cast)(halfs.data(), out.data());
+      for (uint64_t i = 0; i < size; i++) {
+        const float ref = Format::ToFloat(halfs[i]);
+        if (std::isnan(ref))
+          errors += !std::isnan(out[i]);
+        else
+          errors += std::memcmp(&ref, &out[i], sizeof(float)) != 0;
+      }
+    } else {
+      std::vector<uint16_t> out(size);
+      ((void (*)(float *, uint16_t *))cast)(floats.data(), out.data());
+
+      for (uint64_t i = 0; i < size; i++)
+        errors += out[i] != Format::FromFloat(floats[i]);
+    }
+    EXPECT_EQ(errors, 0);
+  }
+}
+
+// SDOT, GEMM or ADD on 16 bit inputs with random values in [-1, 1), against
+// a double reference. 16 bit outputs have to be the reference correctly
+// rounded, give or take an ulp for the order of the float accumulation.
+// host compiles for this CPU, with whatever conversion and dot product
+// instructions it has, and lets sums be reordered so the latter get used.
+template <typename Format>
+void check_16bit_op(OpCode op, const Shape &lhs_shape,
+                    const Shape &rhs_shape, bool float_output,
+                    bool host = false) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+  if (host)
+    module.TargetHost();
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  if (host) {
+    FPPolicy policy;
+    policy.reassociate = true;
+    func->SetFPPolicy(policy);
+  }
+
+  OpParams params;
+  params.float_output = float_output;
+
+  typename Format::Type type;
+  Tensor *lhs, *rhs, *output;
+  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, lhs_shape));
+  EXPECT_NO_THROW(rhs = Variable::Create(func, &type, rhs_shape));
+  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, op, params));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  void *kernel = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::mt19937 gen(5);
+  std::uniform_real_distribution<float> dis(-1.0, 1.0);
+  std::vector<uint16_t> a(lhs_shape.GetSize()), b(rhs_shape.GetSize());
+  for (auto &v : a)
+    v = Format::FromFloat(dis(gen));
+  for (auto &v : b)
+    v = Format::FromFloat(dis(gen));
+
+  const Shape &out_shape = output->GetShape();
+  std::vector<double> ref(out_shape.GetSize(), 0.0);
+  if (op == ADD) {
+    for (uint64_t i = 0; i < ref.size(); i++)
+      ref[i] = Format::ToFloat(a[i]) + Format::ToFloat(b[i]);
+  } else {
+    // SDOT is a 1 x n by n x 1 GEMM
+    const uint64_t m = op == SDOT ? 1 : lhs_shape.GetAxisSize(H);
+    const uint64_t k = op == SDOT ? a.size() : lhs_shape.GetAxisSize(W);
+    const uint64_t n = op == SDOT ? 1 : rhs_shape.GetAxisSize(W);
+    for (uint64_t i = 0; i < m; i++)
+      for (uint64_t j = 0; j < n; j++)
+        for (uint64_t p = 0; p < k; p++)
+          ref[i * n + j] += (double)Format::ToFloat(a[i * k + p]) *
+                            Format::ToFloat(b[p * n + j]);
+  }
+
+  std::vector<float> out32(ref.size());
+  std::vector<uint16_t> out16(ref.size());
+  void *out_data = float_output && op != ADD ? (void *)out32.data()
+                                             : (void *)out16.data();
+
+  ((void (*)(uint16_t *, uint16_t *, void *))kernel)(a.data(), b.data(),
+                                                     out_data);
+
+  uint64_t errors = 0;
+  for (uint64_t i = 0; i < ref.size(); i++) {
+    if (out_data == out32.data()) {
+      errors += std::fabs(out32[i] - ref[i]) > 1e-5 * (1 + std::fabs(ref[i]));
+    } else {
+      const int expected = Format::FromFloat((float)ref[i]);
+      const int slack = op == ADD ? 0 : 1;
+      errors += std::abs(out16[i] - expected) > slack;
+    }
+  }
+  EXPECT_EQ(errors, 0);
+}
+
+// SPMV (n == 0) or SPMM of a random m x k CSR matrix with the given share
+// of nonzeros, against a dense double reference. A constant matrix is
+// compiled into the function, a variable one is passed in. With half every
+// tensor is half, and the reference uses the rounded values.
+void check_sparse(uint64_t m, uint64_t k, uint64_t n, double density,
+                  bool constant, bool half = false) {
+  std::mt19937 gen(11);
+  std::uniform_real_distribution<float> dis(-1.0, 1.0);
+  std::bernoulli_distribution keep(density);
+  auto round = [&](float f) {
+    return half ? half_to_float_ref(float_to_half_ref(f)) : f;
+  };
+  std::vector<int32_t> row_ptr = {0}, col_idx;
+  std::vector<float> values;
+  for (uint64_t r = 0; r < m; r++) {
+    for (uint64_t c = 0; c < k; c++) {
+      if (keep(gen)) {
+        col_idx.push_back(c);
+        values.push_back(round(dis(gen)));
+      }
+    }
+    row_ptr.push_back(col_idx.size());
+  }
+
+  // What the function sees: the floats, or their half encodings
+  auto storage = [&](const std::vector<float> &v) {
+    std::vector<uint16_t> h(v.size());
+    for (uint64_t i = 0; i < v.size(); i++)
+      h[i] = float_to_half_ref(v[i]);
+    return h;
+  };
+  std::vector<uint16_t> half_values = storage(values);
+  void *values_data =
+      half ? (void *)half_values.data() : (void *)values.data();
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  const bool spmv = n == 0;
+  const Shape rhs_shape = spmv ? Shape(1, 1, k) : Shape(1, k, n);
+  if (spmv)
+    n = 1;
+
+  llvm::Type *type =
+      half ? llvm::Type::getHalfPtrTy(ctx) : llvm::Type::getFloatPtrTy(ctx);
+  SparseTensor *lhs;
+  Tensor *rhs, *output;
+  if (constant) {
+    EXPECT_NO_THROW(lhs = SparseConstant::Create(
+                        func, type, Shape(1, m, k), row_ptr.data(),
+                        col_idx.data(), values_data));
+  } else {
+    EXPECT_NO_THROW(lhs = SparseVariable::Create(func, type, Shape(1, m, k),
+                                                 values.size()));
+  }
+  EXPECT_NO_THROW(rhs = Variable::Create(func, type, rhs_shape));
+  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, spmv ? SPMV : SPMM));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+  EXPECT_EQ(args.size(), 5);
+  EXPECT_EQ(args[0], lhs->GetRowPointers());
+  EXPECT_EQ(args[2], lhs->GetValues());
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  void *kernel = module.GetFunctionPtr("test_func");
+
+  std::vector<float> x(k * n), out(m * n);
+  for (auto &v : x)
+    v = round(dis(gen));
+  std::vector<uint16_t> half_x = storage(x), half_out(m * n);
+  void *x_data = half ? (void *)half_x.data() : (void *)x.data();
+  void *out_data = half ? (void *)half_out.data() : (void *)out.data();
+
+  if (constant)
+    ((void (*)(void *, void *))kernel)(x_data, out_data);
+  else
+    ((void (*)(int32_t *, int32_t *, void *, void *, void *))kernel)(
+        row_ptr.data(), col_idx.data(), values_data, x_data, out_data);
+
+  if (half) {
+    for (uint64_t i = 0; i < out.size(); i++)
+      out[i] = half_to_float_ref(half_out[i]);
+  }
+
+  // The half output is rounded once more at the end
+  const double tolerance = half ? 1e-3 : 1e-5;
+  uint64_t errors = 0;
+  for (uint64_t r = 0; r < m; r++) {
+    for (uint64_t j = 0; j < n; j++) {
+      double ref = 0;
+      for (int32_t p = row_ptr[r]; p < row_ptr[r + 1]; p++)
+        ref += (double)values[p] * x[col_idx[p] * n + j];
+      errors +=
+          std::fabs(out[r * n + j] - ref) > tolerance * (1 + std::fabs(ref));
+    }
+  }
+  EXPECT_EQ(errors, 0);
+}
+
+// Element w of row r of a bit tensor with n elements per row
+bool packed_bit(const std::vector<uint64_t> &words, uint64_t n, uint64_t r,
+                uint64_t w) {
+  return (words[r * ((n + 63) / 64) + w / 64] >> (w % 64)) & 1;
+}
+
+// BDOT or BGEMM on random bits, padding included, against the +-1 dot
+// products. With constant_rhs the rhs is compiled into the function.
+void check_binary(OpCode op, const Shape &lhs_shape, const Shape &rhs_shape,
+                  bool constant_rhs) {
+  const uint64_t n = lhs_shape.GetAxisSize(W);
+  const uint64_t words = (n + 63) / 64;
+  std::mt19937_64 gen(13);
+  std::vector<uint64_t> a(lhs_shape.GetAxisSize(K) *
+                          lhs_shape.GetAxisSize(H) * words),
+      b(rhs_shape.GetAxisSize(K) * rhs_shape.GetAxisSize(H) * words);
+  for (auto &v : a)
+    v = gen();
+  for (auto &v : b)
+    v = gen();
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<core::bit *, 1> type;
+  Tensor *lhs, *rhs, *output;
+  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, lhs_shape));
+  if (constant_rhs) {
+    EXPECT_NO_THROW(rhs = Constant::Create(func, &type, rhs_shape,
+                                           (core::bit *)b.data()));
+  } else {
+    EXPECT_NO_THROW(rhs = Variable::Create(func, &type, rhs_shape));
+  }
+  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, op));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  void *kernel = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  const Shape &out_shape = output->GetShape();
+  std::vector<int32_t> out(out_shape.GetSize());
+
+  if (constant_rhs)
+    ((void (*)(uint64_t *, int32_t *))kernel)(a.data(), out.data());
+  else
+    ((void (*)(uint64_t *, uint64_t *, int32_t *))kernel)(a.data(), b.data(),
+                                                          out.data());
+
+  auto dot = [&](uint64_t lhs_row, uint64_t rhs_row) {
+    int32_t sum = 0;
+    for (uint64_t w = 0; w < n; w++)
+      sum += packed_bit(a, n, lhs_row, w) == packed_bit(b, n, rhs_row, w)
+                 ? 1
+                 : -1;
+    return sum;
+  };
+
+  uint64_t errors = 0;
+  if (op == BDOT) {
+    int32_t ref = 0;
+    for (uint64_t r = 0; r < a.size() / words; r++)
+      ref += dot(r, r);
+    errors += out[0] != ref;
+  } else {
+    const uint64_t m = lhs_shape.GetAxisSize(H);
+    const uint64_t p = rhs_shape.GetAxisSize(H);
+    const bool rhs_batched = rhs_shape.GetAxisSize(K) != 1;
+    for (uint64_t k = 0; k < lhs_shape.GetAxisSize(K); k++)
+      for (uint64_t i = 0; i < m; i++)
+        for (uint64_t j = 0; j < p; j++)
+          errors += out[(k * m + i) * p + j] !=
+                    dot(k * m + i, (rhs_batched ? k * p : 0) + j);
+  }
+  EXPECT_EQ(errors, 0);
+}
+
+// BINARIZE of floats with zeros and NaNs mixed in, checked word for word
+// (padding has to come out zero), then straight into a BGEMM
+void check_binarize(const Shape &shape) {
+  const uint64_t n = shape.GetAxisSize(W);
+  const uint64_t rows = shape.GetAxisSize(K) * shape.GetAxisSize(H);
+  const uint64_t words = (n + 63) / 64;
+  std::mt19937 gen(17);
+  std::uniform_real_distribution<float> dis(-1.0, 1.0);
+  std::vector<float> x(shape.GetSize());
+  for (uint64_t i = 0; i < x.size(); i++) {
+    x[i] = dis(gen);
+    if (i % 13 == 0)
+      x[i] = i % 2 ? 0.0f : -0.0f;
+    if (i % 17 == 0)
+      x[i] = std::numeric_limits<float>::quiet_NaN();
+  }
+  std::mt19937_64 bits(19);
+  std::vector<uint64_t> b(3 * words);
+  for (auto &v : b)
+    v = bits();
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> f32;
+  core::Type<core::bit *, 1> bit;
+  Tensor *input, *rhs, *packed, *output;
+  EXPECT_NO_THROW(input = Variable::Create(func, &f32, shape));
+  EXPECT_NO_THROW(rhs = Variable::Create(func, &bit, Shape(1, 3, n)));
+  EXPECT_NO_THROW(packed = func->AddOpNode({input}, BINARIZE));
+  EXPECT_NO_THROW(output = func->AddOpNode({packed, rhs}, BGEMM));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  void *kernel =
+      build_and_jit(module, func, func->GetSignatureArgs({packed, output}));
+
+  std::vector<uint64_t> out(rows * words);
+  std::vector<int32_t> scores(rows * 3);
+  ((void (*)(float *, uint64_t *, uint64_t *, int32_t *))kernel)(
+      x.data(), b.data(), out.data(), scores.data());
+
+  uint64_t errors = 0;
+  std::vector<uint64_t> ref(rows * words, 0);
+  for (uint64_t r = 0; r < rows; r++)
+    for (uint64_t w = 0; w < n; w++)
+      if (x[r * n + w] >= 0)
+        ref[r * words + w / 64] |= (uint64_t)1 << (w % 64);
+  for (uint64_t i = 0; i < ref.size(); i++)
+    errors += out[i] != ref[i];
+  for (uint64_t r = 0; r < rows; r++) {
+    for (uint64_t j = 0; j < 3; j++) {
+      int32_t dot = 0;
+      for (uint64_t w = 0; w < n; w++)
+        dot += packed_bit(ref, n, r, w) == packed_bit(b, n, j, w) ? 1 : -1;
+      errors += scores[r * 3 + j] != dot;
+    }
+  }
+  EXPECT_EQ(errors, 0);
+}
+
+// GATHER of n rows of a rows x d table, with indices past either end mixed
+// in. It's a copy, so the table is random bits of the storage type T
+// compared bit for bit. Index is int32_t or int64_t. host compiles for this
+// CPU, so short rows use its gather instruction if it has one.
+template <typename T, typename Index, typename TableType>
+void check_gather(TableType *type, uint64_t rows, uint64_t d, uint64_t n,
+                  bool host = false) {
+  std::mt19937_64 gen(23);
+  std::vector<T> table(rows * d);
+  for (auto &v : table)
+    v = gen();
+  std::vector<Index> indices(n);
+  for (uint64_t i = 0; i < n; i++) {
+    indices[i] = gen() % rows;
+    if (i % 11 == 5)
+      indices[i] = i % 2 ? -1 : rows;
+  }
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+  if (host)
+    module.TargetHost();
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<int *, sizeof(Index) * 8> index_type;
+  Tensor *table_tensor, *index_tensor, *output;
+  EXPECT_NO_THROW(table_tensor = Variable::Create(func, type,
+                                                  Shape(1, rows, d)));
+  EXPECT_NO_THROW(index_tensor = Variable::Create(func, &index_type,
+                                                  Shape(1, 1, n)));
+  EXPECT_NO_THROW(output =
+                      func->AddOpNode({table_tensor, index_tensor}, GATHER));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(table_tensor));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(index_tensor));
+  EXPECT_TRUE(output->GetShape() == Shape(1, n, d));
+
+  void *kernel = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::vector<T> out(n * d);
+  ((void (*)(T *, Index *, T *))kernel)(table.data(), indices.data(),
+                                        out.data());
+
+  uint64_t errors = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    const bool valid = indices[i] >= 0 && (uint64_t)indices[i] < rows;
+    for (uint64_t j = 0; j < d; j++)
+      errors += out[i * d + j] != (valid ? table[indices[i] * d + j] : 0);
+  }
+  EXPECT_EQ(errors, 0);
+}
+
+// SCATTER_ADD of n random float rows into a rows x d table, with repeated
+// indices and ones outside the table
+void check_scatter_add(uint64_t rows, uint64_t d, uint64_t n) {
+  std::mt19937 gen(29);
+  std::uniform_real_distribution<float> dis(-1.0, 1.0);
+  std::vector<float> table(rows * d), updates(n * d);
+  for (auto &v : table)
+    v = dis(gen);
+  for (auto &v : updates)
+    v = dis(gen);
+  std::vector<int32_t> indices(n);
+  for (uint64_t i = 0; i < n; i++)
+    indices[i] = i % 7 == 3 ? -5 : gen() % (rows / 2 + 1);
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> f32;
+  core::Type<int *, 32> i32;
+  Tensor *table_tensor, *index_tensor, *update_tensor, *output;
+  EXPECT_NO_THROW(table_tensor = Variable::Create(func, &f32,
+                                                  Shape(1, rows, d)));
+  EXPECT_NO_THROW(index_tensor = Variable::Create(func, &i32, Shape(1, 1, n)));
+  EXPECT_NO_THROW(update_tensor = Variable::Create(func, &f32,
+                                                   Shape(1, n, d)));
+  EXPECT_NO_THROW(output = func->AddOpNode(
+                      {table_tensor, index_tensor, update_tensor},
+                      SCATTER_ADD));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(table_tensor));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(index_tensor));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(update_tensor));
+
+  void *kernel = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::vector<float> out(rows * d);
+  ((void (*)(float *, int32_t *, float *, float *))kernel)(
+      table.data(), indices.data(), updates.data(), out.data());
+
+  // Same order of additions, so the result is exact
+  std::vector<float> ref = table;
+  for (uint64_t i = 0; i < n; i++) {
+    if (indices[i] < 0 || (uint64_t)indices[i] >= rows)
+      continue;
+    for (uint64_t j = 0; j < d; j++)
+      ref[indices[i] * d + j] += updates[i * d + j];
+  }
+
+  uint64_t errors = 0;
+  for (uint64_t i = 0; i < ref.size(); i++)
+    errors += out[i] != ref[i];
+  EXPECT_EQ(errors, 0);
+}
+
+void check_attention(uint64_t batch, uint64_t kv_batch, uint64_t lq,
+                     uint64_t lk, uint64_t d, uint64_t dv) {
+  std::mt19937 gen(31);
+  std::uniform_real_distribution<float> dis(-2.0, 2.0);
+  std::vector<float> q(batch * lq * d), k(kv_batch * lk * d),
+      v(kv_batch * lk * dv);
+  for (auto *data : {&q, &k, &v})
+    for (auto &x : *data)
+      x = dis(gen);
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> f32;
+  Tensor *q_tensor, *k_tensor, *v_tensor, *output;
+  EXPECT_NO_THROW(q_tensor = Variable::Create(func, &f32, Shape(batch, lq, d)));
+  EXPECT_NO_THROW(k_tensor =
+                      Variable::Create(func, &f32, Shape(kv_batch, lk, d)));
+  EXPECT_NO_THROW(v_tensor =
+                      Variable::Create(func, &f32, Shape(kv_batch, lk, dv)));
+  EXPECT_NO_THROW(output = func->AddOpNode({q_tensor, k_tensor, v_tensor},
+                                           ATTENTION));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(q_tensor));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(k_tensor));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(v_tensor));
+
+  void *kernel = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::vector<float> out(batch * lq * dv);
+  ((void (*)(float *, float *, float *, float *))kernel)(
+      q.data(), k.data(), v.data(), out.data());
+
+  // Materialized scores and a two-pass softmax in double
+  std::vector<double> scores(lk);
+  for (uint64_t b = 0; b < batch; b++) {
+    const uint64_t kv = kv_batch == 1 ? 0 : b;
+    for (uint64_t i = 0; i < lq; i++) {
+      double max = -INFINITY, sum = 0;
+      for (uint64_t j = 0; j < lk; j++) {
+        double s = 0;
+        for (uint64_t c = 0; c < d; c++)
+          s += (double)q[(b * lq + i) * d + c] * k[(kv * lk + j) * d + c];
+        scores[j] = s / std::sqrt((double)d);
+        max = std::max(max, scores[j]);
+      }
+      for (uint64_t j = 0; j < lk; j++) {
+        scores[j] = std::exp(scores[j] - max);
+        sum += scores[j];
+      }
+      for (uint64_t c = 0; c < dv; c++) {
+        double expected = 0;
+        for (uint64_t j = 0; j < lk; j++)
+          expected += scores[j] * v[(kv * lk + j) * dv + c];
+        EXPECT_NEAR(out[(b * lq + i) * dv + c], expected / sum, 1e-4);
+      }
+    }
+  }
+}
+
+void check_recurrent(OpCode op, uint64_t batch, uint64_t input,
+                     uint64_t hidden) {
+  const uint64_t gates = op == LSTM_CELL ? 4 : 3;
+  const uint64_t n = gates * hidden;
+  const uint64_t state_k = op == LSTM_CELL ? 2 : 1;
+  const uint64_t bias_h = op == LSTM_CELL ? 1 : 2;
+
+  std::mt19937 gen(37);
+  std::uniform_real_distribution<float> dis(-1.0, 1.0);
+  std::vector<float> x(batch * input), state(state_k * batch * hidden),
+      weights((input + hidden) * n), bias(bias_h * n);
+  for (auto *data : {&x, &state, &weights, &bias})
+    for (auto &v : *data)
+      v = dis(gen);
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> f32;
+  Tensor *x_tensor, *state_tensor, *weight_tensor, *bias_tensor, *output;
+  EXPECT_NO_THROW(x_tensor =
+                      Variable::Create(func, &f32, Shape(1, batch, input)));
+  EXPECT_NO_THROW(state_tensor = Variable::Create(
+                      func, &f32, Shape(state_k, batch, hidden)));
+  EXPECT_NO_THROW(weight_tensor = Constant::Create(
+                      func, &f32, Shape(1, input + hidden, n),
+                      weights.data()));
+  EXPECT_NO_THROW(bias_tensor = Constant::Create(
+                      func, &f32, Shape(1, bias_h, n), bias.data()));
+  EXPECT_NO_THROW(output = func->AddOpNode(
+                      {x_tensor, state_tensor, weight_tensor, bias_tensor},
+                      op));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(x_tensor));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(state_tensor));
+
+  void *kernel = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::vector<float> out(state.size());
+  ((void (*)(float *, float *, float *))kernel)(x.data(), state.data(),
+                                                out.data());
+
+  auto sigmoid = [](double v) { return 1.0 / (1.0 + std::exp(-v)); };
+  for (uint64_t b = 0; b < batch; b++) {
+    // Input and hidden halves of every gate
+    std::vector<double> gx(n), gh(n);
+    for (uint64_t c = 0; c < n; c++) {
+      gx[c] = bias[c];
+      gh[c] = op == LSTM_CELL ? 0 : bias[n + c];
+      for (uint64_t i = 0; i < input; i++)
+        gx[c] += (double)x[b * input + i] * weights[i * n + c];
+      for (uint64_t i = 0; i < hidden; i++)
+        gh[c] += (double)state[b * hidden + i] * weights[(input + i) * n + c];
+    }
+    for (uint64_t j = 0; j < hidden; j++) {
+      const double h = state[b * hidden + j];
+      if (op == LSTM_CELL) {
+        double in = sigmoid(gx[j] + gh[j]);
+        double forget = sigmoid(gx[hidden + j] + gh[hidden + j]);
+        double cand = std::tanh(gx[2 * hidden + j] + gh[2 * hidden + j]);
+        double o = sigmoid(gx[3 * hidden + j] + gh[3 * hidden + j]);
+        double c = forget * state[(batch + b) * hidden + j] + in * cand;
+        EXPECT_NEAR(out[b * hidden + j], o * std::tanh(c), 1e-5);
+        EXPECT_NEAR(out[(batch + b) * hidden + j], c, 1e-5);
+      } else {
+        double r = sigmoid(gx[j] + gh[j]);
+        double z = sigmoid(gx[hidden + j] + gh[hidden + j]);
+        double cand = std::tanh(gx[2 * hidden + j] + r * gh[2 * hidden + j]);
+        EXPECT_NEAR(out[b * hidden + j], (1 - z) * cand + z * h, 1e-5);
+      }
+    }
+  }
+}
+
+void check_topk(uint64_t rows, uint64_t w, uint64_t top_k) {
+  // Few distinct values, so there are plenty of ties
+  std::mt19937 gen(41);
+  std::uniform_int_distribution<int> dis(-500, 500);
+  std::vector<float> in(rows * w);
+  for (auto &v : in)
+    v = dis(gen) / 4.0f;
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  OpParams params;
+  params.top_k = top_k;
+
+  core::Type<float *, 32> f32;
+  Tensor *input, *values;
+  std::vector<Tensor *> outputs;
+  EXPECT_NO_THROW(input = Variable::Create(func, &f32, Shape(1, rows, w)));
+  EXPECT_NO_THROW(values = func->AddOpNode({input}, TOPK, params));
+  EXPECT_NO_THROW(outputs = func->GetOpOutputs(values));
+  ASSERT_EQ(outputs.size(), 2);
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+
+  void *kernel = build_and_jit(
+      module, func, func->GetSignatureArgs({outputs[0], outputs[1]}));
+
+  std::vector<float> out_values(rows * top_k);
+  std::vector<int64_t> out_indices(rows * top_k);
+  ((void (*)(float *, float *, int64_t *))kernel)(
+      in.data(), out_values.data(), out_indices.data());
+
+  uint64_t errors = 0;
+  std::vector<int64_t> order(w);
+  for (uint64_t r = 0; r < rows; r++) {
+    const float *row = &in[r * w];
+    for (uint64_t i = 0; i < w; i++)
+      order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int64_t a, int64_t b) { return row[a] > row[b]; });
+    for (uint64_t i = 0; i < top_k; i++) {
+      errors += out_indices[r * top_k + i] != order[i];
+      errors += out_values[r * top_k + i] != row[order[i]];
+    }
+  }
+  EXPECT_EQ(errors, 0);
+}
+
+// Reference Philox4x32-10 of counter (c, 0) under key seed
+std::array<uint32_t, 4> philox_ref(uint64_t c, uint64_t seed) {
+  uint32_t x[4] = {(uint32_t)c, (uint32_t)(c >> 32), 0, 0};
+  uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+  for (int round = 0; round < 10; round++) {
+    uint64_t p0 = (uint64_t)0xD2511F53 * x[0];
+    uint64_t p1 = (uint64_t)0xCD9E8D57 * x[2];
+    uint32_t next[4] = {(uint32_t)(p1 >> 32) ^ x[1] ^ k0, (uint32_t)p1,
+                        (uint32_t)(p0 >> 32) ^ x[3] ^ k1, (uint32_t)p0};
+    std::copy(next, next + 4, x);
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+  return {x[0], x[1], x[2], x[3]};
+}
+
+// op on a tensor of `shape`, alone or (dropout) multiplied into its input
+template <typename T, unsigned int BITS>
+void check_random(OpCode op, const Shape &shape, const OpParams &params,
+                  bool dropout) {
+  const uint64_t size = shape.GetSize();
+  std::vector<T> in(size);
+  for (uint64_t i = 0; i < size; i++)
+    in[i] = (T)(i % 13) - 6;
+
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<T *, BITS> type;
+  Tensor *input, *output;
+  EXPECT_NO_THROW(input = Variable::Create(func, &type, shape));
+  EXPECT_NO_THROW(output = func->AddOpNode({input}, op, params));
+  if (dropout) {
+    EXPECT_NO_THROW(output = func->AddOpNode({input, output}, MUL));
+  }
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(input));
+
+  void *kernel = build_and_jit(module, func, func->GetSignatureArgs({output}));
+
+  std::vector<T> out(size);
+  ((void (*)(T *, T *))kernel)(in.data(), out.data());
+
+  uint64_t errors = 0;
+  double mean = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    // Four elements per block, or two for the double uniform
+    const uint64_t per_counter =
+        op == RANDOM_UNIFORM && sizeof(T) == 8 ? 2 : 4;
+    const uint64_t j = params.random_offset + i;
+    std::array<uint32_t, 4> block =
+        philox_ref(j / per_counter, params.random_seed);
+    const uint32_t *words = &block[4 / per_counter * (j % per_counter)];
+    T expected;
+    if (op == RANDOM_BERNOULLI)
+      expected = words[0] < std::ldexp(params.random_p, 32) ? 1 : 0;
+    else if (sizeof(T) == 8)
+      expected = (T)((((uint64_t)words[0] << 21) | (words[1] >> 11)) *
+                     std::ldexp(1.0, -53));
+    else
+      expected = (T)((words[0] >> 8) * std::ldexp(1.0, -24));
+    mean += expected;
+    if (dropout)
+      expected *= in[i];
+    errors += out[i] != expected;
+  }
+  EXPECT_EQ(errors, 0);
+  // Sanity check of the distribution, not of the generator
+  const double expected_mean = op == RANDOM_BERNOULLI ? params.random_p : 0.5;
+  EXPECT_NEAR(mean / size, expected_mean, 0.02);
+}
+
+// GEMM -> bias -> RELU. The bias and RELU should run as the GEMM stores C,
+// so neither intermediate gets a buffer.
+void check_fused_gemm(uint64_t batch, uint64_t m, uint64_t k, uint64_t n) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> type;
+  Tensor *x = Variable::Create(func, &type, Shape(batch, m, k));
+  Tensor *w = Variable::Create(func, &type, Shape(1, k, n));
+  Tensor *bias = Variable::Create(func, &type, Shape(1, 1, n));
+  Tensor *prod, *biased, *output;
+  EXPECT_NO_THROW(prod = func->AddOpNode({x, w}, GEMM));
+  EXPECT_NO_THROW(biased = func->AddOpNode({prod, bias}, ADD));
+  EXPECT_NO_THROW(output = func->AddOpNode({biased}, RELU));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(w));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(bias));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+  EXPECT_EQ(prod->GetSymbol()->buffer, nullptr);
+  EXPECT_EQ(biased->GetSymbol()->buffer, nullptr);
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  void *kernel = module.GetFunctionPtr("test_func");
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(-1.0, 1.0);
+
+  std::vector<float> a(batch * m * k), b(k * n), bias_data(n),
+      c(batch * m * n);
+  for (auto &v : a)
+    v = dis(gen);
+  for (auto &v : b)
+    v = dis(gen);
+  for (auto &v : bias_data)
+    v = dis(gen);
+
+  ((void (*)(float *, float *, float *, float *))kernel)(
+      a.data(), b.data(), bias_data.data(), c.data());
+
+  for (uint64_t bi = 0; bi < batch; bi++) {
+    for (uint64_t i = 0; i < m; i++) {
+      for (uint64_t j = 0; j < n; j++) {
+        double ref = bias_data[j], mag = std::abs(bias_data[j]);
+        for (uint64_t p = 0; p < k; p++) {
+          ref += a[(bi * m + i) * k + p] * b[p * n + j];
+          mag += std::abs(a[(bi * m + i) * k + p] * b[p * n + j]);
+        }
+        EXPECT_NEAR(c[(bi * m + i) * n + j], std::max(ref, 0.0), mag * 5e-6);
+      }
+    }
+  }
+}
+
+// exp(reduce(x) - y) with y broadcast against the reduced shape. fused says
+// whether the SUB and EXP should run inside the reduction.
+void check_fused_reduce(OpCode op, const std::vector<Axis> &axes,
+                        const Shape &shape, const Shape &y_shape, bool fused) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  OpParams params;
+  params.reduce_axes = axes;
+
+  core::Type<float *, 32> type;
+  Tensor *x = Variable::Create(func, &type, shape);
+  Tensor *y = Variable::Create(func, &type, y_shape);
+  Tensor *reduced, *diff, *output;
+  EXPECT_NO_THROW(reduced = func->AddOpNode({x}, op, params));
+  EXPECT_NO_THROW(diff = func->AddOpNode({reduced, y}, SUB));
+  EXPECT_NO_THROW(output = func->AddOpNode({diff}, EXP));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(y));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+  EXPECT_EQ(reduced->GetSymbol()->buffer == nullptr, fused);
+  EXPECT_EQ(diff->GetSymbol()->buffer, nullptr);
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  void *kernel = module.GetFunctionPtr("test_func");
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(0.0, 1.0);
+
+  const Shape &out_shape = output->GetShape();
+  std::vector<float> in(shape.GetSize()), y_data(y_shape.GetSize()),
+      out(out_shape.GetSize());
+  for (auto &v : in)
+    v = dis(gen);
+  for (auto &v : y_data)
+    v = dis(gen);
+
+  ((void (*)(float *, float *, float *))kernel)(in.data(), y_data.data(),
+                                                out.data());
+
+  // Index of (k, h, w) in s, broadcasting axes of size 1
+  auto at = [](const Shape &s, uint64_t k, uint64_t h, uint64_t w) {
+    k = s.GetAxisSize(K) == 1 ? 0 : k;
+    h = s.GetAxisSize(H) == 1 ? 0 : h;
+    w = s.GetAxisSize(W) == 1 ? 0 : w;
+    return (k * s.GetAxisSize(H) + h) * s.GetAxisSize(W) + w;
+  };
+
+  std::vector<double> ref(out.size(), op == REDUCE_MAX ? -INFINITY : 0);
+  for (uint64_t k = 0; k < shape.GetAxisSize(K); k++) {
+    for (uint64_t h = 0; h < shape.GetAxisSize(H); h++) {
+      for (uint64_t w = 0; w < shape.GetAxisSize(W); w++) {
+        double &r = ref[at(out_shape, k, h, w)];
+        const float v = in[at(shape, k, h, w)];
+        r = op == REDUCE_MAX ? std::max(r, (double)v) : r + v;
+      }
+    }
+  }
+  for (uint64_t k = 0; k < out_shape.GetAxisSize(K); k++) {
+    for (uint64_t h = 0; h < out_shape.GetAxisSize(H); h++) {
+      for (uint64_t w = 0; w < out_shape.GetAxisSize(W); w++) {
+        double r = ref[at(out_shape, k, h, w)];
+        if (op == REDUCE_MEAN)
+          r /= shape.GetSize() / out_shape.GetSize();
+        const double expected = std::exp(r - y_data[at(y_shape, k, h, w)]);
+        EXPECT_NEAR(out[at(out_shape, k, h, w)], expected, expected * 1e-5);
+      }
+    }
+  }
+}
+
 TEST(Basic, CreateModule) {
   llvm::LLVMContext ctx;
 
-  EXPECT_NO_THROW(Module module("test_module", ctx));
+  EXPECT_NO_THROW(Module module("test_module", ctx));
+}
+
+TEST(Basic, GetContext) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  EXPECT_EQ(module.GetContext(), &ctx);
+}
+
+TEST(Basic, CreateFunction) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  EXPECT_NO_THROW(std::unique_ptr<Function> func =
+                      Function::Create(&module, "test_func"));
+}
+
+TEST(Basic, AddVariable) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float, 16> type;
+  Tensor *tensor;
+  EXPECT_NO_THROW(tensor = Variable::Create(func, &type, Shape(1, 2, 3)));
+  EXPECT_TRUE(func->GetSymbol(tensor)->shape == tensor->GetShape());
+  EXPECT_EQ(func->GetSymbol(tensor)->type, llvm::Type::getHalfTy(ctx));
+}
+
+TEST(Basic, AddConstant) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  std::vector<float> input(1 * 2 * 3);
+  for (int i = 0; i < 1 * 2 * 3; i++) {
+    input[i] = i;
+  }
+
+  core::Type<float *, 32> type;
+  Tensor *tensor;
+  // Should not throw errors
+  EXPECT_NO_THROW(
+      tensor = Constant::Create(func, &type, Shape(1, 2, 3), input.data()));
+  // The shape of the symbol should be the same
+  EXPECT_TRUE(func->GetSymbol(tensor)->shape == tensor->GetShape());
+  // The symbol's buffer should just alias the input buffer
+  EXPECT_EQ(func->GetSymbol(tensor)->buffer, input.data());
+}
+
+TEST(Basic, AddAlloca) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  std::vector<float> input(1 * 2 * 3);
+  for (int i = 0; i < 1 * 2 * 3; i++) {
+    input[i] = i;
+  }
+
+  core::Type<float *, 32> type;
+  Tensor *tensor;
+  // Should not throw errors
+  EXPECT_NO_THROW(
+      tensor = Constant::Create(func, &type, Shape(1, 2, 3), input.data()));
+  // The shape of the symbol should be the same
+  EXPECT_TRUE(func->GetSymbol(tensor)->shape == tensor->GetShape());
+  // The symbol's buffer should just alias the input buffer
+  EXPECT_EQ(func->GetSymbol(tensor)->buffer, input.data());
+
+  Tensor *t;
+  EXPECT_NO_THROW(t = func->AddOpNode({tensor}, OpCode::ALLOCA));
+
+  // The symbol should be an alias of the function's symbol, addressed by
+  // `tensor`
+  EXPECT_EQ(t->GetSymbol(), func->GetSymbol(tensor));
+
+  // Alloca throws if you pass in too many args - it only takes in one tensor.
+  EXPECT_THROW(func->AddOpNode({tensor, tensor}, OpCode::ALLOCA),
+               core::IncorrectNumArgs);
+}
+
+TEST(Basic, AddArg) {
+  llvm::LLVMContext ctx;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float, 16> type1;
+  Tensor *tensor, *output;
+  EXPECT_NO_THROW(tensor = Variable::Create(func, &type1, Shape(1, 2, 3)));
+  EXPECT_NO_THROW(output = func->AddOpNode({tensor}, ALLOCA));
+  EXPECT_TRUE(func->GetSymbol(tensor)->shape == tensor->GetShape());
+  EXPECT_EQ(func->GetSymbol(tensor)->type, llvm::Type::getHalfTy(ctx));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(tensor));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+  EXPECT_EQ(args[0]->GetType()->getTypeID(), tensor->GetType()->getTypeID());
+}
+
+TEST(Basic, EmitFunction) {
+  llvm::LLVMContext ctx;
+
+  const int n_elts = 34000;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> type;
+  Tensor *lhs, *rhs, *output;
+  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, Shape(1, 1, n_elts)));
+  EXPECT_NO_THROW(rhs = Variable::Create(func, &type, Shape(1, 1, n_elts)));
+  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, SDOT));
+
+  EXPECT_EQ(func->GetSymbol(lhs)->type, llvm::Type::getFloatPtrTy(ctx));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  EXPECT_EQ(func->GetSymbol(rhs)->type, llvm::Type::getFloatPtrTy(ctx));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  EXPECT_TRUE(output->GetShape() == Shape(1, 1, 1));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+  EXPECT_EQ(args.size(), 3);
+  EXPECT_EQ(args[0], lhs);
+  EXPECT_EQ(args[1], rhs);
+  EXPECT_EQ(args[2], output);
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+  module.Print();
+
+  void (*sdot)(float *, float *, float *) =
+      (void (*)(float *, float *, float *))module.GetFunctionPtr("test_func");
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(0.0, 1.0);
+
+  std::vector<float> f1, f2;
+  for (int i = 0; i < n_elts; i++) {
+    f1.push_back(dis(gen));
+    f2.push_back(dis(gen));
+  }
+
+  float float_out;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  sdot(f1.data(), f2.data(), &float_out);
+  auto finish = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double> elapsed = (finish - start);
+  std::cout << "\nElapsed time: " << elapsed.count() << " s for " << n_elts
+            << " elements" << std::endl;
+
+  EXPECT_NEAR(float_out, ref_sdot<n_elts>(f1.data(), f2.data()),
+              float_out * 5e-6);
+}
+
+TEST(Basic, EmitFastMathSdot) {
+  llvm::LLVMContext ctx;
+
+  // Not a multiple of the accumulator block, so the tail loop runs too
+  const int n_elts = 34003;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  FPPolicy policy;
+  policy.reassociate = true;
+  policy.fma = true;
+  func->SetFPPolicy(policy);
+  EXPECT_TRUE(func->GetFPPolicy().reassociate);
+
+  core::Type<float *, 32> type;
+  Tensor *lhs, *rhs, *output;
+  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, Shape(1, 1, n_elts)));
+  EXPECT_NO_THROW(rhs = Variable::Create(func, &type, Shape(1, 1, n_elts)));
+  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, SDOT));
+
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  void (*sdot)(float *, float *, float *) =
+      (void (*)(float *, float *, float *))module.GetFunctionPtr("test_func");
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(0.0, 1.0);
+
+  std::vector<float> f1, f2;
+  double ref = 0;
+  for (int i = 0; i < n_elts; i++) {
+    f1.push_back(dis(gen));
+    f2.push_back(dis(gen));
+    ref += (double)f1[i] * f2[i];
+  }
+
+  float float_out;
+
+  sdot(f1.data(), f2.data(), &float_out);
+
+  // Many short sums are more accurate than one long one, not less
+  EXPECT_NEAR(float_out, ref, ref * 5e-6);
+}
+
+TEST(Basic, EmitConstFunction) { // this is still iffy
+  llvm::LLVMContext ctx;
+
+  const int n_elts = 3;
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(0.0, 1.0);
+
+  std::vector<float> f1, f2; // why are there a bunch of zeros in the middle...
+  for (int i = 0; i < n_elts; i++) {
+    f1.push_back(dis(gen));
+    f2.push_back(dis(gen));
+  }
+
+  f1.shrink_to_fit();
+  f2.shrink_to_fit();
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> type;
+  Tensor *lhs, *rhs, *output;
+  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, Shape(1, 1, n_elts)));
+  EXPECT_NO_THROW(
+      rhs = Constant::Create(func, &type, Shape(1, 1, n_elts), f2.data()));
+  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, SDOT));
+
+  EXPECT_EQ(func->GetSymbol(lhs)->type, llvm::Type::getFloatPtrTy(ctx));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+
+  EXPECT_EQ(func->GetSymbol(rhs)->type, llvm::Type::getFloatPtrTy(ctx));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  EXPECT_TRUE(output->GetShape() == Shape(1, 1, 1));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+  EXPECT_EQ(args.size(), 3);
+  EXPECT_EQ(args[0], lhs);
+  EXPECT_EQ(args[1], rhs);
+  EXPECT_EQ(args[2], output);
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+  EXPECT_EQ(func->GetSymbol(rhs)->type, llvm::Type::getFloatTy(ctx));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+  module.Print();
+
+  void (*sdot)(float *, float *) =
+      (void (*)(float *, float *))module.GetFunctionPtr("test_func");
+
+  float float_out;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  sdot(f1.data(), &float_out);
+  auto finish = std::chrono::high_resolution_clock::now();
+
+  std::chrono::duration<double> elapsed = (finish - start);
+  std::cout << "\nElapsed time: " << elapsed.count() << " s for " << n_elts
+            << " elements" << std::endl;
+
+  EXPECT_NEAR(float_out, ref_sdot<n_elts>(f1.data(), f2.data()),
+              float_out * 5e-6);
+}
+
+TEST(Basic, EmitGemm) {
+  llvm::LLVMContext ctx;
+
+  // Odd sizes so that every edge case in the blocking gets exercised, and
+  // k > kGemmKC so that the panels accumulate.
+  const int batch = 2, m = 100, k = 300, n = 70;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> type;
+  Tensor *lhs, *rhs, *output;
+  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, Shape(batch, m, k)));
+  EXPECT_NO_THROW(rhs = Variable::Create(func, &type, Shape(1, k, n)));
+  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, GEMM));
+
+  // Inner dimensions have to match
+  EXPECT_THROW(func->AddOpNode({rhs, rhs}, GEMM), core::IncompatibleShapes);
+
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+
+  EXPECT_TRUE(output->GetShape() == Shape(batch, m, n));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+  EXPECT_EQ(args.size(), 3);
+  EXPECT_EQ(args[0], lhs);
+  EXPECT_EQ(args[1], rhs);
+  EXPECT_EQ(args[2], output);
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  void (*gemm)(float *, float *, float *) =
+      (void (*)(float *, float *, float *))module.GetFunctionPtr("test_func");
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(0.0, 1.0);
+
+  std::vector<float> a(batch * m * k), b(k * n), c(batch * m * n);
+  for (auto &v : a)
+    v = dis(gen);
+  for (auto &v : b)
+    v = dis(gen);
+
+  gemm(a.data(), b.data(), c.data());
+
+  for (int bi = 0; bi < batch; bi++) {
+    for (int i = 0; i < m; i++) {
+      for (int j = 0; j < n; j++) {
+        float ref = 0;
+        for (int p = 0; p < k; p++) {
+          ref += a[(bi * m + i) * k + p] * b[p * n + j];
+        }
+        EXPECT_NEAR(c[(bi * m + i) * n + j], ref, ref * 5e-6);
+      }
+    }
+  }
+}
+
+TEST(Basic, EmitElementwise) {
+  llvm::LLVMContext ctx;
+
+  const uint64_t k = 3, h = 5, w = 37;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  core::Type<float *, 32> type;
+  Tensor *a, *b, *c, *d, *e;
+  EXPECT_NO_THROW(a = Variable::Create(func, &type, Shape(k, h, w)));
+  EXPECT_NO_THROW(b = Variable::Create(func, &type, Shape(1, 1, w)));
+  EXPECT_NO_THROW(c = Variable::Create(func, &type, Shape(k, 1, 1)));
+  EXPECT_NO_THROW(d = Variable::Create(func, &type, Shape(1, h, 1)));
+  EXPECT_NO_THROW(e = Variable::Create(func, &type, Shape(k, h, w)));
+
+  OpParams params;
+  params.clamp_min = 0.1;
+  params.clamp_max = 0.5;
+
+  // One fused loop nest; t3 is also an output so it gets stored
+  Tensor *t1 = func->AddOpNode({a, b}, ADD);
+  Tensor *t2 = func->AddOpNode({t1, c}, MUL);
+  Tensor *t3 = func->AddOpNode({t2, d}, SUB);
+  Tensor *t4 = func->AddOpNode({t3, b}, DIV);
+  Tensor *t5 = func->AddOpNode({t4, a}, MAX);
+  Tensor *t6 = func->AddOpNode({t5, c}, MIN);
+  Tensor *t7 = func->AddOpNode({t6}, RELU);
+  Tensor *t8 = func->AddOpNode({t7}, CLAMP, params);
+  Tensor *output;
+  EXPECT_NO_THROW(output = func->AddOpNode({e, t8, t3}, SELECT));
+  EXPECT_TRUE(output->GetShape() == Shape(k, h, w));
+
+  for (auto &t : {a, b, c, d, e, t3})
+    EXPECT_NO_THROW(func->MarkSymbolAsArg(t));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+  EXPECT_EQ(args.size(), 7);
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  void (*chain)(float *, float *, float *, float *, float *, float *,
+                float *) =
+      (void (*)(float *, float *, float *, float *, float *, float *,
+                float *))module.GetFunctionPtr("test_func");
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_real_distribution<float> dis(-1.0, 1.0);
+
+  std::vector<float> a_data(k * h * w), b_data(w), c_data(k), d_data(h),
+      e_data(k * h * w), t3_data(k * h * w), out_data(k * h * w);
+  for (auto &v : a_data)
+    v = dis(gen);
+  for (auto &v : b_data)
+    v = dis(gen) + 2.0f;
+  for (auto &v : c_data)
+    v = dis(gen);
+  for (auto &v : d_data)
+    v = dis(gen);
+  for (auto &v : e_data)
+    v = dis(gen) > 0 ? 1.0f : 0.0f;
+
+  chain(a_data.data(), b_data.data(), c_data.data(), d_data.data(),
+        e_data.data(), t3_data.data(), out_data.data());
+
+  for (uint64_t ki = 0; ki < k; ki++) {
+    for (uint64_t hi = 0; hi < h; hi++) {
+      for (uint64_t wi = 0; wi < w; wi++) {
+        const uint64_t i = (ki * h + hi) * w + wi;
+        float r3 = (a_data[i] + b_data[wi]) * c_data[ki] - d_data[hi];
+        float r = r3 / b_data[wi];
+        r = std::max(r, a_data[i]);
+        r = std::min(r, c_data[ki]);
+        r = std::max(r, 0.0f);
+        r = std::min(std::max(r, 0.1f), 0.5f);
+        EXPECT_FLOAT_EQ(t3_data[i], r3);
+        EXPECT_FLOAT_EQ(out_data[i], e_data[i] != 0 ? r : r3);
+      }
+    }
+  }
+
+  // Axes have to match or be 1
+  Tensor *bad = Variable::Create(func, &type, Shape(1, 2, w));
+  EXPECT_THROW(func->AddOpNode({a, bad}, ADD), core::IncompatibleShapes);
+  EXPECT_THROW(func->AddOpNode({a, b}, RELU), core::IncorrectNumArgs);
+}
+
+TEST(Basic, EmitMixedTypes) {
+  llvm::LLVMContext ctx;
+
+  const uint64_t h = 4, w = 21;
+
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  // An int32 mask choosing between floats gives floats
+  core::Type<float *, 32> f32;
+  core::Type<double *, 64> f64;
+  core::Type<int *, 32> i32;
+  Tensor *mask = Variable::Create(func, &i32, Shape(1, h, w));
+  Tensor *a = Variable::Create(func, &f32, Shape(1, h, w));
+  Tensor *b = Variable::Create(func, &f32, Shape(1, 1, w));
+  Tensor *output;
+  EXPECT_NO_THROW(output = func->AddOpNode({mask, a, b}, SELECT));
+  EXPECT_EQ(output->GetType(), f32.get(&ctx));
+
+  // Values of different types are rejected up front
+  Tensor *d = Variable::Create(func, &f64, Shape(1, h, w));
+  EXPECT_THROW(func->AddOpNode({a, d}, ADD), core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({a, mask}, MUL), core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({mask, a, d}, SELECT),
+               core::IncompatibleTypes);
+
+  for (auto &t : {mask, a, b})
+    EXPECT_NO_THROW(func->MarkSymbolAsArg(t));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  void (*select)(int32_t *, float *, float *, float *) =
+      (void (*)(int32_t *, float *, float *, float *))module.GetFunctionPtr(
+          "test_func");
+
+  std::vector<int32_t> mask_data(h * w);
+  std::vector<float> a_data(h * w), b_data(w), out_data(h * w);
+  for (uint64_t i = 0; i < h * w; i++) {
+    mask_data[i] = (int32_t)(i % 3) - 1;
+    a_data[i] = 0.5f * i;
+  }
+  for (uint64_t i = 0; i < w; i++)
+    b_data[i] = -1.0f - i;
+
+  select(mask_data.data(), a_data.data(), b_data.data(), out_data.data());
+
+  for (uint64_t i = 0; i < h * w; i++)
+    EXPECT_EQ(out_data[i], mask_data[i] != 0 ? a_data[i] : b_data[i % w]);
 }
 
-TEST(Basic, GetContext) {
-  llvm::LLVMContext ctx;
+TEST(Basic, EmitReduce) {
+  const std::vector<std::vector<Axis>> subsets = {
+      {}, {K}, {H}, {W}, {K, H}, {K, W}, {H, W}};
+
+  for (auto &axes : subsets) {
+    OpParams params;
+    params.reduce_axes = axes;
+    for (auto op : {REDUCE_SUM, REDUCE_MEAN, REDUCE_MAX, REDUCE_MIN,
+                    REDUCE_ARGMAX}) {
+      check_reduce(op, params, 5, 7, 77);
+    }
+    // Tree-structured sums
+    check_reduce(REDUCE_SUM, params, 5, 7, 77, true);
+  }
 
-  Module module("test_module", ctx);
+  // Long contiguous rows, as in a normalization layer
+  OpParams params;
+  params.reduce_axes = {W};
+  check_reduce(REDUCE_ARGMAX, params, 1, 3, 4099);
+  check_reduce(REDUCE_SUM, params, 1, 3, 4099, true);
 
-  EXPECT_EQ(module.GetContext(), &ctx);
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 32> type;
+  Tensor *input = Variable::Create(func, &type, Shape(2, 3, 4));
+  EXPECT_THROW(func->AddOpNode({input, input}, REDUCE_SUM),
+               core::IncorrectNumArgs);
+  Tensor *output = func->AddOpNode({input}, REDUCE_MAX, params);
+  EXPECT_TRUE(output->GetShape() == Shape(2, 3, 1));
 }
 
-TEST(Basic, CreateFunction) {
-  llvm::LLVMContext ctx;
+TEST(Basic, EmitSoftmax) {
+  for (auto op : {SOFTMAX, LOG_SOFTMAX}) {
+    check_softmax(op, 2, 3, 77);
+    // Shorter than a vector
+    check_softmax(op, 1, 4, 5);
+  }
+  // A vocabulary sized row
+  check_softmax(SOFTMAX, 1, 4, 32000);
 
+  llvm::LLVMContext ctx;
   Module module("test_module", ctx);
-
-  EXPECT_NO_THROW(std::unique_ptr<Function> func =
-                      Function::Create(&module, "test_func"));
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<int *, 32> i32;
+  Tensor *logits = Variable::Create(func, &i32, Shape(1, 4, 10));
+  EXPECT_THROW(func->AddOpNode({logits}, SOFTMAX), core::IncompatibleTypes);
 }
 
-TEST(Basic, AddVariable) {
-  llvm::LLVMContext ctx;
+TEST(Basic, EmitActivations) {
+  struct Case {
+    OpCode op;
+    double lo, hi, floor;
+  };
+  const std::vector<Case> cases = {
+      {EXP, -80, 80, 0},     {LOG, 1e-30, 1e30, 1e-3}, {TANH, -10, 10, 0},
+      {SIGMOID, -30, 30, 0}, {ERF, -5, 5, 0},          {GELU, -6, 6, 1}};
+
+  for (auto &c : cases) {
+    for (auto accuracy : {MATH_ACCURATE, MATH_FAST}) {
+      double f32 = check_activation<float, 32>(c.op, accuracy, c.lo, c.hi,
+                                               c.floor);
+      double f64 = check_activation<double, 64>(c.op, accuracy, c.lo, c.hi,
+                                                c.floor);
+      if (accuracy == MATH_FAST) {
+        EXPECT_LT(f32, 1e-5);
+        EXPECT_LT(f64, 1e-6);
+        continue;
+      }
+      EXPECT_LT(f32, 5e-7);
+      // erf is only fitted to float precision
+      EXPECT_LT(f64, c.op == ERF || c.op == GELU ? 1e-7 : 1e-14);
+    }
+  }
 
+  llvm::LLVMContext ctx;
   Module module("test_module", ctx);
-
   std::unique_ptr<Function> func = Function::Create(&module, "test_func");
-
-  core::Type<float, 16> type;
-  Tensor *tensor;
-  EXPECT_NO_THROW(tensor = Variable::Create(func, &type, Shape(1, 2, 3)));
-  EXPECT_TRUE(func->GetSymbol(tensor)->shape == tensor->GetShape());
-  EXPECT_EQ(func->GetSymbol(tensor)->type, llvm::Type::getHalfTy(ctx));
+  core::Type<int *, 32> i32;
+  Tensor *x = Variable::Create(func, &i32, Shape(1, 4, 8));
+  for (auto &c : cases)
+    EXPECT_THROW(func->AddOpNode({x}, c.op), core::IncompatibleTypes);
 }
 
-TEST(Basic, AddConstant) {
-  llvm::LLVMContext ctx;
+TEST(Basic, EmitPool) {
+  struct Case {
+    uint64_t pool_h, pool_w, stride_h, stride_w, pad_h, pad_w;
+  };
+  const std::vector<Case> cases = {{2, 2, 2, 2, 0, 0},
+                                   {3, 3, 1, 1, 1, 1},
+                                   {3, 3, 2, 2, 1, 1},
+                                   {3, 2, 2, 3, 2, 1}};
+
+  for (auto &c : cases) {
+    OpParams params;
+    params.pool_h = c.pool_h;
+    params.pool_w = c.pool_w;
+    params.stride_h = c.stride_h;
+    params.stride_w = c.stride_w;
+    params.pad_h = c.pad_h;
+    params.pad_w = c.pad_w;
+    for (auto op : {POOL_MAX, POOL_AVG}) {
+      check_pool(op, params, 3, 17, 45);
+      check_pool(op, params, 64, 56, 56);
+    }
+  }
 
+  llvm::LLVMContext ctx;
   Module module("test_module", ctx);
-
   std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 32> type;
+  Tensor *input = Variable::Create(func, &type, Shape(2, 8, 8));
+  OpParams params;
+  params.pool_h = params.pool_w = 2;
+  params.pad_h = 2;
+  EXPECT_THROW(func->AddOpNode({input}, POOL_MAX, params),
+               core::IncompatibleShapes);
+  EXPECT_THROW(func->AddOpNode({input, input}, POOL_AVG),
+               core::IncorrectNumArgs);
+}
 
-  std::vector<float> input(1 * 2 * 3);
-  for (int i = 0; i < 1 * 2 * 3; i++) {
-    input[i] = i;
+TEST(Basic, EmitTranspose) {
+  check_transpose({}, 3, 37, 29);
+  for (auto &perm : std::vector<std::vector<Axis>>{{K, H, W},
+                                                   {K, W, H},
+                                                   {H, K, W},
+                                                   {H, W, K},
+                                                   {W, K, H},
+                                                   {W, H, K}}) {
+    check_transpose(perm, 5, 19, 70);
+    check_transpose(perm, 17, 3, 9);
   }
+  // Layout conversion of a whole matrix
+  check_transpose({K, W, H}, 1, 1024, 1024);
+  check_transpose({H, W, K}, 64, 56, 56);
 
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
   core::Type<float *, 32> type;
-  Tensor *tensor;
-  // Should not throw errors
-  EXPECT_NO_THROW(
-      tensor = Constant::Create(func, &type, Shape(1, 2, 3), input.data()));
-  // The shape of the symbol should be the same
-  EXPECT_TRUE(func->GetSymbol(tensor)->shape == tensor->GetShape());
-  // The symbol's buffer should just alias the input buffer
-  EXPECT_EQ(func->GetSymbol(tensor)->buffer, input.data());
+  Tensor *input = Variable::Create(func, &type, Shape(2, 3, 4));
+  OpParams params;
+  params.permutation = {K, K, W};
+  EXPECT_THROW(func->AddOpNode({input}, TRANSPOSE, params),
+               core::IncompatibleShapes);
 }
 
-TEST(Basic, AddAlloca) {
+TEST(Basic, EmitQuantized) {
+  OpParams params;
+  params.requantize = false;
+
+  // Plain int8 products, with tails in every loop
+  check_quantized(params, 0, 0, 1000, 0);
+  check_quantized(params, 2, 13, 70, 37);
+
+  // Zero points on both sides
+  params.lhs_quant.zero_point = {3};
+  params.rhs_quant.zero_point = {-5};
+  check_quantized(params, 0, 0, 333, 0);
+  check_quantized(params, 3, 9, 45, 70);
+
+  // Per channel zero points
+  params.rhs_quant.zero_point = std::vector<int32_t>(19);
+  for (int32_t j = 0; j < 19; j++)
+    params.rhs_quant.zero_point[j] = j - 9;
+  check_quantized(params, 1, 11, 31, 19);
+
+  // Requantized to int8
+  params.requantize = true;
+  params.lhs_quant.scale = {0.02f};
+  params.rhs_quant.scale = {0.01f};
+  params.out_quant.scale = {0.5f};
+  params.out_quant.zero_point = {-3};
+  params.rhs_quant.zero_point = {1};
+  check_quantized(params, 0, 0, 500, 0);
+  check_quantized(params, 2, 17, 64, 33);
+
+  // Scaled sums far outside int32, which have to saturate too
+  params.out_quant.scale = {1e-7f};
+  check_quantized(params, 0, 0, 500, 0);
+  check_quantized(params, 2, 17, 64, 33);
+  params.out_quant.scale = {0.5f};
+
+  params.rhs_quant.scale = std::vector<float>(19);
+  for (int32_t j = 0; j < 19; j++)
+    params.rhs_quant.scale[j] = 0.005f * (j + 1);
+  check_quantized(params, 1, 11, 31, 19);
+
+  // Inner layer sized
+  params.rhs_quant = QuantParams();
+  check_quantized(params, 1, 256, 512, 256);
+
+  // The host's instructions, with the same tails and zero points
+  check_quantized(params, 0, 0, 1000, 0, true);
+  check_quantized(params, 2, 13, 70, 37, true);
+  check_quantized(params, 1, 256, 512, 256, true);
+  params.requantize = false;
+  params.lhs_quant.zero_point = {0};
+  params.rhs_quant.zero_point = {-5};
+  check_quantized(params, 0, 0, 333, 0, true);
+  check_quantized(params, 3, 9, 45, 70, true);
+
   llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<int *, 8> i8;
+  core::Type<float *, 32> f32;
+  Tensor *a = Variable::Create(func, &i8, Shape(1, 4, 8));
+  Tensor *b = Variable::Create(func, &f32, Shape(1, 8, 4));
+  EXPECT_THROW(func->AddOpNode({a, b}, QGEMM, OpParams()),
+               core::IncompatibleTypes);
+  Tensor *c = Variable::Create(func, &i8, Shape(1, 8, 4));
+  params.rhs_quant.zero_point = {1, 2, 3};
+  EXPECT_THROW(func->AddOpNode({a, c}, QGEMM, params),
+               core::IncompatibleShapes);
+}
+
+TEST(Basic, EmitHalf) {
+  check_cast<HalfFormat>();
+
+  auto check = check_16bit_op<HalfFormat>;
+  check(ADD, Shape(3, 17, 41), Shape(3, 17, 41), false);
+  check(SDOT, Shape(1, 1, 1003), Shape(1, 1, 1003), false);
+  check(SDOT, Shape(1, 1, 1003), Shape(1, 1, 1003), true);
+  // k > kGemmKC so the half output goes through more than one panel
+  check(GEMM, Shape(1, 37, 300), Shape(1, 300, 45), false);
+  check(GEMM, Shape(1, 37, 300), Shape(1, 300, 45), true);
+  // Bandwidth bound GEMV, and one with a partial column chunk
+  check(GEMM, Shape(1, 1, 2048), Shape(1, 2048, 2048), true);
+  check(GEMM, Shape(1, 1, 301), Shape(1, 301, 700), false);
+  // Again with vcvtph2ps and vcvtps2ph, where the CPU has them
+  check_16bit_op<HalfFormat>(ADD, Shape(3, 17, 41), Shape(3, 17, 41), false,
+                             true);
+  check_16bit_op<HalfFormat>(GEMM, Shape(1, 37, 300), Shape(1, 300, 45),
+                             false, true);
+  check_16bit_op<HalfFormat>(GEMM, Shape(1, 1, 301), Shape(1, 301, 700),
+                             false, true);
 
+  llvm::LLVMContext ctx;
   Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 16> f16;
+  core::Type<float *, 32> f32;
+  core::Type<int *, 32> i32;
+  Tensor *a = Variable::Create(func, &f16, Shape(1, 4, 8));
+  Tensor *b = Variable::Create(func, &f32, Shape(1, 8, 4));
+  Tensor *c = Variable::Create(func, &i32, Shape(1, 8, 4));
+  EXPECT_THROW(func->AddOpNode({a, b}, GEMM), core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({c}, CAST_HALF), core::IncompatibleTypes);
+}
+
+TEST(Basic, EmitBFloat16) {
+  check_cast<BFloat16Format>();
+
+  auto check = check_16bit_op<BFloat16Format>;
+  check(ADD, Shape(3, 17, 41), Shape(3, 17, 41), false);
+  check(SDOT, Shape(1, 1, 1003), Shape(1, 1, 1003), false);
+  check(SDOT, Shape(1, 1, 1003), Shape(1, 1, 1003), true);
+  check(GEMM, Shape(1, 37, 300), Shape(1, 300, 45), false);
+  check(GEMM, Shape(1, 37, 300), Shape(1, 300, 45), true);
+  check(GEMM, Shape(1, 1, 2048), Shape(1, 2048, 2048), true);
+  check(GEMM, Shape(1, 1, 301), Shape(1, 301, 700), false);
+  // Again with vdpbf16ps, where the CPU has it, and a tail past the last
+  // pair of vectors
+  check_16bit_op<BFloat16Format>(SDOT, Shape(1, 1, 1003), Shape(1, 1, 1003),
+                                 false, true);
+  check_16bit_op<BFloat16Format>(SDOT, Shape(1, 1, 1003), Shape(1, 1, 1003),
+                                 true, true);
 
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
   std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<core::bfloat16 *, 16> bf16;
+  core::Type<float *, 16> f16;
+  Tensor *a = Variable::Create(func, &bf16, Shape(1, 4, 8));
+  Tensor *b = Variable::Create(func, &f16, Shape(1, 8, 4));
+  EXPECT_THROW(func->AddOpNode({a, b}, GEMM), core::IncompatibleTypes);
+}
 
-  std::vector<float> input(1 * 2 * 3);
-  for (int i = 0; i < 1 * 2 * 3; i++) {
-    input[i] = i;
+TEST(Basic, EmitSparse) {
+  for (bool constant : {false, true}) {
+    check_sparse(37, 53, 0, 0.1, constant);
+    // Blocks of vectors, a single vector and a scalar tail per row
+    check_sparse(37, 53, 45, 0.1, constant);
+    check_sparse(5, 7, 3, 0.0, constant);
+    // Too many nonzeros to unroll the constant one
+    check_sparse(512, 1024, 0, 0.1, constant);
+    check_sparse(300, 400, 64, 0.15, constant);
   }
+  // Half values become float immediates in the unrolled code
+  check_sparse(37, 53, 0, 0.1, true, true);
+  check_sparse(37, 53, 45, 0.1, true, true);
+  check_sparse(37, 53, 45, 0.1, false, true);
 
-  core::Type<float *, 32> type;
-  Tensor *tensor;
-  // Should not throw errors
-  EXPECT_NO_THROW(
-      tensor = Constant::Create(func, &type, Shape(1, 2, 3), input.data()));
-  // The shape of the symbol should be the same
-  EXPECT_TRUE(func->GetSymbol(tensor)->shape == tensor->GetShape());
-  // The symbol's buffer should just alias the input buffer
-  EXPECT_EQ(func->GetSymbol(tensor)->buffer, input.data());
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 32> f32;
+  core::Type<double *, 64> f64;
+  SparseTensor *a = SparseVariable::Create(func, &f32, Shape(1, 4, 8), 6);
+  Tensor *x = Variable::Create(func, &f32, Shape(1, 1, 8));
+  Tensor *y = Variable::Create(func, &f64, Shape(1, 1, 8));
+  Tensor *z = Variable::Create(func, &f32, Shape(1, 4, 3));
+  EXPECT_THROW(func->AddOpNode({a, x}, ADD), std::runtime_error);
+  EXPECT_THROW(func->AddOpNode({x, x}, SPMV), core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({a, y}, SPMV), core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({a, z}, SPMM), core::IncompatibleShapes);
+}
 
-  Tensor *t;
-  EXPECT_NO_THROW(t = func->AddOpNode({tensor}, OpCode::ALLOCA));
+TEST(Basic, EmitBinary) {
+  check_binarize(Shape(2, 3, 200));
+  check_binarize(Shape(1, 4, 128));
 
-  // The symbol should be an alias of the function's symbol, addressed by
-  // `tensor`
-  EXPECT_EQ(t->GetSymbol(), func->GetSymbol(tensor));
+  check_binary(BDOT, Shape(2, 3, 300), Shape(2, 3, 300), false);
+  check_binary(BDOT, Shape(1, 2, 1024), Shape(1, 2, 1024), true);
+  // Partial last word, a tail column and a batched rhs
+  check_binary(BGEMM, Shape(1, 7, 300), Shape(1, 9, 300), false);
+  check_binary(BGEMM, Shape(2, 5, 512), Shape(2, 8, 512), true);
+  // More rhs rows than fit in one chunk
+  check_binary(BGEMM, Shape(1, 16, 256), Shape(1, 4099, 256), false);
 
-  // Alloca throws if you pass in too many args - it only takes in one tensor.
-  EXPECT_THROW(func->AddOpNode({tensor, tensor}, OpCode::ALLOCA),
-               core::IncorrectNumArgs);
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<core::bit *, 1> bit;
+  core::Type<float *, 32> f32;
+  Tensor *a = Variable::Create(func, &bit, Shape(1, 4, 100));
+  Tensor *b = Variable::Create(func, &bit, Shape(1, 4, 64));
+  Tensor *c = Variable::Create(func, &f32, Shape(1, 4, 100));
+  EXPECT_THROW(func->AddOpNode({a, b}, BGEMM), core::IncompatibleShapes);
+  EXPECT_THROW(func->AddOpNode({a, c}, BDOT), core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({a}, BINARIZE), core::IncompatibleTypes);
+  // Ops that work on single elements can't take packed words
+  for (OpCode op : {REDUCE_SUM, POOL_MAX, SOFTMAX, TRANSPOSE})
+    EXPECT_THROW(func->AddOpNode({a}, op), core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({a, b}, CONV2D), core::IncompatibleTypes);
 }
 
-TEST(Basic, AddArg) {
-  llvm::LLVMContext ctx;
+TEST(Basic, EmitGather) {
+  core::Type<float *, 32> f32;
+  core::Type<core::bfloat16 *, 16> bf16;
+  core::Type<double *, 64> f64;
+  // Rows that are copied, with and without a tail
+  check_gather<uint32_t, int32_t>(&f32, 1000, 64, 500);
+  check_gather<uint32_t, int64_t>(&f32, 1000, 37, 500);
+  check_gather<uint16_t, int32_t>(&bf16, 300, 20, 100);
+  // Short rows packed into vectors, with leftover rows
+  check_gather<uint32_t, int32_t>(&f32, 1000, 1, 503);
+  check_gather<uint32_t, int64_t>(&f32, 1000, 3, 503);
+  check_gather<uint64_t, int32_t>(&f64, 100, 2, 31);
+  check_gather<uint16_t, int32_t>(&bf16, 300, 12, 100);
+  // Again with a gather instruction, where the CPU has one
+  check_gather<uint32_t, int32_t>(&f32, 1000, 1, 503, true);
+  check_gather<uint32_t, int64_t>(&f32, 1000, 3, 503, true);
+  check_gather<uint64_t, int32_t>(&f64, 100, 2, 31, true);
+  check_gather<uint16_t, int32_t>(&bf16, 300, 12, 100, true);
+
+  check_scatter_add(100, 16, 300);
+  check_scatter_add(50, 5, 40);
 
+  llvm::LLVMContext ctx;
   Module module("test_module", ctx);
-
   std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<int *, 32> i32;
+  Tensor *table = Variable::Create(func, &f32, Shape(1, 10, 4));
+  Tensor *idx = Variable::Create(func, &i32, Shape(1, 1, 3));
+  Tensor *updates = Variable::Create(func, &f32, Shape(1, 3, 5));
+  EXPECT_THROW(func->AddOpNode({table, table}, GATHER),
+               core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({table, idx, updates}, SCATTER_ADD),
+               core::IncompatibleShapes);
+}
 
-  core::Type<float, 16> type1;
-  Tensor *tensor, *output;
-  EXPECT_NO_THROW(tensor = Variable::Create(func, &type1, Shape(1, 2, 3)));
-  EXPECT_NO_THROW(output = func->AddOpNode({tensor}, ALLOCA));
-  EXPECT_TRUE(func->GetSymbol(tensor)->shape == tensor->GetShape());
-  EXPECT_EQ(func->GetSymbol(tensor)->type, llvm::Type::getHalfTy(ctx));
-  EXPECT_NO_THROW(func->MarkSymbolAsArg(tensor));
+TEST(Basic, EmitAttention) {
+  // Whole key tiles and query blocks
+  check_attention(2, 2, 32, 128, 64, 64);
+  // Partial last tile and block, shared K and V, odd widths
+  check_attention(3, 1, 19, 100, 37, 21);
+  check_attention(1, 1, 1, 5, 3, 2);
+  // Long context
+  check_attention(1, 1, 64, 2048, 64, 64);
 
-  std::vector<Tensor *> args = func->GetSignatureArgs({output});
-  EXPECT_EQ(args[0]->GetType()->getTypeID(), tensor->GetType()->getTypeID());
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 32> f32;
+  core::Type<int *, 32> i32;
+  Tensor *q = Variable::Create(func, &f32, Shape(2, 4, 8));
+  Tensor *k = Variable::Create(func, &f32, Shape(2, 6, 8));
+  Tensor *v = Variable::Create(func, &f32, Shape(2, 5, 8));
+  Tensor *k3 = Variable::Create(func, &f32, Shape(3, 6, 8));
+  Tensor *ki = Variable::Create(func, &i32, Shape(2, 6, 8));
+  EXPECT_THROW(func->AddOpNode({q, k}, ATTENTION), core::IncorrectNumArgs);
+  EXPECT_THROW(func->AddOpNode({q, k, v}, ATTENTION),
+               core::IncompatibleShapes);
+  EXPECT_THROW(func->AddOpNode({q, k3, k3}, ATTENTION),
+               core::IncompatibleShapes);
+  EXPECT_THROW(func->AddOpNode({q, ki, ki}, ATTENTION),
+               core::IncompatibleTypes);
 }
 
-TEST(Basic, EmitFunction) {
+TEST(Basic, EmitRecurrent) {
+  for (OpCode op : {LSTM_CELL, GRU_CELL}) {
+    // A single stream goes through the GEMV
+    check_recurrent(op, 1, 80, 256);
+    check_recurrent(op, 1, 13, 37);
+    // Batched steps go through the GEMM
+    check_recurrent(op, 8, 64, 128);
+    check_recurrent(op, 3, 5, 7);
+  }
+
   llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 32> f32;
+  core::Type<int *, 32> i32;
+  Tensor *x = Variable::Create(func, &f32, Shape(1, 1, 8));
+  Tensor *state = Variable::Create(func, &f32, Shape(2, 1, 4));
+  Tensor *weights = Variable::Create(func, &f32, Shape(1, 12, 16));
+  Tensor *bias = Variable::Create(func, &f32, Shape(1, 1, 16));
+  Tensor *x_int = Variable::Create(func, &i32, Shape(1, 1, 8));
+  EXPECT_THROW(func->AddOpNode({x, state, weights}, LSTM_CELL),
+               core::IncorrectNumArgs);
+  EXPECT_THROW(func->AddOpNode({x, state, weights, bias}, GRU_CELL),
+               core::IncompatibleShapes);
+  EXPECT_THROW(func->AddOpNode({x_int, state, weights, bias}, LSTM_CELL),
+               core::IncompatibleTypes);
+}
 
-  const int n_elts = 34000;
+TEST(Basic, EmitTopK) {
+  // Vectorized argmax, with and without leftover columns
+  check_topk(16, 1024, 1);
+  check_topk(5, 37, 1);
+  check_topk(3, 5, 1);
+  // Threshold filter and insertion
+  check_topk(4, 50000, 10);
+  check_topk(7, 101, 16);
+  check_topk(2, 9, 9);
+  check_topk(3, 300, 2);
 
+  llvm::LLVMContext ctx;
   Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 32> f32;
+  core::Type<core::bit *, 1> bit;
+  Tensor *x = Variable::Create(func, &f32, Shape(1, 4, 8));
+  Tensor *b = Variable::Create(func, &bit, Shape(1, 4, 64));
+  OpParams params;
+  params.top_k = 9;
+  EXPECT_THROW(func->AddOpNode({x, x}, TOPK), core::IncorrectNumArgs);
+  EXPECT_THROW(func->AddOpNode({x}, TOPK, params), core::IncompatibleShapes);
+  EXPECT_THROW(func->AddOpNode({b}, TOPK), core::IncompatibleTypes);
+
+  // Everything else has just the one output
+  Tensor *sum = func->AddOpNode({x, x}, ADD);
+  EXPECT_EQ(func->GetOpOutputs(sum).size(), 1);
+}
 
+TEST(Basic, EmitRandom) {
+  OpParams params;
+  params.random_seed = 0x123456789ABCDEFull;
+  check_random<float, 32>(RANDOM_UNIFORM, Shape(3, 7, 1001), params, false);
+  check_random<double, 64>(RANDOM_UNIFORM, Shape(1, 1, 5000), params, false);
+  params.random_offset = (1ull << 32) - 100;
+  check_random<float, 32>(RANDOM_UNIFORM, Shape(1, 1, 4099), params, false);
+  // Starting partway into a block
+  params.random_offset = 4 * 1000 + 3;
+  check_random<float, 32>(RANDOM_UNIFORM, Shape(2, 5, 333), params, false);
+  check_random<double, 64>(RANDOM_UNIFORM, Shape(1, 3, 257), params, false);
+
+  // Dropout masks, fused into the multiply
+  params.random_p = 0.9;
+  check_random<float, 32>(RANDOM_BERNOULLI, Shape(2, 50, 100), params, true);
+  params.random_p = 0.25;
+  check_random<int, 32>(RANDOM_BERNOULLI, Shape(1, 8, 777), params, false);
+
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
   std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<int *, 32> i32;
+  Tensor *x = Variable::Create(func, &i32, Shape(1, 4, 8));
+  EXPECT_THROW(func->AddOpNode({x}, RANDOM_UNIFORM), core::IncompatibleTypes);
+  params.random_p = 1.5;
+  EXPECT_THROW(func->AddOpNode({x}, RANDOM_BERNOULLI, params),
+               core::IncompatibleTypes);
+  EXPECT_THROW(func->AddOpNode({x, x}, RANDOM_UNIFORM),
+               core::IncorrectNumArgs);
+}
 
-  core::Type<float *, 32> type;
-  Tensor *lhs, *rhs, *output;
-  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, Shape(1, 1, n_elts)));
-  EXPECT_NO_THROW(rhs = Variable::Create(func, &type, Shape(1, 1, n_elts)));
-  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, SDOT));
+TEST(Basic, ScheduleGraph) {
+  llvm::LLVMContext ctx;
 
-  EXPECT_EQ(func->GetSymbol(lhs)->type, llvm::Type::getFloatPtrTy(ctx));
-  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
-  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+  Module module("test_module", ctx);
 
-  EXPECT_EQ(func->GetSymbol(rhs)->type, llvm::Type::getFloatPtrTy(ctx));
-  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
 
-  EXPECT_TRUE(output->GetShape() == Shape(1, 1, 1));
+  core::Type<float *, 32> f32;
+  Tensor *x = Variable::Create(func, &f32, Shape(1, 4, 64));
+  Tensor *w = Variable::Create(func, &f32, Shape(1, 64, 64));
+  Tensor *sum, *dead_exp, *dead_gemm, *output;
+  EXPECT_NO_THROW(sum = func->AddOpNode({x, x}, ADD));
+  // A branch nothing in the signature reads
+  EXPECT_NO_THROW(dead_exp = func->AddOpNode({sum}, EXP));
+  EXPECT_NO_THROW(dead_gemm = func->AddOpNode({dead_exp, w}, GEMM));
+  EXPECT_NO_THROW(output = func->AddOpNode({sum, x}, MUL));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+
+  core::OpNode *add = func->GetProducer(sum->GetSymbol());
+  core::OpNode *exp = func->GetProducer(dead_exp->GetSymbol());
+  core::OpNode *gemm = func->GetProducer(dead_gemm->GetSymbol());
+  core::OpNode *mul = func->GetProducer(output->GetSymbol());
+  EXPECT_EQ(func->GetProducer(x->GetSymbol()), nullptr);
+  EXPECT_EQ(func->GetConsumers(add), std::vector<core::OpNode *>({exp, mul}));
+  EXPECT_EQ(func->GetConsumers(exp), std::vector<core::OpNode *>({gemm}));
+  EXPECT_TRUE(func->GetConsumers(mul).empty());
 
   std::vector<Tensor *> args = func->GetSignatureArgs({output});
-  EXPECT_EQ(args.size(), 3);
-  EXPECT_EQ(args[0], lhs);
-  EXPECT_EQ(args[1], rhs);
-  EXPECT_EQ(args[2], output);
+  EXPECT_EQ(func->Schedule(), std::vector<core::OpNode *>({add, mul}));
 
   llvm::Function *f;
   EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
@@ -194,102 +2599,491 @@ TEST(Basic, EmitFunction) {
 
   EXPECT_NO_THROW(
       module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
-  module.Print();
 
-  void (*sdot)(float *, float *, float *) =
-      (void (*)(float *, float *, float *))module.GetFunctionPtr("test_func");
+  void *kernel = module.GetFunctionPtr("test_func");
 
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<float> dis(0.0, 1.0);
+  std::vector<float> in(4 * 64), out(4 * 64);
+  for (uint64_t i = 0; i < in.size(); i++)
+    in[i] = i * 0.25f;
+  ((void (*)(float *, float *))kernel)(in.data(), out.data());
+  for (uint64_t i = 0; i < in.size(); i++)
+    EXPECT_EQ(out[i], 2 * in[i] * in[i]);
+}
 
-  std::vector<float> f1, f2;
-  for (int i = 0; i < n_elts; i++) {
-    f1.push_back(dis(gen));
-    f2.push_back(dis(gen));
-  }
+TEST(Basic, FuseGraph) {
+  // Edge tiles, a GEMV, and a k that spans several panels
+  check_fused_gemm(1, 16, 24, 64);
+  check_fused_gemm(2, 7, 19, 37);
+  check_fused_gemm(1, 1, 100, 70);
+  check_fused_gemm(1, 13, 300, 21);
+
+  // Along contiguous memory, then across rows
+  check_fused_reduce(REDUCE_MEAN, {W}, Shape(4, 6, 40), Shape(1, 6, 1), true);
+  check_fused_reduce(REDUCE_MAX, {H}, Shape(3, 9, 20), Shape(1, 1, 20), true);
+  check_fused_reduce(REDUCE_SUM, {K}, Shape(5, 3, 16), Shape(1, 3, 16), true);
+  // The output rows of a reduction over K are emitted as one run, which
+  // can't broadcast y, so that one isn't fused
+  check_fused_reduce(REDUCE_SUM, {K}, Shape(5, 3, 16), Shape(1, 1, 16),
+                     false);
+
+  // The ADD is scheduled after an unrelated GEMM, but only needs the EXP,
+  // so the two still share a loop
+  llvm::LLVMContext ctx;
 
-  float float_out;
+  Module module("test_module", ctx);
 
-  auto start = std::chrono::high_resolution_clock::now();
-  sdot(f1.data(), f2.data(), &float_out);
-  auto finish = std::chrono::high_resolution_clock::now();
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
 
-  std::chrono::duration<double> elapsed = (finish - start);
-  std::cout << "\nElapsed time: " << elapsed.count() << " s for " << n_elts
-            << " elements" << std::endl;
+  core::Type<float *, 32> f32;
+  Tensor *x = Variable::Create(func, &f32, Shape(1, 4, 32));
+  Tensor *w = Variable::Create(func, &f32, Shape(1, 32, 32));
+  Tensor *e, *prod, *output;
+  EXPECT_NO_THROW(e = func->AddOpNode({x}, EXP));
+  EXPECT_NO_THROW(prod = func->AddOpNode({x, w}, GEMM));
+  EXPECT_NO_THROW(output = func->AddOpNode({e, x}, ADD));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(w));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output, prod});
+  EXPECT_EQ(func->Schedule(),
+            std::vector<core::OpNode *>(
+                {func->GetProducer(e->GetSymbol()),
+                 func->GetProducer(prod->GetSymbol()),
+                 func->GetProducer(output->GetSymbol())}));
 
-  EXPECT_NEAR(float_out, ref_sdot<n_elts>(f1.data(), f2.data()),
-              float_out * 5e-6);
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+  EXPECT_EQ(e->GetSymbol()->buffer, nullptr);
+
+  EXPECT_NO_THROW(
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+  void *kernel = module.GetFunctionPtr("test_func");
+
+  std::vector<float> in(4 * 32), weights(32 * 32, 0.0f), out(4 * 32),
+      prod_out(4 * 32);
+  for (uint64_t i = 0; i < in.size(); i++)
+    in[i] = i / 64.0f;
+  for (uint64_t i = 0; i < 32; i++)
+    weights[i * 32 + i] = 1.0f;
+  ((void (*)(float *, float *, float *, float *))kernel)(
+      in.data(), weights.data(), out.data(), prod_out.data());
+  for (uint64_t i = 0; i < in.size(); i++) {
+    EXPECT_NEAR(out[i], std::exp(in[i]) + in[i], out[i] * 1e-6);
+    EXPECT_EQ(prod_out[i], in[i]);
+  }
 }
 
-TEST(Basic, EmitConstFunction) { // this is still iffy
+TEST(Basic, PlanMemory) {
   llvm::LLVMContext ctx;
 
-  const int n_elts = 3;
-
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<float> dis(0.0, 1.0);
+  {
+    // A chain of GEMMs: the third product can reuse the first one's bytes,
+    // but the second overlaps both
+    Module module("test_module", ctx);
+
+    std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+    const uint64_t n = 64;
+    core::Type<float *, 32> f32;
+    Tensor *x = Variable::Create(func, &f32, Shape(1, n, n));
+    Tensor *w = Variable::Create(func, &f32, Shape(1, n, n));
+    Tensor *output = x;
+    for (int i = 0; i < 4; i++)
+      EXPECT_NO_THROW(output = func->AddOpNode({output, w}, GEMM));
+    EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+    EXPECT_NO_THROW(func->MarkSymbolAsArg(w));
+
+    std::vector<Tensor *> args = func->GetSignatureArgs({output});
+
+    llvm::Function *f;
+    EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+    EXPECT_NO_THROW(func->Emit(f));
+    EXPECT_NO_THROW(module.FinalizeFunction(f));
+    EXPECT_EQ(func->GetWorkspaceSize(), 2 * n * n * sizeof(float));
+
+    EXPECT_NO_THROW(
+        module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+    void *kernel = module.GetFunctionPtr("test_func");
+
+    std::vector<float> in(n * n), weights(n * n, 0.0f), out(n * n);
+    for (uint64_t i = 0; i < in.size(); i++)
+      in[i] = i;
+    for (uint64_t i = 0; i < n; i++)
+      weights[i * n + i] = 0.5f;
+    ((void (*)(float *, float *, float *))kernel)(in.data(), weights.data(),
+                                                  out.data());
+    for (uint64_t i = 0; i < in.size(); i++)
+      EXPECT_EQ(out[i], in[i] / 16);
+  }
 
-  std::vector<float> f1, f2; // why are there a bunch of zeros in the middle...
-  for (int i = 0; i < n_elts; i++) {
-    f1.push_back(dis(gen));
-    f2.push_back(dis(gen));
+  {
+    // The EXP writes over the softmax it reads, so only one intermediate
+    // is ever live
+    Module module("test_module", ctx);
+
+    std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+    const uint64_t h = 4, w = 1000;
+    core::Type<float *, 32> f32;
+    Tensor *x = Variable::Create(func, &f32, Shape(1, h, w));
+    Tensor *probs, *e, *output;
+    EXPECT_NO_THROW(probs = func->AddOpNode({x}, SOFTMAX));
+    EXPECT_NO_THROW(e = func->AddOpNode({probs}, EXP));
+    EXPECT_NO_THROW(output = func->AddOpNode({e}, SOFTMAX));
+    EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+
+    std::vector<Tensor *> args = func->GetSignatureArgs({output});
+
+    llvm::Function *f;
+    EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+    EXPECT_NO_THROW(func->Emit(f));
+    EXPECT_NO_THROW(module.FinalizeFunction(f));
+    EXPECT_EQ(func->GetWorkspaceSize(), h * w * sizeof(float));
+
+    EXPECT_NO_THROW(
+        module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+    void *kernel = module.GetFunctionPtr("test_func");
+
+    std::vector<float> in(h * w), out(h * w);
+    for (uint64_t i = 0; i < in.size(); i++)
+      in[i] = (i % 17) * 0.1f;
+    ((void (*)(float *, float *))kernel)(in.data(), out.data());
+
+    for (uint64_t r = 0; r < h; r++) {
+      std::vector<double> p(w);
+      double sum = 0, sum_e = 0;
+      for (uint64_t c = 0; c < w; c++)
+        sum += std::exp(in[r * w + c]);
+      for (uint64_t c = 0; c < w; c++) {
+        p[c] = std::exp(std::exp(in[r * w + c]) / sum);
+        sum_e += std::exp(p[c]);
+      }
+      for (uint64_t c = 0; c < w; c++)
+        EXPECT_NEAR(out[r * w + c], std::exp(p[c]) / sum_e, 1e-6);
+    }
   }
 
-  f1.shrink_to_fit();
-  f2.shrink_to_fit();
+  {
+    // The GEMM chain again in bfloat16, whose elements are structs: the two
+    // live products still need a block each
+    Module module("test_module", ctx);
+
+    std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+    const uint64_t n = 64;
+    core::Type<core::bfloat16 *, 16> bf16;
+    Tensor *x = Variable::Create(func, &bf16, Shape(1, n, n));
+    Tensor *w = Variable::Create(func, &bf16, Shape(1, n, n));
+    Tensor *output = x;
+    for (int i = 0; i < 4; i++)
+      EXPECT_NO_THROW(output = func->AddOpNode({output, w}, GEMM));
+    EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+    EXPECT_NO_THROW(func->MarkSymbolAsArg(w));
+
+    std::vector<Tensor *> args = func->GetSignatureArgs({output});
+
+    llvm::Function *f;
+    EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
+
+    EXPECT_NO_THROW(func->Emit(f));
+    EXPECT_NO_THROW(module.FinalizeFunction(f));
+    EXPECT_EQ(func->GetWorkspaceSize(), 2 * n * n * sizeof(uint16_t));
+
+    EXPECT_NO_THROW(
+        module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
+
+    void *kernel = module.GetFunctionPtr("test_func");
+
+    // Small integers and their sixteenths are exact in bfloat16
+    std::vector<uint16_t> in(n * n), weights(n * n, 0), out(n * n);
+    for (uint64_t i = 0; i < in.size(); i++)
+      in[i] = float_to_bfloat16_ref(i % 64);
+    for (uint64_t i = 0; i < n; i++)
+      weights[i * n + i] = float_to_bfloat16_ref(0.5f);
+    ((void (*)(uint16_t *, uint16_t *, uint16_t *))kernel)(
+        in.data(), weights.data(), out.data());
+    for (uint64_t i = 0; i < in.size(); i++)
+      EXPECT_EQ(bfloat16_to_float_ref(out[i]), (i % 64) / 16.0f);
+  }
+}
 
+TEST(Basic, WorkspaceArg) {
+  llvm::LLVMContext ctx;
   Module module("test_module", ctx);
 
   std::unique_ptr<Function> func = Function::Create(&module, "test_func");
 
-  core::Type<float *, 32> type;
-  Tensor *lhs, *rhs, *output;
-  EXPECT_NO_THROW(lhs = Variable::Create(func, &type, Shape(1, 1, n_elts)));
+  // The same GEMM chain as PlanMemory, but with the workspace passed in. The
+  // packed A and B blocks move into it too, after the intermediates.
+  const uint64_t n = 64;
+  core::Type<float *, 32> f32;
+  Tensor *x = Variable::Create(func, &f32, Shape(1, n, n));
+  Tensor *w = Variable::Create(func, &f32, Shape(1, n, n));
+  Tensor *output = x;
+  for (int i = 0; i < 4; i++)
+    EXPECT_NO_THROW(output = func->AddOpNode({output, w}, GEMM));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(w));
+
+  std::vector<Tensor *> args = func->GetSignatureArgs({output});
+
+  llvm::Function *f;
+  EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args, true));
+  EXPECT_EQ(f->arg_size(), 4);
+
+  EXPECT_NO_THROW(func->Emit(f));
+  EXPECT_NO_THROW(module.FinalizeFunction(f));
+
+  // mc = 66 rows of A and nc = 64 columns of B, each by kc = 64
+  const uint64_t packs = (66 * n + n * n) * sizeof(float);
+  EXPECT_EQ(func->GetWorkspaceSize(), 2 * n * n * sizeof(float) + packs);
+
   EXPECT_NO_THROW(
-      rhs = Constant::Create(func, &type, Shape(1, 1, n_elts), f2.data()));
-  EXPECT_NO_THROW(output = func->AddOpNode({lhs, rhs}, SDOT));
+      module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
 
-  EXPECT_EQ(func->GetSymbol(lhs)->type, llvm::Type::getFloatPtrTy(ctx));
-  EXPECT_NO_THROW(func->MarkSymbolAsArg(lhs));
+  void *kernel = module.GetFunctionPtr("test_func");
 
-  EXPECT_EQ(func->GetSymbol(rhs)->type, llvm::Type::getFloatPtrTy(ctx));
-  EXPECT_NO_THROW(func->MarkSymbolAsArg(rhs));
+  std::vector<float> in(n * n), weights(n * n, 0.0f), out(n * n);
+  for (uint64_t i = 0; i < in.size(); i++)
+    in[i] = i;
+  for (uint64_t i = 0; i < n; i++)
+    weights[i * n + i] = 0.5f;
 
-  EXPECT_TRUE(output->GetShape() == Shape(1, 1, 1));
+  // Garbage in the workspace mustn't matter
+  const uint64_t size = func->GetWorkspaceSize();
+  std::vector<double> workspace(size / sizeof(double) + 4, -1.0);
+  uint8_t *base = (uint8_t *)workspace.data();
+  base += (32 - (uintptr_t)base % 32) % 32;
+
+  ((void (*)(float *, float *, float *, uint8_t *))kernel)(
+      in.data(), weights.data(), out.data(), base);
+  for (uint64_t i = 0; i < in.size(); i++)
+    EXPECT_EQ(out[i], in[i] / 16);
+}
+
+TEST(Basic, FoldConstants) {
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+
+  // A weight stored transposed and a per-column scale, both known up front,
+  // so only the GEMM is left to run
+  const uint64_t m = 5, k = 12, n = 9;
+  std::vector<float> w(n * k), scale(n);
+  for (uint64_t i = 0; i < w.size(); i++)
+    w[i] = (float)(i % 7) - 3;
+  for (uint64_t j = 0; j < n; j++)
+    scale[j] = 0.25f * (j + 1);
+
+  core::Type<float *, 32> f32;
+  Tensor *x = Variable::Create(func, &f32, Shape(1, m, k));
+  Tensor *w_t = Constant::Create(func, &f32, Shape(1, n, k), w.data());
+  Tensor *s = Constant::Create(func, &f32, Shape(1, 1, n), scale.data());
+  Tensor *weights, *scaled, *output;
+  EXPECT_NO_THROW(weights = func->AddOpNode({w_t}, TRANSPOSE));
+  EXPECT_NO_THROW(scaled = func->AddOpNode({weights, s}, MUL));
+  EXPECT_NO_THROW(output = func->AddOpNode({x, scaled}, GEMM));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(x));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(w_t));
+  EXPECT_NO_THROW(func->MarkSymbolAsArg(s));
 
   std::vector<Tensor *> args = func->GetSignatureArgs({output});
-  EXPECT_EQ(args.size(), 3);
-  EXPECT_EQ(args[0], lhs);
-  EXPECT_EQ(args[1], rhs);
-  EXPECT_EQ(args[2], output);
 
   llvm::Function *f;
   EXPECT_NO_THROW(f = module.GetFunction(func->GetName(), args));
-  EXPECT_EQ(func->GetSymbol(rhs)->type, llvm::Type::getFloatTy(ctx));
+  EXPECT_EQ(f->arg_size(), 2);
 
+  EXPECT_NE(func->GetProducer(func->GetSymbol(scaled)), nullptr);
   EXPECT_NO_THROW(func->Emit(f));
   EXPECT_NO_THROW(module.FinalizeFunction(f));
 
+  // Both folded, and neither needs any workspace
+  EXPECT_EQ(func->GetProducer(func->GetSymbol(weights)), nullptr);
+  EXPECT_EQ(func->GetProducer(func->GetSymbol(scaled)), nullptr);
+  EXPECT_EQ(func->Schedule().size(), 1);
+  EXPECT_EQ(func->GetWorkspaceSize(), 0);
+
   EXPECT_NO_THROW(
       module.FinalizeModule(3, llvm::sys::getDefaultTargetTriple()));
-  module.Print();
 
-  void (*sdot)(float *, float *) =
-      (void (*)(float *, float *))module.GetFunctionPtr("test_func");
+  void *kernel = module.GetFunctionPtr("test_func");
 
-  float float_out;
+  std::vector<float> in(m * k), out(m * n);
+  for (uint64_t i = 0; i < in.size(); i++)
+    in[i] = (float)(i % 5) * 0.5f;
+  ((void (*)(float *, float *))kernel)(in.data(), out.data());
 
-  auto start = std::chrono::high_resolution_clock::now();
-  sdot(f1.data(), &float_out);
-  auto finish = std::chrono::high_resolution_clock::now();
+  for (uint64_t r = 0; r < m; r++) {
+    for (uint64_t c = 0; c < n; c++) {
+      float expected = 0;
+      for (uint64_t i = 0; i < k; i++)
+        expected += in[r * k + i] * (w[c * k + i] * scale[c]);
+      EXPECT_NEAR(out[r * n + c], expected, 1e-4);
+    }
+  }
 
-  std::chrono::duration<double> elapsed = (finish - start);
-  std::cout << "\nElapsed time: " << elapsed.count() << " s for " << n_elts
-            << " elements" << std::endl;
+  {
+    // A bfloat16 weight stored transposed: the folded copy needs host
+    // storage for all of its elements, not just its first word
+    Module bf16_module("test_module", ctx);
+
+    std::unique_ptr<Function> bf16_func =
+        Function::Create(&bf16_module, "test_func");
+
+    std::vector<uint16_t> w_bf16(n * k), in_bf16(m * k);
+    for (uint64_t i = 0; i < w.size(); i++)
+      w_bf16[i] = float_to_bfloat16_ref(w[i]);
+    for (uint64_t i = 0; i < in_bf16.size(); i++)
+      in_bf16[i] = float_to_bfloat16_ref((float)(i % 5) * 0.5f);
+
+    OpParams params;
+    params.float_output = true;
+    core::Type<core::bfloat16 *, 16> bf16;
+    Tensor *lhs = Variable::Create(bf16_func, &bf16, Shape(1, m, k));
+    Tensor *rhs_t =
+        Constant::Create(bf16_func, &bf16, Shape(1, n, k), w_bf16.data());
+    Tensor *rhs, *product;
+    EXPECT_NO_THROW(rhs = bf16_func->AddOpNode({rhs_t}, TRANSPOSE));
+    EXPECT_NO_THROW(product = bf16_func->AddOpNode({lhs, rhs}, GEMM, params));
+    EXPECT_NO_THROW(bf16_func->MarkSymbolAsArg(lhs));
+    EXPECT_NO_THROW(bf16_func->MarkSymbolAsArg(rhs_t));
+
+    void *bf16_kernel = build_and_jit(
+        bf16_module, bf16_func, bf16_func->GetSignatureArgs({product}));
+    EXPECT_EQ(bf16_func->GetProducer(bf16_func->GetSymbol(rhs)), nullptr);
+
+    // Halves times small integers, so every sum is exact
+    std::vector<float> bf16_out(m * n);
+    ((void (*)(uint16_t *, float *))bf16_kernel)(in_bf16.data(),
+                                                 bf16_out.data());
+    for (uint64_t r = 0; r < m; r++) {
+      for (uint64_t c = 0; c < n; c++) {
+        float expected = 0;
+        for (uint64_t i = 0; i < k; i++)
+          expected += in[r * k + i] * w[c * k + i];
+        EXPECT_EQ(bf16_out[r * n + c], expected);
+      }
+    }
+  }
+}
 
-  EXPECT_NEAR(float_out, ref_sdot<n_elts>(f1.data(), f2.data()),
-              float_out * 5e-6);
+TEST(Basic, EmitConv2D) {
+  OpParams params;
+  params.pad_h = 1;
+  params.pad_w = 1;
+
+  // 3x3 "same" convolution with each lowering
+  check_conv2d(params, 4, 20, 23, 8, 3, 3);
+  params.conv_algorithm = CONV_DIRECT;
+  check_conv2d(params, 4, 20, 23, 8, 3, 3);
+
+  // Strided, dilated, asymmetric filter
+  params.stride_h = 2;
+  params.stride_w = 3;
+  params.pad_h = 2;
+  params.pad_w = 1;
+  params.dilation_h = 2;
+  params.dilation_w = 1;
+  check_conv2d(params, 3, 17, 19, 7, 5, 3);
+  params.conv_algorithm = CONV_IM2COL;
+  check_conv2d(params, 3, 17, 19, 7, 5, 3);
+
+  // 1x1 goes straight to GEMM
+  check_conv2d(OpParams(), 16, 9, 11, 10, 1, 1);
+
+  // The filter can't be bigger than the padded input
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 32> type;
+  Tensor *input = Variable::Create(func, &type, Shape(1, 2, 2));
+  Tensor *filter = Variable::Create(func, &type, Shape(1, 3, 3));
+  EXPECT_THROW(func->AddOpNode({input, filter}, CONV2D),
+               core::IncompatibleShapes);
+
+  // Input and filter have to share a type
+  core::Type<double *, 64> f64;
+  Tensor *wide = Variable::Create(func, &f64, Shape(1, 3, 3));
+  EXPECT_THROW(func->AddOpNode({wide, filter}, CONV2D),
+               core::IncompatibleTypes);
+
+  // A column buffer too big for the stack is only used with a workspace
+  OpParams same;
+  same.pad_h = 1;
+  same.pad_w = 1;
+  Tensor *big = Variable::Create(func, &type, Shape(16, 32, 32));
+  Tensor *filters = Variable::Create(func, &type, Shape(16 * 16, 3, 3));
+  Tensor *conv = func->AddOpNode({big, filters}, CONV2D, same);
+  core::Conv2D *op =
+      dynamic_cast<core::Conv2D *>(func->GetProducer(conv->GetSymbol()));
+  ASSERT_NE(op, nullptr);
+  EXPECT_EQ(op->GetAlgorithm(false), CONV_DIRECT);
+  EXPECT_EQ(op->GetAlgorithm(true), CONV_IM2COL);
+}
+
+TEST(Basic, EmitWinograd) {
+  OpParams params;
+  params.pad_h = 1;
+  params.pad_w = 1;
+
+  // Output sizes that don't divide into tiles, with the filter transformed
+  // both at JIT time (constant) and at run time (argument)
+  params.conv_algorithm = CONV_WINOGRAD_2X2;
+  params.conv_tolerance = 1e-5f;
+  check_conv2d(params, 5, 13, 10, 7, 3, 3, true);
+  check_conv2d(params, 5, 13, 10, 7, 3, 3, false);
+  params.conv_algorithm = CONV_WINOGRAD_4X4;
+  params.conv_tolerance = 1e-4f;
+  check_conv2d(params, 5, 13, 10, 7, 3, 3, true);
+  check_conv2d(params, 5, 13, 10, 7, 3, 3, false);
+
+  // CONV_AUTO picks Winograd once the tolerance allows it, no padding here
+  params.conv_algorithm = CONV_AUTO;
+  params.pad_h = 0;
+  params.pad_w = 0;
+  check_conv2d(params, 8, 16, 16, 8, 3, 3, true);
+
+  // Only 3x3 with unit stride and dilation
+  llvm::LLVMContext ctx;
+  Module module("test_module", ctx);
+  std::unique_ptr<Function> func = Function::Create(&module, "test_func");
+  core::Type<float *, 32> type;
+  Tensor *input = Variable::Create(func, &type, Shape(1, 8, 8));
+  Tensor *filter = Variable::Create(func, &type, Shape(1, 3, 3));
+  params.conv_algorithm = CONV_WINOGRAD_2X2;
+  params.stride_h = 2;
+  EXPECT_THROW(func->AddOpNode({input, filter}, CONV2D, params),
+               core::IncompatibleShapes);
+}
+
+TEST(Basic, BenchmarkWinograd) {
+  // A typical 3x3 "same" layer with constant weights
+  const uint64_t c_in = 32, h = 28, w = 28, c_out = 32;
+
+  OpParams params;
+  params.pad_h = 1;
+  params.pad_w = 1;
+  params.conv_tolerance = 1e-4f;
+
+  params.conv_algorithm = CONV_DIRECT;
+  double direct = check_conv2d(params, c_in, h, w, c_out, 3, 3, true);
+  params.conv_algorithm = CONV_IM2COL;
+  double im2col = check_conv2d(params, c_in, h, w, c_out, 3, 3, true);
+  params.conv_algorithm = CONV_WINOGRAD_2X2;
+  double f2 = check_conv2d(params, c_in, h, w, c_out, 3, 3, true);
+  params.conv_algorithm = CONV_WINOGRAD_4X4;
+  double f4 = check_conv2d(params, c_in, h, w, c_out, 3, 3, true);
+
+  std::cout << "\nElapsed time: direct " << direct << " s, im2col " << im2col
+            << " s, F(2x2,3x3) " << f2 << " s, F(4x4,3x3) " << f4 << " s"
+            << std::endl;
 }